@@ -0,0 +1,740 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * #epoll device, kernel-side readiness sets.
+ *
+ * Each attach is a new set.  Items are added by FD through the ctl file, and
+ * the set registers its own kernel taps (fd_tap->func) with the FD's device.
+ * Those taps are not in the FD table, so a chan can be in any number of sets,
+ * in addition to having a regular user FD tap.
+ *
+ * Tap fires are edges.  Edge-triggered items report the edges that arrived
+ * since the last read.  Level-triggered items stay on the ready list after they
+ * are reported, and the next read asks the device whether they are still ready,
+ * using the same DMREADABLE/DMWRITABLE stat bits that select() uses.  Devices
+ * that don't set those bits get edge behavior.  Oneshot items are disarmed
+ * after they are reported until the next "mod".
+ *
+ * Sets can be tapped and added to other sets, one level deep.
+ *
+ * An item holds its chan, so closing the FD does not remove it from the set;
+ * "del" it first, or the FD number stays taken in the set. */
+
+#include <ns.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <sys/queue.h>
+#include <fdtap.h>
+#include <syscall.h>
+#include <smp.h>
+
+struct dev ep_devtab;
+
+static char *devname(void)
+{
+	return ep_devtab.name;
+}
+
+enum {
+	Qdir,
+	Qctl,
+	Qdata,
+};
+
+static struct dirtab ep_dir[] = {
+	{".", {Qdir, 0, QTDIR}, 0, DMDIR | 0555},
+	{"ctl", {Qctl, 0, QTFILE}, 0, 0666},
+	{"data", {Qdata, 0, QTFILE}, 0, 0444},
+};
+
+enum {
+	EP_ET =						1 << 0,
+	EP_ONESHOT =				1 << 1,
+	EP_INIT_ITEMS =				64,
+	EP_BATCH =					64,	/* events harvested per ready lock */
+};
+
+#define EP_LEGAL_FILTERS (FDTAP_FILT_READABLE | FDTAP_FILT_WRITABLE |          \
+                          FDTAP_FILT_HANGUP | FDTAP_FILT_RDHUP |               \
+                          FDTAP_FILT_PRIORITY | FDTAP_FILT_ERROR)
+
+struct epoll_set;
+
+struct ep_item {
+	struct fd_tap				tap;
+	struct epoll_set			*ep;
+	TAILQ_ENTRY(ep_item)		link;	/* ready list */
+	uint64_t					data;
+	int							fd;
+	int							flags;
+	int							pending;	/* edges not yet reported */
+	bool						queued;
+	bool						armed;
+	struct epoll_set			*child;		/* if the item is itself a set */
+};
+TAILQ_HEAD(ep_item_tailq, ep_item);
+
+struct epoll_set {
+	qlock_t						qlock;		/* items table, ctl, harvests */
+	struct ep_item				**items;	/* indexed by FD */
+	int							nr_items_max;
+	int							nr_items;
+	spinlock_t					lock;		/* ready list, item state */
+	struct ep_item_tailq		ready;
+	struct rendez				rv;
+	struct fdtap_slist			fd_taps;	/* taps on this set */
+	spinlock_t					tap_lock;
+	int							nr_children;
+	int							nr_parents;
+	struct kref					refcnt;
+};
+
+/* Protects the nesting counts across sets. */
+static qlock_t ep_nest_lock = QLOCK_INITIALIZER(ep_nest_lock);
+
+static void ep_fire_taps(struct epoll_set *ep, int filter)
+{
+	struct fd_tap *tap_i;
+
+	if (SLIST_EMPTY(&ep->fd_taps))
+		return;
+	spin_lock(&ep->tap_lock);
+	SLIST_FOREACH(tap_i, &ep->fd_taps, link)
+		fire_tap(tap_i, filter);
+	spin_unlock(&ep->tap_lock);
+}
+
+/* Puts item on the ready list, with edges (which may be 0 for a level recheck).
+ * Caller holds ep->lock.  Returns TRUE if the list was empty. */
+static bool __ep_enqueue(struct epoll_set *ep, struct ep_item *item, int edges)
+{
+	bool was_empty;
+
+	item->pending |= edges;
+	if (item->queued)
+		return FALSE;
+	was_empty = TAILQ_EMPTY(&ep->ready);
+	TAILQ_INSERT_TAIL(&ep->ready, item, link);
+	item->queued = TRUE;
+	return was_empty;
+}
+
+static void ep_wake(struct epoll_set *ep)
+{
+	rendez_wakeup(&ep->rv);
+	ep_fire_taps(ep, FDTAP_FILT_READABLE);
+}
+
+/* Tap callback, called by the item's device with its tap lock held. */
+static void ep_tap_fire(struct fd_tap *tap, int filter)
+{
+	struct ep_item *item = container_of(tap, struct ep_item, tap);
+	struct epoll_set *ep = item->ep;
+	bool was_empty = FALSE;
+
+	spin_lock(&ep->lock);
+	if (item->armed)
+		was_empty = __ep_enqueue(ep, item, filter);
+	spin_unlock(&ep->lock);
+	if (was_empty)
+		ep_wake(ep);
+}
+
+/* Asks the item's device which of its filters hold right now.  Only readable
+ * and writable have stat bits. */
+static int ep_level(struct ep_item *item)
+{
+	struct dir *d;
+	int level = 0;
+
+	d = chandirstat(item->tap.chan);
+	if (!d)
+		return 0;
+	if (d->mode & DMREADABLE)
+		level |= FDTAP_FILT_READABLE;
+	if (d->mode & DMWRITABLE)
+		level |= FDTAP_FILT_WRITABLE;
+	kfree(d);
+	return level & item->tap.filter;
+}
+
+static bool ep_has_ready(struct epoll_set *ep)
+{
+	return !TAILQ_EMPTY(&ep->ready);
+}
+
+static int ep_has_ready_cond(void *arg)
+{
+	return ep_has_ready((struct epoll_set*)arg);
+}
+
+/* Reports the item's current state if it is ready, as after an add or mod. */
+static void ep_check_item(struct epoll_set *ep, struct ep_item *item)
+{
+	int level = ep_level(item);
+	bool was_empty = FALSE;
+
+	if (!level)
+		return;
+	spin_lock(&ep->lock);
+	if (item->armed)
+		was_empty = __ep_enqueue(ep, item, level);
+	spin_unlock(&ep->lock);
+	if (was_empty)
+		ep_wake(ep);
+}
+
+/* Fills evs with up to max ready items.  Caller holds ep->qlock, which keeps
+ * the items from being removed while we check them.
+ *
+ * Level-triggered items that we report go on requeue, not back on the ready
+ * list, so that one read reports each item at most once.  They still count as
+ * queued, so fires only add to their pending edges.  The caller puts them back
+ * with ep_requeue() once it is done harvesting. */
+static int ep_harvest(struct epoll_set *ep, struct fd_tap_event *evs, int max,
+                      struct ep_item_tailq *requeue)
+{
+	struct ep_item *batch[EP_BATCH];
+	struct ep_item *item;
+	int nr_batch = 0;
+	int nr_evs = 0;
+	int filter;
+
+	max = MIN(max, EP_BATCH);
+	spin_lock(&ep->lock);
+	while (nr_batch < max && (item = TAILQ_FIRST(&ep->ready))) {
+		TAILQ_REMOVE(&ep->ready, item, link);
+		item->queued = FALSE;
+		/* Stash the edges in the event slot's filter until we look at them,
+		 * since a fire can come in once we unlock. */
+		batch[nr_batch++] = item;
+		evs[nr_batch - 1].filter = item->pending;
+		item->pending = 0;
+	}
+	spin_unlock(&ep->lock);
+	for (int i = 0; i < nr_batch; i++) {
+		item = batch[i];
+		filter = evs[i].filter & item->tap.filter;
+		if (!(item->flags & EP_ET))
+			filter |= ep_level(item);
+		if (!filter)
+			continue;
+		evs[nr_evs].filter = filter;
+		evs[nr_evs].fd = item->fd;
+		evs[nr_evs].data = item->data;
+		nr_evs++;
+		/* From here on, batch[] only holds reported items. */
+		batch[nr_evs - 1] = item;
+	}
+	spin_lock(&ep->lock);
+	for (int i = 0; i < nr_evs; i++) {
+		item = batch[i];
+		if (item->flags & EP_ONESHOT) {
+			item->armed = FALSE;
+			item->pending = 0;
+			if (item->queued) {
+				TAILQ_REMOVE(&ep->ready, item, link);
+				item->queued = FALSE;
+			}
+		} else if (!(item->flags & EP_ET)) {
+			/* A fire since we unlocked could have queued it again */
+			if (item->queued)
+				TAILQ_REMOVE(&ep->ready, item, link);
+			TAILQ_INSERT_TAIL(requeue, item, link);
+			item->queued = TRUE;
+		}
+	}
+	spin_unlock(&ep->lock);
+	return nr_evs;
+}
+
+/* Puts the level-triggered items from ep_harvest() back on the ready list, to
+ * be checked again by the next read. */
+static void ep_requeue(struct epoll_set *ep, struct ep_item_tailq *requeue)
+{
+	bool was_empty;
+
+	if (TAILQ_EMPTY(requeue))
+		return;
+	spin_lock(&ep->lock);
+	was_empty = TAILQ_EMPTY(&ep->ready);
+	TAILQ_CONCAT(&ep->ready, requeue, link);
+	spin_unlock(&ep->lock);
+	if (was_empty)
+		ep_wake(ep);
+}
+
+static struct ep_item *ep_lookup(struct epoll_set *ep, int fd)
+{
+	if (fd < 0 || fd >= ep->nr_items_max)
+		return NULL;
+	return ep->items[fd];
+}
+
+static void ep_grow(struct epoll_set *ep, int fd)
+{
+	int new_max = MAX(ep->nr_items_max, EP_INIT_ITEMS);
+	struct ep_item **new_items;
+
+	while (new_max <= fd)
+		new_max *= 2;
+	new_items = kreallocarray(ep->items, new_max, sizeof(struct ep_item*),
+	                          MEM_WAIT);
+	memset(new_items + ep->nr_items_max, 0,
+	       (new_max - ep->nr_items_max) * sizeof(struct ep_item*));
+	ep->items = new_items;
+	ep->nr_items_max = new_max;
+}
+
+static bool ep_is_set(struct chan *c)
+{
+	return &devtab[c->type] == &ep_devtab;
+}
+
+/* Sets can be nested one level: a set with children can't be a child, so there
+ * are no cycles and no chains of tap locks. */
+static void ep_nest(struct epoll_set *ep, struct ep_item *item)
+{
+	struct epoll_set *child = item->tap.chan->aux;
+
+	qlock(&ep_nest_lock);
+	if (child == ep || child->nr_children || ep->nr_parents) {
+		qunlock(&ep_nest_lock);
+		error(ELOOP, "#%s sets nest only one level deep", devname());
+	}
+	ep->nr_children++;
+	child->nr_parents++;
+	item->child = child;
+	qunlock(&ep_nest_lock);
+}
+
+static void ep_unnest(struct epoll_set *ep, struct ep_item *item)
+{
+	if (!item->child)
+		return;
+	qlock(&ep_nest_lock);
+	ep->nr_children--;
+	item->child->nr_parents--;
+	qunlock(&ep_nest_lock);
+	item->child = NULL;
+}
+
+static void ep_set_item(struct ep_item *item, int filter, uint64_t data,
+                        int flags)
+{
+	item->tap.filter = filter;
+	item->data = data;
+	item->flags = flags;
+}
+
+static void ep_add(struct epoll_set *ep, int fd, int filter, uint64_t data,
+                   int flags)
+{
+	ERRSTACK(2);
+	struct ep_item *item;
+	struct chan *c;
+
+	if (ep_lookup(ep, fd))
+		error(EEXIST, "FD %d is already in the #%s set", fd, devname());
+	c = fdtochan(&current->open_files, fd, -1, 0, 1);
+	if (waserror()) {
+		cclose(c);
+		nexterror();
+	}
+	if (!devtab[c->type].tapfd)
+		error(ENOSYS, "Device %s does not handle taps", devtab[c->type].name);
+	item = kzmalloc(sizeof(struct ep_item), MEM_WAIT);
+	item->ep = ep;
+	item->fd = fd;
+	item->armed = TRUE;
+	item->tap.chan = c;
+	item->tap.fd = fd;
+	item->tap.proc = current;
+	item->tap.func = ep_tap_fire;
+	ep_set_item(item, filter, data, flags);
+	if (ep_is_set(c)) {
+		if (waserror()) {
+			kfree(item);
+			nexterror();
+		}
+		ep_nest(ep, item);
+		poperror();
+	}
+	if (devtab[c->type].tapfd(c, &item->tap, FDTAP_CMD_ADD)) {
+		ep_unnest(ep, item);
+		kfree(item);
+		error(get_errno(), "%s", current_errstr());
+	}
+	poperror();
+	if (fd >= ep->nr_items_max)
+		ep_grow(ep, fd);
+	ep->items[fd] = item;
+	ep->nr_items++;
+	ep_check_item(ep, item);
+}
+
+/* Unhooks item from its device and the set.  Once the device has removed the
+ * tap, it won't fire again, so we can pull it off the ready list for good. */
+static void ep_remove_item(struct epoll_set *ep, struct ep_item *item)
+{
+	struct chan *c = item->tap.chan;
+
+	devtab[c->type].tapfd(c, &item->tap, FDTAP_CMD_REM);
+	spin_lock(&ep->lock);
+	if (item->queued)
+		TAILQ_REMOVE(&ep->ready, item, link);
+	spin_unlock(&ep->lock);
+	ep_unnest(ep, item);
+	cclose(c);
+	kfree(item);
+}
+
+static void ep_del(struct epoll_set *ep, int fd)
+{
+	struct ep_item *item = ep_lookup(ep, fd);
+
+	if (!item)
+		error(ENOENT, "FD %d is not in the #%s set", fd, devname());
+	ep->items[fd] = NULL;
+	ep->nr_items--;
+	ep_remove_item(ep, item);
+}
+
+/* Changes an item's filter and data, and rearms it.  The device vets filters
+ * when the tap is added, so a new filter means a new registration. */
+static void ep_mod(struct epoll_set *ep, int fd, int filter, uint64_t data,
+                   int flags)
+{
+	struct ep_item *item = ep_lookup(ep, fd);
+	struct chan *c;
+	int old_filter;
+
+	if (!item)
+		error(ENOENT, "FD %d is not in the #%s set", fd, devname());
+	c = item->tap.chan;
+	old_filter = item->tap.filter;
+	if (filter != old_filter) {
+		devtab[c->type].tapfd(c, &item->tap, FDTAP_CMD_REM);
+		item->tap.filter = filter;
+		if (devtab[c->type].tapfd(c, &item->tap, FDTAP_CMD_ADD)) {
+			/* The old filter was fine a moment ago. */
+			item->tap.filter = old_filter;
+			devtab[c->type].tapfd(c, &item->tap, FDTAP_CMD_ADD);
+			error(get_errno(), "%s", current_errstr());
+		}
+	}
+	spin_lock(&ep->lock);
+	ep_set_item(item, filter, data, flags);
+	item->armed = TRUE;
+	item->pending &= filter;
+	spin_unlock(&ep->lock);
+	ep_check_item(ep, item);
+}
+
+static void ep_release(struct kref *kref)
+{
+	struct epoll_set *ep = container_of(kref, struct epoll_set, refcnt);
+	struct ep_item *item;
+
+	/* Sets that tapped us hold a chan, so they are gone by now. */
+	assert(SLIST_EMPTY(&ep->fd_taps));
+	for (int i = 0; i < ep->nr_items_max; i++) {
+		item = ep->items[i];
+		if (item)
+			ep_remove_item(ep, item);
+	}
+	kfree(ep->items);
+	kfree(ep);
+}
+
+static struct chan *ep_attach(char *spec)
+{
+	struct chan *c;
+	struct epoll_set *ep;
+
+	c = devattach(devname(), spec);
+	ep = kzmalloc(sizeof(struct epoll_set), MEM_WAIT);
+	qlock_init(&ep->qlock);
+	spinlock_init(&ep->lock);
+	TAILQ_INIT(&ep->ready);
+	rendez_init(&ep->rv);
+	SLIST_INIT(&ep->fd_taps);
+	spinlock_init(&ep->tap_lock);
+	/* As with #eventfd, each distinct chan of this instance holds a ref. */
+	kref_init(&ep->refcnt, ep_release, 1);
+	mkqid(&c->qid, Qdir, 0, QTDIR);
+	c->aux = ep;
+	return c;
+}
+
+static struct walkqid *ep_walk(struct chan *c, struct chan *nc, char **name,
+                               int nname)
+{
+	struct walkqid *wq;
+	struct epoll_set *ep = c->aux;
+
+	wq = devwalk(c, nc, name, nname, ep_dir, ARRAY_SIZE(ep_dir), devgen);
+	if (wq != NULL && wq->clone != NULL && wq->clone != c)
+		kref_get(&ep->refcnt, 1);
+	return wq;
+}
+
+static int ep_stat(struct chan *c, uint8_t *db, int n)
+{
+	struct epoll_set *ep = c->aux;
+	struct dirtab *tab;
+	struct dir dir;
+	int perm;
+
+	if (c->qid.path != Qdata)
+		return devstat(c, db, n, ep_dir, ARRAY_SIZE(ep_dir), devgen);
+	tab = &ep_dir[Qdata];
+	perm = tab->perm;
+	perm |= ep_has_ready(ep) ? DMREADABLE : 0;
+	devdir(c, c->qid, tab->name, 0, eve.name, perm, &dir);
+	n = convD2M(&dir, db, n);
+	if (n < BIT16SZ)
+		error(ENODATA, ERROR_FIXME);
+	return n;
+}
+
+static struct chan *ep_open(struct chan *c, int omode)
+{
+	return devopen(c, omode, ep_dir, ARRAY_SIZE(ep_dir), devgen);
+}
+
+static void ep_close(struct chan *c)
+{
+	struct epoll_set *ep = c->aux;
+
+	kref_put(&ep->refcnt);
+}
+
+static long ep_read_data(struct epoll_set *ep, struct chan *c, void *ubuf,
+                         long n)
+{
+	ERRSTACK(2);
+	struct fd_tap_event *evs;
+	struct ep_item_tailq requeue = TAILQ_HEAD_INITIALIZER(requeue);
+	int max = n / sizeof(struct fd_tap_event);
+	int nr_evs = 0;
+	int ret;
+
+	if (!max)
+		error(EINVAL, "#%s reads must fit at least one struct fd_tap_event",
+		      devname());
+	evs = kmalloc(MIN(max, EP_BATCH) * sizeof(struct fd_tap_event), MEM_WAIT);
+	if (waserror()) {
+		kfree(evs);
+		nexterror();
+	}
+	while (!nr_evs) {
+		if (!ep_has_ready(ep)) {
+			if (c->flag & O_NONBLOCK)
+				error(EAGAIN, "Would block on #%s read", devname());
+			rendez_sleep(&ep->rv, ep_has_ready_cond, ep);
+		}
+		qlock(&ep->qlock);
+		if (waserror()) {
+			ep_requeue(ep, &requeue);
+			qunlock(&ep->qlock);
+			nexterror();
+		}
+		do {
+			ret = ep_harvest(ep, evs, max - nr_evs, &requeue);
+			/* We're not holding a spinlock, so faulting on ubuf is OK. */
+			memcpy(ubuf + nr_evs * sizeof(struct fd_tap_event), evs,
+			       ret * sizeof(struct fd_tap_event));
+			nr_evs += ret;
+		} while (ret && nr_evs < max && ep_has_ready(ep));
+		poperror();
+		ep_requeue(ep, &requeue);
+		qunlock(&ep->qlock);
+	}
+	poperror();
+	kfree(evs);
+	return nr_evs * sizeof(struct fd_tap_event);
+}
+
+static long ep_read(struct chan *c, void *ubuf, long n, int64_t offset)
+{
+	struct epoll_set *ep = c->aux;
+
+	switch (c->qid.path) {
+	case Qdir:
+		return devdirread(c, ubuf, n, ep_dir, ARRAY_SIZE(ep_dir), devgen);
+	case Qctl:
+		return readnum(offset, ubuf, n, ep->nr_items, NUMSIZE32);
+	case Qdata:
+		return ep_read_data(ep, c, ubuf, n);
+	default:
+		panic("Bad Qid %p!", c->qid.path);
+	}
+	return -1;
+}
+
+enum {
+	CMadd,
+	CMmod,
+	CMdel,
+};
+
+static struct cmdtab ep_ctlmsg[] = {
+	{CMadd, "add", 0},
+	{CMmod, "mod", 0},
+	{CMdel, "del", 2},
+};
+
+/* Parses the "FD FILTER DATA [et] [oneshot]" part of add and mod. */
+static void ep_parse_item(struct cmdbuf *cb, int *filter, uint64_t *data,
+                          int *flags)
+{
+	if (cb->nf < 4)
+		error(EINVAL, "usage: %s FD FILTER DATA [et] [oneshot]", cb->f[0]);
+	*filter = strtoul(cb->f[2], 0, 0);
+	if (!*filter || (*filter & ~EP_LEGAL_FILTERS))
+		error(EINVAL, "Bad #%s filter %p, must be in %p", devname(), *filter,
+		      EP_LEGAL_FILTERS);
+	*data = strtoul(cb->f[3], 0, 0);
+	*flags = 0;
+	for (int i = 4; i < cb->nf; i++) {
+		if (!strcmp(cb->f[i], "et"))
+			*flags |= EP_ET;
+		else if (!strcmp(cb->f[i], "oneshot"))
+			*flags |= EP_ONESHOT;
+		else
+			error(EINVAL, "Unknown #%s flag %s", devname(), cb->f[i]);
+	}
+}
+
+static void ep_ctl(struct epoll_set *ep, void *ubuf, long n)
+{
+	ERRSTACK(2);
+	struct cmdbuf *cb;
+	struct cmdtab *ct;
+	int fd, filter, flags;
+	uint64_t data;
+
+	cb = parsecmd(ubuf, n);
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	ct = lookupcmd(cb, ep_ctlmsg, ARRAY_SIZE(ep_ctlmsg));
+	if (cb->nf < 2)
+		error(EINVAL, "usage: %s FD ...", cb->f[0]);
+	fd = strtol(cb->f[1], 0, 0);
+	qlock(&ep->qlock);
+	if (waserror()) {
+		qunlock(&ep->qlock);
+		nexterror();
+	}
+	switch (ct->index) {
+	case CMadd:
+		ep_parse_item(cb, &filter, &data, &flags);
+		ep_add(ep, fd, filter, data, flags);
+		break;
+	case CMmod:
+		ep_parse_item(cb, &filter, &data, &flags);
+		ep_mod(ep, fd, filter, data, flags);
+		break;
+	case CMdel:
+		ep_del(ep, fd);
+		break;
+	}
+	poperror();
+	qunlock(&ep->qlock);
+	poperror();
+	kfree(cb);
+}
+
+static long ep_write(struct chan *c, void *ubuf, long n, int64_t offset)
+{
+	struct epoll_set *ep = c->aux;
+
+	switch (c->qid.path) {
+	case Qctl:
+		ep_ctl(ep, ubuf, n);
+		break;
+	default:
+		error(EPERM, "Can't write #%s file %s", devname(),
+		      ep_dir[c->qid.path].name);
+	}
+	return n;
+}
+
+static char *ep_chaninfo(struct chan *c, char *ret, size_t ret_l)
+{
+	struct epoll_set *ep = c->aux;
+
+	snprintf(ret, ret_l, "QID type %s, items %d, %sready",
+	         ep_dir[c->qid.path].name, ep->nr_items,
+	         ep_has_ready(ep) ? "" : "not ");
+	return ret;
+}
+
+static int ep_tapfd(struct chan *c, struct fd_tap *tap, int cmd)
+{
+	struct epoll_set *ep = c->aux;
+	int ret;
+
+	#define EP_LEGAL_TAPS (FDTAP_FILT_READABLE | FDTAP_FILT_HANGUP |            \
+	                       FDTAP_FILT_ERROR)
+
+	switch (c->qid.path) {
+	case Qdata:
+		if (tap->filter & ~EP_LEGAL_TAPS) {
+			set_error(ENOSYS, "Unsupported #%s tap, must be %p", devname(),
+			          EP_LEGAL_TAPS);
+			return -1;
+		}
+		spin_lock(&ep->tap_lock);
+		switch (cmd) {
+		case (FDTAP_CMD_ADD):
+			SLIST_INSERT_HEAD(&ep->fd_taps, tap, link);
+			ret = 0;
+			break;
+		case (FDTAP_CMD_REM):
+			SLIST_REMOVE(&ep->fd_taps, tap, fd_tap, link);
+			ret = 0;
+			break;
+		default:
+			set_error(ENOSYS, "Unsupported #%s tap command %p", devname(),
+			          cmd);
+			ret = -1;
+		}
+		spin_unlock(&ep->tap_lock);
+		return ret;
+	default:
+		set_error(ENOSYS, "Can't tap #%s file type %d", devname(),
+		          c->qid.path);
+		return -1;
+	}
+}
+
+struct dev ep_devtab __devtab = {
+	.name = "epoll",
+	.reset = devreset,
+	.init = devinit,
+	.shutdown = devshutdown,
+	.attach = ep_attach,
+	.walk = ep_walk,
+	.stat = ep_stat,
+	.open = ep_open,
+	.create = devcreate,
+	.close = ep_close,
+	.read = ep_read,
+	.bread = devbread,
+	.write = ep_write,
+	.bwrite = devbwrite,
+	.remove = devremove,
+	.wstat = devwstat,
+	.power = devpower,
+	.chaninfo = ep_chaninfo,
+	.tapfd = ep_tapfd,
+};
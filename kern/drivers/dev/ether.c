@@ -311,7 +311,7 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 	struct block *xbp;
 	struct ether *vlan;
 
-	ether->inpackets++;
+	percpu_ctr_inc(&ether->pkts, NetifInPackets);
 
 	pkt = (struct etherpkt *)bp->rp;
 	/* TODO: we might need to assert more for higher layers, or otherwise deal
@@ -371,23 +371,26 @@ struct block *etheriq(struct ether *ether, struct block *bp, int fromwire)
 					etherrtrace(f, pkt, BHLEN(bp));
 					continue;
 				}
+				/* Ring mode copies into the ring; bp stays ours. */
+				if (etherring_rx(f, bp))
+					continue;
 				if (fromwire && fx == 0) {
 					fx = f;
 					continue;
 				}
 				xbp = copyblock(bp, MEM_ATOMIC);
 				if (xbp == 0) {
-					ether->soverflows++;
+					percpu_ctr_inc(&ether->pkts, NetifSoverflows);
 					continue;
 				}
 				if (qpass(f->in, xbp) < 0)
-					ether->soverflows++;
+					percpu_ctr_inc(&ether->pkts, NetifSoverflows);
 			}
 	}
 
 	if (fx) {
 		if (qpass(fx->in, bp) < 0)
-			ether->soverflows++;
+			percpu_ctr_inc(&ether->pkts, NetifSoverflows);
 		return 0;
 	}
 	if (fromwire) {
@@ -404,11 +407,12 @@ static int etheroq(struct ether *ether, struct block *bp)
 	struct etherpkt *pkt;
 	int8_t irq_state = 0;
 
-	ether->outpackets++;
+	percpu_ctr_inc(&ether->pkts, NetifOutPackets);
 
 	if (!(ether->feat & NETF_SG))
-		bp = linearizeblock(bp);
-	ptclcsum_finalize(bp, ether->feat);
+		bp = ptclcsum_linearize(bp, ether->feat);
+	else
+		ptclcsum_finalize(bp, ether->feat);
 	/*
 	 * Check if the packet has to be placed back onto the input queue,
 	 * i.e. if it's a loopback or broadcast packet or the interface is
@@ -450,6 +454,53 @@ static int etheroq(struct ether *ether, struct block *bp)
 	return len;
 }
 
+/* "itr auto" or "itr USEC" set every polled ring's interrupt moderation.
+ * "busypoll USEC" sets how long pollers spin before going back to irqs. */
+static void etherpollctl(struct ether *ether, struct cmdbuf *cb)
+{
+	struct etherq *q;
+	long v = 0;
+
+	if (cb->nf != 2)
+		error(EINVAL, "usage: itr auto|usec, busypoll usec");
+	if (strcmp(cb->f[0], "itr") != 0 || strcmp(cb->f[1], "auto") != 0) {
+		v = strtol(cb->f[1], 0, 0);
+		if (v < 0 || v > 10000)
+			error(EINVAL, "%s: %ld usec is out of range", cb->f[0], v);
+	}
+	for (int i = 0; i < ether->nrxq; i++) {
+		q = &ether->rxq[i];
+		if (!q->poll)
+			continue;
+		if (strcmp(cb->f[0], "busypoll") == 0) {
+			q->busypoll = v;
+		} else if (strcmp(cb->f[1], "auto") == 0) {
+			q->itrauto = !!q->setitr;
+		} else {
+			if (!q->setitr)
+				error(ENOTSUP, "%s can't moderate interrupts", ether->name);
+			q->itrauto = FALSE;
+			q->itr = v;
+			q->setitr(q, v);
+		}
+	}
+}
+
+/* A write to the data file of a netfile in ring mode: sends everything in its
+ * tx ring.  Returns the number of frames sent. */
+static long etherringkick(struct ether *ether, struct netfile *f)
+{
+	struct block *bp;
+	long nr = 0;
+
+	while ((bp = etherring_tx(f, ether->maxmtu + ETHERHDRSIZE))) {
+		memmove(bp->rp + Eaddrlen, ether->ea, Eaddrlen);
+		etheroq(ether, bp);
+		nr++;
+	}
+	return nr;
+}
+
 static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 {
 	ERRSTACK(2);
@@ -484,6 +535,17 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 			kfree(cb);
 			goto out;
 		}
+		if (strcmp(cb->f[0], "itr") == 0 || strcmp(cb->f[0], "busypoll") == 0) {
+			if (waserror()) {
+				kfree(cb);
+				nexterror();
+			}
+			etherpollctl(ether, cb);
+			poperror();
+			kfree(cb);
+			l = n;
+			goto out;
+		}
 		kfree(cb);
 		if (ether->ctl != NULL) {
 			l = ether->ctl(ether, buf, n);
@@ -492,6 +554,10 @@ static long etherwrite(struct chan *chan, void *buf, long n, int64_t unused)
 		error(EINVAL, ERROR_FIXME);
 	}
 
+	if (etherring_on(ether->f[NETID(chan->qid.path)])) {
+		l = etherringkick(ether, ether->f[NETID(chan->qid.path)]);
+		goto out;
+	}
 	if (n > ether->maxmtu + ETHERHDRSIZE)
 		error(E2BIG, ERROR_FIXME);
 	bp = block_alloc(n, MEM_WAIT);
@@ -544,6 +610,221 @@ static long etherbwrite(struct chan *chan, struct block *bp, uint32_t unused)
 	return n;
 }
 
+/* Poll mode.
+ *
+ * The driver's interrupt handler masks the ring's rx interrupt and calls
+ * etherpollirq(), which wakes the ring's poller.  The poller calls the driver's
+ * poll function, up to budget packets at a time, until the ring is empty, and
+ * then rearms the interrupt with irqon.  Pending causes fire as soon as the irq
+ * is unmasked, so there's no lost wakeup.
+ *
+ * If busypoll is set and the ring has been busy, the poller keeps polling for
+ * that many usec after the ring goes empty before it rearms.
+ *
+ * A reader of a conversation with "busypoll" set can also take a ring while
+ * its irq is armed, poll it itself, and give it back the same way the poller
+ * does (etherbusypoll()).  Ownership of a ring (q->owner) changes with a CAS,
+ * so the irq handler, the poller and readers never poll a ring at once.
+ *
+ * A reader leaves the irq armed, and the poller's can fire before it masks it
+ * again, so an irq can come while someone else has the ring.  The driver has
+ * already cleared its cause by then, so it won't fire again when the ring is
+ * rearmed.  etherpollirq() notes it in irqpending, and whoever gives the ring
+ * back checks for it (etherpollrelease()) and hands the ring to the poller.
+ *
+ * With itrauto, the poller also picks the NIC's interrupt moderation (setitr)
+ * from how many packets each wakeup finds, like e1000's dynamic ITR.  A packet
+ * or two per wakeup means we're latency bound, so no moderation.  Lots per
+ * wakeup means bulk traffic, where interrupts just cost us throughput. */
+enum {
+	EtherPollBudget = 64,
+	EtherItrLatency = 0,		/* usec */
+	EtherItrLow = 50,			/* ~20000 irqs/sec */
+	EtherItrBulk = 250,			/* ~4000 irqs/sec */
+	EtherPppLow = 4 * 16,		/* ppp is x16 */
+	EtherPppBulk = 32 * 16,
+	EtherBusyPollMax = 16,		/* rings one reader polls */
+};
+
+/* Every poll-mode ring, for busy-polling readers.  Rings never go away. */
+static struct etherq *etherpollqs[MaxEther * MaxEtherQueues];
+static int netherpollqs;
+static spinlock_t etherpollqs_lock = SPINLOCK_INITIALIZER;
+
+static void etherpollitr(struct etherq *q, unsigned int npkts)
+{
+	unsigned int itr;
+
+	q->ppp = (q->ppp * 7 + npkts * 16) / 8;
+	if (!q->itrauto || !q->setitr)
+		return;
+	if (q->ppp < EtherPppLow)
+		itr = EtherItrLatency;
+	else if (q->ppp < EtherPppBulk)
+		itr = EtherItrLow;
+	else
+		itr = EtherItrBulk;
+	if (itr != q->itr) {
+		q->itr = itr;
+		q->setitr(q, itr);
+	}
+}
+
+static int etherpollready(void *arg)
+{
+	struct etherq *q = arg;
+
+	return q->owner == EtherPollPoller;
+}
+
+/* Gives q back to its irq.  If the irq fired while we had the ring, its cause
+ * is gone and it won't fire again for the frames it was about, so we hand the
+ * ring to the poller instead.  When that's us, our next rendez_sleep() falls
+ * right through. */
+static void etherpollrelease(struct etherq *q)
+{
+	q->owner = EtherPollIrq;
+	wmb();	/* the irq handler must see the ring is free once it fires */
+	q->irqon(q);
+	mb();	/* etherpollirq() sets irqpending before its CAS */
+	if (!q->irqpending)
+		return;
+	q->irqpending = FALSE;
+	if (__sync_bool_compare_and_swap(&q->owner, EtherPollIrq,
+	                                 EtherPollPoller))
+		rendez_wakeup(&q->pollr);
+}
+
+static void etherpollproc(void *arg)
+{
+	struct etherq *q = arg;
+	uint64_t deadline;
+	unsigned int npkts;
+	int n;
+
+	for (;;) {
+		rendez_sleep(&q->pollr, etherpollready, q);
+		/* we're about to poll, so any irq so far is covered */
+		q->irqpending = FALSE;
+		npkts = 0;
+		deadline = 0;
+		for (;;) {
+			n = q->poll(q, q->budget);
+			q->polls++;
+			q->packets += n;
+			npkts += n;
+			if (n == q->budget) {
+				/* more where that came from; let others run first */
+				kthread_yield();
+				continue;
+			}
+			if (!q->busypoll || q->ppp < EtherPppLow)
+				break;
+			if (n || !deadline)
+				deadline = read_tsc() + usec2tsc(q->busypoll);
+			else if (read_tsc() > deadline)
+				break;
+			q->busypolls++;
+			cpu_relax();
+		}
+		etherpollitr(q, npkts);
+		etherpollrelease(q);
+	}
+}
+
+/* Starts q's poller.  The driver fills in poll, irqon and (optionally) setitr
+ * first, with the ring's irq masked.  The poller does the first poll and arms
+ * the irq. */
+void etherpollstart(struct etherq *q)
+{
+	struct ether *ether = q->ether;
+
+	snprintf(q->name, sizeof(q->name), "#l%dp%d", ether->ctlrno, q->idx);
+	rendez_init(&q->pollr);
+	if (!q->budget)
+		q->budget = EtherPollBudget;
+	q->itrauto = !!q->setitr;
+	q->owner = EtherPollPoller;
+	spin_lock(&etherpollqs_lock);
+	if (netherpollqs < ARRAY_SIZE(etherpollqs)) {
+		etherpollqs[netherpollqs] = q;
+		wmb();	/* busy pollers see the ring before the count */
+		netherpollqs++;
+	}
+	spin_unlock(&etherpollqs_lock);
+	ktask_on_core(q->name, etherpollproc, q, q->coreid);
+}
+
+/* Called from the driver's irq handler, with q's irq masked. */
+void etherpollirq(struct etherq *q)
+{
+	q->irqs++;
+	/* If someone else has the ring, they'll see this when they give it back */
+	q->irqpending = TRUE;
+	if (!__sync_bool_compare_and_swap(&q->owner, EtherPollIrq,
+	                                  EtherPollPoller))
+		return;
+	rendez_wakeup(&q->pollr);
+}
+
+/* Called by a reader that wants to spin instead of sleeping (see ipread()).
+ * Grabs every poll-mode ring whose irq is armed and polls them until done(arg)
+ * or the deadline, then rearms them.  Rings that their poller already owns are
+ * being polled anyway.
+ *
+ * Polled frames still go up through the medium's kprocs (etherread4/6).  Those
+ * are plain ktasks, not pinned (ktask_on_core()), so waking them sends a
+ * routine kmsg to the waker's core: this one.  They can't run while we spin,
+ * so whenever there are routine kmsgs waiting, we yield to them.  That runs the
+ * receive path right here, without an irq or a trip through the poller, and
+ * then we're back to check done(). */
+void etherbusypoll(uint64_t deadline, int (*done)(void *), void *arg)
+{
+	struct etherq *mine[EtherBusyPollMax];
+	struct etherq *q;
+	int nmine = 0, n = ACCESS_ONCE(netherpollqs);
+
+	rmb();
+	for (int i = 0; i < n && nmine < EtherBusyPollMax; i++) {
+		q = etherpollqs[i];
+		if (__sync_bool_compare_and_swap(&q->owner, EtherPollIrq,
+		                                 EtherPollReader)) {
+			q->irqpending = FALSE;
+			mine[nmine++] = q;
+		}
+	}
+	while (!done(arg) && read_tsc() < deadline) {
+		for (int i = 0; i < nmine; i++) {
+			q = mine[i];
+			n = q->poll(q, q->budget);
+			q->rdpolls++;
+			q->packets += n;
+		}
+		if (has_routine_kmsg())
+			kthread_yield();
+		else
+			cpu_relax();
+	}
+	for (int i = 0; i < nmine; i++)
+		etherpollrelease(mine[i]);
+}
+
+
+/* Sets up the rx rings a driver asked for in its reset: spreads them over the
+ * cores, leaving core 0 alone if we can.  Pollers run on their ring's core. */
+static void etherinitqs(struct ether *ether)
+{
+	int ncores = num_cores > 1 ? num_cores - 1 : 1;
+	int first = num_cores > 1 ? 1 : 0;
+
+	ether->nrxq = MIN(ether->nrxq, MaxEtherQueues);
+	for (int i = 0; i < ether->nrxq; i++) {
+		ether->rxq[i].ether = ether;
+		ether->rxq[i].idx = i;
+		ether->rxq[i].coreid = first + (ether->ctlrno + i) % ncores;
+	}
+}
+
 static void nop(struct ether *unused)
 {
 }
@@ -770,6 +1051,7 @@ static void etherreset(void)
 				ether->oq = qopen(qsize, Qmsg, 0, 0);
 			if (ether->oq == 0)
 				panic("etherreset %s", name);
+			etherinitqs(ether);
 			ether->alen = Eaddrlen;
 			memmove(ether->addr, ether->ea, Eaddrlen);
 			memset(ether->bcast, 0xFF, Eaddrlen);
@@ -40,6 +40,8 @@
 #include <smp.h>
 #include <ip.h>
 #include <smallidpool.h>
+#include <init.h>
+#include <umem.h>
 
 struct dev mntdevtab;
 
@@ -59,9 +61,15 @@ static char *devname(void)
  * connection.
  */
 
-#define MAXRPC (IOHDRSZ+8192)
+#define MAXRPC (IOHDRSZ+65536)
 #define MAXTAG MAX_U16_POOL_SZ
 
+/* Most Treads a single mntrdwr() keeps outstanding.  The default can be set
+ * with the "mntwindow=N" boot option. */
+#define MNTMAXWINDOW 32
+static int mnt_rpc_window = 8;
+DEVVARS_ENTRY(mnt_rpc_window, "dw");
+
 static __inline int isxdigit(int c)
 {
 	if ((c >= '0') && (c <= '9'))
@@ -84,6 +92,7 @@ struct mntrpc {
 	unsigned int rpclen;		/* len of buffer */
 	struct block *b;			/* reply blocks */
 	char done;					/* Rpc completed */
+	char direct;				/* Rread data went right to request.data */
 	uint64_t stime;				/* start time for mnt statistics */
 	uint32_t reqlen;			/* request length for mnt statistics */
 	uint32_t replen;			/* reply length for mnt statistics */
@@ -121,6 +130,11 @@ int mntrpcread(struct mnt *, struct mntrpc *);
 void mountio(struct mnt *, struct mntrpc *);
 void mountmux(struct mnt *, struct mntrpc *);
 void mountrpc(struct mnt *, struct mntrpc *);
+static void mountrpcsend(struct mnt *, struct mntrpc *);
+static void mountrpcwait(struct mnt *, struct mntrpc *);
+static void mntcancel(struct mnt *, struct mntrpc *);
+static void mountxmit(struct mnt *, struct mntrpc *);
+static void __mountio(struct mnt *, struct mntrpc *, bool);
 int rpcattn(void *);
 struct chan *mntchan(void);
 
@@ -128,6 +142,10 @@ void (*mntstats) (int unused_int, struct chan *, uint64_t, uint32_t);
 
 static void mntinit(void)
 {
+	char buf[16];
+
+	if (get_boot_option(NULL, "mntwindow", buf, sizeof(buf)))
+		mnt_rpc_window = MAX(MIN(strtol(buf, 0, 0), MNTMAXWINDOW), 1);
 	mntalloc.id = 1;
 	mntalloc.tags = create_u16_pool(MAXTAG);
 	(void) get_u16(mntalloc.tags);	/* don't allow 0 as a tag */
@@ -692,6 +710,7 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 	uint8_t *p, *e;
 	int nc, cache, isdir, dirlen;
 	int numdirent = 0;
+	bool eof;
 
 	isdir = 0;
 	cache = c->flag & CCACHE;
@@ -702,14 +721,12 @@ static long mntread(struct chan *c, void *buf, long n, int64_t off)
 
 	p = buf;
 	if (cache) {
-		nc = cread(c, buf, n, off);
-		if (nc > 0) {
-			n -= nc;
-			if (n == 0)
-				return nc;
-			p += nc;
-			off += nc;
-		}
+		nc = cread(c, buf, n, off, &eof);
+		if (eof || nc == n)
+			return nc;
+		n -= nc;
+		p += nc;
+		off += nc;
 		n = mntrdwr(Tread, c, p, n, off);
 		cupdate(c, p, n, off);
 		return n + nc;
@@ -743,69 +760,133 @@ static long mntwrite(struct chan *c, void *buf, long n, int64_t off)
 	return mntrdwr(Twrite, c, buf, n, off);
 }
 
+/* The rpcs of one mntrdwr(), in order.  [head, tail) have been sent. */
+struct mntwin {
+	struct mntrpc *rpc[MNTMAXWINDOW];
+	unsigned int head;
+	unsigned int tail;
+};
+
+/* Cancels and frees everything still in flight. */
+static void mntwin_drain(struct mnt *m, struct mntwin *w)
+{
+	struct mntrpc *r;
+
+	for (; w->head != w->tail; w->head++) {
+		r = w->rpc[w->head % MNTMAXWINDOW];
+		mntcancel(m, r);
+		mntfree(r);
+	}
+}
+
+/* Large reads and writes are split into msize chunks.  For big reads of
+ * storage, we keep up to mnt_rpc_window of them outstanding so the read costs
+ * about one round trip per window instead of one per chunk.  Replies are
+ * consumed in order, and we stop at the first short one, flushing the rest.  If
+ * a chunk after the first fails, the caller gets the bytes that made it, like
+ * any short read or write.
+ *
+ * Only reads pipeline, and only on MCACHE mounts, whose mounter told us the
+ * files are plain storage we can also cache.  A server may answer concurrent
+ * reads of a stream or ctl file in its own order, not offset order, and 9P has
+ * no qid bit for "seekable", so the mount flag is all we have to go on.  Even
+ * then, directories and the special qid types stay one rpc at a time, and the
+ * window only opens once the first chunk comes back full.
+ *
+ * Writes never pipeline: a later chunk could be applied past one that came
+ * back short or failed, and a Tflush can't take it back. */
 long mntrdwr(int type, struct chan *c, void *buf, long n, int64_t off)
 {
 	ERRSTACK(1);
 	struct mnt *m;
-	struct mntrpc *r;			/* TO DO: volatile struct { Mntrpc *r; } r; */
-	char *uba;
-	int cache;
-	uint32_t cnt, nr, nreq;
+	struct mntrpc *r;
+	struct mntwin w;
+	char *uba, *sba;
+	int cache, window, limit;
+	int64_t soff;
+	long sn;
+	uint32_t nr, nreq, chunk;
+	volatile uint32_t cnt;		/* volatile for the waserror */
 
 	m = mntchk(c);
+	chunk = m->msize - IOHDRSZ;
 	uba = buf;
 	cnt = 0;
 	cache = c->flag & CCACHE;
 	if (c->qid.type & QTDIR)
 		cache = 0;
-	for (;;) {
-		r = mntralloc(c, m->msize);
-		if (waserror()) {
-			mntfree(r);
+	window = 1;
+	if (type == Tread && (c->flag & CCACHE) &&
+	    !(c->qid.type & (QTDIR | QTAPPEND | QTEXCL | QTMOUNT | QTAUTH)))
+		window = mnt_rpc_window;
+	limit = 1;
+	sba = uba;
+	soff = off;
+	sn = n;
+	w.head = w.tail = 0;
+	if (waserror()) {
+		mntwin_drain(m, &w);
+		if (!cnt)
 			nexterror();
+		poperror();
+		return cnt;
+	}
+	for (;;) {
+		while (sn > 0 && w.tail - w.head < limit) {
+			r = mntralloc(c, m->msize);
+			r->request.type = type;
+			r->request.fid = c->fid;
+			r->request.offset = soff;
+			r->request.data = sba;
+			nr = sn;
+			if (nr > chunk)
+				nr = chunk;
+			/* Line big reads up on chunk boundaries of the file, so every
+			 * chunk but the first and last is a full, aligned one. */
+			if (type == Tread && sn > chunk)
+				nr = MIN(nr, chunk - soff % chunk);
+			r->request.count = nr;
+			w.rpc[w.tail++ % MNTMAXWINDOW] = r;
+			mountrpcsend(m, r);
+			soff += nr;
+			sba += nr;
+			sn -= nr;
 		}
-		r->request.type = type;
-		r->request.fid = c->fid;
-		r->request.offset = off;
-		r->request.data = uba;
-		nr = n;
-		if (nr > m->msize - IOHDRSZ)
-			nr = m->msize - IOHDRSZ;
-		r->request.count = nr;
-		mountrpc(m, r);
+		if (w.head == w.tail)
+			break;
+		r = w.rpc[w.head % MNTMAXWINDOW];
+		mountrpcwait(m, r);
 		nreq = r->request.count;
 		nr = r->reply.count;
 		if (nr > nreq)
 			nr = nreq;
 
-		if (type == Tread)
-			r->b = bl2mem((uint8_t *) uba, r->b, nr);
-		else if (cache)
-			cwrite(c, (uint8_t *) uba, nr, off);
+		if (type == Tread) {
+			if (!r->direct)
+				r->b = bl2mem((uint8_t *) uba, r->b, nr);
+		} else if (cache)
+			cwrite(c, (uint8_t *) uba, nr, r->request.offset);
 
-		poperror();
+		w.head++;
 		mntfree(r);
-		off += nr;
 		uba += nr;
 		cnt += nr;
-		n -= nr;
-		if (nr != nreq || n == 0 /*|| current->killed */ )
+		if (nr != nreq)
 			break;
+		limit = window;
 	}
+	mntwin_drain(m, &w);
+	poperror();
 	return cnt;
 }
 
-void mountrpc(struct mnt *m, struct mntrpc *r)
+/* Throws if r's reply isn't the one r's request wants. */
+static void mountrpccheck(struct mnt *m, struct mntrpc *r)
 {
 	char *sn, *cn;
 	int t;
 	char *e;
 
-	r->reply.tag = 0;
-	r->reply.type = Tmax;	/* can't ever be a valid message type */
-
-	mountio(m, r);
-
 	t = r->reply.type;
 	switch (t) {
 		case Rerror:
@@ -843,11 +924,88 @@ void mountrpc(struct mnt *m, struct mntrpc *r)
 	}
 }
 
-void mountio(struct mnt *m, struct mntrpc *r)
+void mountrpc(struct mnt *m, struct mntrpc *r)
+{
+	r->reply.tag = 0;
+	r->reply.type = Tmax;	/* can't ever be a valid message type */
+
+	mountio(m, r);
+	mountrpccheck(m, r);
+}
+
+/* Sends r without waiting for the reply.  The caller must follow up with
+ * mountrpcwait() or mntcancel(). */
+static void mountrpcsend(struct mnt *m, struct mntrpc *r)
+{
+	ERRSTACK(1);
+
+	r->reply.tag = 0;
+	r->reply.type = Tmax;
+	if (waserror()) {
+		mntqrm(m, r);
+		nexterror();
+	}
+	mountxmit(m, r);
+	poperror();
+}
+
+static void mountrpcwait(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, TRUE);
+	mountrpccheck(m, r);
+}
+
+/* Gives up on a sent rpc, flushing it if it hasn't been answered.  Never
+ * throws; the caller still frees r. */
+static void mntcancel(struct mnt *m, struct mntrpc *r)
 {
 	ERRSTACK(1);
+
+	if (r->done)
+		return;
+	if (waserror()) {
+		/* In case we couldn't even get a flush out. */
+		mntqrm(m, r);
+		poperror();
+		return;
+	}
+	__mountio(m, mntflushalloc(r, m->msize), FALSE);
+	poperror();
+}
+
+/* Queues r on m and transmits it. */
+static void mountxmit(struct mnt *m, struct mntrpc *r)
+{
 	int n;
 
+	spin_lock(&m->lock);
+	r->m = m;
+	r->list = m->queue;
+	m->queue = r;
+	spin_unlock(&m->lock);
+
+	/* Transmit a file system rpc */
+	if (m->msize == 0)
+		panic("msize");
+	n = convS2M(&r->request, r->rpc, m->msize);
+	if (n < 0)
+		panic("bad message type in mountio");
+	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
+		error(EIO, ERROR_FIXME);
+/*	r->stime = fastticks(NULL); */
+	r->reqlen = n;
+}
+
+void mountio(struct mnt *m, struct mntrpc *r)
+{
+	__mountio(m, r, FALSE);
+}
+
+/* Sends r, unless it's already been sent, and waits for its reply. */
+static void __mountio(struct mnt *m, struct mntrpc *r, bool sent)
+{
+	ERRSTACK(1);
+
 	while (waserror()) {
 		if (m->rip == current)
 			mntgate(m);
@@ -866,26 +1024,13 @@ void mountio(struct mnt *m, struct mntrpc *r)
 		}
 		/* try again.  this is where you can get the "rpc tags" errstr. */
 		r = mntflushalloc(r, m->msize);
+		sent = FALSE;
 		/* need one for every waserror call (so this plus one outside) */
 		poperror();
 	}
 
-	spin_lock(&m->lock);
-	r->m = m;
-	r->list = m->queue;
-	m->queue = r;
-	spin_unlock(&m->lock);
-
-	/* Transmit a file system rpc */
-	if (m->msize == 0)
-		panic("msize");
-	n = convS2M(&r->request, r->rpc, m->msize);
-	if (n < 0)
-		panic("bad message type in mountio");
-	if (devtab[m->c->type].write(m->c, r->rpc, n, 0) != n)
-		error(EIO, ERROR_FIXME);
-/*	r->stime = fastticks(NULL); */
-	r->reqlen = n;
+	if (!sent)
+		mountxmit(m, r);
 
 	/* Gate readers onto the mount point one at a time */
 	for (;;) {
@@ -929,6 +1074,41 @@ static int doread(struct mnt *m, int len)
 	return 0;
 }
 
+/* Copies the data of our own Rread from m->q straight into the caller's buffer
+ * (request.data), instead of hanging blocks off the reply for mntrdwr() to
+ * copy out later.  The whole message is already on m->q, and nb is its
+ * pulled-up header, so nothing here can block or fail once we start eating it.
+ *
+ * Returns TRUE if we took the message.  We only do this for r, since we're r's
+ * thread and know its buffer is still there, and only for kernel buffers, which
+ * in practice means the page cache's fills.  User buffers take the block path:
+ * we hold m->rip here, and faulting on a user page could need this mount to
+ * make progress.  Nor can we fault them in beforehand and hold on to them,
+ * since pages have no refcount to pin them with; a munmap during the rpc would
+ * free them under us.  bl2mem() copies into them after we've left the gate. */
+static bool mntrpcread_direct(struct mnt *m, struct mntrpc *r, struct block *nb,
+                              int len, int hlen)
+{
+	uint8_t *dst = (uint8_t *) r->request.data;
+	uint32_t count = GBIT32(nb->rp + hlen - BIT32SZ);
+	uint32_t got = 0;
+
+	if (r->request.type != Tread || !dst || count != len - hlen ||
+	    count > r->request.count)
+		return FALSE;
+	if (is_user_rwaddr(dst, count))
+		return FALSE;
+	if (convM2S(nb->rp, len, &r->reply) <= 0)
+		return FALSE;
+	qdiscard(m->q, hlen);
+	while (got < count)
+		got += qread(m->q, dst + got, count - got);
+	r->reply.data = (char *) dst;
+	r->b = NULL;
+	r->direct = 1;
+	return TRUE;
+}
+
 int mntrpcread(struct mnt *m, struct mntrpc *r)
 {
 	int i, t, len, hlen;
@@ -942,16 +1122,14 @@ int mntrpcread(struct mnt *m, struct mntrpc *r)
 		return -1;
 	nb = pullupqueue(m->q, BIT32SZ + BIT8SZ + BIT16SZ);
 
-	/* read in the rest of the message, avoid ridiculous (for now) message sizes */
+	/* avoid ridiculous (for now) message sizes */
 	len = GBIT32(nb->rp);
 	if (len > m->msize) {
 		qdiscard(m->q, qlen(m->q));
 		return -1;
 	}
-	if (doread(m, len) < 0)
-		return -1;
 
-	/* pullup the header (i.e. everything except data) */
+	/* the header is everything except data */
 	t = nb->rp[BIT32SZ];
 	switch (t) {
 		case Rread:
@@ -961,8 +1139,19 @@ int mntrpcread(struct mnt *m, struct mntrpc *r)
 			hlen = len;
 			break;
 	}
+	if (len < hlen) {
+		qdiscard(m->q, qlen(m->q));
+		return -1;
+	}
+	/* read in the rest of the message, all of it before we take any */
+	if (doread(m, len) < 0)
+		return -1;
 	nb = pullupqueue(m->q, hlen);
 
+	if (t == Rread && GBIT16(nb->rp + BIT32SZ + BIT8SZ) == r->request.tag &&
+	    mntrpcread_direct(m, r, nb, len, hlen))
+		return 0;
+
 	if (convM2S(nb->rp, len, &r->reply) <= 0) {
 		/* bad message, dump it */
 		printd("mntrpcread: convM2S failed\n");
@@ -1161,6 +1350,7 @@ struct mntrpc *mntralloc(struct chan *c, uint32_t msize)
 	spin_unlock(&mntalloc.l);
 	new->c = c;
 	new->done = 0;
+	new->direct = 0;
 	new->flushed = NULL;
 	new->b = NULL;
 	return new;
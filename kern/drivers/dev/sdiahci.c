@@ -122,7 +122,7 @@ static char *descmode[] = {
 };
 
 static char *flagname[] = {
-    "llba", "smart", "power", "nop", "atapi", "atapi16",
+    "llba", "smart", "power", "nop", "atapi", "atapi16", "ncq",
 };
 
 struct drive {
@@ -866,8 +866,9 @@ static int ahciconfigdrive(struct drive *d)
 	pm = d->portc.pm;
 	if (pm->list == 0) {
 		setupfis(&pm->fis);
-		pm->list = malign(ALIST_SIZE, 1024);
-		pm->ctab = malign(ACTAB_PRDT + APRDT_SIZE, 128);
+		/* slot 0's list entry and table are the legacy path's */
+		pm->list = malign(AHCI_NSLOT * ALIST_SIZE, 1024);
+		pm->ctab = malign(AHCI_NSLOT * ACTAB_SIZE, 128);
 	}
 
 	if (d->unit)
@@ -1037,6 +1038,32 @@ static int identify(struct drive *d)
 	return 0;
 }
 
+/*
+ * Turns on native command queueing if the HBA and the drive both do it (word 76
+ * bit 8).  Tags are slot numbers, so the depth is the smaller of the HBA's
+ * command slots and the drive's queue (word 75).
+ */
+static void ncqsetup(struct drive *d)
+{
+	struct aportm *pm;
+	uint32_t cap;
+	int depth;
+
+	pm = &d->portm;
+	pm->feat &= ~Dncq;
+	pm->ncqdepth = 0;
+	pm->ncqfree = 0;
+	cap = ahci_hba_read32(d->ctlr->hba, HBA_CAP);
+	if ((cap & Hsncq) == 0 || (pm->feat & (Datapi | Dllba)) != Dllba ||
+	    d->infosz < 77 * sizeof(uint16_t) ||
+	    (gbit16(d->info + 76) & (1 << 8)) == 0)
+		return;
+	depth = MIN(((cap >> 8) & 0x1f) + 1, (gbit16(d->info + 75) & 0x1f) + 1);
+	pm->ncqdepth = depth;
+	pm->ncqfree = depth == AHCI_NSLOT ? ~0 : (1 << depth) - 1;
+	pm->feat |= Dncq;
+}
+
 static void clearci(void *p)
 {
 	uint32_t cmd;
@@ -1048,9 +1075,30 @@ static void clearci(void *p)
 	}
 }
 
+/* Finishes the queued commands in slots, failing them if err.  The drive's Lock
+ * is held. */
+static void ncqcomplete(struct drive *d, uint32_t slots, int err)
+{
+	struct aportm *pm;
+	int i;
+
+	pm = &d->portm;
+	slots &= pm->ncqissued;
+	if (slots == 0)
+		return;
+	pm->ncqissued &= ~slots;
+	if (err)
+		pm->ncqerr |= slots;
+	for (i = 0; i < AHCI_NSLOT; i++)
+		if (slots & (1 << i))
+			rendez_wakeup(&pm->ncqrend[i]);
+	if (pm->ncqissued == 0)
+		rendez_wakeup(&pm->slotrend);
+}
+
 static void updatedrive(struct drive *d)
 {
-	uint32_t cause, serr, task, sstatus, ie, s0, pr, ewake;
+	uint32_t cause, serr, task, sstatus, ie, s0, pr, ewake, done;
 	char *name;
 	void *port;
 	static uint32_t last;
@@ -1071,6 +1119,13 @@ static void updatedrive(struct drive *d)
 		pr = 0;
 	} else if (cause & Adps)
 		pr = 0;
+	if (d->portm.ncqissued) {
+		/* the drive clears a tag's SActive bit when it's done with it */
+		done = ~(ahci_port_read32(port, PORT_SACT) |
+		         ahci_port_read32(port, PORT_CI));
+		ncqcomplete(d, done, 0);
+		pr = 0;
+	}
 	if (cause & Ifatal) {
 		ewake = 1;
 		printd("ahci: updatedrive: %s: fatal\n", name);
@@ -1125,7 +1180,9 @@ static void updatedrive(struct drive *d)
 	}
 	ahci_port_write32(port, PORT_SERR, serr);
 	if (ewake) {
+		/* an ncq error aborts the whole queue */
 		clearci(port);
+		ncqcomplete(d, ~0, 1);
 		rendez_wakeup(&d->portm.Rendez);
 	}
 	last = cause;
@@ -1195,6 +1252,7 @@ static void resetdisk(struct drive *d)
 	if (d->state != Dready || d->state != Dnew)
 		d->portm.flag |= Ferror;
 	clearci(port); /* satisfy sleep condition. */
+	ncqcomplete(d, ~0, 1);
 	rendez_wakeup(&d->portm.Rendez);
 	if (stat != (Devpresent | Devphycomm)) {
 		/* device absent or phy not communicating */
@@ -1247,12 +1305,14 @@ static int newdrive(struct drive *d)
 		if (ahcirecover(pc) == -1)
 			goto lose;
 	}
+	ncqsetup(d);
 	setstate(d, Dready);
 	qunlock(&pc->pm->ql);
 
-	iprintd("%s: %sLBA %llu sectors: %s %s %s %s\n", d->unit->sdperm.name,
-	        (pm->feat & Dllba ? "L" : ""), d->sectors, d->model, d->firmware,
-	        d->serial, d->mediachange ? "[mediachange]" : "");
+	iprintd("%s: %sLBA %llu sectors: %s %s %s %s ncq %d\n",
+	        d->unit->sdperm.name, (pm->feat & Dllba ? "L" : ""), d->sectors,
+	        d->model, d->firmware, d->serial,
+	        d->mediachange ? "[mediachange]" : "", pm->ncqdepth);
 	return 0;
 
 lose:
@@ -1411,6 +1471,7 @@ static void checkdrive(struct drive *d, int i)
 		       diskstates[d->state], d->mode, s);
 		d->portm.flag |= Ferror;
 		clearci(d->port);
+		ncqcomplete(d, ~0, 1);
 		rendez_wakeup(&d->portm.Rendez);
 		if ((s & Devdet) == 0) { /* no device */
 			d->state = Dmissing;
@@ -1657,6 +1718,203 @@ static int iaonline(struct sdunit *unit)
 	return r;
 }
 
+/*
+ * Native command queueing.  Any number of iario()s can have a command queued in
+ * a slot of their own, and the interrupt finishes them in whatever order the
+ * drive does.  A queued command is built and issued under the port's qlock.
+ * The legacy path holds that qlock for the whole of its command, after letting
+ * the queue drain (ncqdrain()), so the two never mix on the wire and can share
+ * slot 0.
+ */
+static int ncqslotfree(void *v)
+{
+	struct drive *d = v;
+	struct aportm *pm = &d->portm;
+
+	return (pm->ncqfree & ~pm->ncqbusy) || d->state != Dready ||
+	       (pm->feat & Dncq) == 0;
+}
+
+/* Returns a slot of our own, or -1 if the drive can't queue right now. */
+static int ncqgetslot(struct drive *d)
+{
+	struct aportm *pm;
+	uint32_t avail;
+	int slot;
+
+	pm = &d->portm;
+	for (;;) {
+		spin_lock_irqsave(&d->Lock);
+		if (d->state != Dready || (pm->feat & Dncq) == 0) {
+			spin_unlock_irqsave(&d->Lock);
+			return -1;
+		}
+		avail = pm->ncqfree & ~pm->ncqbusy;
+		if (avail) {
+			for (slot = 0; (avail & (1 << slot)) == 0; slot++)
+				;
+			pm->ncqbusy |= 1 << slot;
+			spin_unlock_irqsave(&d->Lock);
+			return slot;
+		}
+		spin_unlock_irqsave(&d->Lock);
+		rendez_sleep(&pm->slotrend, ncqslotfree, d);
+	}
+}
+
+static void ncqputslot(struct drive *d, int slot)
+{
+	spin_lock_irqsave(&d->Lock);
+	d->portm.ncqbusy &= ~(1 << slot);
+	spin_unlock_irqsave(&d->Lock);
+	rendez_wakeup(&d->portm.slotrend);
+}
+
+static int ncqidle(void *v)
+{
+	struct aportm *pm = v;
+
+	return ACCESS_ONCE(pm->ncqissued) == 0;
+}
+
+/* Waits for every queued command to finish.  Called with the port qlocked, so
+ * nothing new gets queued meanwhile. */
+static void ncqdrain(struct drive *d)
+{
+	ERRSTACK(1);
+
+	if (ACCESS_ONCE(d->portm.ncqissued) == 0)
+		return;
+	while (waserror())
+		poperror();
+	rendez_sleep(&d->portm.slotrend, ncqidle, &d->portm);
+	poperror();
+}
+
+static int ncqclear(void *v)
+{
+	struct Asleep *s = v;
+	struct aportm *pm = s->p;
+
+	return (ACCESS_ONCE(pm->ncqissued) & s->i) == 0;
+}
+
+/* Builds a READ or WRITE FPDMA QUEUED in slot, tagged with the slot number. */
+static void ncqbuild(struct drive *d, int slot, int write, void *data, int n,
+                     uint64_t lba)
+{
+	void *cfis, *list, *prdt, *ctab;
+	struct aportm *pm;
+	uint32_t flags;
+
+	pm = &d->portm;
+	list = pm->list + slot * ALIST_SIZE;
+	ctab = pm->ctab + slot * ACTAB_SIZE;
+	cfis = ctab;
+
+	ahci_cfis_write8(cfis, 0, 0x27);
+	ahci_cfis_write8(cfis, 1, 0x80);
+	ahci_cfis_write8(cfis, 2, write ? 0x61 : 0x60);
+	ahci_cfis_write8(cfis, 3, n); /* features: sector count */
+
+	ahci_cfis_write8(cfis, 4, lba);
+	ahci_cfis_write8(cfis, 5, lba >> 8);
+	ahci_cfis_write8(cfis, 6, lba >> 16);
+	ahci_cfis_write8(cfis, 7, 0x40); /* lba; no fua */
+
+	ahci_cfis_write8(cfis, 8, lba >> 24);
+	ahci_cfis_write8(cfis, 9, lba >> 32);
+	ahci_cfis_write8(cfis, 10, lba >> 40);
+	ahci_cfis_write8(cfis, 11, n >> 8); /* features (exp): sector count */
+
+	ahci_cfis_write8(cfis, 12, slot << 3); /* sector count: tag */
+	ahci_cfis_write8(cfis, 13, 0);         /* priority */
+	ahci_cfis_write8(cfis, 14, 0);
+	ahci_cfis_write8(cfis, 15, 0);
+
+	ahci_cfis_write8(cfis, 16, 0);
+	ahci_cfis_write8(cfis, 17, 0);
+	ahci_cfis_write8(cfis, 18, 0);
+	ahci_cfis_write8(cfis, 19, 0);
+
+	/* no Lpref: the spec says not to prefetch queued commands */
+	flags = 1 << 16 | 0x5;
+	if (write)
+		flags |= Lwrite;
+	ahci_list_write32(list, ALIST_FLAGS, flags);
+	ahci_list_write32(list, ALIST_LEN, 0);
+	ahci_list_write32(list, ALIST_CTAB, paddr_low32(ctab));
+	ahci_list_write32(list, ALIST_CTABHI, paddr_high32(ctab));
+
+	prdt = ctab + ACTAB_PRDT;
+	ahci_prdt_write32(prdt, APRDT_DBA, paddr_low32(data));
+	ahci_prdt_write32(prdt, APRDT_DBAHI, paddr_high32(data));
+	ahci_prdt_write32(prdt, APRDT_COUNT,
+	                  1 << 31 | (d->unit->secsize * n - 2) | 1);
+}
+
+/*
+ * Queues one command and waits for it.  Returns 0 on success, or -1 if the
+ * caller should do it the legacy way instead: the drive isn't queueing, or the
+ * command failed or timed out, which aborts the whole queue.  The legacy path
+ * knows how to recover the port from there.
+ */
+static int ncqio(struct drive *d, int write, void *data, int n, uint64_t lba)
+{
+	ERRSTACK(1);
+	struct aportm *pm;
+	struct Asleep as;
+	uint32_t bit;
+	int slot, err;
+
+	pm = &d->portm;
+	slot = ncqgetslot(d);
+	if (slot == -1)
+		return -1;
+	bit = 1 << slot;
+
+	qlock(&pm->ql);
+	ncqbuild(d, slot, write, data, n, lba);
+	spin_lock_irqsave(&d->Lock);
+	if (d->state != Dready || (pm->feat & Dncq) == 0) {
+		spin_unlock_irqsave(&d->Lock);
+		qunlock(&pm->ql);
+		ncqputslot(d, slot);
+		return -1;
+	}
+	pm->ncqissued |= bit;
+	d->intick = ms();
+	d->active++;
+	ahci_port_write32(d->port, PORT_SACT, bit);
+	ahci_port_write32(d->port, PORT_CI, bit);
+	spin_unlock_irqsave(&d->Lock);
+	qunlock(&pm->ql);
+
+	as.p = pm;
+	as.i = bit;
+	while (waserror())
+		poperror();
+	/* don't sleep here forever */
+	rendez_sleep_timeout(&pm->ncqrend[slot], ncqclear, &as,
+	                     (3 * 1000) * 1000);
+	poperror();
+
+	spin_lock_irqsave(&d->Lock);
+	if (pm->ncqissued & bit) {
+		/* have checkdrive() reset the port, which aborts the rest */
+		printd("%s: ncq tag %d timed out\n", d->unit->sdperm.name, slot);
+		ncqcomplete(d, bit, 1);
+		d->state = Dreset;
+	}
+	err = pm->ncqerr & bit;
+	pm->ncqerr &= ~bit;
+	pm->ncqbusy &= ~bit;
+	d->active--;
+	spin_unlock_irqsave(&d->Lock);
+	rendez_wakeup(&pm->slotrend);
+	return err ? -1 : 0;
+}
+
 /* returns locked list! */
 static void *ahcibuild(struct drive *d, unsigned char *cmd, void *data, int n,
                        int64_t lba)
@@ -1674,6 +1932,7 @@ static void *ahcibuild(struct drive *d, unsigned char *cmd, void *data, int n,
 	llba = pm->feat & Dllba ? 1 : 0;
 	acmd = tab[dir][llba];
 	qlock(&pm->ql);
+	ncqdrain(d);
 	list = pm->list;
 	ctab = pm->ctab;
 	cfis = ctab;
@@ -1815,6 +2074,7 @@ static int lockready(struct drive *d)
 		esleep(1);
 		qlock(&d->portm.ql);
 	}
+	ncqdrain(d);
 	return i;
 }
 
@@ -1950,7 +2210,7 @@ retry:
 static int iario(struct sdreq *r)
 {
 	ERRSTACK(1);
-	int i, n, count, try, max, flag, task;
+	int i, n, count, try, max, flag, task, ncq;
 	uint64_t lba;
 	char *name;
 	unsigned char *cmd, *data;
@@ -1995,6 +2255,7 @@ static int iario(struct sdreq *r)
 	if (r->dlen < count * unit->secsize)
 		count = r->dlen / unit->secsize;
 	max = 128;
+	ncq = d->portm.feat & Dncq;
 
 	try = 0;
 retry:
@@ -2003,6 +2264,12 @@ retry:
 		n = count;
 		if (n > max)
 			n = max;
+		if (ncq) {
+			if (ncqio(d, *cmd == 0x2a, data, n, lba) == 0)
+				goto next;
+			/* finish this request the old way */
+			ncq = 0;
+		}
 		ahcibuild(d, cmd, data, n, lba);
 		switch (waitready(d)) {
 		case -1:
@@ -2064,7 +2331,7 @@ retry:
 			r->status = SDeio;
 			return SDeio;
 		}
-
+	next:
 		count -= n;
 		lba += n;
 		data += n * unit->secsize;
@@ -2143,7 +2410,7 @@ static int didtype(struct pci_device *p)
 
 static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 {
-	int i, n;
+	int i, j, n;
 	struct drive *drive;
 	uint32_t h_cap, pi;
 
@@ -2178,6 +2445,9 @@ static int newctlr(struct ctlr *ctlr, struct sdev *sdev, int nunit)
 		drive->portc.pm = &drive->portm;
 		qlock_init(&drive->portm.ql);
 		rendez_init(&drive->portm.Rendez);
+		rendez_init(&drive->portm.slotrend);
+		for (j = 0; j < AHCI_NSLOT; j++)
+			rendez_init(&drive->portm.ncqrend[j]);
 		drive->driveno = n++;
 		ctlr->drive[drive->driveno] = drive;
 		iadrive[niadrive + drive->driveno] = drive;
@@ -2315,6 +2585,9 @@ static int iarctl(struct sdunit *u, char *p, int l)
 			p = seprintf(p, e, "smart\t%s\n", smarttab[d->portm.smart]);
 		p = seprintf(p, e, "flag\t");
 		p = pflag(p, e, d->portm.feat);
+		if (d->portm.ncqdepth)
+			p = seprintf(p, e, "ncq\tdepth %d %s\n", d->portm.ncqdepth,
+			             d->portm.feat & Dncq ? "on" : "off");
 	} else
 		p = seprintf(p, e, "no disk present [%s]\n", diskstates[d->state]);
 	serror = ahci_port_read32(port, PORT_SERR);
@@ -2358,6 +2631,23 @@ static void forcemode(struct drive *d, char *mode)
 	spin_unlock_irqsave(&d->Lock);
 }
 
+/* "ncq off" sends everything down the legacy path, e.g. to compare. */
+static void forcencq(struct drive *d, char *onoff)
+{
+	spin_lock_irqsave(&d->Lock);
+	if (strcmp(onoff, "off") == 0)
+		d->portm.feat &= ~Dncq;
+	else if (strcmp(onoff, "on") == 0 && d->portm.ncqdepth)
+		d->portm.feat |= Dncq;
+	else {
+		spin_unlock_irqsave(&d->Lock);
+		error(EINVAL, "ncq %s: not supported", onoff);
+	}
+	spin_unlock_irqsave(&d->Lock);
+	/* kick anyone waiting for a slot over to the legacy path */
+	rendez_wakeup(&d->portm.slotrend);
+}
+
 static void runsmartable(struct drive *d, int i)
 {
 	ERRSTACK(1);
@@ -2427,6 +2717,8 @@ static int iawctl(struct sdunit *u, struct cmdbuf *cmd)
 		printd("ahci: %04d %#x\n", i, d->info[i]);
 	} else if (strcmp(f[0], "mode") == 0)
 		forcemode(d, f[1] ? f[1] : "satai");
+	else if (strcmp(f[0], "ncq") == 0)
+		forcencq(d, f[1] ? f[1] : "on");
 	else if (strcmp(f[0], "nop") == 0) {
 		if ((d->portm.feat & Dnop) == 0) {
 			sdierror(cmd, "no drive support");
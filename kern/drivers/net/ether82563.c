@@ -589,6 +589,7 @@ struct ctlr {
 	qlock_t alock;				/* attach */
 	void *alloc;
 	unsigned int rbsz;
+	struct bpool *rbpool;		/* receive blocks, never freed */
 	int attached;
 
 	int *nic;
@@ -616,7 +617,6 @@ struct ctlr {
 	uint8_t ra[Eaddrlen];		/* receive address */
 	uint32_t mta[128];			/* multicast table array */
 
-	struct rendez rrendez;
 	int rim;
 	int rdfree;					/* rx descriptors awaiting packets */
 	struct rd *rdba;			/* receive descriptor base address */
@@ -791,6 +791,8 @@ static long i82563ifstat(struct ether *edev, void *a, long n, uint32_t offset)
 
 	p = seprintf(p, e, "lintr: %ud %ud\n", ctlr->lintr, ctlr->lsleep);
 	p = seprintf(p, e, "rintr: %ud %ud\n", ctlr->rintr, ctlr->rsleep);
+	if (ctlr->rbpool)
+		p = seprintbpool(p, e, ctlr->rbpool);
 	p = seprintf(p, e, "tintr: %ud %ud\n", ctlr->tintr, ctlr->txdw);
 	p = seprintf(p, e, "ixcs: %ud %ud %ud\n", ctlr->ixsm, ctlr->ipcs,
 				 ctlr->tcpcs);
@@ -1121,7 +1123,7 @@ static void i82563replenish(struct ctlr *ctlr)
 			printd("#l%d: 82563: rx overrun\n", ctlr->edev->ctlrno);
 			break;
 		}
-		bp = block_alloc(ctlr->rbsz + Slop + Rbalign, MEM_ATOMIC);
+		bp = bpool_alloc(ctlr->rbpool, MEM_ATOMIC);
 		if (bp == NULL) {
 			warn_once("OOM, trying to survive");
 			break;
@@ -1220,11 +1222,6 @@ static void i82563rxinit(struct ctlr *ctlr)
 	csr32w(ctlr, Rxcsum, 0);
 }
 
-static int i82563rim(void *ctlr)
-{
-	return ((struct ctlr *)ctlr)->rim != 0;
-}
-
 /*
  * With no errors and the Ixsm bit set,
  * the descriptor status Tpcs and Ipcs bits give
@@ -1258,7 +1255,12 @@ static void ckcksums(struct ctlr *ctlr, struct rd *rd, struct block *bp)
 	}
 }
 
-static void i82563rproc(void *arg)
+/*
+ * Receive runs in the ether layer's poll mode (etherpollstart()).  The
+ * interrupt handler masks the rx causes and kicks the poller, which calls
+ * i82563poll() until the ring is empty and then i82563rxirqon().
+ */
+static int i82563poll(struct etherq *q, int budget)
 {
 	struct rd *rd;
 	struct block *bp;
@@ -1266,8 +1268,72 @@ static void i82563rproc(void *arg)
 	int rdh, rim, passed;
 	struct ether *edev;
 
-	edev = arg;
+	edev = q->ether;
 	ctlr = edev->ctlr;
+	rdh = ctlr->rdh;
+	passed = 0;
+	while (passed < budget) {
+		rim = ctlr->rim;
+		ctlr->rim = 0;
+		rd = &ctlr->rdba[rdh];
+		if (!(rd->status & Rdd))
+			break;
+
+		/*
+		 * Accept eop packets with no errors.
+		 */
+		bp = ctlr->rb[rdh];
+		if ((rd->status & Reop) && rd->errors == 0) {
+			bp->wp += rd->length;
+			bp->lim = bp->wp;	/* lie like a dog. */
+			if (0)
+				ckcksums(ctlr, rd, bp);
+			etheriq(edev, bp, 1);	/* pass pkt upstream */
+			passed++;
+		} else {
+			if (rd->status & Reop && rd->errors)
+				printd("%s: input packet error %#ux\n",
+					   tname[ctlr->type], rd->errors);
+			freeb(bp);
+		}
+		ctlr->rb[rdh] = NULL;
+
+		/* rd needs to be replenished to accept another pkt */
+		rd->status = 0;
+		ctlr->rdfree--;
+		ctlr->rdh = rdh = NEXT_RING(rdh, Nrd);
+		/*
+		 * if number of rds ready for packets is too low,
+		 * set up the unready ones.
+		 */
+		if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
+			i82563replenish(ctlr);
+	}
+	return passed;
+}
+
+static void i82563rxirqon(struct etherq *q)
+{
+	struct ctlr *ctlr = q->ether->ctlr;
+
+	i82563replenish(ctlr);
+	ctlr->rsleep++;
+	i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
+}
+
+/* Itr counts in 256ns units; 0 turns throttling off. */
+static void i82563setitr(struct etherq *q, unsigned int usec)
+{
+	struct ctlr *ctlr = q->ether->ctlr;
+
+	csr32w(ctlr, Itr, usec * 1000 / 256);
+}
+
+static void i82563rxstart(struct ether *edev)
+{
+	struct ctlr *ctlr = edev->ctlr;
+	struct etherq *q = &edev->rxq[0];
+
 	i82563rxinit(ctlr);
 	csr32w(ctlr, Rctl, csr32r(ctlr, Rctl) | Ren);
 
@@ -1277,52 +1343,10 @@ static void i82563rproc(void *arg)
 	if (ctlr->type == i210)
 		csr32w(ctlr, Rxdctl, csr32r(ctlr, Rxdctl) | Qenable);
 
-	for (;;) {
-		i82563replenish(ctlr);
-		i82563im(ctlr, Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
-		ctlr->rsleep++;
-		rendez_sleep(&ctlr->rrendez, i82563rim, ctlr);
-
-		rdh = ctlr->rdh;
-		passed = 0;
-		for (;;) {
-			rim = ctlr->rim;
-			ctlr->rim = 0;
-			rd = &ctlr->rdba[rdh];
-			if (!(rd->status & Rdd))
-				break;
-
-			/*
-			 * Accept eop packets with no errors.
-			 */
-			bp = ctlr->rb[rdh];
-			if ((rd->status & Reop) && rd->errors == 0) {
-				bp->wp += rd->length;
-				bp->lim = bp->wp;	/* lie like a dog. */
-				if (0)
-					ckcksums(ctlr, rd, bp);
-				etheriq(edev, bp, 1);	/* pass pkt upstream */
-				passed++;
-			} else {
-				if (rd->status & Reop && rd->errors)
-					printd("%s: input packet error %#ux\n",
-						   tname[ctlr->type], rd->errors);
-				freeb(bp);
-			}
-			ctlr->rb[rdh] = NULL;
-
-			/* rd needs to be replenished to accept another pkt */
-			rd->status = 0;
-			ctlr->rdfree--;
-			ctlr->rdh = rdh = NEXT_RING(rdh, Nrd);
-			/*
-			 * if number of rds ready for packets is too low,
-			 * set up the unready ones.
-			 */
-			if (ctlr->rdfree <= Nrd - 32 || (rim & Rxdmt0))
-				i82563replenish(ctlr);
-		}
-	}
+	q->poll = i82563poll;
+	q->irqon = i82563rxirqon;
+	q->setitr = i82563setitr;
+	etherpollstart(q);
 }
 
 static int i82563lim(void *ctlr)
@@ -1613,7 +1637,7 @@ static void i82563attach(struct ether *edev)
 	int i;
 	struct block *bp;
 	struct ctlr *ctlr;
-	char *lname, *rname, *tname;
+	char *lname, *tname;
 
 	ctlr = edev->ctlr;
 	qlock(&ctlr->alock);
@@ -1645,6 +1669,10 @@ static void i82563attach(struct ether *edev)
 		error(ENOMEM, "i82563attach: error allocating rx/tx buffers");
 	}
 
+	if (!ctlr->rbpool)
+		ctlr->rbpool = bpool_create("rx", ctlr->rbsz + Slop + Rbalign,
+		                            2 * Nrd, Nrd);
+
 	ctlr->edev = edev;	/* point back to Ether* */
 	ctlr->attached = 1;
 
@@ -1652,9 +1680,7 @@ static void i82563attach(struct ether *edev)
 	snprintf(lname, KNAMELEN, "#l%dl", edev->ctlrno);
 	ktask(lname, i82563lproc, edev);
 
-	rname = kzmalloc(KNAMELEN, MEM_WAIT);
-	snprintf(rname, KNAMELEN, "#l%dr", edev->ctlrno);
-	ktask(rname, i82563rproc, edev);
+	i82563rxstart(edev);
 
 	tname = kzmalloc(KNAMELEN, MEM_WAIT);
 	snprintf(tname, KNAMELEN, "#l%dt", edev->ctlrno);
@@ -1691,7 +1717,7 @@ static void i82563interrupt(struct hw_trapframe *unused_hw_trapframe, void *arg)
 		if (icr & (Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack)) {
 			ctlr->rim = icr & (Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
 			im &= ~(Rxt0 | Rxo | Rxdmt0 | Rxseq | Ack);
-			rendez_wakeup(&ctlr->rrendez);
+			etherpollirq(&edev->rxq[0]);
 			ctlr->rintr++;
 		}
 		if (icr & Txdw) {
@@ -2159,7 +2185,6 @@ static void i82563pci(void)
 		spinlock_init_irqsave(&ctlr->imlock);
 		rendez_init(&ctlr->lrendez);
 		qlock_init(&ctlr->slock);
-		rendez_init(&ctlr->rrendez);
 		rendez_init(&ctlr->trendez);
 		qlock_init(&ctlr->tlock);
 
@@ -2212,6 +2237,7 @@ static int pnp(struct ether *edev, int type)
 	edev->tbdf = pci_to_tbdf(ctlr->pcidev);
 	edev->mbps = 1000;
 	edev->maxmtu = ctlr->rbsz - ETHERHDRSIZE;
+	edev->nrxq = 1;
 	memmove(edev->ea, ctlr->ra, Eaddrlen);
 
 	/*
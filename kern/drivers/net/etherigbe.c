@@ -516,6 +516,7 @@ struct ctlr {
 	int	rdfree;
 	Rd*	rdba;			/* receive descriptor base address */
 	struct block**	rb;			/* receive buffers */
+	struct bpool*	rbpool;			/* where they come from, never freed */
 	int	rdh;			/* receive descriptor head */
 	int	rdt;			/* receive descriptor tail */
 	int	rdtr;			/* receive delay timer ring value */
@@ -679,6 +680,8 @@ igbeifstat(struct ether* edev, void* a, long n, uint32_t offset)
 		ctlr->lintr, ctlr->lsleep);
 	l += snprintf(p+l, READSTR-l, "rintr: %ud %ud\n",
 		ctlr->rintr, ctlr->rsleep);
+	if(ctlr->rbpool != NULL)
+		l = seprintbpool(p+l, p+READSTR, ctlr->rbpool) - p;
 	l += snprintf(p+l, READSTR-l, "tintr: %ud %ud\n",
 		ctlr->tintr, ctlr->txdw);
 	l += snprintf(p+l, READSTR-l, "ixcs: %ud %ud %ud\n",
@@ -1054,7 +1057,7 @@ igbereplenish(struct ctlr* ctlr)
 	while(NEXT_RING(rdt, ctlr->nrd) != ctlr->rdh){
 		rd = &ctlr->rdba[rdt];
 		if(ctlr->rb[rdt] == NULL){
-			bp = block_alloc(Rbsz, MEM_ATOMIC);
+			bp = bpool_alloc(ctlr->rbpool, MEM_ATOMIC);
 			if(bp == NULL){
 				/* needs to be a safe print for interrupt level */
 				printk("#l%d: igbereplenish: no available buffers\n",
@@ -1257,6 +1260,9 @@ igbeattach(struct ether* edev)
 		error(ENOMEM, ERROR_FIXME);
 	}
 
+	if(ctlr->rbpool == NULL)
+		ctlr->rbpool = bpool_create("rx", Rbsz, 2 * ctlr->nrd, ctlr->nrd);
+
 	/* the ktasks should free these names, if they ever exit */
 	name = kmalloc(KNAMELEN, MEM_WAIT);
 	snprintf(name, KNAMELEN, "#l%dlproc", edev->ctlrno);
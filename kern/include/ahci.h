@@ -270,6 +270,10 @@ enum {
 #define ACTAB_ATAPI 0x40 // ATAPI Command (12 or 16 bytes)
 #define ACTAB_RES   0x50 // Reserved
 #define ACTAB_PRDT  0x80 // PRDT (up to 65,535 entries in spec, this has one)
+#define ACTAB_SIZE  0x100 // Stride of our command tables, one per slot
+
+// Command slots per port.  The legacy path only ever uses slot 0.
+#define AHCI_NSLOT 32
 
 // Portm flags (status flags?)
 enum {
@@ -285,6 +289,7 @@ enum {
 	Dnop = 1 << 3,
 	Datapi = 1 << 4,
 	Datapi16 = 1 << 5,
+	Dncq = 1 << 6,
 };
 
 struct aportm {
@@ -296,6 +301,15 @@ struct aportm {
 	struct afis fis;
 	void *list;
 	void *ctab;
+
+	/* native command queueing; all under the drive's Lock */
+	int ncqdepth;
+	uint32_t ncqfree;   /* slots we may use as tags */
+	uint32_t ncqbusy;   /* slots owned by an iario() */
+	uint32_t ncqissued; /* slots the HBA has */
+	uint32_t ncqerr;    /* slots that finished badly */
+	struct rendez slotrend; /* waiting for a slot, or for the queue to drain */
+	struct rendez ncqrend[AHCI_NSLOT];
 };
 
 struct aportc {
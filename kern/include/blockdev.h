@@ -11,6 +11,7 @@
 #include <slab.h>
 #include <pagemap.h>
 #include <kthread.h>
+#include <sys/queue.h>
 
 /* All block IO is done assuming a certain size sector, which is the smallest
  * possible unit of transfer between the kernel and the block layer.  This can
@@ -20,6 +21,52 @@
 #define SECTOR_SZ_LOG 9
 #define SECTOR_SZ (1 << SECTOR_SZ_LOG)
 
+struct block_device;
+struct block_request;
+struct block_queue;
+TAILQ_HEAD(breq_tailq, block_request);
+
+/* Driver methods.  dispatch() starts the IO for a request (and the requests
+ * merged into it, see breq_for_each_seg()).  It must not block: it runs in
+ * whoever submitted or completed the last request, which could be an IRQ
+ * handler.  The driver calls bdev_complete_request() when the IO is done, from
+ * any context, possibly before dispatch() returns. */
+struct block_device_operations {
+	void (*dispatch)(struct block_device *bdev, struct block_request *breq);
+};
+
+/* IO schedulers decide what the driver sees next.  init() returns the
+ * scheduler's state for a queue, which lives in q->sched_data, and destroy()
+ * frees it once the queue has been emptied.  add() queues a request, or merges
+ * it into one that's already queued (returning TRUE).  next() takes the request
+ * to dispatch off the queue, if any.  add() and next() are called with the
+ * queue's lock held. */
+struct iosched {
+	char						*name;
+	void						*(*init)(void);
+	void						(*destroy)(void *sched_data);
+	bool						(*add)(struct block_queue *q,
+							           struct block_request *breq);
+	struct block_request		*(*next)(struct block_queue *q);
+};
+extern struct iosched noop_iosched;
+extern struct iosched deadline_iosched;
+
+/* Per-device request queue.  Requests wait here, in the scheduler, until the
+ * driver has fewer than depth in flight. */
+struct block_queue {
+	spinlock_t					lock;
+	struct iosched				*sched;
+	void						*sched_data;
+	unsigned int				depth;
+	unsigned int				nr_queued;
+	unsigned int				nr_inflight;
+	bool						running;			/* someone is dispatching */
+	unsigned long				nr_submitted;
+	unsigned long				nr_merged;
+	unsigned long				nr_dispatched;
+};
+
 /* Every block device is represented by one of these, with custom methods, as
  * applicable for the type of device.  Subject to massive changes. */
 #define BDEV_INLINE_NAME 10
@@ -31,10 +78,8 @@ struct block_device {
 	struct page_map				b_pm;
 	void						*b_data;			/* dev-specific use */
 	char						b_name[BDEV_INLINE_NAME];
-	// TODO: list or something of buffer heads (?)
-	// list of outstanding requests
-	// io scheduler
-	// callbacks for completion
+	struct block_device_operations	*b_ops;
+	struct block_queue			b_queue;
 };
 
 /* So far, only NEEDS_ZEROED is used */
@@ -72,7 +117,13 @@ void bdev_put_buffer(struct buffer_head *bh);
  *
  * bhs normally points to the inline version (enough for a page).  kmalloc
  * another array of BH pointers if you want more.  The BHs do not need to be
- * linked or otherwise associated with a page mapping. */
+ * linked or otherwise associated with a page mapping.
+ *
+ * The rest belongs to the block layer.  Requests whose BHs cover one run of
+ * sectors get BREQ_CONTIG, and the scheduler can merge them with their
+ * neighbors on the disk: the first one stays in the queue, covering the whole
+ * run, and the others hang off its merged chain.  The callback is called once
+ * for every request, with error set, when the driver is done with it. */
 #define NR_INLINE_BH (PGSIZE >> SECTOR_SZ_LOG)
 struct block_request;
 struct block_request {
@@ -83,16 +134,42 @@ struct block_request {
 	struct buffer_head			**bhs;				/* BHs describing the IOs */
 	unsigned int				nr_bhs;
 	struct buffer_head			*local_bhs[NR_INLINE_BH];
+	int							error;
+	unsigned long				sector;				/* of the whole chain */
+	unsigned int				nr_sector;
+	uint64_t					deadline;			/* tsc, for deadline */
+	struct block_request		*merged;			/* chain of merged reqs */
+	struct block_request		*merged_tail;
+	TAILQ_ENTRY(block_request)	link;				/* scheduler's use */
+	TAILQ_ENTRY(block_request)	fifo_link;			/* scheduler's use */
 };
 struct kmem_cache *breq_kcache;	/* for the block requests */
 
 /* Block request flags */
 #define BREQ_READ 			0x001
 #define BREQ_WRITE 			0x002
+#define BREQ_CONTIG			0x004	/* BHs are one run of sectors */
+
+/* Largest request the schedulers will build by merging, in sectors. */
+#define BREQ_MAX_MERGE		256
 
 void block_init(void);
 struct block_device *get_bdev(char *path);
 void free_bhs(struct page *page);
+void bdev_queue_init(struct block_device *bdev,
+                     struct block_device_operations *ops, unsigned int depth,
+                     char *sched);
+int bdev_set_sched(struct block_device *bdev, char *name);
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq);
+void bdev_complete_request(struct block_device *bdev,
+                           struct block_request *breq, int error);
+int breq_for_each_seg(struct block_request *breq,
+                      int (*fn)(struct block_request *breq, void *buf,
+                                unsigned long sector, unsigned int nr_sector,
+                                void *arg),
+                      void *arg);
+bool breq_back_merge(struct block_request *q, struct block_request *breq);
+bool breq_front_merge(struct block_request *q, struct block_request *breq);
 void generic_breq_done(struct block_request *breq);
 void sleep_on_breq(struct block_request *breq);
+extern struct block_device_operations ramdisk_bdev_ops;
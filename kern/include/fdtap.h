@@ -18,6 +18,11 @@ struct chan;
 struct fd_tap;
 SLIST_HEAD(fdtap_slist, fd_tap);
 
+/* Kernel-internal taps (e.g. #epoll) set func, which fire_tap calls instead of
+ * sending an event.  It runs with the device's tap lock held, so it must not
+ * block.  These taps are not in any FD table and do not use the kref. */
+typedef void (*fd_tap_func_t)(struct fd_tap *tap, int filter);
+
 struct fd_tap {
 	SLIST_ENTRY(fd_tap)			link;	/* for device use */
 	struct kref					kref;
@@ -28,6 +33,7 @@ struct fd_tap {
 	struct event_queue			*ev_q;
 	int							ev_id;
 	void						*data;
+	fd_tap_func_t				func;
 };
 
 int add_fd_tap(struct proc *p, struct fd_tap_req *tap_req);
@@ -29,6 +29,7 @@
 
 #pragma once
 #include <ns.h>
+#include <percpu.h>
 
 enum {
 	Addrlen = 64,
@@ -131,6 +132,12 @@ struct conv {
 
 	struct route *r;			/* last route used */
 	uint32_t rgen;				/* routetable generation for *r */
+
+	struct zcrx *zcrx;			/* zero-copy receive ring, if on */
+	unsigned int busypoll;		/* usec a blocking reader spins first */
+	int reuseport;				/* may share laddr!lport with a listen group */
+	int batch;					/* data file uses struct udpmsg_hdr framing */
+	atomic_t tx_inflight;		/* sent blocks not yet freed, for autocork */
 };
 
 struct Ipifc;
@@ -246,6 +253,8 @@ struct Ipifc {
 	uint32_t inerr, outerr;		/* ... */
 	uint32_t tracedrop;
 
+	struct rps *rps;			/* receive packet steering, see rps.c */
+
 	uint8_t sendra6;			/* == 1 => send router advs on this ifc */
 	uint8_t recvra6;			/* == 1 => recv router advs on this ifc */
 	struct routerparams rp;		/* router parameters as in RFC 2461, pp.40--43.
@@ -359,6 +368,11 @@ struct Fs {
 	struct route *v4root[1 << Lroot];	/* v4 routing forest */
 	struct route *v6root[1 << Lroot];	/* v6 routing forest */
 	struct route *queue;		/* used as temp when reinjecting routes */
+	struct v4trie *v4trie;		/* longest prefix match over v4root */
+	struct v6trie *v6trie;		/* and over v6root */
+	seq_ctr_t rtseq;			/* bumped around trie updates */
+	bool v4nonprefix;			/* a route has a non-contiguous mask */
+	bool v6nonprefix;
 
 	struct Netlog *alog;
 	struct Ifclog *ilog;
@@ -513,6 +527,53 @@ extern void routetype(int unused_int, char *unused_char_p_t);
 extern void ipwalkroutes(struct Fs *, struct routewalk *);
 extern void convroute(struct route *r, uint8_t * u8pt, uint8_t * u8pt1,
 					  uint8_t * u8pt2, char *unused_char_p_t, int *intp);
+extern void routeinit(struct Fs *f);
+
+/*
+ *  ipfrag.c
+ */
+/* A fragment's place in its datagram, kept in the headroom of its first block.
+ * flen and hlen change as overlaps are trimmed. */
+struct Ipfrag {
+	uint16_t foff;				/* offset of our payload in the datagram */
+	uint16_t flen;				/* bytes of payload we'll use */
+	uint16_t hlen;				/* bytes in front of that payload */
+	uint8_t last;				/* no fragments after this one */
+};
+#define BKFG(xp)	((struct Ipfrag*)((xp)->base))
+
+struct fragstats {
+	uint32_t timeouts;
+	uint32_t reqds;
+	uint32_t oks;
+	uint32_t fails;
+};
+
+struct fraghash;
+struct fraghash *fraghash_alloc(void);
+void fraghash_stats(struct fraghash *fh, struct fragstats *st);
+struct block *ipfragadd(struct fraghash *fh, struct block *bp,
+                        struct Ipfrag *fg, uint8_t *src, uint8_t *dst,
+                        uint32_t id, uint8_t proto, int *len);
+
+/*
+ *  iptrie.c
+ */
+struct v4trie *v4trie_alloc(void);
+struct route *v4trie_lookup(struct v4trie *t, uint32_t addr);
+void v4trie_insert(struct v4trie *t, uint32_t addr, int plen, struct route *r);
+void v4trie_remove(struct v4trie *t, uint32_t addr, int plen,
+                   struct route *(*exact)(void *arg, uint32_t addr, int plen),
+                   void *arg);
+void v4trie_free(struct v4trie *t);
+unsigned long v4trie_memory(struct v4trie *t);
+struct v6trie *v6trie_alloc(void);
+struct route *v6trie_lookup(struct v6trie *t, const uint32_t *a);
+void v6trie_insert(struct v6trie *t, const uint32_t *a, int plen,
+                   struct route *r);
+void v6trie_remove(struct v6trie *t, const uint32_t *a, int plen);
+void v6trie_free(struct v6trie *t);
+unsigned long v6trie_memory(struct v6trie *t);
 
 /*
  *  devip.c
@@ -541,6 +602,7 @@ struct arpent {
 	struct block *last;
 	uint64_t ctime;			/* time entry was created or refreshed */
 	uint64_t utime;			/* time entry was last used */
+	uint64_t wtime;			/* tsc when we started resolving it */
 	uint8_t state;
 	struct arpent *nextrxt;		/* re-transmit chain */
 	uint64_t rtime;			/* time for next retransmission */
@@ -549,8 +611,12 @@ struct arpent {
 	uint8_t ifcid;				/* must match ifc->id */
 };
 
+extern struct arp *arpcreate(struct Fs *);
+extern void arpdestroy(struct arp *);
 extern void arpinit(struct Fs *);
+extern void arpexpire(struct arp *);
 extern int arpread(struct arp *, char *unused_char_p_t, uint32_t, int);
+extern int arpstatsread(struct arp *, char *, uint32_t, int);
 extern int arpwrite(struct Fs *, char *unused_char_p_t, long);
 extern struct arpent *arpget(struct arp *, struct block *bp, int version,
 							 struct Ipifc *ifc, uint8_t * ip, uint8_t * h);
@@ -576,6 +642,13 @@ extern void v4tov6(uint8_t * v6, uint8_t * v4);
 extern int v6tov4(uint8_t * v4, uint8_t * v6);
 //extern int    eipfmt(Fmt*);
 
+enum {
+	RSS_KEY_LEN = 40,
+};
+extern uint8_t rss_default_key[RSS_KEY_LEN];
+extern uint32_t toeplitz_hash(uint8_t *key, uint8_t *data, int len);
+extern uint32_t ip_flow_hash(uint8_t *key, uint8_t *pkt, int len);
+
 
 #ifdef CONFIG_RISCV
 #warning "Potentially unaligned IP addrs!"
@@ -670,7 +743,9 @@ extern int ipoput6(struct Fs *,
 				   struct block *, int unused_int, int, int, struct conv *);
 extern int ipstats(struct Fs *, char *unused_char_p_t, int);
 extern uint16_t ptclbsum(uint8_t * unused_uint8_p_t, int);
+extern uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len);
 extern uint16_t ptclcsum(struct block *, int unused_int, int);
+extern struct block *ptclcsum_linearize(struct block *bp, unsigned int feat);
 extern void ip_init(struct Fs *);
 extern void update_mtucache(uint8_t * unused_uint8_p_t, uint32_t);
 extern uint32_t restrict_mtu(uint8_t * unused_uint8_p_t, uint32_t);
@@ -693,6 +768,44 @@ static inline void ptclcsum_finalize(struct block *bp, unsigned int feat)
 	}
 }
 
+/*
+ *  rps.c
+ */
+struct rps;
+void rps_input(struct Fs *f, struct Ipifc *ifc, struct block *bp);
+void rpsctl(struct Fs *f, struct Ipifc *ifc, char **argv, int argc);
+int rpsstats(struct Ipifc *ifc, char *buf, int len);
+
+/*
+ *  zcrx.c
+ */
+struct zcrx;
+long zcrx_read(struct conv *c, void *va, long n, bool nonblock);
+void zcrxctl(struct conv *c, char **argv, int argc);
+void zcrxrelease(struct conv *c, char **argv, int argc);
+void zcrxclose(struct conv *c);
+
+/*
+ *  tcp.c
+ */
+struct Proto *tcpalloc(void);
+void tcpfree(struct Proto *tcp);
+uint32_t tcpsyncookie(struct Proto *tcp, uint8_t *raddr, uint16_t rport,
+                      uint8_t *laddr, uint16_t lport, uint32_t irs,
+                      uint16_t mss, uint32_t tick);
+int tcpsyncookiemss(struct Proto *tcp, uint8_t *raddr, uint16_t rport,
+                    uint8_t *laddr, uint16_t lport, uint32_t irs,
+                    uint32_t cookie, uint32_t tick);
+void tcprcvsetup(struct conv *s, int sndscale);
+uint32_t tcprcvdata(struct conv *s, uint32_t len, uint64_t now);
+long tcprcvmem(struct Proto *tcp);
+
+/*
+ *  udp.c
+ */
+long udpbatchread(struct conv *c, void *va, long n, bool nonblock);
+long udpbatchwrite(struct conv *c, void *va, long n, bool nonblock);
+
 /*
  *  iprouter.c
  */
@@ -953,6 +1066,7 @@ struct netfile {
 	int nmaddr;					/* number of multicast addresses */
 
 	struct queue *in;			/* input buffer */
+	struct etherring *ring;		/* packet ring, see etherring.c */
 };
 
 /*
@@ -1010,15 +1124,13 @@ struct netif {
 	int all;					/* number of -1 multiplexors */
 
 	/* statistics */
+	struct percpu_ctrs pkts;	/* [Nnetifpkts], bumped on every packet */
 	int misses;
-	int inpackets;
-	int outpackets;
 	int crcs;					/* input crc errors */
 	int oerrs;					/* output errors */
 	int frames;					/* framing errors */
 	int overflows;				/* packet overflows */
 	int buffs;					/* buffering errors */
-	int soverflows;				/* software overflow */
 
 	/* routines for touching the hardware */
 	void *arg;
@@ -1027,6 +1139,15 @@ struct netif {
 	void (*scanbs) (void *, unsigned nt);	/* scan for base stations */
 };
 
+/* struct ether's per core packet counters */
+enum {
+	NetifInPackets,
+	NetifOutPackets,
+	NetifSoverflows,			/* software overflow */
+
+	Nnetifpkts,
+};
+
 void netifinit(struct ether *, char *, int, uint32_t);
 struct walkqid *netifwalk(struct ether *, struct chan *, struct chan *,
 			  char **,
@@ -1040,6 +1161,17 @@ int netifwstat(struct ether *, struct chan *, uint8_t *, int);
 int netifstat(struct ether *, struct chan *, uint8_t *, int);
 int activemulti(struct ether *, uint8_t *, int);
 
+/*
+ *  etherring.c
+ */
+struct etherring;
+bool etherring_on(struct netfile *f);
+bool etherring_rx(struct netfile *f, struct block *bp);
+long etherring_read(struct netfile *f, void *va, long n);
+struct block *etherring_tx(struct netfile *f, size_t maxlen);
+void etherringctl(struct netfile *f, char *p);
+void etherringclose(struct netfile *f);
+
 /*
  *  Ethernet specific
  */
@@ -1060,6 +1192,56 @@ enum {
 	MaxEther = 32,
 	MaxFID = 16,
 	Ntypes = 8,
+	MaxEtherQueues = 16,
+};
+
+/* A hardware rx ring.  Drivers with rings the ether layer should know about
+ * set ether->nrxq in their reset; etherreset() then spreads the rings over the
+ * cores (see etherinitqs()).
+ *
+ * There are only rx rings.  Transmits all go through ether->oq, and the layer
+ * doesn't program an RSS indirection table: no driver here has more than one
+ * hardware ring (ether82563 would need per-queue MSI-X vectors), so there'd be
+ * nothing to steer to.  Flows are spread over cores in software instead, by
+ * RPS (rps.c), with the same Toeplitz hash (toeplitz_hash()) an RSS NIC uses.
+ * A driver that grows real rings should add the tx side and the RSS hook then.
+ *
+ * An rx ring can run in poll mode (see etherpollstart()): the driver provides
+ * poll, irqon and optionally setitr, masks the ring's irq in its interrupt
+ * handler and calls etherpollirq().  The ring's poller runs on the ring's core.
+ *
+ * Whoever owns a poll-mode ring calls its poll function: the ring's poller, a
+ * busy-polling reader (etherbusypoll()), or no one while the irq is armed. */
+enum {
+	EtherPollIrq,
+	EtherPollPoller,
+	EtherPollReader,
+};
+
+struct etherq {
+	struct ether *ether;
+	int idx;
+	int coreid;
+	char name[KNAMELEN];
+	void *priv;					/* driver's ring */
+	uint64_t packets;
+
+	/* poll mode */
+	int (*poll) (struct etherq *, int budget);	/* returns pkts passed up */
+	void (*irqon) (struct etherq *);
+	void (*setitr) (struct etherq *, unsigned int usec);
+	struct rendez pollr;
+	int owner;					/* EtherPoll*, changed with CAS */
+	bool irqpending;			/* irq fired while someone had the ring */
+	int budget;
+	bool itrauto;
+	unsigned int itr;			/* usec between irqs, 0 for no moderation */
+	unsigned int busypoll;		/* usec to keep polling before rearming */
+	unsigned int ppp;			/* packets per wakeup, EWMA, x16 */
+	uint64_t irqs;
+	uint64_t polls;
+	uint64_t busypolls;
+	uint64_t rdpolls;			/* polls by busy-polling readers */
 };
 
 struct ether {
@@ -1089,6 +1271,11 @@ struct ether {
 
 	struct queue *oq;
 
+	/* rx rings, see struct etherq.  With nrxq == 0, the driver manages its
+	 * own receive path. */
+	int nrxq;
+	struct etherq rxq[MaxEtherQueues];
+
 	qlock_t vlq;				/* array change */
 	int nvlan;
 	struct ether *vlans[MaxFID];
@@ -1097,6 +1284,9 @@ struct ether {
 };
 
 extern struct block *etheriq(struct ether *, struct block *, int);
+extern void etherpollstart(struct etherq *);
+extern void etherpollirq(struct etherq *);
+extern void etherbusypoll(uint64_t deadline, int (*done)(void *), void *arg);
 extern void addethercard(char *unused_char_p_t, int (*)(struct ether *));
 extern int archether(int unused_int, struct ether *);
 
@@ -68,6 +68,8 @@ int munmap(struct proc *p, uintptr_t addr, size_t len);
 int handle_page_fault(struct proc *p, uintptr_t va, int prot);
 int handle_page_fault_nofile(struct proc *p, uintptr_t va, int prot);
 unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs);
+int lend_kpage(struct proc *p, uintptr_t va, void *kva);
+void reclaim_kpage(struct proc *p, uintptr_t va, void *kva);
 
 /* These assume the mm_lock is held already */
 int __do_mprotect(struct proc *p, uintptr_t addr, size_t len, int prot);
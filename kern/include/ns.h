@@ -372,8 +372,11 @@ struct extra_bdata {
 	/* using u32s for packing reasons.  this means no extras > 4GB */
 	uint32_t off;
 	uint32_t len;
+	uint32_t flags;
 };
 
+#define EBD_PAGEMAP		(1 << 0)	/* base is a page map page, see sendfile */
+
 struct block {
 	struct block *next;
 	struct block *list;
@@ -382,6 +385,8 @@ struct block {
 	uint8_t *lim;				/* 1 past the end of the buffer */
 	uint8_t *base;				/* start of the buffer */
 	void (*free) (struct block *);
+	void *free_arg;				/* for free's and txdone's use */
+	void (*txdone) (struct block *);	/* see block_txdone() */
 	uint16_t flag;
 	uint16_t checksum;			/* IP checksum of complete packet (minus media header) */
 	uint16_t checksum_start;		/* off from start of block to start csum */
@@ -638,6 +643,7 @@ enum {
 	Qcoalesce		= (1 << 3),	/* coalesce empty packets on read */
 	Qkick			= (1 << 4),	/* always call the kick routine after qwrite */
 	Qdropoverflow	= (1 << 5),	/* writes that would block will be dropped */
+	Qspsc			= (1 << 6),	/* single producer, lock-free fast paths */
 };
 
 #define DEVDOTDOT -1
@@ -655,13 +661,24 @@ void addrootfile(char *unused_char_p_t, uint8_t * unused_uint8_p_t, uint32_t);
 struct block *adjustblock(struct block *, int);
 struct block *block_alloc(size_t, int);
 int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags);
+void block_txdone(struct block *b);
+void extra_buf_incref(struct extra_bdata *ebd);
+void extra_buf_decref(struct extra_bdata *ebd);
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags);
+int block_append_extra_flags(struct block *b, uintptr_t base, uint32_t off,
+                             uint32_t len, uint32_t ebd_flags, int mem_flags);
+struct bpool;
+struct bpool *bpool_create(char *name, size_t size, unsigned int max,
+                           unsigned int prealloc);
+struct block *bpool_alloc(struct bpool *pool, int mem_flags);
+char *seprintbpool(char *p, char *e, struct bpool *pool);
 int anyhigher(void);
 int anyready(void);
 void _assert(char *unused_char_p_t);
 struct block *bl2mem(uint8_t * unused_uint8_p_t, struct block *, int);
 int blocklen(struct block *);
+int blockalloclen(struct block *);
 char *channame(struct chan *);
 void cclose(struct chan *);
 void chan_incref(struct chan *);
@@ -689,7 +706,10 @@ void confinit(void);
 void cons_add_char(char c);
 void copen(struct chan *);
 struct block *copyblock(struct block *b, int mem_flags);
-int cread(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t);
+struct block *copyblock_csum(struct block *b, int csum_off, uint16_t *csum,
+                             int mem_flags);
+int cread(struct chan *, uint8_t * unused_uint8_p_t, int unused_int, int64_t,
+          bool *);
 struct chan *cunique(struct chan *);
 struct chan *createdir(struct chan *, struct mhead *);
 void cunmount(struct chan *, struct chan *);
@@ -779,6 +799,7 @@ void mkqid(struct qid *, int64_t, uint32_t, int);
 void modinit(void);
 struct chan *mntauth(struct chan *, char *unused_char_p_t);
 long mntversion(struct chan *, char *unused_char_p_t, int unused_int, int);
+long mntrdwr(int, struct chan *, void *, long, int64_t);
 void mountfree(struct mount *);
 void mousetrack(int unused_int, int, int, int);
 uint64_t ms2fastticks(uint32_t);
@@ -818,6 +839,8 @@ void putstrn(char *unused_char_p_t, int);
 void qaddlist(struct queue *, struct block *);
 struct block *qbread(struct queue *q, size_t len);
 struct block *qbread_nonblock(struct queue *q, size_t len);
+struct block *qbread_msgs(struct queue *q, size_t len, size_t overhead,
+                          bool nonblock);
 ssize_t qbwrite(struct queue *, struct block *);
 ssize_t qbwrite_nonblock(struct queue *, struct block *);
 ssize_t qibwrite(struct queue *q, struct block *b);
@@ -32,6 +32,7 @@ typedef BSD_LIST_ENTRY(page) page_list_entry_t;
 #define PG_BUFFER		0x008	/* is a buffer page, has BHs */
 #define PG_PAGEMAP		0x010	/* belongs to a page map */
 #define PG_REMOVAL		0x020	/* Working flag for page map removal */
+#define PG_LENT			0x040	/* kernel buffer page lent to a user PTE */
 
 /* TODO: this struct is not protected from concurrent operations in some
  * functions.  If you want to lock on it, use the spinlock in the semaphore.
@@ -79,8 +80,14 @@ void lock_page(struct page *page);
 void unlock_page(struct page *page);
 void print_pageinfo(struct page *page);
 static inline bool page_is_pagemap(struct page *page);
+static inline bool page_is_lent(struct page *page);
 
 static inline bool page_is_pagemap(struct page *page)
 {
 	return atomic_read(&page->pg_flags) & PG_PAGEMAP ? true : false;
 }
+
+static inline bool page_is_lent(struct page *page)
+{
+	return atomic_read(&page->pg_flags) & PG_LENT ? true : false;
+}
@@ -88,3 +88,40 @@ extern char __attribute__((weak)) PERCPU_STOP_VAR[];
 extern char *percpu_base;
 
 void percpu_init(void);
+
+/* Per CPU counters for objects created at runtime, which DEFINE_PERCPU can't
+ * cover (e.g. one set of stats per network stack).  Each core bumps counters
+ * in its own cache lines, and readers sum over all cores:
+ *
+ *   percpu_ctrs_init(&ip->stats, Nstats, MEM_WAIT);
+ *   percpu_ctr_inc(&ip->stats, InReceives);
+ *   total = percpu_ctr_sum(&ip->stats, InReceives);
+ *
+ * The increments aren't atomic, so an IRQ on the same core can rarely cost a
+ * count.  Use them for statistics, not for anything that must balance. */
+struct percpu_ctrs {
+	size_t nr;
+	size_t stride;				/* counters from one core's set to the next */
+	uint64_t *ctrs;
+};
+
+void percpu_ctrs_init(struct percpu_ctrs *pc, size_t nr, int flags);
+void percpu_ctrs_destroy(struct percpu_ctrs *pc);
+uint64_t percpu_ctr_sum(struct percpu_ctrs *pc, size_t i);
+void percpu_ctr_set(struct percpu_ctrs *pc, size_t i, uint64_t val);
+
+static inline void percpu_ctr_add(struct percpu_ctrs *pc, size_t i,
+                                  int64_t amt)
+{
+	pc->ctrs[core_id() * pc->stride + i] += amt;
+}
+
+static inline void percpu_ctr_inc(struct percpu_ctrs *pc, size_t i)
+{
+	percpu_ctr_add(pc, i, 1);
+}
+
+static inline void percpu_ctr_dec(struct percpu_ctrs *pc, size_t i)
+{
+	percpu_ctr_add(pc, i, -1);
+}
@@ -42,3 +42,18 @@ struct fd_tap_req {
 	struct event_queue			*ev_q;
 	void						*data;
 };
+
+/* #epoll readiness sets.  Items are added by writing to the set's ctl file:
+ *
+ * 	add FD FILTER DATA [et] [oneshot]
+ * 	mod FD FILTER DATA [et] [oneshot]
+ * 	del FD
+ *
+ * Items are level-triggered unless "et" is given.  Reading the set's data file
+ * returns an array of these, one per ready item, blocking until at least one is
+ * ready unless the chan is O_NONBLOCK. */
+struct fd_tap_event {
+	uint32_t					filter;
+	int32_t						fd;
+	uint64_t					data;
+};
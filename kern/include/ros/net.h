@@ -0,0 +1,68 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Binary formats shared between the network stack and userspace. */
+
+#pragma once
+
+#include <ros/common.h>
+
+/* Zero-copy receive.  After "zcrecv VA NPAGES" on a conversation's ctl, reads
+ * of its data file return an array of these instead of bytes.  Each one points
+ * at len bytes at byte offset off into the ring at VA.  A descriptor never
+ * crosses a page.  Give each one back with "zcrelease OFF [OFF ...]" once you
+ * are done with the data; the ring page can't be reused until then. */
+struct zcrx_desc {
+	uint32_t					off;
+	uint32_t					len;
+};
+
+/* Batched datagrams.  After "batch" on a UDP conversation's ctl, a read of its
+ * data file returns as many whole datagrams as fit, each one preceded by one
+ * of these, packed back to back.  A write takes the same format and sends one
+ * datagram per header, stopping at a bad one; it returns the bytes of the
+ * datagrams it sent, like a short write.  In headers mode, len covers the
+ * address header too.  A datagram that doesn't fit on its own is cut short and
+ * flagged. */
+struct udpmsg_hdr {
+	uint16_t					len;
+	uint16_t					flags;
+};
+
+#define UDPMSG_TRUNC			(1 << 0)	/* rest of the datagram was dropped */
+
+/* Packet rings.  After "ring VA NPAGES [FRAMESZ]" on an #ether type's ctl, the
+ * NPAGES of anonymous memory at VA are shared with the kernel: a struct
+ * ether_ring_hdr at VA, then nr_frames rx frames at VA + rx_off and nr_frames
+ * tx frames at VA + tx_off.  Each frame is frame_sz bytes and starts with a
+ * struct ether_frame.
+ *
+ * The indices run freely; index i is frame i & (nr_frames - 1).  The kernel
+ * fills rx frames and advances rx_prod, and you advance rx_cons as you finish
+ * with them.  To send, fill tx frames, advance tx_prod, and write anything to
+ * the data file; that write sends every frame up to tx_prod, advances tx_cons,
+ * and returns the number of frames sent.  Reads of the data file block until
+ * rx_prod != rx_cons, and return the number of ready frames as a uint32_t.
+ * Packets that find the rx ring full or that don't fit in a frame count in
+ * rx_drops. */
+struct ether_ring_hdr {
+	uint32_t					nr_frames;	/* per ring, a power of two */
+	uint32_t					frame_sz;
+	uint32_t					rx_off;
+	uint32_t					tx_off;
+	uint64_t					rx_drops;
+	/* Each index gets its own cache line */
+	uint32_t					rx_prod __attribute__((aligned(64)));
+	uint32_t					rx_cons __attribute__((aligned(64)));
+	uint32_t					tx_prod __attribute__((aligned(64)));
+	uint32_t					tx_cons __attribute__((aligned(64)));
+};
+
+/* data starts 6 bytes in, so the network header after a 14 byte ethernet
+ * header is 4 byte aligned. */
+struct ether_frame {
+	uint32_t					len;
+	uint16_t					flags;		/* zero, for now */
+	uint8_t						data[];
+};
@@ -10,8 +10,6 @@
 #include <slab.h>
 #include <page_alloc.h>
 #include <pmap.h>
-/* These two are needed for the fake interrupt */
-#include <alarm.h>
 #include <smp.h>
 
 struct file_operations block_f_op;
@@ -43,6 +41,7 @@ void block_init(void)
 	pm_init(&ram_bd->b_pm, &block_pm_op, ram_bd);
 	ram_bd->b_data = _binary_mnt_ext2fs_img_start;
 	strlcpy(ram_bd->b_name, "RAMDISK", BDEV_INLINE_NAME);
+	bdev_queue_init(ram_bd, &ramdisk_bdev_ops, 1, "noop");
 	/* Connect it to the file system */
 	struct file *ram_bf = make_device("/dev_vfs/ramdisk", S_IRUSR | S_IWUSR,
 	                                  __S_IFBLK, &block_f_op);
@@ -83,68 +82,277 @@ void free_bhs(struct page *page)
 	page->pg_private = 0;		/* catch bugs */
 }
 
-/* This ultimately will handle the actual request processing, all the way down
- * to the driver, and will deal with blocking.  For now, we just fulfill the
- * request right away (RAM based block devs). */
+static struct iosched *ioscheds[] = {
+	&noop_iosched,
+	&deadline_iosched,
+};
+
+static struct iosched *iosched_lookup(char *name)
+{
+	for (int i = 0; i < ARRAY_SIZE(ioscheds); i++)
+		if (!strcmp(ioscheds[i]->name, name))
+			return ioscheds[i];
+	return 0;
+}
+
+/* Sets up bdev's request queue.  Up to depth requests go to the driver at a
+ * time; the rest wait in the scheduler called sched, where they can merge. */
+void bdev_queue_init(struct block_device *bdev,
+                     struct block_device_operations *ops, unsigned int depth,
+                     char *sched)
+{
+	struct block_queue *q = &bdev->b_queue;
+
+	bdev->b_ops = ops;
+	memset(q, 0, sizeof(struct block_queue));
+	spinlock_init_irqsave(&q->lock);
+	q->depth = MAX(depth, 1);
+	q->sched = iosched_lookup(sched);
+	if (!q->sched)
+		q->sched = &noop_iosched;
+	q->sched_data = q->sched->init();
+}
+
+/* Switches bdev's scheduler, carrying over whatever is queued. */
+int bdev_set_sched(struct block_device *bdev, char *name)
+{
+	struct block_queue *q = &bdev->b_queue;
+	struct iosched *new = iosched_lookup(name);
+	struct iosched *old;
+	struct breq_tailq pending = TAILQ_HEAD_INITIALIZER(pending);
+	struct block_request *breq;
+	void *old_data, *new_data;
+
+	if (!new)
+		return -EINVAL;
+	new_data = new->init();
+	spin_lock_irqsave(&q->lock);
+	old = q->sched;
+	if (old == new) {
+		spin_unlock_irqsave(&q->lock);
+		new->destroy(new_data);
+		return 0;
+	}
+	while ((breq = old->next(q)))
+		TAILQ_INSERT_TAIL(&pending, breq, link);
+	old_data = q->sched_data;
+	q->sched = new;
+	q->sched_data = new_data;
+	while ((breq = TAILQ_FIRST(&pending))) {
+		TAILQ_REMOVE(&pending, breq, link);
+		if (new->add(q, breq))
+			q->nr_queued--;
+	}
+	spin_unlock_irqsave(&q->lock);
+	old->destroy(old_data);
+	return 0;
+}
+
+/* Hands requests to the driver until it has depth of them.  Only one caller
+ * dispatches at a time; the others leave their requests for it, since it
+ * rechecks the queue under the lock before it stops.  That also keeps drivers
+ * that complete from dispatch() from recursing. */
+static void bdev_run_queue(struct block_device *bdev)
+{
+	struct block_queue *q = &bdev->b_queue;
+	struct block_request *breq;
+
+	spin_lock_irqsave(&q->lock);
+	if (q->running) {
+		spin_unlock_irqsave(&q->lock);
+		return;
+	}
+	q->running = TRUE;
+	while (q->nr_inflight < q->depth && (breq = q->sched->next(q))) {
+		q->nr_queued--;
+		q->nr_inflight++;
+		q->nr_dispatched++;
+		spin_unlock_irqsave(&q->lock);
+		bdev->b_ops->dispatch(bdev, breq);
+		spin_lock_irqsave(&q->lock);
+	}
+	q->running = FALSE;
+	spin_unlock_irqsave(&q->lock);
+}
+
+/* Queues breq for bdev and returns; breq->callback runs once the IO is done,
+ * possibly before we return.  Returns -1 (and queues nothing) if the request
+ * doesn't fit on the device. */
 int bdev_submit_request(struct block_device *bdev, struct block_request *breq)
 {
-	void *src, *dst;
-	unsigned long first_sector;
-	unsigned int nr_sector;
+	struct block_queue *q = &bdev->b_queue;
+	struct buffer_head *bh;
+	unsigned long next_sector = 0;
 
+	if (!(breq->flags & (BREQ_READ | BREQ_WRITE)))
+		panic("Need a request type!\n");
+	breq->flags |= BREQ_CONTIG;
 	for (int i = 0; i < breq->nr_bhs; i++) {
-		first_sector = breq->bhs[i]->bh_sector;
-		nr_sector = breq->bhs[i]->bh_nr_sector;
+		bh = breq->bhs[i];
 		/* Sectors are indexed starting with 0, for now. */
-		if (first_sector + nr_sector > bdev->b_nr_sector) {
+		if (bh->bh_sector + bh->bh_nr_sector > bdev->b_nr_sector) {
 			warn("Exceeding the num sectors!");
 			return -1;
 		}
-		if (breq->flags & BREQ_READ) {
-			dst = breq->bhs[i]->bh_buffer;
-			src = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-		} else if (breq->flags & BREQ_WRITE) {
-			dst = bdev->b_data + (first_sector << SECTOR_SZ_LOG);
-			src = breq->bhs[i]->bh_buffer;
-		} else {
-			panic("Need a request type!\n");
-		}
-		memcpy(dst, src, nr_sector << SECTOR_SZ_LOG);
+		if (i && bh->bh_sector != next_sector)
+			breq->flags &= ~BREQ_CONTIG;
+		next_sector = bh->bh_sector + bh->bh_nr_sector;
 	}
-	/* Faking the device interrupt with an alarm */
-	void breq_handler(struct alarm_waiter *waiter)
-	{
-		/* In the future, we'll need to figure out which breq this was in
-		 * response to */
-		struct block_request *breq = (struct block_request*)waiter->data;
+	breq->error = 0;
+	breq->merged = 0;
+	breq->merged_tail = 0;
+	breq->sector = breq->nr_bhs ? breq->bhs[0]->bh_sector : 0;
+	breq->nr_sector = 0;
+	if (breq->flags & BREQ_CONTIG)
+		breq->nr_sector = next_sector - breq->sector;
+	spin_lock_irqsave(&q->lock);
+	q->nr_submitted++;
+	if (q->sched->add(q, breq))
+		q->nr_merged++;
+	else
+		q->nr_queued++;
+	spin_unlock_irqsave(&q->lock);
+	bdev_run_queue(bdev);
+	return 0;
+}
+
+/* Called by drivers, from any context, when they're done with a request they
+ * got from dispatch().  Completes it and everything merged into it. */
+void bdev_complete_request(struct block_device *bdev,
+                           struct block_request *breq, int error)
+{
+	struct block_queue *q = &bdev->b_queue;
+	struct block_request *next;
+
+	spin_lock_irqsave(&q->lock);
+	q->nr_inflight--;
+	spin_unlock_irqsave(&q->lock);
+	/* The callback can free its breq, so get the next one first. */
+	for (; breq; breq = next) {
+		next = breq->merged;
+		breq->merged = 0;
+		breq->error = error;
 		if (breq->callback)
 			breq->callback(breq);
-		kfree(waiter);
 	}
-	struct timer_chain *tchain = &per_cpu_info[core_id()].tchain;
-	struct alarm_waiter *waiter = kmalloc(sizeof(struct alarm_waiter), 0);
-	init_awaiter(waiter, breq_handler);
-	/* Stitch things up, so we know how to find things later */
-	waiter->data = breq;
-	/* Set for 5ms. */
-	set_awaiter_rel(waiter, 5000);
-	set_alarm(tchain, waiter);
+	bdev_run_queue(bdev);
+}
+
+/* Calls fn on each run of sectors in breq and its merged chain that is also
+ * one run of memory, i.e. adjacent BHs are coalesced.  Stops at and returns
+ * fn's first nonzero return. */
+int breq_for_each_seg(struct block_request *breq,
+                      int (*fn)(struct block_request *breq, void *buf,
+                                unsigned long sector, unsigned int nr_sector,
+                                void *arg),
+                      void *arg)
+{
+	struct buffer_head *bh;
+	void *buf = 0;
+	unsigned long sector = 0;
+	unsigned int nr_sector = 0;
+	int ret;
+
+	for (struct block_request *b = breq; b; b = b->merged) {
+		for (int i = 0; i < b->nr_bhs; i++) {
+			bh = b->bhs[i];
+			if (nr_sector && bh->bh_sector == sector + nr_sector &&
+			    bh->bh_buffer == buf + (nr_sector << SECTOR_SZ_LOG)) {
+				nr_sector += bh->bh_nr_sector;
+				continue;
+			}
+			if (nr_sector) {
+				ret = fn(breq, buf, sector, nr_sector, arg);
+				if (ret)
+					return ret;
+			}
+			buf = bh->bh_buffer;
+			sector = bh->bh_sector;
+			nr_sector = bh->bh_nr_sector;
+		}
+	}
+	if (nr_sector)
+		return fn(breq, buf, sector, nr_sector, arg);
+	return 0;
+}
+
+static bool breq_mergeable(struct block_request *a, struct block_request *b)
+{
+	return (a->flags & BREQ_CONTIG) && (b->flags & BREQ_CONTIG) &&
+	       (a->flags & (BREQ_READ | BREQ_WRITE)) ==
+	       (b->flags & (BREQ_READ | BREQ_WRITE)) &&
+	       a->nr_sector + b->nr_sector <= BREQ_MAX_MERGE;
+}
+
+/* Merges breq onto the end of the queued q, if breq starts where q ends. */
+bool breq_back_merge(struct block_request *q, struct block_request *breq)
+{
+	if (!breq_mergeable(q, breq) || q->sector + q->nr_sector != breq->sector)
+		return FALSE;
+	if (q->merged_tail)
+		q->merged_tail->merged = breq;
+	else
+		q->merged = breq;
+	q->merged_tail = breq->merged_tail ? breq->merged_tail : breq;
+	breq->merged_tail = 0;
+	q->nr_sector += breq->nr_sector;
+	return TRUE;
+}
+
+/* Makes breq the head of q's chain, if breq ends where q starts.  The caller
+ * puts breq in the scheduler in place of q. */
+bool breq_front_merge(struct block_request *q, struct block_request *breq)
+{
+	if (!breq_mergeable(q, breq) || breq->sector + breq->nr_sector != q->sector)
+		return FALSE;
+	if (breq->merged_tail)
+		breq->merged_tail->merged = q;
+	else
+		breq->merged = q;
+	breq->merged_tail = q->merged_tail ? q->merged_tail : q;
+	breq->nr_sector += q->nr_sector;
+	breq->deadline = q->deadline;
+	q->merged_tail = 0;
+	return TRUE;
+}
+
+static int ramdisk_seg(struct block_request *breq, void *buf,
+                       unsigned long sector, unsigned int nr_sector, void *arg)
+{
+	struct block_device *bdev = arg;
+	void *disk = bdev->b_data + (sector << SECTOR_SZ_LOG);
+
+	if (breq->flags & BREQ_READ)
+		memcpy(buf, disk, nr_sector << SECTOR_SZ_LOG);
+	else
+		memcpy(disk, buf, nr_sector << SECTOR_SZ_LOG);
 	return 0;
 }
 
-/* Helper method, unblocks someone blocked on sleep_on_breq(). */
+/* RAM based block devs: the IO is a memcpy, so we complete right away. */
+static void ramdisk_dispatch(struct block_device *bdev,
+                             struct block_request *breq)
+{
+	breq_for_each_seg(breq, ramdisk_seg, bdev);
+	bdev_complete_request(bdev, breq, 0);
+}
+
+struct block_device_operations ramdisk_bdev_ops = {
+	ramdisk_dispatch,
+};
+
+/* Helper method, unblocks someone blocked on sleep_on_breq().  Drivers that
+ * complete right away (like the RAM disk) get here before the submitter sleeps,
+ * in which case the sem just remembers the up. */
 void generic_breq_done(struct block_request *breq)
 {
 	int8_t irq_state = 0;
-	if (!sem_up_irqsave(&breq->sem, &irq_state)) {
-		/* This shouldn't happen anymore.  Let brho know if it does. */
-		warn("[kernel] no one waiting on breq %p", breq);
-	}
+	sem_up_irqsave(&breq->sem, &irq_state);
 }
 
-/* Helper, pairs with generic_breq_done().  Note we sleep here on a semaphore
- * instead of faking it with an alarm.  Ideally, this code will be the same even
- * for real block devices (that don't fake things with timer interrupts). */
+/* Helper, pairs with generic_breq_done().  Note we sleep here on a semaphore,
+ * which works the same whether the driver completes from dispatch() or from an
+ * IRQ later. */
 void sleep_on_breq(struct block_request *breq)
 {
 	int8_t irq_state = 0;
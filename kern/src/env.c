@@ -111,7 +111,9 @@ void env_user_mem_free(env_t* e, void* start, size_t len)
 			return 0;
 		page_t *page = pa2page(pte_get_paddr(pte));
 		pte_clear(pte);
-		page_decref(page);
+		/* lent pages belong to whoever lent them (lend_kpage()) */
+		if (!page_is_lent(page))
+			page_decref(page);
 		/* TODO: consider other states here (like !P, yet still tracking a page,
 		 * for VM tricks, page map stuff, etc.  Should be okay: once we're
 		 * freeing, everything else about this proc is dead. */
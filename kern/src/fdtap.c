@@ -154,6 +154,10 @@ int fire_tap(struct fd_tap *tap, int filter)
 
 	if (!fire_filt)
 		return 0;
+	if (tap->func) {
+		tap->func(tap, fire_filt);
+		return 0;
+	}
 	if (waserror()) {
 		/* The process owning the tap could trigger a kernel PF, as with any
 		 * send_event() call.  Eventually we'll catch that with waserror. */
@@ -0,0 +1,177 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * IO schedulers for the block request queues (struct iosched, blockdev.h).
+ *
+ * noop: FIFO.  A request that continues the last one queued merges into it,
+ * which is all sequential IO needs.
+ *
+ * deadline: requests are kept sorted by sector, one list per direction, and we
+ * sweep up the disk from where the last dispatch ended.  Every request also
+ * gets a deadline (reads sooner than writes); once the oldest one of a
+ * direction is late, it goes next regardless of where it is.  Reads go first,
+ * but writes get a turn after DL_WRITES_STARVED reads while they wait.  New
+ * requests merge with their neighbors on either side in the sorted list. */
+
+#include <blockdev.h>
+#include <kmalloc.h>
+#include <time.h>
+#include <arch/arch.h>
+
+/* noop */
+
+static void *noop_init(void)
+{
+	struct breq_tailq *fifo = kmalloc(sizeof(struct breq_tailq), MEM_WAIT);
+
+	TAILQ_INIT(fifo);
+	return fifo;
+}
+
+static void noop_destroy(void *sched_data)
+{
+	kfree(sched_data);
+}
+
+static bool noop_add(struct block_queue *q, struct block_request *breq)
+{
+	struct breq_tailq *fifo = q->sched_data;
+	struct block_request *last = TAILQ_LAST(fifo, breq_tailq);
+
+	if (last && breq_back_merge(last, breq))
+		return TRUE;
+	TAILQ_INSERT_TAIL(fifo, breq, link);
+	return FALSE;
+}
+
+static struct block_request *noop_next(struct block_queue *q)
+{
+	struct breq_tailq *fifo = q->sched_data;
+	struct block_request *breq = TAILQ_FIRST(fifo);
+
+	if (breq)
+		TAILQ_REMOVE(fifo, breq, link);
+	return breq;
+}
+
+struct iosched noop_iosched = {
+	.name = "noop",
+	.init = noop_init,
+	.destroy = noop_destroy,
+	.add = noop_add,
+	.next = noop_next,
+};
+
+/* deadline */
+
+enum {
+	DL_READ,
+	DL_WRITE,
+	DL_WRITES_STARVED = 2,
+};
+
+static const uint64_t dl_expire_usec[2] = {
+	[DL_READ] = 500 * 1000,
+	[DL_WRITE] = 5000 * 1000,
+};
+
+struct deadline_data {
+	struct breq_tailq			sorted[2];
+	struct breq_tailq			fifo[2];
+	unsigned long				head;		/* where the last dispatch ended */
+	int							starved;	/* reads sent while writes waited */
+};
+
+static int dl_dir(struct block_request *breq)
+{
+	return breq->flags & BREQ_WRITE ? DL_WRITE : DL_READ;
+}
+
+static void *deadline_init(void)
+{
+	struct deadline_data *dd = kzmalloc(sizeof(struct deadline_data),
+	                                    MEM_WAIT);
+
+	for (int i = 0; i < 2; i++) {
+		TAILQ_INIT(&dd->sorted[i]);
+		TAILQ_INIT(&dd->fifo[i]);
+	}
+	return dd;
+}
+
+static void deadline_destroy(void *sched_data)
+{
+	kfree(sched_data);
+}
+
+static bool deadline_add(struct block_queue *q, struct block_request *breq)
+{
+	struct deadline_data *dd = q->sched_data;
+	int dir = dl_dir(breq);
+	struct block_request *next, *prev;
+
+	TAILQ_FOREACH(next, &dd->sorted[dir], link)
+		if (next->sector > breq->sector)
+			break;
+	prev = next ? TAILQ_PREV(next, breq_tailq, link)
+	            : TAILQ_LAST(&dd->sorted[dir], breq_tailq);
+	if (prev && breq_back_merge(prev, breq))
+		return TRUE;
+	if (next && breq_front_merge(next, breq)) {
+		/* breq takes next's place in both lists, and its deadline */
+		TAILQ_INSERT_BEFORE(next, breq, link);
+		TAILQ_REMOVE(&dd->sorted[dir], next, link);
+		TAILQ_INSERT_BEFORE(next, breq, fifo_link);
+		TAILQ_REMOVE(&dd->fifo[dir], next, fifo_link);
+		return TRUE;
+	}
+	breq->deadline = read_tsc() + usec2tsc(dl_expire_usec[dir]);
+	if (next)
+		TAILQ_INSERT_BEFORE(next, breq, link);
+	else
+		TAILQ_INSERT_TAIL(&dd->sorted[dir], breq, link);
+	TAILQ_INSERT_TAIL(&dd->fifo[dir], breq, fifo_link);
+	return FALSE;
+}
+
+static struct block_request *deadline_next(struct block_queue *q)
+{
+	struct deadline_data *dd = q->sched_data;
+	bool reads = !TAILQ_EMPTY(&dd->fifo[DL_READ]);
+	bool writes = !TAILQ_EMPTY(&dd->fifo[DL_WRITE]);
+	struct block_request *breq;
+	int dir;
+
+	if (!reads && !writes)
+		return 0;
+	if (reads && (!writes || dd->starved < DL_WRITES_STARVED)) {
+		dir = DL_READ;
+		if (writes)
+			dd->starved++;
+	} else {
+		dir = DL_WRITE;
+		dd->starved = 0;
+	}
+	breq = TAILQ_FIRST(&dd->fifo[dir]);
+	if (breq->deadline > read_tsc()) {
+		/* Nothing is late; carry on up the disk, wrapping at the end. */
+		TAILQ_FOREACH(breq, &dd->sorted[dir], link)
+			if (breq->sector >= dd->head)
+				break;
+		if (!breq)
+			breq = TAILQ_FIRST(&dd->sorted[dir]);
+	}
+	TAILQ_REMOVE(&dd->sorted[dir], breq, link);
+	TAILQ_REMOVE(&dd->fifo[dir], breq, fifo_link);
+	dd->head = breq->sector + breq->nr_sector;
+	return breq;
+}
+
+struct iosched deadline_iosched = {
+	.name = "deadline",
+	.init = deadline_init,
+	.destroy = deadline_destroy,
+	.add = deadline_add,
+	.next = deadline_next,
+};
@@ -1,6 +1,7 @@
 #include <ip.h>
 #include <ktest.h>
 #include <linker_func.h>
+#include <smp.h>
 
 KTEST_SUITE("NET")
 
@@ -80,10 +81,967 @@ bool test_ptclbsum_bench(void)
 	return true;
 }
 
+bool test_ptclbsum_copy(void)
+{
+	uint8_t src[200], dst[200];
+	uint16_t csum, expected;
+	int i, j, len;
+
+	for (i = 0; i < sizeof(src); i++)
+		src[i] = (i * 7) & 0xff;
+	for (i = 0; i < 16; i++) {
+		for (len = 0; len < sizeof(src) - 16; len++) {
+			j = (i * 3) % 16;
+			memset(dst, 0, sizeof(dst));
+			csum = ptclbsum_copy(dst + j, src + i, len);
+			expected = simplesum(src + i, len);
+			KT_ASSERT_M("ptclbsum_copy sum mismatch", csum == expected);
+			KT_ASSERT_M("ptclbsum_copy data mismatch",
+			            !memcmp(dst + j, src + i, len));
+		}
+	}
+	return true;
+}
+
+/* Builds a block with the first hdr_len bytes of data in the main body and the
+ * rest in extra_data buffers of at most frag bytes each.  The extra buffers
+ * start at an odd offset, so we exercise unaligned sums. */
+static struct block *csum_test_block(uint8_t *data, int hdr_len, int len,
+                                     int frag)
+{
+	struct block *b;
+	uint8_t *ebuf;
+	int off, n;
+
+	b = block_alloc(hdr_len, MEM_WAIT);
+	memcpy(b->wp, data, hdr_len);
+	b->wp += hdr_len;
+	for (off = hdr_len; off < len; off += n) {
+		n = MIN(frag, len - off);
+		ebuf = kmalloc(n + 1, MEM_WAIT);
+		memcpy(ebuf + 1, data + off, n);
+		block_append_extra(b, (uintptr_t)ebuf, 1, n, MEM_WAIT);
+	}
+	return b;
+}
+
+bool test_ptclcsum_extra(void)
+{
+	uint8_t *data;
+	struct block *b, *newb;
+	uint16_t csum;
+	int len = 3000;
+	int layouts[][2] = { {54, 1448}, {55, 1461}, {14, 4096}, {100, 7} };
+
+	data = kmalloc(len, MEM_WAIT);
+	for (int i = 0; i < len; i++)
+		data[i] = (i * 13 + 5) & 0xff;
+	for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
+		b = csum_test_block(data, layouts[i][0], len, layouts[i][1]);
+		for (int off = 0; off < len; off += 97) {
+			KT_ASSERT_M("ptclcsum mismatch",
+			            ptclcsum(b, off, len - off) ==
+			            (~simplesum(data + off, len - off) & 0xffff));
+		}
+		newb = copyblock_csum(b, layouts[i][0] + 1, &csum, MEM_WAIT);
+		KT_ASSERT_M("copyblock_csum sum mismatch",
+		            csum == simplesum(data + layouts[i][0] + 1,
+		                              len - layouts[i][0] - 1));
+		KT_ASSERT_M("copyblock_csum data mismatch",
+		            BHLEN(newb) == len && !memcmp(newb->rp, data, len));
+		freeb(newb);
+		freeb(b);
+	}
+	kfree(data);
+	return true;
+}
+
+/* Prints the throughput of ptclcsum() in GB/s for a range of packet sizes, for
+ * a linear block and for a few extra_data layouts. */
+bool test_ptclcsum_bench(void)
+{
+	int sizes[] = {64, 256, 576, 1500, 4096, 9000, 65536};
+	struct {
+		char *name;
+		int hdr_len;
+		int frag;
+	} layouts[] = {
+		{"linear", 0, 0},
+		{"hdr+page", 54, PGSIZE},
+		{"hdr+mss", 54, 1448},
+		{"hdr+odd", 55, 1461},
+	};
+	uint8_t *data;
+	struct block *b;
+	uint64_t start, nsec, mbps;
+	uint16_t csum = 0;
+	int len, iters;
+
+	data = kmalloc(sizes[ARRAY_SIZE(sizes) - 1], MEM_WAIT);
+	for (int i = 0; i < sizes[ARRAY_SIZE(sizes) - 1]; i++)
+		data[i] = i & 0xff;
+	for (int l = 0; l < ARRAY_SIZE(layouts); l++) {
+		for (int s = 0; s < ARRAY_SIZE(sizes); s++) {
+			len = sizes[s];
+			b = csum_test_block(data, layouts[l].frag ? MIN(layouts[l].hdr_len,
+			                                                len) : len,
+			                    len, layouts[l].frag);
+			iters = (64 << 20) / len;
+			start = read_tsc();
+			for (int i = 0; i < iters; i++)
+				csum += ptclcsum(b, 0, len);
+			nsec = tsc2nsec(read_tsc() - start);
+			freeb(b);
+			mbps = (uint64_t)iters * len * 1000 / MAX(nsec, 1);
+			printk("ptclcsum %8s %6d bytes: %llu.%03llu GB/s\n",
+			       layouts[l].name, len, mbps / 1000, mbps % 1000);
+		}
+	}
+	kfree(data);
+	return true;
+}
+
+struct qio_test {
+	struct queue *q;
+	int nr_blocks;
+	size_t blksz;
+	struct semaphore done;
+};
+
+/* Writes nr_blocks blocks; every byte of block i is i & 0xff. */
+static void qio_test_producer(void *arg)
+{
+	struct qio_test *qt = arg;
+	struct block *b;
+
+	for (int i = 0; i < qt->nr_blocks; i++) {
+		b = block_alloc(qt->blksz, MEM_WAIT);
+		memset(b->wp, i & 0xff, qt->blksz);
+		b->wp += qt->blksz;
+		qbwrite(qt->q, b);
+	}
+	sem_up(&qt->done);
+}
+
+static void qio_test_start(struct qio_test *qt, int state, int limit,
+                           int nr_blocks, size_t blksz)
+{
+	qt->q = qopen(limit, state, 0, 0);
+	qt->nr_blocks = nr_blocks;
+	qt->blksz = blksz;
+	sem_init(&qt->done, 0);
+	ktask_on_core("qio_test", qio_test_producer, qt,
+	              (core_id() + 1) % num_cores);
+}
+
+/* Reads a Qspsc stream with a producer on another core, with read sizes that
+ * split blocks, take whole ones and take several at once.  The small limit
+ * makes the producer overflow the ring and block on flow control. */
+bool test_qio_spsc(void)
+{
+	size_t lens[] = {1, 37, 100, 101, 250, 4096};
+	struct qio_test qt;
+	uint8_t *buf;
+	size_t total, pos = 0, n;
+	int bad = 0;
+
+	qio_test_start(&qt, Qcoalesce | Qspsc, 8192, 20000, 100);
+	total = qt.nr_blocks * qt.blksz;
+	buf = kmalloc(4096, MEM_WAIT);
+	for (int i = 0; pos < total; i++) {
+		n = qread(qt.q, buf, MIN(lens[i % ARRAY_SIZE(lens)], total - pos));
+		for (int j = 0; j < n; j++, pos++)
+			bad += buf[j] != ((pos / qt.blksz) & 0xff);
+	}
+	sem_down(&qt.done);
+	KT_ASSERT_M("qio_spsc: data out of order", !bad);
+	KT_ASSERT_M("qio_spsc: queue should be empty", !qlen(qt.q));
+	KT_ASSERT_M("qio_spsc: bytes_read is off", q_bytes_read(qt.q) == total);
+	qfree(qt.q);
+	kfree(buf);
+	return true;
+}
+
+/* Prints the cost of moving a block through a queue, producer and consumer
+ * on different cores, with and without Qspsc. */
+bool test_qio_spsc_bench(void)
+{
+	struct {
+		char *name;
+		int state;
+	} modes[] = {
+		{"locked", Qmsg},
+		{"spsc", Qmsg | Qspsc},
+	};
+	struct qio_test qt;
+	uint64_t start, nsec;
+
+	for (int m = 0; m < ARRAY_SIZE(modes); m++) {
+		qio_test_start(&qt, modes[m].state, 256 * 1024, 200000, 1460);
+		start = read_tsc();
+		for (int i = 0; i < qt.nr_blocks; i++)
+			freeb(qbread(qt.q, qt.blksz));
+		nsec = tsc2nsec(read_tsc() - start);
+		sem_down(&qt.done);
+		qfree(qt.q);
+		printk("qio %6s: %d blocks, %llu ns/block\n", modes[m].name,
+		       qt.nr_blocks, nsec / qt.nr_blocks);
+	}
+	return true;
+}
+
+/* xorshift, so the trie tests are repeatable */
+static uint32_t iptrie_rand(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+struct v4pfx {
+	uint32_t addr;
+	int plen;
+	bool live;
+};
+
+static uint32_t v4pfx_mask(int plen)
+{
+	return plen ? ~0U << (32 - plen) : 0;
+}
+
+static struct v4pfx *v4pfx_tbl;
+static struct route *v4pfx_routes;
+static int v4pfx_nr;
+
+static struct route *v4pfx_exact(void *arg, uint32_t addr, int plen)
+{
+	for (int i = 0; i < v4pfx_nr; i++) {
+		if (v4pfx_tbl[i].live && v4pfx_tbl[i].plen == plen &&
+		    v4pfx_tbl[i].addr == addr)
+			return &v4pfx_routes[i];
+	}
+	return NULL;
+}
+
+static struct route *v4pfx_lpm(uint32_t addr)
+{
+	int best = -1;
+
+	for (int i = 0; i < v4pfx_nr; i++) {
+		if (!v4pfx_tbl[i].live ||
+		    (addr & v4pfx_mask(v4pfx_tbl[i].plen)) != v4pfx_tbl[i].addr)
+			continue;
+		if (best < 0 || v4pfx_tbl[i].plen > v4pfx_tbl[best].plen)
+			best = i;
+	}
+	return best < 0 ? NULL : &v4pfx_routes[best];
+}
+
+static bool v4trie_check(struct v4trie *t, uint32_t *seed)
+{
+	struct v4pfx *p;
+	uint32_t addr;
+
+	for (int i = 0; i < 20000; i++) {
+		addr = iptrie_rand(seed);
+		/* Half the time, somewhere inside a prefix we have */
+		if (i & 1) {
+			p = &v4pfx_tbl[addr % v4pfx_nr];
+			addr = p->addr | (iptrie_rand(seed) & ~v4pfx_mask(p->plen));
+		}
+		if (v4trie_lookup(t, addr) != v4pfx_lpm(addr))
+			return false;
+	}
+	return true;
+}
+
+struct v6pfx {
+	uint32_t addr[IPllen];
+	int plen;
+	bool live;
+};
+
+static bool v6pfx_match(const uint32_t *a, struct v6pfx *p)
+{
+	int plen = p->plen;
+	int i;
+
+	for (i = 0; plen >= 32; i++, plen -= 32) {
+		if (a[i] != p->addr[i])
+			return false;
+	}
+	return !plen || !((a[i] ^ p->addr[i]) >> (32 - plen));
+}
+
+static void v6pfx_rand(struct v6pfx *p, uint32_t *seed)
+{
+	int plen = p->plen;
+
+	for (int i = 0; i < IPllen; i++) {
+		/* Share the top bits a lot, so the trie has to branch deep */
+		p->addr[i] = i ? iptrie_rand(seed) : 0x20010db8 ^
+		                                     (iptrie_rand(seed) & 0x3);
+		if (plen >= 32)
+			plen -= 32;
+		else {
+			p->addr[i] &= plen ? ~0U << (32 - plen) : 0;
+			plen = 0;
+		}
+	}
+}
+
+/* Compares both tries against a linear longest prefix match while we add and
+ * remove random prefixes. */
+bool test_iptrie(void)
+{
+	enum { NR = 2000 };
+	struct v4trie *t4 = v4trie_alloc();
+	struct v6trie *t6 = v6trie_alloc();
+	struct v6pfx *v6 = kzmalloc(NR * sizeof(struct v6pfx), MEM_WAIT);
+	struct route *v6r = kzmalloc(NR * sizeof(struct route), MEM_WAIT);
+	uint32_t seed = 0x1234567, a[IPllen];
+	int best;
+
+	v4pfx_tbl = kzmalloc(NR * sizeof(struct v4pfx), MEM_WAIT);
+	v4pfx_routes = kzmalloc(NR * sizeof(struct route), MEM_WAIT);
+	v4pfx_nr = NR;
+	for (int i = 0; i < NR; i++) {
+		v4pfx_tbl[i].plen = iptrie_rand(&seed) % 33;
+		v4pfx_tbl[i].addr = iptrie_rand(&seed) &
+		                    v4pfx_mask(v4pfx_tbl[i].plen);
+		/* Duplicates would make the reference ambiguous */
+		if (v4pfx_exact(NULL, v4pfx_tbl[i].addr, v4pfx_tbl[i].plen))
+			continue;
+		v4pfx_tbl[i].live = true;
+		v4trie_insert(t4, v4pfx_tbl[i].addr, v4pfx_tbl[i].plen,
+		              &v4pfx_routes[i]);
+	}
+	KT_ASSERT_M("v4 trie lookups after insert", v4trie_check(t4, &seed));
+	for (int i = 0; i < NR; i += 2) {
+		if (!v4pfx_tbl[i].live)
+			continue;
+		v4pfx_tbl[i].live = false;
+		v4trie_remove(t4, v4pfx_tbl[i].addr, v4pfx_tbl[i].plen, v4pfx_exact,
+		              NULL);
+	}
+	KT_ASSERT_M("v4 trie lookups after remove", v4trie_check(t4, &seed));
+
+	for (int i = 0; i < NR; i++) {
+		v6[i].plen = iptrie_rand(&seed) % 129;
+		v6pfx_rand(&v6[i], &seed);
+		v6[i].live = true;
+		for (int j = 0; j < i; j++) {
+			if (v6[j].live && v6[j].plen == v6[i].plen &&
+			    !memcmp(v6[j].addr, v6[i].addr, IPaddrlen))
+				v6[i].live = false;
+		}
+		if (v6[i].live)
+			v6trie_insert(t6, v6[i].addr, v6[i].plen, &v6r[i]);
+	}
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < 20000; i++) {
+			memcpy(a, v6[iptrie_rand(&seed) % NR].addr, IPaddrlen);
+			a[IPllen - 1 - (i & 3)] ^= iptrie_rand(&seed) >> (i % 32);
+			best = -1;
+			for (int j = 0; j < NR; j++) {
+				if (v6[j].live && v6pfx_match(a, &v6[j]) &&
+				    (best < 0 || v6[j].plen > v6[best].plen))
+					best = j;
+			}
+			KT_ASSERT_M("v6 trie lookup", v6trie_lookup(t6, a) ==
+			            (best < 0 ? NULL : &v6r[best]));
+		}
+		for (int i = pass; i < NR; i += 3) {
+			if (!v6[i].live)
+				continue;
+			v6[i].live = false;
+			v6trie_remove(t6, v6[i].addr, v6[i].plen);
+		}
+	}
+
+	v4trie_free(t4);
+	v6trie_free(t6);
+	kfree(v4pfx_tbl);
+	kfree(v4pfx_routes);
+	kfree(v6);
+	kfree(v6r);
+	return true;
+}
+
+/* Loads a BGP-sized table, mostly /24s like the real thing, and prints ns per
+ * lookup for random addresses. */
+bool test_iptrie_bench(void)
+{
+	enum { NR4 = 800000, NR6 = 200000, NR_ADDRS = 1 << 20, LOOKUPS = 1 << 24 };
+	struct v4trie *t4 = v4trie_alloc();
+	struct v6trie *t6 = v6trie_alloc();
+	struct route *r = kzmalloc(2 * sizeof(struct route), MEM_WAIT);
+	uint32_t *addrs = kmalloc(NR_ADDRS * sizeof(uint32_t), MEM_WAIT);
+	struct v6pfx p6;
+	uint32_t seed = 0xdeadbeef, x;
+	uint64_t start, nsec;
+	uintptr_t sum = 0;
+	int plen;
+
+	start = read_tsc();
+	for (int i = 0; i < NR4; i++) {
+		x = iptrie_rand(&seed);
+		plen = x % 100 < 60 ? 24 : x % 100 < 90 ? 17 + x % 7 :
+		       x % 100 < 98 ? 9 + x % 8 : 25 + x % 8;
+		x = iptrie_rand(&seed);
+		v4trie_insert(t4, x & ~0U << (32 - plen), plen, r + (x & 1));
+	}
+	nsec = tsc2nsec(read_tsc() - start);
+	printk("iptrie v4: %d routes in %llu ms, %lu KB\n", NR4, nsec / 1000000,
+	       v4trie_memory(t4) / 1024);
+	for (int i = 0; i < NR_ADDRS; i++)
+		addrs[i] = iptrie_rand(&seed);
+	start = read_tsc();
+	for (int i = 0; i < LOOKUPS; i++)
+		sum += (uintptr_t)v4trie_lookup(t4, addrs[i & (NR_ADDRS - 1)]);
+	nsec = tsc2nsec(read_tsc() - start);
+	printk("iptrie v4: %llu ns/lookup\n", nsec / LOOKUPS);
+
+	start = read_tsc();
+	for (int i = 0; i < NR6; i++) {
+		p6.plen = 32 + iptrie_rand(&seed) % 17;
+		v6pfx_rand(&p6, &seed);
+		v6trie_insert(t6, p6.addr, p6.plen, r);
+	}
+	nsec = tsc2nsec(read_tsc() - start);
+	printk("iptrie v6: %d routes in %llu ms, %lu KB\n", NR6, nsec / 1000000,
+	       v6trie_memory(t6) / 1024);
+	start = read_tsc();
+	for (int i = 0; i < LOOKUPS / 4; i++) {
+		p6.plen = 128;
+		v6pfx_rand(&p6, &seed);
+		sum += (uintptr_t)v6trie_lookup(t6, p6.addr);
+	}
+	nsec = tsc2nsec(read_tsc() - start);
+	printk("iptrie v6: %llu ns/lookup (with address generation)\n",
+	       nsec / (LOOKUPS / 4));
+
+	v4trie_free(t4);
+	v6trie_free(t6);
+	kfree(addrs);
+	kfree(r);
+	return sum != 1;
+}
+
+/* Four reuseport listeners on *!80: every flow must stick to one of them, the
+ * flows must spread, and a flow must find a new home when its listener goes. */
+bool test_ipht_reuseport(void)
+{
+	enum { NR_LIS = 4, NR_FLOWS = 4000 };
+	struct Ipht *ht = kzmalloc(sizeof(struct Ipht), MEM_WAIT);
+	struct conv *lis = kzmalloc(NR_LIS * sizeof(struct conv), MEM_WAIT);
+	struct conv *other = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	int hits[NR_LIS] = {0};
+	uint8_t sa[IPaddrlen], da[IPaddrlen];
+	struct conv *c;
+
+	parseip(da, "10.0.0.1");
+	for (int i = 0; i < NR_LIS; i++) {
+		lis[i].lport = 80;
+		lis[i].reuseport = 1;
+		iphtadd(ht, &lis[i]);
+	}
+	other->lport = 81;
+	iphtadd(ht, other);
+
+	for (int i = 0; i < NR_FLOWS; i++) {
+		parseip(sa, "192.168.0.0");
+		hnputs(sa + IPaddrlen - 2, i);
+		c = iphtlook(ht, sa, 1024 + i, da, 80);
+		KT_ASSERT_M("flow matched a listener", c >= lis && c < lis + NR_LIS);
+		KT_ASSERT_M("flow sticks to its listener",
+		            iphtlook(ht, sa, 1024 + i, da, 80) == c);
+		hits[c - lis]++;
+	}
+	for (int i = 0; i < NR_LIS; i++)
+		KT_ASSERT_M("flows spread across the group",
+		            hits[i] > NR_FLOWS / NR_LIS / 2);
+	KT_ASSERT_M("plain listener is unaffected",
+	            iphtlook(ht, sa, 1, da, 81) == other);
+
+	iphtrem(ht, &lis[0]);
+	for (int i = 0; i < NR_FLOWS; i++) {
+		parseip(sa, "192.168.0.0");
+		hnputs(sa + IPaddrlen - 2, i);
+		c = iphtlook(ht, sa, 1024 + i, da, 80);
+		KT_ASSERT_M("flow moved to a live listener",
+		            c > lis && c < lis + NR_LIS);
+	}
+
+	for (int i = 1; i < NR_LIS; i++)
+		iphtrem(ht, &lis[i]);
+	iphtrem(ht, other);
+	kfree(other);
+	kfree(lis);
+	kfree(ht);
+	return true;
+}
+
+/* Builds fragment off/len of a PAYLOAD-byte datagram behind a HDR-byte header,
+ * split into two blocks if split is set. */
+static struct block *ipfrag_mkfrag(uint8_t *payload, int off, int len,
+                                   bool split)
+{
+	enum { HDR = 20 };
+	struct block *bp, *tail;
+	int first = split ? len / 2 : len;
+
+	bp = block_alloc(HDR + first, MEM_WAIT);
+	memset(bp->wp, 0xee, HDR);
+	bp->wp += HDR;
+	memcpy(bp->wp, payload + off, first);
+	bp->wp += first;
+	if (split) {
+		tail = block_alloc(len - first, MEM_WAIT);
+		memcpy(tail->wp, payload + off + first, len - first);
+		tail->wp += len - first;
+		bp->next = tail;
+	}
+	return bp;
+}
+
+static struct block *ipfrag_add(struct fraghash *fh, uint8_t *payload, int off,
+                                int len, bool last, bool split, int *dlen)
+{
+	struct Ipfrag fg = {.foff = off, .flen = len, .hlen = 20, .last = last};
+	uint8_t src[IPaddrlen], dst[IPaddrlen];
+
+	parseip(src, "10.0.0.1");
+	parseip(dst, "10.0.0.2");
+	return ipfragadd(fh, ipfrag_mkfrag(payload, off, len, split), &fg, src,
+	                 dst, 1234, 17, dlen);
+}
+
+/* Out of order, overlapping, multi-block fragments must come back as the
+ * original payload, chained rather than copied into one block. */
+bool test_ipfrag(void)
+{
+	enum { PAYLOAD = 3000, HDR = 20 };
+	struct fraghash *fh = fraghash_alloc();
+	uint8_t *payload = kmalloc(PAYLOAD, MEM_WAIT);
+	uint8_t *out = kmalloc(HDR + PAYLOAD, MEM_WAIT);
+	struct fragstats st = {0};
+	struct block *bp;
+	int len = 0;
+
+	for (int i = 0; i < PAYLOAD; i++)
+		payload[i] = i * 7;
+	KT_ASSERT(!ipfrag_add(fh, payload, 2000, 1000, TRUE, FALSE, &len));
+	KT_ASSERT(!ipfrag_add(fh, payload, 0, 1200, FALSE, TRUE, &len));
+	KT_ASSERT(!ipfrag_add(fh, payload, 800, 400, FALSE, FALSE, &len));
+	bp = ipfrag_add(fh, payload, 1000, 1000, FALSE, TRUE, &len);
+	KT_ASSERT_M("datagram completes", bp);
+	KT_ASSERT_M("payload length", len == PAYLOAD);
+	KT_ASSERT_M("datagram length", blocklen(bp) == HDR + PAYLOAD);
+	KT_ASSERT_M("fragments are chained", bp->next);
+	bl2mem(out, bp, HDR + PAYLOAD);
+	KT_ASSERT_M("header kept", out[0] == 0xee && out[HDR - 1] == 0xee);
+	KT_ASSERT_M("payload intact", !memcmp(out + HDR, payload, PAYLOAD));
+	freeblist(bp);
+
+	/* An unfragmented packet flushes a partial queue for its id. */
+	KT_ASSERT(!ipfrag_add(fh, payload, 0, 1000, FALSE, FALSE, &len));
+	bp = ipfrag_add(fh, payload, 0, 500, TRUE, FALSE, &len);
+	KT_ASSERT_M("unfragmented packet passes through", bp && len == 500);
+	freeblist(bp);
+
+	fraghash_stats(fh, &st);
+	KT_ASSERT_M("stats", st.oks == 1 && st.fails == 1 && st.reqds == 2);
+	kfree(out);
+	kfree(payload);
+	kfree(fh);
+	return true;
+}
+
+/* The RSS verification suite from Microsoft's RSS spec: IPv4 flows hashed with
+ * the default key, with and without the ports. */
+bool test_toeplitz(void)
+{
+	static const struct {
+		char *src, *dst;
+		uint16_t sport, dport;
+		uint32_t hash_ports, hash_addrs;
+	} v[] = {
+		{"66.9.149.187", "161.142.100.80", 2794, 1766,
+		 0x51ccc178, 0x323e8fc2},
+		{"199.92.111.2", "65.69.140.83", 14230, 4739,
+		 0xc626b0ea, 0xd718262a},
+		{"24.19.198.95", "12.22.207.184", 12898, 38024,
+		 0x5c2b394a, 0xd2d0a5de},
+		{"38.27.205.30", "209.142.163.6", 48228, 2217,
+		 0xafc7327f, 0x82989176},
+		{"153.39.163.191", "202.188.127.2", 44251, 1303,
+		 0x10e828a2, 0x5d1809c5},
+	};
+	uint8_t pkt[IPV4HDR_LEN + 4];
+
+	for (int i = 0; i < ARRAY_SIZE(v); i++) {
+		memset(pkt, 0, sizeof(pkt));
+		pkt[0] = IP_VER4 | (IPV4HDR_LEN >> 2);
+		pkt[9] = TCP;
+		v4parseip(pkt + 12, v[i].src);
+		v4parseip(pkt + 16, v[i].dst);
+		hnputs(pkt + IPV4HDR_LEN, v[i].sport);
+		hnputs(pkt + IPV4HDR_LEN + 2, v[i].dport);
+		KT_ASSERT_M("4-tuple hash",
+		            toeplitz_hash(rss_default_key, pkt + 12, 12)
+		            == v[i].hash_ports);
+		KT_ASSERT_M("2-tuple hash",
+		            toeplitz_hash(rss_default_key, pkt + 12, 8)
+		            == v[i].hash_addrs);
+		KT_ASSERT_M("flow hash of a TCP packet",
+		            ip_flow_hash(rss_default_key, pkt, sizeof(pkt))
+		            == v[i].hash_ports);
+		/* a fragment's ports aren't in every fragment, so they don't count */
+		hnputs(pkt + 6, 100);
+		KT_ASSERT_M("flow hash of a fragment",
+		            ip_flow_hash(rss_default_key, pkt, sizeof(pkt))
+		            == v[i].hash_addrs);
+	}
+	return true;
+}
+
+/* Sends "argv" to p's ctl and returns the errno it threw, or 0.  errno lives in
+ * the syscall struct, and ktests aren't in a syscall, so lend the kthread
+ * one. */
+static int proto_ctl_errno(struct Proto *p, struct conv *c, char **argv,
+                           int argc)
+{
+	ERRSTACK(1);
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct syscall *old_sysc = kth->sysc;
+	struct syscall sysc = {0};
+
+	kth->sysc = &sysc;
+	if (!waserror())
+		p->ctl(c, argv, argc);
+	poperror();
+	kth->sysc = old_sysc;
+	return sysc.err;
+}
+
+/* Cookies must come back with the peer's MSS (rounded down to the table) for
+ * the tick they were made in and the next one, and nothing else may get in:
+ * stale ones, ones from the future, forged ones, or any while they're off. */
+bool test_tcp_syncookies(void)
+{
+	static const uint16_t mss[] = {0, 536, 1000, 1460, 1500, 9000};
+	static const int want[] = {0, 536, 536, 1460, 1460, 8960};
+	static const uint32_t ticks[] = {0, 17, 31};
+	struct Proto *tcp = tcpalloc();
+	struct conv *c = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	char *off[] = {"syncookies", "off"};
+	char *on[] = {"syncookies", "on"};
+	char *bad[] = {"syncookies", "maybe"};
+	uint8_t ra[IPaddrlen], la[IPaddrlen];
+	uint32_t cookie, irs, t;
+	uint16_t rport;
+
+	parseip(ra, "10.0.0.1");
+	parseip(la, "10.0.0.2");
+	c->p = tcp;
+	KT_ASSERT_M("no cookies taken back before any went out",
+	            tcpsyncookiemss(tcp, ra, 1234, la, 80, 1, 0x12345678, 0) < 0);
+	for (int i = 0; i < ARRAY_SIZE(mss); i++) {
+		for (int j = 0; j < ARRAY_SIZE(ticks); j++) {
+			t = ticks[j];
+			rport = 1024 + i;
+			irs = 0x10000 * i + 0x333 * j;
+			cookie = tcpsyncookie(tcp, ra, rport, la, 80, irs, mss[i], t);
+			KT_ASSERT_M("cookie round trip",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs, cookie,
+			                            t) == want[i]);
+			KT_ASSERT_M("cookie is good for one more tick",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs, cookie,
+			                            t + 1) == want[i]);
+			KT_ASSERT_M("stale cookie",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs, cookie,
+			                            t + 2) < 0);
+			KT_ASSERT_M("cookie from the future",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs, cookie,
+			                            t - 1) < 0);
+			KT_ASSERT_M("forged hash",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs,
+			                            cookie ^ 1, t) < 0);
+			KT_ASSERT_M("forged MSS",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs,
+			                            cookie ^ (7 << 24), t) < 0);
+			KT_ASSERT_M("cookie for another irs",
+			            tcpsyncookiemss(tcp, ra, rport, la, 80, irs + 1,
+			                            cookie, t) < 0);
+			KT_ASSERT_M("cookie for another port",
+			            tcpsyncookiemss(tcp, ra, rport + 1, la, 80, irs,
+			                            cookie, t) < 0);
+		}
+	}
+
+	cookie = tcpsyncookie(tcp, ra, 1234, la, 80, 1, 1460, 5);
+	KT_ASSERT_M("syncookies off", !proto_ctl_errno(tcp, c, off, 2));
+	KT_ASSERT_M("no cookies taken back while off",
+	            tcpsyncookiemss(tcp, ra, 1234, la, 80, 1, cookie, 5) < 0);
+	KT_ASSERT_M("syncookies on", !proto_ctl_errno(tcp, c, on, 2));
+	KT_ASSERT_M("cookies taken back when on again",
+	            tcpsyncookiemss(tcp, ra, 1234, la, 80, 1, cookie, 5) == 1460);
+	KT_ASSERT_M("syncookies maybe", proto_ctl_errno(tcp, c, bad, 2)
+	            == EINVAL);
+	KT_ASSERT_M("syncookies with no value", proto_ctl_errno(tcp, c, on, 1)
+	            == EINVAL);
+
+	kfree(c);
+	tcpfree(tcp);
+	return true;
+}
+
+/* Returns the value of "name: N" in arp's stats. */
+static uint64_t arp_stat(struct arp *arp, char *name)
+{
+	char *buf = kzmalloc(READSTR, MEM_WAIT);
+	char *p;
+	uint64_t val = 0;
+
+	arpstatsread(arp, buf, 0, READSTR - 1);
+	p = strstr(buf, name);
+	if (p)
+		val = strtoul(p + strlen(name) + 2, 0, 0);
+	kfree(buf);
+	return val;
+}
+
+static void arp_test_ip(uint8_t *ip, int i)
+{
+	v4parseip(ip, "10.1.0.0");
+	hnputs(ip + 2, i);
+}
+
+/* Resolves i's address to a mac made from i, the way a reply would. */
+static struct arpent *arp_test_resolve(struct arp *arp, struct Ipifc *ifc,
+                                       int i)
+{
+	uint8_t ip[IPv4addrlen], mac[MAClen] = {0x02, 0, 0, 0, 0, 0};
+	struct arpent *a;
+	struct block *bp = block_alloc(1, MEM_WAIT);
+
+	arp_test_ip(ip, i);
+	hnputs(mac + 4, i);
+	a = arpget(arp, bp, V4, ifc, ip, mac);
+	if (!a)
+		return NULL;
+	freeb(arpresolve(arp, a, ifc->m, mac));
+	return a;
+}
+
+/* Whether i's address hits without the qlock, with the right mac. */
+static bool arp_test_hit(struct arp *arp, struct Ipifc *ifc, int i)
+{
+	uint8_t ip[IPv4addrlen], mac[MAClen];
+	uint64_t hits = arp_stat(arp, "hits");
+	struct arpent *a;
+
+	arp_test_ip(ip, i);
+	a = arpget(arp, NULL, V4, ifc, ip, mac);
+	if (a) {
+		/* a miss comes back as a new entry, with arp locked */
+		arprelease(arp, a);
+		return false;
+	}
+	return arp_stat(arp, "hits") == hits + 1 && mac[0] == 0x02 &&
+	       nhgets(mac + 4) == i;
+}
+
+/* Fills an arp table past a few doublings, checks every entry still hits
+ * lock-free, then ages some out and checks the sweep frees them and new
+ * entries reuse them. */
+bool test_arp(void)
+{
+	enum { NR = 1000, NR_OLD = 100 };
+	struct arp *arp = arpcreate(NULL);
+	struct Ipifc *ifc = kzmalloc(sizeof(struct Ipifc), MEM_WAIT);
+	struct arpent **ents = kzmalloc(NR * sizeof(struct arpent *), MEM_WAIT);
+	struct arpent *a, *w;
+	struct block *bp;
+	uint8_t ip[IPv4addrlen], mac[MAClen];
+	int reused = 0;
+
+	ifc->m = &ethermedium;
+	for (int i = 0; i < NR; i++) {
+		ents[i] = arp_test_resolve(arp, ifc, i);
+		KT_ASSERT_M("a new address waits for a reply", ents[i]);
+	}
+	KT_ASSERT_M("all entries in the table", arp_stat(arp, "entries") == NR);
+	KT_ASSERT_M("the table grew", arp_stat(arp, "buckets") >= NR / 2);
+	KT_ASSERT_M("misses took the lock", arp_stat(arp, "misses") == NR);
+	for (int i = 0; i < NR; i++)
+		KT_ASSERT_M("resolved entry hits", arp_test_hit(arp, ifc, i));
+
+	/* One unanswered address with a packet waiting on it */
+	arp_test_ip(ip, NR);
+	bp = block_alloc(1, MEM_WAIT);
+	w = arpget(arp, bp, V4, ifc, ip, mac);
+	KT_ASSERT_M("unresolved entry holds the packet", w && w->hold == bp);
+	arprelease(arp, w);
+	arp_test_ip(ip, NR);
+	KT_ASSERT_M("unresolved entry doesn't hit",
+	            (a = arpget(arp, NULL, V4, ifc, ip, mac)) == w);
+	arprelease(arp, a);
+
+	/* Age some out: resolved ones past their life, and the waiting one past
+	 * its wait. */
+	for (int i = 0; i < NR_OLD; i++)
+		ents[i]->ctime = NOW - 24 * 60 * 60 * 1000ULL;
+	w->wtime = read_tsc() - usec2tsc(60 * 60 * 1000000ULL);
+	arpexpire(arp);
+	KT_ASSERT_M("sweep expired the old entries",
+	            arp_stat(arp, "expired") == NR_OLD + 1);
+	KT_ASSERT_M("sweep left the rest", arp_stat(arp, "entries") ==
+	            NR - NR_OLD);
+	for (int i = NR_OLD; i < NR; i++)
+		KT_ASSERT_M("live entry still hits", arp_test_hit(arp, ifc, i));
+
+	/* New addresses come off the free list */
+	for (int i = 0; i < NR_OLD + 1; i++) {
+		a = arp_test_resolve(arp, ifc, 2 * NR + i);
+		KT_ASSERT_M("new address after the sweep", a);
+		for (int j = 0; j < NR_OLD; j++)
+			reused += a == ents[j];
+		reused += a == w;
+		KT_ASSERT_M("reused entry hits", arp_test_hit(arp, ifc, 2 * NR + i));
+	}
+	KT_ASSERT_M("new entries reuse freed ones", reused == NR_OLD + 1);
+	KT_ASSERT_M("old address misses", !arp_test_hit(arp, ifc, 0));
+
+	arpdestroy(arp);
+	kfree(ents);
+	kfree(ifc);
+	return true;
+}
+
+enum {
+	RCVQMAX = 64 * 1024 - 1,	/* QMAX in tcp.c */
+	RCVMAXSCALE = 8,			/* TCP_MAXSCALE in tcp.c */
+	RCVRTT = 10,				/* ms */
+	RCVCHUNK = 64 * 1024,
+};
+
+/* One rtt of a sender filling the window and a reader that keeps up: len bytes
+ * arrive and go through the rq.  Returns the window after that. */
+static uint32_t tcp_rcv_rtt(struct conv *c, uint8_t *buf, uint32_t len,
+                            uint64_t now)
+{
+	size_t n;
+
+	for (size_t left = len; left; left -= n) {
+		n = MIN(left, RCVCHUNK);
+		qwrite(c->rq, buf, n);
+		qread(c->rq, buf, n);
+	}
+	return tcprcvdata(c, len, now);
+}
+
+/* Resets c to a new connection, with a new rq so the drain measurements start
+ * from zero. */
+static void tcp_rcv_reset(struct conv *c, int scale)
+{
+	qfree(c->rq);
+	c->rq = qopen(RCVQMAX, 0, 0, 0);
+	tcprcvsetup(c, scale);
+}
+
+/* Runs rtts until the window stops growing.  Returns the window, or 0 if it
+ * ever shrank or went past what scale can advertise. */
+static uint32_t tcp_rcv_grow(struct conv *c, uint8_t *buf, int scale,
+                             uint64_t *now)
+{
+	uint32_t w, prev;
+	int stable = 0;
+
+	w = tcprcvdata(c, 0, *now);
+	for (int i = 0; i < 30 && stable < 3; i++) {
+		prev = w;
+		*now += RCVRTT;
+		w = tcp_rcv_rtt(c, buf, w, *now);
+		if (w < prev || w > (uint32_t)RCVQMAX << scale)
+			return 0;
+		stable = w == prev ? stable + 1 : 0;
+	}
+	return w;
+}
+
+/* Receive window autotuning: a reader that keeps up grows the window to what
+ * our window scale can advertise and no further, within the tcprcvmem budget,
+ * and the growth goes back to the budget when the connection is reset. */
+bool test_tcp_rcvtune(void)
+{
+	enum { BUDGET = 1000000 };
+	struct Proto *tcp = tcpalloc();
+	struct conv *c = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	uint8_t *buf = kzmalloc(RCVCHUNK, MEM_WAIT);
+	char val[32];
+	char *rcvmem[] = {"tcprcvmem", val};
+	uint32_t start = RCVQMAX << 3;	/* QMAX << TCP_INITSCALE */
+	uint64_t now = 1000;
+
+	c->p = tcp;
+	c->ptcl = kzmalloc(tcp->ptclsize, MEM_WAIT);
+	c->rq = qopen(RCVQMAX, 0, 0, 0);
+
+	tcp_rcv_reset(c, 2);
+	KT_ASSERT_M("a small scale starts at its limit",
+	            tcp_rcv_grow(c, buf, 2, &now) == RCVQMAX << 2);
+	KT_ASSERT_M("nothing charged without growth", tcprcvmem(tcp) == 0);
+
+	tcp_rcv_reset(c, RCVMAXSCALE);
+	KT_ASSERT_M("window grows to QMAX << TCP_MAXSCALE",
+	            tcp_rcv_grow(c, buf, RCVMAXSCALE, &now) ==
+	            RCVQMAX << RCVMAXSCALE);
+	KT_ASSERT_M("growth is charged",
+	            tcprcvmem(tcp) == (RCVQMAX << RCVMAXSCALE) - start);
+	tcp_rcv_reset(c, RCVMAXSCALE);
+	KT_ASSERT_M("reset gives the growth back", tcprcvmem(tcp) == 0);
+	KT_ASSERT_M("reset window", tcprcvdata(c, 0, now) == start);
+
+	snprintf(val, sizeof(val), "%d", BUDGET);
+	KT_ASSERT(!proto_ctl_errno(tcp, c, rcvmem, 2));
+	KT_ASSERT_M("growth stops at the budget",
+	            tcp_rcv_grow(c, buf, RCVMAXSCALE, &now) == start + BUDGET);
+	KT_ASSERT_M("the budget is all used", tcprcvmem(tcp) == BUDGET);
+	tcp_rcv_reset(c, RCVMAXSCALE);
+	KT_ASSERT_M("reset gives the budget back", tcprcvmem(tcp) == 0);
+	snprintf(val, sizeof(val), "%ld", 256L << 20);
+	KT_ASSERT(!proto_ctl_errno(tcp, c, rcvmem, 2));
+
+	qfree(c->rq);
+	kfree(c->ptcl);
+	kfree(c);
+	kfree(buf);
+	tcpfree(tcp);
+	return true;
+}
+
 static struct ktest ktests[] = {
 	KTEST_REG(ptclbsum,				CONFIG_TEST_ptclbsum),
 	KTEST_REG(simplesum_bench,		CONFIG_TEST_simplesum_bench),
 	KTEST_REG(ptclbsum_bench,		CONFIG_TEST_ptclbsum_bench),
+	KTEST_REG(ptclbsum_copy,		CONFIG_TEST_ptclbsum_copy),
+	KTEST_REG(ptclcsum_extra,		CONFIG_TEST_ptclcsum_extra),
+	KTEST_REG(ptclcsum_bench,		CONFIG_TEST_ptclcsum_bench),
+	KTEST_REG(qio_spsc,				CONFIG_TEST_qio_spsc),
+	KTEST_REG(qio_spsc_bench,		CONFIG_TEST_qio_spsc_bench),
+	KTEST_REG(iptrie,				CONFIG_TEST_iptrie),
+	KTEST_REG(iptrie_bench,			CONFIG_TEST_iptrie_bench),
+	KTEST_REG(ipht_reuseport,		CONFIG_TEST_ipht_reuseport),
+	KTEST_REG(ipfrag,				CONFIG_TEST_ipfrag),
+	KTEST_REG(toeplitz,				CONFIG_TEST_toeplitz),
+	KTEST_REG(tcp_syncookies,		CONFIG_TEST_tcp_syncookies),
+	KTEST_REG(arp,					CONFIG_TEST_arp),
+	KTEST_REG(tcp_rcvtune,			CONFIG_TEST_tcp_rcvtune),
 };
 
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
@@ -43,6 +43,7 @@
 #include <ucq.h>
 #include <setjmp.h>
 #include <sort.h>
+#include <blockdev.h>
 
 #include <apipe.h>
 #include <rwlock.h>
@@ -50,6 +51,8 @@
 #include <ktest.h>
 #include <smallidpool.h>
 #include <linker_func.h>
+#include <ip.h>
+#include <ros/net.h>
 
 KTEST_SUITE("POSTBOOT")
 
@@ -2193,6 +2196,378 @@ bool test_cmdline_parse(void)
 	return TRUE;
 }
 
+/* A driver that holds on to what it's dispatched until the test completes it */
+static struct block_request *bdt_held[8];
+static int bdt_nr_held;
+static int bdt_nr_done;
+
+static void bdt_dispatch(struct block_device *bdev, struct block_request *breq)
+{
+	bdt_held[bdt_nr_held++] = breq;
+}
+
+static struct block_device_operations bdt_ops = {
+	bdt_dispatch,
+};
+
+static void bdt_callback(struct block_request *breq)
+{
+	bdt_nr_done++;
+}
+
+static struct block_request *bdt_req(struct buffer_head *bh,
+                                     unsigned int flags, void *buf,
+                                     unsigned long sector, unsigned int nr)
+{
+	struct block_request *breq = kmem_cache_alloc(breq_kcache, MEM_WAIT);
+
+	memset(bh, 0, sizeof(struct buffer_head));
+	bh->bh_buffer = buf;
+	bh->bh_sector = sector;
+	bh->bh_nr_sector = nr;
+	breq->flags = flags;
+	breq->callback = bdt_callback;
+	breq->data = 0;
+	sem_init_irqsave(&breq->sem, 0);
+	breq->bhs = breq->local_bhs;
+	breq->bhs[0] = bh;
+	breq->nr_bhs = 1;
+	return breq;
+}
+
+static int bdt_count_seg(struct block_request *breq, void *buf,
+                         unsigned long sector, unsigned int nr_sector,
+                         void *arg)
+{
+	unsigned int *segs = arg;
+
+	segs[0]++;
+	segs[1] += nr_sector;
+	return 0;
+}
+
+bool test_bdev_queue(void)
+{
+	struct block_device *bdev = kzmalloc(sizeof(struct block_device),
+	                                     MEM_WAIT);
+	struct buffer_head bhs[6];
+	struct block_request *a, *b, *c, *d, *e, *w;
+	uint8_t *disk = kpages_zalloc(64 * SECTOR_SZ, MEM_WAIT);
+	uint8_t *buf = kpages_zalloc(64 * SECTOR_SZ, MEM_WAIT);
+	unsigned int segs[2] = {0, 0};
+
+	bdev->b_sector_sz = SECTOR_SZ;
+	bdev->b_nr_sector = 64;
+	bdev->b_data = disk;
+	bdev_queue_init(bdev, &bdt_ops, 1, "deadline");
+	bdt_nr_held = bdt_nr_done = 0;
+
+	/* a goes straight to the driver, and the rest queue up behind it. */
+	a = bdt_req(&bhs[0], BREQ_READ, buf + 40 * SECTOR_SZ, 40, 8);
+	b = bdt_req(&bhs[1], BREQ_READ, buf + 8 * SECTOR_SZ, 8, 8);
+	c = bdt_req(&bhs[2], BREQ_READ, buf + 16 * SECTOR_SZ, 16, 8);
+	d = bdt_req(&bhs[3], BREQ_READ, buf, 0, 8);
+	e = bdt_req(&bhs[4], BREQ_READ, buf + 32 * SECTOR_SZ, 32, 8);
+	KT_ASSERT(!bdev_submit_request(bdev, a));
+	KT_ASSERT_M("first request dispatched", bdt_nr_held == 1 &&
+	            bdt_held[0] == a);
+	KT_ASSERT(!bdev_submit_request(bdev, b));
+	KT_ASSERT(!bdev_submit_request(bdev, c));
+	KT_ASSERT(!bdev_submit_request(bdev, d));
+	KT_ASSERT(!bdev_submit_request(bdev, e));
+	KT_ASSERT_M("c back merged and d front merged into b",
+	            bdev->b_queue.nr_merged == 2 && bdev->b_queue.nr_queued == 2);
+
+	/* The sweep wraps from a's end to the start of the disk: d, b, c. */
+	bdev_complete_request(bdev, a, 0);
+	KT_ASSERT_M("a completed", bdt_nr_done == 1);
+	KT_ASSERT_M("merged request dispatched next", bdt_nr_held == 2 &&
+	            bdt_held[1] == d && d->sector == 0 && d->nr_sector == 24);
+	KT_ASSERT_M("merge chain", d->merged == b && b->merged == c);
+	breq_for_each_seg(d, bdt_count_seg, segs);
+	KT_ASSERT_M("adjacent BHs coalesced", segs[0] == 1 && segs[1] == 24);
+
+	bdev_complete_request(bdev, d, 0);
+	KT_ASSERT_M("whole chain completed", bdt_nr_done == 4);
+	KT_ASSERT_M("e dispatched last", bdt_nr_held == 3 && bdt_held[2] == e);
+	bdev_complete_request(bdev, e, 0);
+	KT_ASSERT(bdt_nr_done == 5);
+
+	/* Out of bounds requests are refused. */
+	w = bdt_req(&bhs[5], BREQ_READ, buf, 60, 8);
+	KT_ASSERT_M("past the end", bdev_submit_request(bdev, w) == -1);
+
+	/* The RAM disk completes before submit returns. */
+	bdev->b_queue.sched->destroy(bdev->b_queue.sched_data);
+	bdev_queue_init(bdev, &ramdisk_bdev_ops, 1, "noop");
+	memset(buf, 0xab, 8 * SECTOR_SZ);
+	w = bdt_req(&bhs[5], BREQ_WRITE, buf, 4, 8);
+	w->callback = generic_breq_done;
+	KT_ASSERT(!bdev_submit_request(bdev, w));
+	sleep_on_breq(w);
+	KT_ASSERT_M("ramdisk write", w->error == 0 &&
+	            disk[4 * SECTOR_SZ] == 0xab && disk[12 * SECTOR_SZ - 1] == 0xab &&
+	            disk[12 * SECTOR_SZ] == 0);
+
+	kmem_cache_free(breq_kcache, w);
+	kmem_cache_free(breq_kcache, a);
+	kmem_cache_free(breq_kcache, b);
+	kmem_cache_free(breq_kcache, c);
+	kmem_cache_free(breq_kcache, d);
+	kmem_cache_free(breq_kcache, e);
+	noop_iosched.destroy(bdev->b_queue.sched_data);
+	kpages_free(disk, 64 * SECTOR_SZ);
+	kpages_free(buf, 64 * SECTOR_SZ);
+	kfree(bdev);
+	return TRUE;
+}
+
+/* Cost of a 4K request through the layer to the RAM disk, with nothing but the
+ * queue in the way, for each scheduler. */
+bool test_bdev_queue_bench(void)
+{
+	static char *scheds[] = {"noop", "deadline"};
+	struct block_device *bdev = kzmalloc(sizeof(struct block_device),
+	                                     MEM_WAIT);
+	size_t disk_sz = 1024 * PGSIZE;
+	uint8_t *disk = kpages_zalloc(disk_sz, MEM_WAIT);
+	uint8_t *buf = kpages_alloc(PGSIZE, MEM_WAIT);
+	struct buffer_head bh;
+	struct block_request *breq;
+	int nr_reqs = 100000;
+	uint64_t start, nsec;
+
+	bdev->b_sector_sz = SECTOR_SZ;
+	bdev->b_nr_sector = disk_sz / SECTOR_SZ;
+	bdev->b_data = disk;
+	bdev_queue_init(bdev, &ramdisk_bdev_ops, 1, "noop");
+	breq = bdt_req(&bh, BREQ_READ, buf, 0, PGSIZE / SECTOR_SZ);
+	breq->callback = generic_breq_done;
+	for (int s = 0; s < ARRAY_SIZE(scheds); s++) {
+		KT_ASSERT(!bdev_set_sched(bdev, scheds[s]));
+		start = read_tsc();
+		for (int i = 0; i < nr_reqs; i++) {
+			bh.bh_sector = (i % 1024) * (PGSIZE / SECTOR_SZ);
+			KT_ASSERT(!bdev_submit_request(bdev, breq));
+			sleep_on_breq(breq);
+		}
+		nsec = tsc2nsec(read_tsc() - start);
+		printk("bdev %8s: %d 4K reads, %llu ns/req, %llu MB/s\n", scheds[s],
+		       nr_reqs, nsec / nr_reqs,
+		       (uint64_t)nr_reqs * PGSIZE * 1000 / MAX(nsec, 1));
+	}
+	bdev->b_queue.sched->destroy(bdev->b_queue.sched_data);
+	kmem_cache_free(breq_kcache, breq);
+	kpages_free(buf, PGSIZE);
+	kpages_free(disk, disk_sz);
+	kfree(bdev);
+	return TRUE;
+}
+
+/* zcrx reports errors with error(), and errno lives in the syscall struct.
+ * Ktests aren't in a syscall, so lend the kthread one while we run op. */
+static int zcrx_errno(void (*op)(struct conv *, char **, int),
+                      struct conv *c, char **argv, int argc)
+{
+	ERRSTACK(1);
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct syscall *old_sysc = kth->sysc;
+	struct syscall sysc = {0};
+
+	kth->sysc = &sysc;
+	if (!waserror())
+		op(c, argv, argc);
+	poperror();
+	kth->sysc = old_sysc;
+	return sysc.err;
+}
+
+static int zcrx_release(struct conv *c, uint32_t off)
+{
+	char buf[32];
+	char *argv[] = {"zcrelease", buf};
+
+	snprintf(buf, sizeof(buf), "%u", off);
+	return zcrx_errno(zcrxrelease, c, argv, 2);
+}
+
+/* Returns the number of descriptors read, or -errno. */
+static long zcrx_try_read(struct conv *c, struct zcrx_desc *d, int nd)
+{
+	ERRSTACK(1);
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+	struct syscall *old_sysc = kth->sysc;
+	struct syscall sysc = {0};
+	long ret = 0;
+
+	kth->sysc = &sysc;
+	if (!waserror())
+		ret = zcrx_read(c, d, nd * sizeof(struct zcrx_desc), TRUE) /
+		      sizeof(struct zcrx_desc);
+	poperror();
+	kth->sysc = old_sysc;
+	return sysc.err ? -sysc.err : ret;
+}
+
+static struct block *zcrx_page_block(void)
+{
+	struct block *b = block_alloc(0, MEM_WAIT);
+
+	block_append_extra(b, (uintptr_t)kmalloc_align(PGSIZE, MEM_WAIT, PGSIZE),
+	                   0, PGSIZE, MEM_WAIT);
+	return b;
+}
+
+/* Runs the ring through its paces on c.  The caller cleans up, even if we bail
+ * out halfway. */
+static bool zcrx_test_ring(struct proc *p, struct conv *c, struct conv *batch,
+                           uintptr_t ring, int npages)
+{
+	enum { HDR = 100, LEN = HDR + 2 * PGSIZE, NR_DESC = 16 };
+	struct zcrx_desc d[NR_DESC], held[NR_DESC * NR_DESC];
+	char va_str[32], unaligned_str[32], npages_str[32];
+	char *on[] = {"zcrecv", va_str, npages_str};
+	char *bad_va[] = {"zcrecv", unaligned_str, npages_str};
+	uint8_t *expect, *lent, *shared, *got;
+	struct block *b;
+	long nd, nheld = 0, pos = 0;
+	int err = 0;
+	bool lent_seen = FALSE;
+
+	snprintf(va_str, sizeof(va_str), "%lu", ring);
+	snprintf(unaligned_str, sizeof(unaligned_str), "%lu", ring + 8);
+	snprintf(npages_str, sizeof(npages_str), "%d", npages);
+
+	KT_ASSERT_M("zcrecv with a bad va", zcrx_errno(zcrxctl, c, bad_va, 3)
+	            == EINVAL);
+	KT_ASSERT_M("zcrecv with no npages", zcrx_errno(zcrxctl, c, on, 2)
+	            == EINVAL);
+	KT_ASSERT_M("zcrecv on a batch conv", zcrx_errno(zcrxctl, batch, on, 3)
+	            == EBUSY);
+	KT_ASSERT_M("zcrecv", !zcrx_errno(zcrxctl, c, on, 3) && c->zcrx);
+	KT_ASSERT_M("zcrecv twice", zcrx_errno(zcrxctl, c, on, 3) == EBUSY);
+
+	/* A header, a page nobody else holds (lent) and a page someone else holds
+	 * a ref on (copied). */
+	expect = kmalloc(LEN, MEM_WAIT);
+	got = kmalloc(PGSIZE, MEM_WAIT);
+	lent = kmalloc_align(PGSIZE, MEM_WAIT, PGSIZE);
+	shared = kmalloc_align(PGSIZE, MEM_WAIT, PGSIZE);
+	for (int i = 0; i < LEN; i++)
+		expect[i] = i * 7;
+	memcpy(lent, expect + HDR, PGSIZE);
+	memcpy(shared, expect + HDR + PGSIZE, PGSIZE);
+	kmalloc_incref(shared);
+	b = block_alloc(HDR, MEM_WAIT);
+	memcpy(b->wp, expect, HDR);
+	b->wp += HDR;
+	block_append_extra(b, (uintptr_t)lent, 0, PGSIZE, MEM_WAIT);
+	block_append_extra(b, (uintptr_t)shared, 0, PGSIZE, MEM_WAIT);
+	qbwrite(c->rq, b);
+
+	KT_ASSERT_M("zcrx needs 4 descriptors", zcrx_try_read(c, d, 3)
+	            == -EINVAL);
+	nd = zcrx_try_read(c, d, NR_DESC);
+	KT_ASSERT_M("zcrx read", nd > 0);
+	for (int i = 0; i < nd; i++) {
+		KT_ASSERT_M("descriptor inside the ring",
+		            d[i].off + d[i].len <= npages * PGSIZE);
+		KT_ASSERT_M("descriptor data",
+		            !copy_from_user(got, (void*)(ring + d[i].off), d[i].len)
+		            && !memcmp(got, expect + pos, d[i].len));
+		if (uva2kva(p, (void*)(ring + d[i].off), 1, PROT_READ) ==
+		    (uintptr_t)lent) {
+			KT_ASSERT_M("lent a whole page",
+			            d[i].len == PGSIZE && pos == HDR);
+			lent_seen = TRUE;
+		}
+		pos += d[i].len;
+	}
+	KT_ASSERT_M("read the whole block", pos == LEN && !qlen(c->rq));
+	KT_ASSERT_M("the free page was lent", lent_seen);
+	KT_ASSERT_M("the ring holds the lent page",
+	            kmalloc_refcnt(lent) == 1);
+	KT_ASSERT_M("the shared page was copied, not held",
+	            kmalloc_refcnt(shared) == 1);
+	kfree(shared);
+
+	for (int i = 0; i < nd; i++)
+		KT_ASSERT_M("zcrelease", !zcrx_release(c, d[i].off));
+	for (int i = 0; i < nd; i++) {
+		KT_ASSERT_M("the lent page went back",
+		            uva2kva(p, (void*)(ring + d[i].off), 1, PROT_READ) !=
+		            (uintptr_t)lent);
+	}
+	KT_ASSERT_M("zcrelease twice", zcrx_release(c, d[0].off) == EINVAL);
+	KT_ASSERT_M("zcrelease outside the ring",
+	            zcrx_release(c, npages * PGSIZE) == EINVAL);
+
+	/* Don't give anything back: the ring fills with data still queued. */
+	for (int i = 0; i < 2 * npages; i++)
+		qbwrite(c->rq, zcrx_page_block());
+	for (int i = 0; i < NR_DESC; i++) {
+		nd = zcrx_try_read(c, d, NR_DESC);
+		if (nd < 0) {
+			err = -nd;
+			break;
+		}
+		memcpy(held + nheld, d, nd * sizeof(struct zcrx_desc));
+		nheld += nd;
+	}
+	KT_ASSERT_M("a full ring is ENOBUFS", err == ENOBUFS);
+	KT_ASSERT_M("a full ring leaves data queued", qlen(c->rq));
+	for (int i = 0; i < nheld; i++)
+		KT_ASSERT_M("zcrelease a full ring", !zcrx_release(c, held[i].off));
+	KT_ASSERT_M("reads resume after zcrelease",
+	            zcrx_try_read(c, d, NR_DESC) > 0);
+
+	/* Close with descriptors still out; zcrxclose takes the pages back. */
+	zcrxclose(c);
+	KT_ASSERT_M("zcrecv is off", !c->zcrx);
+	KT_ASSERT_M("zcrelease after close", zcrx_release(c, d[0].off) == EINVAL);
+	KT_ASSERT_M("zcrecv after close", !zcrx_errno(zcrxctl, c, on, 3));
+	zcrxclose(c);
+
+	kfree(got);
+	kfree(expect);
+	return TRUE;
+}
+
+/* Zero-copy receive on a fake conv: zcrecv/zcrelease/close, lending vs.
+ * copying, and ENOBUFS when the process doesn't give descriptors back. */
+bool test_zcrx(void)
+{
+	enum { NPAGES = 8 };
+	struct conv *c = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	struct conv *batch = kzmalloc(sizeof(struct conv), MEM_WAIT);
+	struct proc *tmp;
+	uintptr_t switch_tmp;
+	void *ring;
+	int err;
+	bool passed = FALSE;
+
+	err = proc_alloc(&tmp, 0, 0);
+	KT_ASSERT_M("Failed to alloc a temp proc", err == 0);
+	__proc_set_state(tmp, PROC_RUNNABLE_S);
+	switch_tmp = switch_to(tmp);
+	ring = mmap(tmp, 0, NPAGES * PGSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	            -1, 0);
+	if (ring == MAP_FAILED)
+		goto out;
+	c->rq = qopen(64 * PGSIZE, 0, 0, 0);
+	batch->batch = 1;
+	passed = zcrx_test_ring(tmp, c, batch, (uintptr_t)ring, NPAGES);
+	zcrxclose(c);
+	qfree(c->rq);
+	munmap(tmp, (uintptr_t)ring, NPAGES * PGSIZE);
+out:
+	switch_back(tmp, switch_tmp);
+	proc_decref(tmp);
+	kfree(batch);
+	kfree(c);
+	return passed;
+}
+
 static struct ktest ktests[] = {
 #ifdef CONFIG_X86
 	KTEST_REG(ipi_sending,        CONFIG_TEST_ipi_sending),
@@ -2230,6 +2605,9 @@ static struct ktest ktests[] = {
 	KTEST_REG(uaccess,            CONFIG_TEST_uaccess),
 	KTEST_REG(sort,               CONFIG_TEST_sort),
 	KTEST_REG(cmdline_parse,      CONFIG_TEST_cmdline_parse),
+	KTEST_REG(bdev_queue,         CONFIG_TEST_bdev_queue),
+	KTEST_REG(bdev_queue_bench,   CONFIG_TEST_bdev_queue_bench),
+	KTEST_REG(zcrx,               CONFIG_TEST_zcrx),
 };
 static int num_ktests = sizeof(ktests) / sizeof(struct ktest);
 linker_func_1(register_pb_ktests)
@@ -206,10 +206,17 @@ static void __launch_kthread(uint32_t srcid, long a0, long a1, long a2)
 }
 
 /* Call this when a kthread becomes runnable/unblocked.  We don't do anything
- * particularly smart yet, but when we do, we can put it here. */
+ * particularly smart yet, but when we do, we can put it here.  Pinned kthreads
+ * always go back to their core. */
 void kthread_runnable(struct kthread *kthread)
 {
 	uint32_t dst = core_id();
+
+	if (kthread->flags & KTH_IS_PINNED) {
+		send_kernel_message(kthread->coreid, __launch_kthread, (long)kthread,
+		                    0, 0, KMSG_ROUTINE);
+		return;
+	}
 	#if 0
 	/* turn this block on if you want to test migrating non-core0 kthreads */
 	switch (dst) {
@@ -289,6 +296,19 @@ out:
 	/* if we blocked, when we return, PRKM will smp_idle() */
 }
 
+/* Runs a ktask pinned to the core the kmsg was sent to.  The kthread keeps the
+ * pin across blocking, since kthread_runnable() sends it back here.  If fn
+ * blocked, we're still the same kthread when it returns, so we can unpin. */
+static void __ktask_pinned_wrapper(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct kthread *kth = per_cpu_info[core_id()].cur_kthread;
+
+	kth->coreid = core_id();
+	kth->flags |= KTH_IS_PINNED;
+	__ktask_wrapper(srcid, a0, a1, a2);
+	kth->flags &= ~KTH_IS_PINNED;
+}
+
 /* Creates a kernel task, running fn(arg), named "name".  This is just a routine
  * kernel message that happens to have a name, and is allowed to block.  It
  * won't be associated with any process.  For lack of a better place, we'll just
@@ -300,6 +320,15 @@ void ktask(char *name, void (*fn)(void*), void *arg)
 	                    (long)name, KMSG_ROUTINE);
 }
 
+/* Like ktask(), but the task runs on coreid, and only there: whenever it
+ * blocks, it restarts on coreid, no matter which core wakes it up.  Plain
+ * ktasks aren't pinned; they restart wherever they're woken. */
+void ktask_on_core(char *name, void (*fn)(void*), void *arg, int coreid)
+{
+	send_kernel_message(coreid, __ktask_pinned_wrapper, (long)fn, (long)arg,
+	                    (long)name, KMSG_ROUTINE);
+}
+
 /* Semaphores, using kthreads directly */
 static void debug_downed_sem(struct semaphore *sem);
 static void debug_upped_sem(struct semaphore *sem);
@@ -883,7 +883,7 @@ static int __vmr_free_pgs(struct proc *p, pte_t pte, void *va, void *arg)
 		return 0;
 	page = pa2page(pte_get_paddr(pte));
 	pte_clear(pte);
-	if (!page_is_pagemap(page))
+	if (!page_is_pagemap(page) && !page_is_lent(page))
 		page_decref(page);
 	return 0;
 }
@@ -1160,6 +1160,71 @@ unsigned long populate_va(struct proc *p, uintptr_t va, unsigned long nr_pgs)
 	return nr_filled;
 }
 
+/* Maps the kernel page at kva into p's address space at va, replacing whatever
+ * anonymous page was there.  The caller still owns the page: the PTE doesn't
+ * hold a reference, and munmap and proc teardown will skip it (PG_LENT).  The
+ * caller must reclaim_kpage() before freeing the memory.
+ *
+ * va must be in a private, anonymous, readable VMR.  Returns 0 or -errno. */
+int lend_kpage(struct proc *p, uintptr_t va, void *kva)
+{
+	struct vm_region *vmr;
+	struct page *page = kva2page(kva);
+	struct page *old_page = NULL;
+	pte_t pte;
+	int pte_prot;
+
+	assert(!PGOFF(va) && !PGOFF(kva));
+	spin_lock(&p->vmr_lock);
+	vmr = find_vmr(p, va);
+	if (!vmr || vmr->vm_file || (vmr->vm_flags & MAP_SHARED) ||
+	    !(vmr->vm_prot & PROT_READ)) {
+		spin_unlock(&p->vmr_lock);
+		return -EINVAL;
+	}
+	pte_prot = (vmr->vm_prot & PROT_WRITE) ? PTE_USER_RW : PTE_USER_RO;
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, TRUE);
+	if (!pte_walk_okay(pte)) {
+		spin_unlock(&p->pte_lock);
+		spin_unlock(&p->vmr_lock);
+		return -ENOMEM;
+	}
+	if (pte_is_mapped(pte))
+		old_page = pa2page(pte_get_paddr(pte));
+	atomic_or(&page->pg_flags, PG_LENT);
+	pte_write(pte, page2pa(page), pte_prot);
+	spin_unlock(&p->pte_lock);
+	spin_unlock(&p->vmr_lock);
+	if (old_page) {
+		proc_tlbshootdown(p, va, va + PGSIZE);
+		if (!page_is_lent(old_page))
+			page_decref(old_page);
+	}
+	return 0;
+}
+
+/* Undoes lend_kpage().  If the user already unmapped va, or mapped something
+ * else there, we just drop the lent status. */
+void reclaim_kpage(struct proc *p, uintptr_t va, void *kva)
+{
+	struct page *page = kva2page(kva);
+	bool shootdown_needed = FALSE;
+	pte_t pte;
+
+	spin_lock(&p->pte_lock);
+	pte = pgdir_walk(p->env_pgdir, (void*)va, FALSE);
+	if (pte_walk_okay(pte) && pte_is_mapped(pte) &&
+	    pte_get_paddr(pte) == page2pa(page)) {
+		pte_clear(pte);
+		shootdown_needed = TRUE;
+	}
+	spin_unlock(&p->pte_lock);
+	if (shootdown_needed)
+		proc_tlbshootdown(p, va, va + PGSIZE);
+	atomic_and(&page->pg_flags, ~PG_LENT);
+}
+
 /* Kernel Dynamic Memory Mappings */
 
 static struct arena *vmap_addr_arena;
@@ -39,14 +39,30 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <hash.h>
 
 /*
  *  address resolution tables
+ *
+ *  Entries hang off a hash of the whole address, which doubles as it fills.
+ *  Transmits look up resolved entries without the qlock.  Every change to the
+ *  table, or to an entry's ip, type, state, mac or ctime, is made with the
+ *  qlock held inside a write section of arp->seq, and readers retry if one
+ *  overlapped them.  For that to be safe, nothing a reader can reach is ever
+ *  freed: dead entries go on a free list and outgrown tables are kept.
  */
 
 enum {
-	NHASH = (1 << 6),
-	NCACHE = 256,
+	ArpMinHash = 6,				/* log2 of the initial buckets */
+	ArpMaxHash = 16,
+	ArpMaxEnt = 1 << 16,		/* a flat /16 */
+	ArpMaxWalk = 16,			/* lock-free walks give up after this */
+	ArpTries = 4,				/* lock-free attempts before taking the lock */
+	ArpLife = 15 * 60 * 1000,	/* ms a resolved entry is believed */
+	ArpWaitLife = 10 * 1000,	/* ms a v4 entry waits for a reply */
+	ArpSweep = 1000,			/* ms between timer sweeps */
+	ArpSweepBuckets = 4096,		/* buckets looked at per sweep */
+	ArpVictims = 8,				/* buckets sampled to pick an eviction */
 
 	AOK = 1,
 	AWAIT = 2,
@@ -58,121 +74,271 @@ char *arpstate[] = {
 	"WAIT",
 };
 
+struct arphash {
+	struct arphash *old;		/* smaller tables a reader may still be in */
+	unsigned int bits;
+	struct arpent *tab[];
+};
+
+/* Per core, so that hits don't bounce a line between transmitting cores. */
+struct arpstats {
+	uint64_t hits;				/* resolved without the qlock */
+	uint64_t misses;			/* had to take the qlock */
+	uint64_t resolved;			/* went from WAIT to OK */
+	uint64_t rlat_usec;			/* total time those spent in WAIT */
+	uint64_t rlat_max;
+	uint64_t expired;			/* timed out by the sweeper */
+	uint64_t evicted;			/* pushed out by a new entry */
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 /*
  *  one per Fs
  */
 struct arp {
 	qlock_t qlock;
+	seq_ctr_t seq;				/* see above */
 	struct Fs *f;
-	struct arpent *hash[NHASH];
-	struct arpent cache[NCACHE];
+	struct arphash *ht;
+	unsigned int nent;			/* entries in ht */
+	unsigned int nalloc;		/* entries ever allocated, in ht or free */
+	unsigned int hand;			/* next bucket to sweep or evict from */
+	uint64_t nextsweep;
+	struct arpent *free;		/* linked by ->hash */
 	struct arpent *rxmt;
 	struct proc *rxmitp;		/* neib sol re-transmit proc */
 	struct rendez rxmtq;
 	struct block *dropf, *dropl;
+	struct arpstats *stats;		/* [num_cores] */
 };
 
-#define haship(s) ((s)[IPaddrlen-1]%NHASH)
-
 int ReTransTimer = RETRANS_TIMER;
 static void rxmitproc(void *v);
 
+static unsigned int haship(struct arphash *ht, uint8_t *ip)
+{
+	uint64_t hi, lo;
+
+	memcpy(&hi, ip, sizeof(hi));
+	memcpy(&lo, ip + sizeof(hi), sizeof(lo));
+	return hash_64(hi * GOLDEN_RATIO_64 ^ lo, ht->bits);
+}
+
+static struct arphash *arphashalloc(unsigned int bits)
+{
+	struct arphash *ht;
+
+	ht = kzmalloc(sizeof(struct arphash) + (1 << bits) *
+	              sizeof(struct arpent *), MEM_WAIT);
+	ht->bits = bits;
+	return ht;
+}
+
+/* An arp table for f, without the rxmit ktask.  arpinit() starts that; the
+ * ktests make their own tables and arpdestroy() them. */
+struct arp *arpcreate(struct Fs *f)
+{
+	struct arp *arp;
+
+	arp = kzmalloc(sizeof(struct arp), MEM_WAIT);
+	qlock_init(&arp->qlock);
+	rendez_init(&arp->rxmtq);
+	arp->f = f;
+	arp->ht = arphashalloc(ArpMinHash);
+	arp->stats = kzmalloc_align(num_cores * sizeof(struct arpstats),
+	                            MEM_WAIT, ARCH_CL_SIZE);
+	arp->rxmt = NULL;
+	arp->dropf = arp->dropl = NULL;
+	return arp;
+}
+
 void arpinit(struct Fs *f)
 {
-	f->arp = kzmalloc(sizeof(struct arp), MEM_WAIT);
-	qlock_init(&f->arp->qlock);
-	rendez_init(&f->arp->rxmtq);
-	f->arp->f = f;
-	f->arp->rxmt = NULL;
-	f->arp->dropf = f->arp->dropl = NULL;
+	f->arp = arpcreate(f);
 	ktask("rxmitproc", rxmitproc, f->arp);
 }
 
-/*
- *  create a new arp entry for an ip address.
- */
-static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
-                              int addrxt)
+/* Doubles the table.  Called with arp qlocked, in a seq write section. */
+static void arpgrow(struct arp *arp)
 {
-	unsigned int t;
-	struct block *next, *xp;
-	struct arpent *a, *e, *f, **l;
-	struct medium *m = ifc->m;
-	int empty;
+	struct arphash *old = arp->ht, *ht;
+	struct arpent *a, *next;
+	unsigned int h;
+
+	ht = arphashalloc(old->bits + 1);
+	for (int i = 0; i < (1 << old->bits); i++) {
+		for (a = old->tab[i]; a; a = next) {
+			next = a->hash;
+			h = haship(ht, a->ip);
+			a->hash = ht->tab[h];
+			ht->tab[h] = a;
+		}
+	}
+	ht->old = old;
+	wmb();	/* readers that see the new table see its chains */
+	arp->ht = ht;
+}
 
-	/* find oldest entry */
-	e = &arp->cache[NCACHE];
-	a = arp->cache;
-	t = a->utime;
-	for (f = a; f < e; f++) {
-		if (f->utime < t) {
-			t = f->utime;
-			a = f;
+static void unhash(struct arp *arp, struct arpent *a)
+{
+	struct arpent *f, **l;
+
+	l = &arp->ht->tab[haship(arp->ht, a->ip)];
+	for (f = *l; f; f = f->hash) {
+		if (f == a) {
+			*l = a->hash;
+			break;
 		}
+		l = &f->hash;
 	}
+}
+
+static void unrxmt(struct arp *arp, struct arpent *a)
+{
+	struct arpent *f, **l;
+
+	l = &arp->rxmt;
+	for (f = *l; f; f = f->nextrxt) {
+		if (f == a) {
+			*l = a->nextrxt;
+			break;
+		}
+		l = &f->nextrxt;
+	}
+	a->nextrxt = NULL;
+}
+
+/* Gets rid of the packets waiting on a: v4 ones are dropped, v6 ones get an
+ * icmp unreachable from rxmitproc, later, w/o the arp lock. */
+static void drophold(struct arp *arp, struct arpent *a)
+{
+	struct block *next, *xp;
 
-	/* dump waiting packets */
 	xp = a->hold;
 	a->hold = NULL;
-
+	a->last = NULL;
 	if (isv4(a->ip)) {
 		while (xp) {
 			next = xp->list;
 			freeblist(xp);
 			xp = next;
 		}
-	} else {
-		/* queue icmp unreachable for rxmitproc later, w/o arp lock */
-		if (xp) {
-			if (arp->dropl == NULL)
-				arp->dropf = xp;
-			else
-				arp->dropl->list = xp;
+	} else if (xp) {
+		if (arp->dropl == NULL)
+			arp->dropf = xp;
+		else
+			arp->dropl->list = xp;
 
-			for (next = xp->list; next; next = next->list)
-				xp = next;
-			arp->dropl = xp;
-			rendez_wakeup(&arp->rxmtq);
-		}
+		for (next = xp->list; next; next = next->list)
+			xp = next;
+		arp->dropl = xp;
+		rendez_wakeup(&arp->rxmtq);
 	}
+}
 
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
-			break;
+/* called with arp qlocked.  a goes back on the free list. */
+void cleanarpent(struct arp *arp, struct arpent *a)
+{
+	__seq_start_write(&arp->seq);
+	unhash(arp, a);
+	a->utime = 0;
+	a->ctime = 0;
+	a->type = 0;
+	a->state = 0;
+	memset(a->ip, 0, sizeof(a->ip));
+	__seq_end_write(&arp->seq);
+
+	unrxmt(arp, a);
+	a->hold = NULL;
+	a->last = NULL;
+	a->ifc = NULL;
+	a->hash = arp->free;
+	arp->free = a;
+	arp->nent--;
+}
+
+/* Picks the least recently used entry from a few buckets, preferring ones that
+ * no one is waiting on. */
+static struct arpent *arpvictim(struct arp *arp)
+{
+	struct arphash *ht = arp->ht;
+	struct arpent *a, *victim = NULL;
+	unsigned int mask = (1 << ht->bits) - 1;
+	int seen = 0;
+
+	for (int i = 0; i <= mask && seen < ArpVictims; i++) {
+		a = ht->tab[arp->hand++ & mask];
+		if (a)
+			seen++;
+		for (; a; a = a->hash) {
+			if (!victim || (victim->state == AWAIT && a->state != AWAIT) ||
+			    ((victim->state == AWAIT) == (a->state == AWAIT) &&
+			     a->utime < victim->utime))
+				victim = a;
 		}
-		l = &f->hash;
 	}
+	return victim;
+}
 
-	/* insert into new chain */
-	l = &arp->hash[haship(ip)];
-	a->hash = *l;
-	*l = a;
+static struct arpent *arpalloc(struct arp *arp)
+{
+	struct arpent *a;
+
+	if (arp->free) {
+		a = arp->free;
+		arp->free = a->hash;
+		a->hash = NULL;
+	} else if (arp->nalloc < ArpMaxEnt) {
+		a = kzmalloc(sizeof(struct arpent), MEM_WAIT);
+		arp->nalloc++;
+	} else {
+		a = arpvictim(arp);
+		drophold(arp, a);
+		cleanarpent(arp, a);
+		arp->stats[core_id()].evicted++;
+		arp->free = a->hash;
+		a->hash = NULL;
+	}
+	arp->nent++;
+	return a;
+}
+
+/*
+ *  create a new arp entry for an ip address.
+ */
+static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
+                              int addrxt, int state)
+{
+	struct arpent *a, *f, **l;
+	struct medium *m = ifc->m;
+	int empty;
 
+	a = arpalloc(arp);
+
+	__seq_start_write(&arp->seq);
+	if (arp->nent > (2U << arp->ht->bits) && arp->ht->bits < ArpMaxHash)
+		arpgrow(arp);
 	memmove(a->ip, ip, sizeof(a->ip));
-	a->utime = NOW;
-	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
+	a->state = state;
 	a->type = m;
+	a->ctime = 0;	/* somewhat of a "last sent time".  0, to trigger a send. */
+	l = &arp->ht->tab[haship(arp->ht, ip)];
+	a->hash = *l;
+	wmb();	/* readers that find a see it filled in */
+	*l = a;
+	__seq_end_write(&arp->seq);
 
+	a->utime = NOW;
+	a->wtime = read_tsc();
 	a->rtime = NOW + ReTransTimer;
 	a->rxtsrem = MAX_MULTICAST_SOLICIT;
 	a->ifc = ifc;
 	a->ifcid = ifc->ifcid;
+	a->nextrxt = NULL;
 
 	/* put to the end of re-transmit chain; addrxt is 0 when isv4(a->ip) */
 	if (!ipismulticast(a->ip) && addrxt) {
 		l = &arp->rxmt;
 		empty = (*l == NULL);
-
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
 		for (f = *l; f; f = f->nextrxt) {
 			l = &f->nextrxt;
 		}
@@ -181,46 +347,71 @@ static struct arpent *newarp6(struct arp *arp, uint8_t *ip, struct Ipifc *ifc,
 			rendez_wakeup(&arp->rxmtq);
 	}
 
-	a->nextrxt = NULL;
-
 	return a;
 }
 
-/* called with arp qlocked */
-
-void cleanarpent(struct arp *arp, struct arpent *a)
+/* Called with arp qlocked when a goes from WAIT to OK. */
+static void arpresolved(struct arp *arp, struct arpent *a)
 {
-	struct arpent *f, **l;
+	struct arpstats *s = &arp->stats[core_id()];
+	uint64_t usec = tsc2usec(read_tsc() - a->wtime);
 
-	a->utime = 0;
-	a->ctime = 0;
-	a->type = 0;
-	a->state = 0;
+	s->resolved++;
+	s->rlat_usec += usec;
+	s->rlat_max = MAX(s->rlat_max, usec);
+}
 
-	/* take out of current chain */
-	l = &arp->hash[haship(a->ip)];
-	for (f = *l; f; f = f->hash) {
-		if (f == a) {
-			*l = a->hash;
+static struct arpent *arplookup(struct arp *arp, uint8_t *ip,
+                                struct medium *type)
+{
+	struct arpent *a;
+
+	for (a = arp->ht->tab[haship(arp->ht, ip)]; a; a = a->hash) {
+		if (ipcmp(ip, a->ip) == 0 && type == a->type)
 			break;
-		}
-		l = &f->hash;
 	}
+	return a;
+}
 
-	/* take out of re-transmit chain */
-	l = &arp->rxmt;
-	for (f = *l; f; f = f->nextrxt) {
-		if (f == a) {
-			*l = a->nextrxt;
-			break;
+/* Lock-free lookup of a resolved entry.  Returns TRUE and fills in mac if we
+ * found one.  Misses, unresolved and expired entries take the locked path. */
+static bool arpget_fast(struct arp *arp, uint8_t *ip, struct medium *type,
+                        uint8_t *mac)
+{
+	struct arphash *ht;
+	struct arpent *a;
+	seq_ctr_t seq;
+	uint64_t now = NOW;
+	bool found;
+	int walk;
+
+	for (int tries = 0; tries < ArpTries; tries++) {
+		seq = ACCESS_ONCE(arp->seq);
+		rmb();
+		found = FALSE;
+		ht = ACCESS_ONCE(arp->ht);
+		a = ACCESS_ONCE(ht->tab[haship(ht, ip)]);
+		for (walk = 0; a && walk < ArpMaxWalk; walk++) {
+			if (ipcmp(ip, a->ip) == 0 && a->type == type) {
+				found = a->state == AOK &&
+			        (int64_t)(now - a->ctime) <= ArpLife;
+				if (found)
+					memmove(mac, a->mac, type->maclen);
+				break;
+			}
+			a = ACCESS_ONCE(a->hash);
 		}
-		l = &f->nextrxt;
+		rmb();
+		if (seqctr_retry(seq, ACCESS_ONCE(arp->seq)))
+			continue;
+		if (!found)
+			return FALSE;
+		/* an LRU hint, racy on purpose; skip the store if it's current */
+		if (a->utime != now)
+			a->utime = now;
+		return TRUE;
 	}
-	a->nextrxt = NULL;
-	a->hash = NULL;
-	a->hold = NULL;
-	a->last = NULL;
-	a->ifc = NULL;
+	return FALSE;
 }
 
 /*
@@ -232,29 +423,25 @@ void cleanarpent(struct arp *arp, struct arpent *a)
 struct arpent *arpget(struct arp *arp, struct block *bp, int version,
                       struct Ipifc *ifc, uint8_t *ip, uint8_t *mac)
 {
-	int hash, len;
 	struct arpent *a;
 	struct medium *type = ifc->m;
 	uint8_t v6ip[IPaddrlen];
-	uint16_t *s, *d;
 
 	if (version == V4) {
 		v4tov6(v6ip, ip);
 		ip = v6ip;
 	}
 
-	qlock(&arp->qlock);
-	hash = haship(ip);
-	for (a = arp->hash[hash]; a; a = a->hash) {
-		if (ipcmp(ip, a->ip) == 0)
-			if (type == a->type)
-				break;
+	if (arpget_fast(arp, ip, type, mac)) {
+		arp->stats[core_id()].hits++;
+		return NULL;
 	}
 
-	if (a == NULL) {
-		a = newarp6(arp, ip, ifc, (version != V4));
-		a->state = AWAIT;
-	}
+	qlock(&arp->qlock);
+	arp->stats[core_id()].misses++;
+	a = arplookup(arp, ip, type);
+	if (a == NULL)
+		a = newarp6(arp, ip, ifc, (version != V4), AWAIT);
 	a->utime = NOW;
 	if (a->state == AWAIT) {
 		if (bp != NULL) {
@@ -268,16 +455,10 @@ struct arpent *arpget(struct arp *arp, struct block *bp, int version,
 		return a;	/* return with arp qlocked */
 	}
 
-	s = (uint16_t *)a->mac;
-	d = (uint16_t *)mac;
-	len = a->type->maclen / 2;
-	while (len) {
-		*d++ = *s++;
-		len--;
-	}
+	memmove(mac, a->mac, a->type->maclen);
 
 	/* remove old entries */
-	if (NOW - a->ctime > 15 * 60 * 1000)
+	if ((int64_t)(NOW - a->ctime) > ArpLife)
 		cleanarpent(arp, a);
 
 	qunlock(&arp->qlock);
@@ -302,22 +483,16 @@ struct block *arpresolve(struct arp *arp, struct arpent *a, struct medium *type,
                          uint8_t *mac)
 {
 	struct block *bp;
-	struct arpent *f, **l;
 
-	if (!isv4(a->ip)) {
-		l = &arp->rxmt;
-		for (f = *l; f; f = f->nextrxt) {
-			if (f == a) {
-				*l = a->nextrxt;
-				break;
-			}
-			l = &f->nextrxt;
-		}
-	}
+	if (!isv4(a->ip))
+		unrxmt(arp, a);
 
+	__seq_start_write(&arp->seq);
 	memmove(a->mac, mac, type->maclen);
 	a->type = type;
 	a->state = AOK;
+	a->ctime = NOW;
+	__seq_end_write(&arp->seq);
 	a->utime = NOW;
 	bp = a->hold;
 	a->hold = NULL;
@@ -336,7 +511,7 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	ERRSTACK(1);
 	struct arp *arp;
 	struct route *r;
-	struct arpent *a, *f, **l;
+	struct arpent *a;
 	struct Ipifc *ifc;
 	struct medium *type;
 	struct block *bp, *next;
@@ -370,76 +545,91 @@ void arpenter(struct Fs *fs, int version, uint8_t *ip, uint8_t *mac, int n,
 	type = ifc->m;
 
 	qlock(&arp->qlock);
-	for (a = arp->hash[haship(ip)]; a; a = a->hash) {
-		if (a->type != type || (a->state != AWAIT && a->state != AOK))
-			continue;
-
-		if (ipcmp(a->ip, ip) == 0) {
-			a->state = AOK;
-			memmove(a->mac, mac, type->maclen);
-
-			if (version == V6) {
-				/* take out of re-transmit chain */
-				l = &arp->rxmt;
-				for (f = *l; f; f = f->nextrxt) {
-					if (f == a) {
-						*l = a->nextrxt;
-						break;
-					}
-					l = &f->nextrxt;
-				}
-			}
+	a = arplookup(arp, ip, type);
+	if (a && (a->state == AWAIT || a->state == AOK)) {
+		if (a->state == AWAIT)
+			arpresolved(arp, a);
+		if (version == V6) {
+			/* take out of re-transmit chain */
+			unrxmt(arp, a);
+		}
+		__seq_start_write(&arp->seq);
+		a->state = AOK;
+		memmove(a->mac, mac, type->maclen);
+		a->ctime = NOW;
+		__seq_end_write(&arp->seq);
+
+		a->ifc = ifc;
+		a->ifcid = ifc->ifcid;
+		bp = a->hold;
+		a->hold = NULL;
+		if (version == V4)
+			ip += IPv4off;
+		a->utime = a->ctime;
+		qunlock(&arp->qlock);
 
-			a->ifc = ifc;
-			a->ifcid = ifc->ifcid;
-			bp = a->hold;
-			a->hold = NULL;
-			if (version == V4)
-				ip += IPv4off;
-			a->utime = NOW;
-			a->ctime = a->utime;
-			qunlock(&arp->qlock);
-
-			while (bp) {
-				next = bp->list;
-				if (ifc != NULL) {
-					rlock(&ifc->rwlock);
-					if (waserror()) {
-						runlock(&ifc->rwlock);
-						nexterror();
-					}
-					if (ifc->m != NULL)
-						ifc->m->bwrite(ifc, bp, version, ip);
-					else
-						freeb(bp);
+		while (bp) {
+			next = bp->list;
+			if (ifc != NULL) {
+				rlock(&ifc->rwlock);
+				if (waserror()) {
 					runlock(&ifc->rwlock);
-					poperror();
-				} else
+					nexterror();
+				}
+				if (ifc->m != NULL)
+					ifc->m->bwrite(ifc, bp, version, ip);
+				else
 					freeb(bp);
-				bp = next;
-			}
-			return;
+				runlock(&ifc->rwlock);
+				poperror();
+			} else
+				freeb(bp);
+			bp = next;
 		}
+		return;
 	}
 
 	if (refresh == 0) {
-		a = newarp6(arp, ip, ifc, 0);
-		a->state = AOK;
-		a->type = type;
-		a->ctime = NOW;
+		/* lock-free readers can't see it until it's AOK */
+		a = newarp6(arp, ip, ifc, 0, 0);
+		__seq_start_write(&arp->seq);
 		memmove(a->mac, mac, type->maclen);
+		a->ctime = NOW;
+		a->state = AOK;
+		__seq_end_write(&arp->seq);
 	}
 
 	qunlock(&arp->qlock);
 }
 
+/* Empties the table.  Called with arp qlocked. */
+static void arpflush(struct arp *arp)
+{
+	struct arphash *ht = arp->ht;
+	struct arpent *a;
+
+	for (int i = 0; i < (1 << ht->bits); i++) {
+		while ((a = ht->tab[i]) != NULL) {
+			while (a->hold != NULL) {
+				a->last = a->hold->list;
+				freeblist(a->hold);
+				a->hold = a->last;
+			}
+			cleanarpent(arp, a);
+		}
+	}
+	/* clear all pkts on these lists (rxmt, dropf/l) */
+	arp->rxmt = NULL;
+	arp->dropf = NULL;
+	arp->dropl = NULL;
+}
+
 int arpwrite(struct Fs *fs, char *s, long len)
 {
 	int n;
 	struct route *r;
 	struct arp *arp;
-	struct block *bp;
-	struct arpent *a, *fl, **l;
+	struct arpent *a;
 	struct medium *m;
 	char *f[4], buf[256];
 	uint8_t ip[IPaddrlen], mac[MAClen];
@@ -457,23 +647,7 @@ int arpwrite(struct Fs *fs, char *s, long len)
 	n = getfields(buf, f, 4, 1, " ");
 	if (strcmp(f[0], "flush") == 0) {
 		qlock(&arp->qlock);
-		for (a = arp->cache; a < &arp->cache[NCACHE]; a++) {
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
-			a->hash = NULL;
-			a->state = 0;
-			a->utime = 0;
-			while (a->hold != NULL) {
-				bp = a->hold->list;
-				freeblist(a->hold);
-				a->hold = bp;
-			}
-		}
-		memset(arp->hash, 0, sizeof(arp->hash));
-		/* clear all pkts on these lists (rxmt, dropf/l) */
-		arp->rxmt = NULL;
-		arp->dropf = NULL;
-		arp->dropl = NULL;
+		arpflush(arp);
 		qunlock(&arp->qlock);
 	} else if (strcmp(f[0], "add") == 0) {
 		switch (n) {
@@ -509,34 +683,13 @@ int arpwrite(struct Fs *fs, char *s, long len)
 
 		parseip(ip, f[1]);
 		qlock(&arp->qlock);
-
-		l = &arp->hash[haship(ip)];
-		for (a = *l; a; a = a->hash) {
-			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0) {
-				*l = a->hash;
+		for (a = arp->ht->tab[haship(arp->ht, ip)]; a; a = a->hash) {
+			if (memcmp(ip, a->ip, sizeof(a->ip)) == 0)
 				break;
-			}
-			l = &a->hash;
 		}
-
 		if (a) {
-			/* take out of re-transmit chain */
-			l = &arp->rxmt;
-			for (fl = *l; fl; fl = fl->nextrxt) {
-				if (fl == a) {
-					*l = a->nextrxt;
-					break;
-				}
-				l = &fl->nextrxt;
-			}
-
-			a->nextrxt = NULL;
-			a->hash = NULL;
-			a->hold = NULL;
-			a->last = NULL;
-			a->ifc = NULL;
-			memset(a->ip, 0, sizeof(a->ip));
-			memset(a->mac, 0, sizeof(a->mac));
+			drophold(arp, a);
+			cleanarpent(arp, a);
 		}
 		qunlock(&arp->qlock);
 	} else
@@ -553,6 +706,7 @@ static char *aformat = "%-6.6s %-8.8s %-40.40I %E\n";
 
 int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 {
+	struct arphash *ht;
 	struct arpent *a;
 	int n;
 	int left = len;
@@ -565,26 +719,117 @@ int arpread(struct arp *arp, char *p, uint32_t offset, int len)
 	len = len / Alinelen;
 
 	n = 0;
-	for (a = arp->cache; len > 0 && a < &arp->cache[NCACHE]; a++) {
-		if (a->state == 0)
-			continue;
-		if (offset > 0) {
-			offset--;
-			continue;
+	qlock(&arp->qlock);
+	ht = arp->ht;
+	for (int i = 0; len > 0 && i < (1 << ht->bits); i++) {
+		for (a = ht->tab[i]; len > 0 && a; a = a->hash) {
+			if (offset > 0) {
+				offset--;
+				continue;
+			}
+			len--;
+			left--;
+			amt = snprintf(p + n, left, aformat, a->type->name,
+			               arpstate[a->state], a->ip, a->mac);
+			n += amt;
+			left -= amt;
 		}
-		len--;
-		left--;
-		qlock(&arp->qlock);
-		amt = snprintf(p + n, left, aformat, a->type->name, arpstate[a->state],
-		               a->ip, a->mac);
-		n += amt;
-		left -= amt;
-		qunlock(&arp->qlock);
 	}
+	qunlock(&arp->qlock);
+
+	return n;
+}
+
+int arpstatsread(struct arp *arp, char *p, uint32_t offset, int len)
+{
+	struct arpstats t = {0}, *s;
+	char *buf = kzmalloc(READSTR, MEM_WAIT);
+	int n;
 
+	for (int i = 0; i < num_cores; i++) {
+		s = &arp->stats[i];
+		t.hits += s->hits;
+		t.misses += s->misses;
+		t.resolved += s->resolved;
+		t.rlat_usec += s->rlat_usec;
+		t.rlat_max = MAX(t.rlat_max, s->rlat_max);
+		t.expired += s->expired;
+		t.evicted += s->evicted;
+	}
+	n = snprintf(buf, READSTR, "entries: %u\nbuckets: %u\n", arp->nent,
+	             1 << arp->ht->bits);
+	n += snprintf(buf + n, READSTR - n, "hits: %llu\nmisses: %llu\n",
+	              t.hits, t.misses);
+	n += snprintf(buf + n, READSTR - n,
+	              "resolved: %llu\nresolve avg usec: %llu\nresolve max usec: %llu\n",
+	              t.resolved, t.resolved ? t.rlat_usec / t.resolved : 0,
+	              t.rlat_max);
+	n += snprintf(buf + n, READSTR - n, "expired: %llu\nevicted: %llu\n",
+	              t.expired, t.evicted);
+	n = readstr(offset, p, len, buf);
+	kfree(buf);
 	return n;
 }
 
+/* The per-entry timers: resolved entries expire ArpLife after they were last
+ * confirmed, and v4 entries give up ArpWaitLife after they started waiting.
+ * (v6 waits are timed by the re-transmit chain.)  Each sweep looks at part of
+ * the table, so one pass over a big table takes a few sweeps.  Called with
+ * arp qlocked. */
+static void arpsweep(struct arp *arp)
+{
+	struct arphash *ht = arp->ht;
+	struct arpent *a, *next;
+	unsigned int mask = (1 << ht->bits) - 1;
+	uint64_t now = NOW;
+	bool dead;
+
+	for (int i = 0; i <= mask && i < ArpSweepBuckets; i++) {
+		for (a = ht->tab[arp->hand++ & mask]; a; a = next) {
+			next = a->hash;
+			if (a->state == AOK)
+				dead = (int64_t)(now - a->ctime) > ArpLife;
+			else
+				dead = isv4(a->ip) &&
+				       tsc2msec(read_tsc() - a->wtime) > ArpWaitLife;
+			if (!dead)
+				continue;
+			drophold(arp, a);
+			cleanarpent(arp, a);
+			arp->stats[core_id()].expired++;
+		}
+	}
+}
+
+/* Runs a sweep now.  rxmitproc does this every ArpSweep ms. */
+void arpexpire(struct arp *arp)
+{
+	qlock(&arp->qlock);
+	arpsweep(arp);
+	qunlock(&arp->qlock);
+}
+
+/* Frees a table from arpcreate().  No one else may be using it. */
+void arpdestroy(struct arp *arp)
+{
+	struct arphash *ht, *old;
+	struct arpent *a;
+
+	qlock(&arp->qlock);
+	arpflush(arp);
+	qunlock(&arp->qlock);
+	while ((a = arp->free) != NULL) {
+		arp->free = a->hash;
+		kfree(a);
+	}
+	for (ht = arp->ht; ht; ht = old) {
+		old = ht->old;
+		kfree(ht);
+	}
+	kfree(arp->stats);
+	kfree(arp);
+}
+
 static uint64_t rxmitsols(struct arp *arp)
 {
 	unsigned int sflag;
@@ -699,10 +944,14 @@ static void rxmitproc(void *v)
 	}
 	for (;;) {
 		wakeupat = rxmitsols(arp);
+		if (NOW >= arp->nextsweep) {
+			arpexpire(arp);
+			arp->nextsweep = NOW + ArpSweep;
+		}
 		if (wakeupat == 0)
-			rendez_sleep(&arp->rxmtq, rxready, v);
+			rendez_sleep_timeout(&arp->rxmtq, rxready, v, ArpSweep * 1000);
 		else if (wakeupat > ReTransTimer / 4)
-			kthread_usleep(wakeupat * 1000);
+			kthread_usleep(MIN(wakeupat, ArpSweep) * 1000);
 	}
 	poperror();
 }
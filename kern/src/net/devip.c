@@ -51,6 +51,7 @@ enum {
 	Qtopdir = 1,				/* top level directory */
 	Qtopbase,
 	Qarp = Qtopbase,
+	Qarpstats,
 	Qndb,
 	Qiproute,
 	Qiprouter,
@@ -212,6 +213,10 @@ static int ip1gen(struct chan *c, int i, struct dir *dp)
 		case Qarp:
 			p = "arp";
 			break;
+		case Qarpstats:
+			p = "arpstats";
+			prot = 0444;
+			break;
 		case Qndb:
 			p = "ndb";
 			len = strlen(f->ndb);
@@ -260,6 +265,7 @@ ipgen(struct chan *c, char *unused_char_p_t, struct dirtab *d, int unused_int,
 			s -= f->np;
 			return ip1gen(c, s + Qtopbase, dp);
 		case Qarp:
+		case Qarpstats:
 		case Qndb:
 		case Qlog:
 		case Qiproute:
@@ -335,6 +341,7 @@ static struct Fs *ipgetfs(int dev)
 		rwinit(&f->rwlock);
 		qlock_init(&f->iprouter.qlock);
 		ip_init(f);
+		routeinit(f);
 		arpinit(f);
 		netloginit(f);
 		for (i = 0; ipprotoinit[i]; i++)
@@ -449,6 +456,7 @@ static struct chan *ipopen(struct chan *c, int omode)
 		case Qlocal:
 		case Qstats:
 		case Qipselftab:
+		case Qarpstats:
 			if (omode & O_WRITE)
 				error(EPERM, ERROR_FIXME);
 			break;
@@ -711,7 +719,11 @@ static void closeconv(struct conv *cv)
 	cv->rgen = 0;
 	if (cv->state == Bypass)
 		undo_proto_qio_bypass(cv);
+	zcrxclose(cv);
+	cv->busypoll = 0;
 	cv->p->close(cv);
+	cv->reuseport = 0;
+	cv->batch = 0;
 	cv->state = Idle;
 	qunlock(&cv->qlock);
 	poperror();
@@ -755,8 +767,29 @@ static void ipclose(struct chan *c)
 
 enum {
 	Statelen = 32 * 1024,
+	BusyPollMax = 10000,		/* usec */
 };
 
+static int ipbusypoll_done(void *arg)
+{
+	struct conv *c = arg;
+
+	return qcanread(c->rq) || qisclosed(c->rq);
+}
+
+/* Busy polling.  With "busypoll USEC" on its ctl, a blocking read of a conv's
+ * data file spins for up to USEC before it sleeps in qio, polling the NICs' rx
+ * rings itself and running the receive path on its own core (see
+ * etherbusypoll()).  That saves the irq, the ring's poller and our own
+ * sleep and wakeup per packet.  Only MCPs spin: their vcores have their cores to
+ * themselves, while an SCP would be burning a core someone else could use. */
+static void ipbusypoll(struct conv *c)
+{
+	if (qcanread(c->rq) || !__proc_is_mcp(current))
+		return;
+	etherbusypoll(read_tsc() + usec2tsc(c->busypoll), ipbusypoll_done, c);
+}
+
 static long ipread(struct chan *ch, void *a, long n, int64_t off)
 {
 	struct conv *c;
@@ -778,6 +811,8 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 			return devdirread(ch, a, n, 0, 0, ipgen);
 		case Qarp:
 			return arpread(f->arp, a, offset, n);
+		case Qarpstats:
+			return arpstatsread(f->arp, a, offset, n);
 		case Qndb:
 			return readstr(offset, a, n, f->ndb);
 		case Qiproute:
@@ -833,6 +868,12 @@ static long ipread(struct chan *ch, void *a, long n, int64_t off)
 			return rv;
 		case Qdata:
 			c = f->p[PROTO(ch->qid)]->conv[CONV(ch->qid)];
+			if (c->busypoll && !(ch->flag & O_NONBLOCK))
+				ipbusypoll(c);
+			if (c->zcrx)
+				return zcrx_read(c, a, n, ch->flag & O_NONBLOCK);
+			if (c->batch)
+				return udpbatchread(c, a, n, ch->flag & O_NONBLOCK);
 			if (ch->flag & O_NONBLOCK)
 				return qread_nonblock(c->rq, a, n);
 			else
@@ -879,6 +920,16 @@ static void setladdr(struct conv *c)
 	findlocalip(c->p->f, c->laddr, c->raddr);
 }
 
+/*
+ *  an announcer with reuseport may join other announced convs of the same owner
+ *  on the same laddr,lport.  iphtlook spreads new flows across the group.
+ */
+static bool canshareport(struct conv *c, struct conv *xp)
+{
+	return c->reuseport && xp->reuseport && c->state == Announcing
+	       && xp->state == Announced && strcmp(c->owner, xp->owner) == 0;
+}
+
 /*
  *  set a local port making sure the quad of raddr,rport,laddr,lport is unique
  */
@@ -902,7 +953,8 @@ static void setluniqueport(struct conv *c, int lport)
 			&& xp->lport == lport
 			&& xp->rport == c->rport
 			&& ipcmp(xp->raddr, c->raddr) == 0
-			&& ipcmp(xp->laddr, c->laddr) == 0) {
+			&& ipcmp(xp->laddr, c->laddr) == 0
+			&& !canshareport(c, xp)) {
 			qunlock(&p->qlock);
 			error(EFAIL, "address in use");
 		}
@@ -1331,6 +1383,28 @@ static void tosctlmsg(struct conv *c, struct cmdbuf *cb)
 		c->tos = atoi(cb->f[1]);
 }
 
+/* "busypoll USEC", 0 to turn it off.  See ipbusypoll(). */
+static void busypollctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	long usec;
+
+	if (cb->nf < 2)
+		error(EINVAL, "usage: busypoll usec");
+	usec = strtol(cb->f[1], 0, 0);
+	if (usec < 0 || usec > BusyPollMax)
+		error(EINVAL, "busypoll: usec must be between 0 and %d", BusyPollMax);
+	c->busypoll = usec;
+}
+
+/* "reuseport", before announce: lets several convs announce the same
+ * address and port, each with its own listen queue. */
+static void reuseportctlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	if (c->state != Idle)
+		error(EBUSY, "reuseport must come before announce");
+	c->reuseport = 1;
+}
+
 static void ttlctlmsg(struct conv *c, struct cmdbuf *cb)
 {
 	if (cb->nf < 2)
@@ -1355,6 +1429,78 @@ static void autobind(struct conv *cv)
 	kfree(cb);
 }
 
+enum {
+	SendfileBlockPages = 16,
+};
+
+/* "sendfile FD [OFFSET [LEN]]", TCP only.  Queues LEN bytes (default: to EOF)
+ * of the VFS file FD, starting at OFFSET, on c's write queue without copying
+ * them.  Each block's extra_data points at the file's page cache pages, and
+ * those page refs are held until TCP frees the block, when the data is acked.
+ * Other protocols treat the write queue as messages, so a sendfile would turn
+ * into arbitrarily cut up datagrams.
+ *
+ * Like a data write, this blocks on flow control, so it runs without the conv
+ * qlock. */
+static void sendfilectlmsg(struct conv *c, struct cmdbuf *cb)
+{
+	ERRSTACK(1);
+	struct file *file;
+	struct page *page;
+	struct block *volatile b = NULL;	/* volatile for the waserror */
+	struct block *tmp;
+	off64_t off, size;
+	size_t len, amt, pg_off;
+	int fd, ret;
+
+	if (cb->nf < 2 || cb->nf > 4)
+		error(EINVAL, "usage: sendfile fd [offset [len]]");
+	if (c->p->ipproto != TCP)
+		error(ENOTSUP, "sendfile: %s is not a stream protocol", c->p->name);
+#ifndef CONFIG_BLOCK_EXTRAS
+	error(ENOTSUP, "sendfile needs CONFIG_BLOCK_EXTRAS");
+#endif
+	fd = atoi(cb->f[1]);
+	off = cb->nf > 2 ? strtoul(cb->f[2], 0, 0) : 0;
+	file = get_file_from_fd(&current->open_files, fd);
+	if (!file)
+		error(EBADF, "sendfile: fd %d is not a file", fd);
+	if (waserror()) {
+		freeb(b);
+		kref_put(&file->f_kref);
+		nexterror();
+	}
+	if (!(file->f_flags & O_READ) || !file->f_mapping)
+		error(EBADF, "sendfile: fd %d is not readable", fd);
+	size = file->f_dentry->d_inode->i_size;
+	len = off < size ? size - off : 0;
+	if (cb->nf > 3)
+		len = MIN(len, strtoul(cb->f[3], 0, 0));
+	while (len) {
+		b = block_alloc(0, MEM_WAIT);
+		for (int i = 0; i < SendfileBlockPages && len; i++) {
+			ret = pm_load_page(file->f_mapping, off >> PGSHIFT, &page);
+			if (ret)
+				error(-ret, "sendfile: can't load page %lu", off >> PGSHIFT);
+			pg_off = PGOFF(off);
+			amt = MIN(len, PGSIZE - pg_off);
+			/* the block owns the page's slot ref now */
+			if (block_append_extra_flags(b, (uintptr_t)page2kva(page), pg_off,
+			                             amt, EBD_PAGEMAP, MEM_WAIT)) {
+				pm_put_page(page);
+				error(ENOMEM, ERROR_FIXME);
+			}
+			off += amt;
+			len -= amt;
+		}
+		tmp = b;
+		b = NULL;
+		qbwrite(c->wq, tmp);
+	}
+	poperror();
+	kref_put(&file->f_kref);
+}
+
 static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 {
 	ERRSTACK(1);
@@ -1379,6 +1525,8 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 			 * binding. */
 			if (c->lport == 0)
 				autobind(c);
+			if (c->batch)
+				return udpbatchwrite(c, a, n, ch->flag & O_NONBLOCK);
 			if (ch->flag & O_NONBLOCK)
 				qwrite_nonblock(c->wq, a, n);
 			else
@@ -1397,6 +1545,16 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 			x = f->p[PROTO(ch->qid)];
 			c = x->conv[CONV(ch->qid)];
 			cb = parsecmd(a, n);
+			if (cb->nf && strcmp(cb->f[0], "sendfile") == 0) {
+				if (waserror()) {
+					kfree(cb);
+					nexterror();
+				}
+				sendfilectlmsg(c, cb);
+				poperror();
+				kfree(cb);
+				break;
+			}
 
 			qlock(&c->qlock);
 			if (waserror()) {
@@ -1422,6 +1580,14 @@ static long ipwrite(struct chan *ch, void *v, long n, int64_t off)
 				tosctlmsg(c, cb);
 			else if (strcmp(cb->f[0], "ignoreadvice") == 0)
 				c->ignoreadvice = 1;
+			else if (strcmp(cb->f[0], "busypoll") == 0)
+				busypollctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "reuseport") == 0)
+				reuseportctlmsg(c, cb);
+			else if (strcmp(cb->f[0], "zcrecv") == 0)
+				zcrxctl(c, cb->f, cb->nf);
+			else if (strcmp(cb->f[0], "zcrelease") == 0)
+				zcrxrelease(c, cb->f, cb->nf);
 			else if (strcmp(cb->f[0], "addmulti") == 0) {
 				if (cb->nf < 2)
 					error(EFAIL, "addmulti needs interface address");
@@ -1723,6 +1889,10 @@ retry:
 	c->restricted = 0;
 	c->ttl = MAXTTL;
 	c->tos = DFLTTOS;
+	c->busypoll = 0;
+	c->reuseport = 0;
+	c->batch = 0;
+	atomic_set(&c->tx_inflight, 0);
 	qreopen(c->rq);
 	qreopen(c->wq);
 	qreopen(c->eq);
@@ -457,7 +457,10 @@ static void etherread4(void *a)
 			freeb(bp);
 		} else {
 			ipifc_trace_block(ifc, bp);
-			ipiput4(er->f, ifc, bp);
+			if (ifc->rps)
+				rps_input(er->f, ifc, bp);
+			else
+				ipiput4(er->f, ifc, bp);
 		}
 		runlock(&ifc->rwlock);
 		poperror();
@@ -500,7 +503,10 @@ static void etherread6(void *a)
 			freeb(bp);
 		} else {
 			ipifc_trace_block(ifc, bp);
-			ipiput6(er->f, ifc, bp);
+			if (ifc->rps)
+				rps_input(er->f, ifc, bp);
+			else
+				ipiput6(er->f, ifc, bp);
 		}
 		runlock(&ifc->rwlock);
 		poperror();
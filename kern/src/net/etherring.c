@@ -0,0 +1,335 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Packet rings for #ether netfiles.
+ *
+ * "ring VA NPAGES [FRAMESZ]" on a type's ctl swaps the process's anonymous
+ * pages at VA for kernel pages (lend_kpage()) laid out as in ros/net.h.  From
+ * then on etheriq() copies that type's packets straight into the next rx frame
+ * instead of cloning a block onto f->in, and a write to the data file drains
+ * the tx frames.  User space polls the indices; there's no per-packet syscall,
+ * block, or queue.
+ *
+ * We only ever trust our own copies of the indices we produce (rx_prod and
+ * tx_cons).  The ones the user produces are sanity checked on every read.
+ *
+ * A netfile's etherring is allocated on the first "ring" and lives as long as
+ * the netfile, so etheriq() can look at f->ring without a reference.  Turning
+ * the ring off only frees the pages, with both locks held. */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <umem.h>
+#include <mm.h>
+#include <process.h>
+#include <page_alloc.h>
+#include <rendez.h>
+#include <ip.h>
+#include <ros/net.h>
+
+enum {
+	EtherRingMaxPages = 16384,
+	EtherRingFrameSz = 2048,
+};
+
+struct etherring {
+	spinlock_t lock;			/* rx producer, and kva/hdr */
+	qlock_t txlock;				/* tx consumer */
+	struct rendez rv;
+	atomic_t sleepers;
+	struct proc *p;
+	uintptr_t va;
+	int npages;
+	uint8_t *kva;				/* NULL when the ring is off */
+	struct ether_ring_hdr *hdr;
+	uint8_t *rx;
+	uint8_t *tx;
+	uint32_t nr_frames;
+	uint32_t frame_sz;
+	uint32_t rx_prod;
+	uint32_t tx_cons;
+	uint64_t rx_drops;
+};
+
+static struct ether_frame *ring_frame(struct etherring *r, uint8_t *base,
+                                      uint32_t idx)
+{
+	return (struct ether_frame*)(base + (idx & (r->nr_frames - 1)) *
+	                             r->frame_sz);
+}
+
+static size_t frame_room(struct etherring *r)
+{
+	return r->frame_sz - offsetof(struct ether_frame, data);
+}
+
+/* Copies bp's packet to buf without consuming it; bp may still go elsewhere. */
+static void ring_copy_block(uint8_t *buf, struct block *bp)
+{
+	struct extra_bdata *ebd;
+
+	for (; bp; bp = bp->next) {
+		memcpy(buf, bp->rp, BHLEN(bp));
+		buf += BHLEN(bp);
+		for (int i = 0; i < bp->nr_extra_bufs; i++) {
+			ebd = &bp->extra_data[i];
+			if (!ebd->base || !ebd->len)
+				continue;
+			memcpy(buf, (void*)(ebd->base + ebd->off), ebd->len);
+			buf += ebd->len;
+		}
+	}
+}
+
+/* Gives back the pages in [0, npages).  Called with both locks held, or before
+ * anyone else could see the pages. */
+static void ring_unlend(struct etherring *r, uint8_t *kva, int npages)
+{
+	for (int i = 0; i < npages; i++)
+		reclaim_kpage(r->p, r->va + i * PGSIZE, kva + i * PGSIZE);
+}
+
+bool etherring_on(struct netfile *f)
+{
+	struct etherring *r = f->ring;
+
+	return r && ACCESS_ONCE(r->kva);
+}
+
+/* Called from etheriq() for every packet f wants.  Returns FALSE if f isn't in
+ * ring mode, in which case the caller queues bp as usual.  bp is never
+ * consumed. */
+bool etherring_rx(struct netfile *f, struct block *bp)
+{
+	struct etherring *r = f->ring;
+	struct ether_frame *fr;
+	size_t len;
+
+	if (!r || !ACCESS_ONCE(r->kva))
+		return FALSE;
+	spin_lock_irqsave(&r->lock);
+	if (!r->kva) {
+		spin_unlock_irqsave(&r->lock);
+		return FALSE;
+	}
+	len = blocklen(bp);
+	if (len > frame_room(r) ||
+	    r->rx_prod - ACCESS_ONCE(r->hdr->rx_cons) >= r->nr_frames) {
+		r->hdr->rx_drops = ++r->rx_drops;
+		spin_unlock_irqsave(&r->lock);
+		return TRUE;
+	}
+	fr = ring_frame(r, r->rx, r->rx_prod);
+	ring_copy_block(fr->data, bp);
+	fr->len = len;
+	fr->flags = 0;
+	wmb();
+	r->hdr->rx_prod = ++r->rx_prod;
+	spin_unlock_irqsave(&r->lock);
+	/* Pairs with the atomic_inc in etherring_read(). */
+	mb();
+	if (atomic_read(&r->sleepers))
+		rendez_wakeup(&r->rv);
+	return TRUE;
+}
+
+/* ring_off() can free the header under us, so look at it under the lock. */
+static int ring_rx_ready(void *arg)
+{
+	struct etherring *r = arg;
+	int ready;
+
+	spin_lock_irqsave(&r->lock);
+	ready = !r->kva || r->rx_prod != ACCESS_ONCE(r->hdr->rx_cons);
+	spin_unlock_irqsave(&r->lock);
+	return ready;
+}
+
+/* Blocks until there are rx frames, and returns how many as a uint32_t. */
+long etherring_read(struct netfile *f, void *va, long n)
+{
+	ERRSTACK(1);
+	struct etherring *r = f->ring;
+	uint32_t ready = 0;
+
+	if (n < sizeof(uint32_t))
+		error(EINVAL, "ring reads need room for a uint32_t");
+	atomic_inc(&r->sleepers);
+	if (waserror()) {
+		atomic_dec(&r->sleepers);
+		nexterror();
+	}
+	rendez_sleep(&r->rv, ring_rx_ready, r);
+	poperror();
+	atomic_dec(&r->sleepers);
+	spin_lock_irqsave(&r->lock);
+	if (r->kva)
+		ready = r->rx_prod - ACCESS_ONCE(r->hdr->rx_cons);
+	spin_unlock_irqsave(&r->lock);
+	if (ready > r->nr_frames)
+		error(EINVAL, "ring rx_cons is past rx_prod");
+	memcpy(va, &ready, sizeof(uint32_t));
+	return sizeof(uint32_t);
+}
+
+/* Returns a block holding the next tx frame, or NULL once we've caught up with
+ * tx_prod.  Frames that are empty or longer than maxlen are skipped.  Called
+ * by the tx doorbell in ether.c, which owns the blocks we return. */
+struct block *etherring_tx(struct netfile *f, size_t maxlen)
+{
+	ERRSTACK(1);
+	struct etherring *r = f->ring;
+	struct ether_frame *fr;
+	struct block *bp = NULL;
+	uint32_t prod, len;
+
+	qlock(&r->txlock);
+	if (waserror()) {
+		qunlock(&r->txlock);
+		nexterror();
+	}
+	if (!r->kva)
+		error(EINVAL, "ring is off");
+	prod = ACCESS_ONCE(r->hdr->tx_prod);
+	if (prod - r->tx_cons > r->nr_frames)
+		error(EINVAL, "ring tx_prod is more than a ring past tx_cons");
+	while (prod != r->tx_cons) {
+		fr = ring_frame(r, r->tx, r->tx_cons);
+		len = ACCESS_ONCE(fr->len);
+		if (len >= ETHERHDRSIZE && len <= MIN(maxlen, frame_room(r))) {
+			bp = block_alloc(len, MEM_WAIT);
+			memcpy(bp->wp, fr->data, len);
+			bp->wp += len;
+		}
+		r->hdr->tx_cons = ++r->tx_cons;
+		if (bp)
+			break;
+	}
+	poperror();
+	qunlock(&r->txlock);
+	return bp;
+}
+
+/* Turns the ring off, if it's on.  Sleeping readers wake up and see it off.
+ * Anyone who looks at the pages does so under a lock and checks kva first, so
+ * once kva is NULL and we hold both locks, we can free them. */
+static void ring_off(struct etherring *r)
+{
+	uint8_t *kva;
+
+	qlock(&r->txlock);
+	spin_lock_irqsave(&r->lock);
+	kva = r->kva;
+	r->kva = NULL;
+	r->hdr = NULL;
+	spin_unlock_irqsave(&r->lock);
+	rendez_wakeup(&r->rv);
+	if (kva) {
+		ring_unlend(r, kva, r->npages);
+		kpages_free(kva, r->npages * PGSIZE);
+		proc_decref(r->p);
+		r->p = NULL;
+	}
+	qunlock(&r->txlock);
+}
+
+/* "ring VA NPAGES [FRAMESZ]" or "ring off".  Called with the nif qlocked. */
+void etherringctl(struct netfile *f, char *p)
+{
+	ERRSTACK(1);
+	struct cmdbuf *cb;
+	struct etherring *r;
+	uintptr_t va;
+	long npages, frame_sz = EtherRingFrameSz;
+	uint32_t nr_frames;
+	uint8_t *kva;
+
+	cb = parsecmd(p, strlen(p));
+	if (waserror()) {
+		kfree(cb);
+		nexterror();
+	}
+	if (cb->nf == 1 && !strcmp(cb->f[0], "off")) {
+		if (f->ring)
+			ring_off(f->ring);
+		poperror();
+		kfree(cb);
+		return;
+	}
+	if (cb->nf != 2 && cb->nf != 3)
+		error(EINVAL, "usage: ring va npages [framesz] | ring off");
+	if (etherring_on(f))
+		error(EBUSY, "ring is already on");
+	va = strtoul(cb->f[0], 0, 0);
+	npages = strtol(cb->f[1], 0, 0);
+	if (cb->nf == 3)
+		frame_sz = strtol(cb->f[2], 0, 0);
+	if (PGOFF(va) || npages < 2 || npages > EtherRingMaxPages)
+		error(EINVAL, "ring: va must be page aligned, 2 <= npages <= %d",
+		      EtherRingMaxPages);
+	if (!IS_PWR2(frame_sz) || frame_sz < 128 || frame_sz > 16 * PGSIZE)
+		error(EINVAL, "ring: framesz must be a power of two, 128 to %d",
+		      16 * PGSIZE);
+	if (((npages - 1) * PGSIZE) / frame_sz < 4)
+		error(EINVAL, "ring: need room for at least two frames a side");
+	if (!is_user_rwaddr((void*)va, npages * PGSIZE))
+		error(EFAULT, "ring: bad address");
+	nr_frames = ROUNDDOWNPWR2(((npages - 1) * PGSIZE) / frame_sz / 2);
+
+	if (!f->ring) {
+		r = kzmalloc(sizeof(struct etherring), MEM_WAIT);
+		spinlock_init_irqsave(&r->lock);
+		qlock_init(&r->txlock);
+		rendez_init(&r->rv);
+		f->ring = r;
+	}
+	r = f->ring;
+	kva = kpages_zalloc(npages * PGSIZE, MEM_WAIT);
+	r->p = current;
+	r->va = va;
+	for (int i = 0; i < npages; i++) {
+		if (lend_kpage(current, va + i * PGSIZE, kva + i * PGSIZE)) {
+			ring_unlend(r, kva, i);
+			kpages_free(kva, npages * PGSIZE);
+			r->p = NULL;
+			error(EINVAL, "ring: va must be private, anonymous memory");
+		}
+	}
+	proc_incref(current, 1);
+	r->npages = npages;
+	r->hdr = (struct ether_ring_hdr*)kva;
+	r->rx = kva + PGSIZE;
+	r->tx = r->rx + nr_frames * frame_sz;
+	r->nr_frames = nr_frames;
+	r->frame_sz = frame_sz;
+	r->rx_prod = 0;
+	r->tx_cons = 0;
+	r->rx_drops = 0;
+	r->hdr->nr_frames = nr_frames;
+	r->hdr->frame_sz = frame_sz;
+	r->hdr->rx_off = r->rx - kva;
+	r->hdr->tx_off = r->tx - kva;
+	spin_lock_irqsave(&r->lock);
+	r->kva = kva;
+	spin_unlock_irqsave(&r->lock);
+	poperror();
+	kfree(cb);
+}
+
+/* Called when the last user of f closes. */
+void etherringclose(struct netfile *f)
+{
+	if (f->ring)
+		ring_off(f->ring);
+}
@@ -42,8 +42,6 @@
 
 typedef struct Ip4hdr Ip4hdr;
 typedef struct IP IP;
-typedef struct Fragment4 Fragment4;
-typedef struct Fragment6 Fragment6;
 typedef struct Ipfrag Ipfrag;
 
 enum {
@@ -97,41 +95,14 @@ enum {
 	Nstats,
 };
 
-struct fragment4 {
-	struct block *blist;
-	struct fragment4 *next;
-	uint32_t src;
-	uint32_t dst;
-	uint16_t id;
-	uint64_t age;
-};
-
-struct fragment6 {
-	struct block *blist;
-	struct fragment6 *next;
-	uint8_t src[IPaddrlen];
-	uint8_t dst[IPaddrlen];
-	unsigned int id;
-	uint64_t age;
-};
-
-struct Ipfrag {
-	uint16_t foff;
-	uint16_t flen;
-};
-
 /* an instance of IP */
 struct IP {
-	uint32_t stats[Nstats];
+	struct percpu_ctrs stats;	/* [Nstats] */
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct fraghash *frag4;		/* reassembly queues, see ipfrag.c */
 	int id4;
 
-	qlock_t fraglock6;
-	struct fragment6 *flisthead6;
-	struct fragment6 *fragfree6;
+	struct fraghash *frag6;
 	int id6;
 
 	int iprouting;				/* true if we route like a gateway */
@@ -160,17 +131,10 @@ static char *statnames[] = {
 };
 
 #define BLKIP(xp)	((struct Ip4hdr*)((xp)->rp))
-/*
- * This sleazy macro relies on the media header size being
- * larger than sizeof(Ipfrag). ipreassemble checks this is true
- */
-#define BKFG(xp)	((struct Ipfrag*)((xp)->base))
 
 uint16_t ipcsum(uint8_t * unused_uint8_p_t);
 struct block *ip4reassemble(struct IP *, int unused_int,
 							struct block *, struct Ip4hdr *);
-void ipfragfree4(struct IP *, struct fragment4 *);
-struct fragment4 *ipfragallo4(struct IP *);
 
 void ip_init_6(struct Fs *f)
 {
@@ -196,42 +160,14 @@ void ip_init_6(struct Fs *f)
 
 }
 
-void initfrag(struct IP *ip, int size)
-{
-	struct fragment4 *fq4, *eq4;
-	struct fragment6 *fq6, *eq6;
-
-	ip->fragfree4 =
-		(struct fragment4 *)kzmalloc(sizeof(struct fragment4) * size, 0);
-	if (ip->fragfree4 == NULL)
-		panic("initfrag");
-
-	eq4 = &ip->fragfree4[size];
-	for (fq4 = ip->fragfree4; fq4 < eq4; fq4++)
-		fq4->next = fq4 + 1;
-
-	ip->fragfree4[size - 1].next = NULL;
-
-	ip->fragfree6 =
-		(struct fragment6 *)kzmalloc(sizeof(struct fragment6) * size, 0);
-	if (ip->fragfree6 == NULL)
-		panic("initfrag");
-
-	eq6 = &ip->fragfree6[size];
-	for (fq6 = ip->fragfree6; fq6 < eq6; fq6++)
-		fq6->next = fq6 + 1;
-
-	ip->fragfree6[size - 1].next = NULL;
-}
-
 void ip_init(struct Fs *f)
 {
 	struct IP *ip;
 
 	ip = kzmalloc(sizeof(struct IP), 0);
-	qlock_init(&ip->fraglock4);
-	qlock_init(&ip->fraglock6);
-	initfrag(ip, 100);
+	percpu_ctrs_init(&ip->stats, Nstats, MEM_WAIT);
+	ip->frag4 = fraghash_alloc();
+	ip->frag6 = fraghash_alloc();
 	f->ip = ip;
 
 	ip_init_6(f);
@@ -241,9 +177,9 @@ void iprouting(struct Fs *f, int on)
 {
 	f->ip->iprouting = on;
 	if (f->ip->iprouting == 0)
-		f->ip->stats[Forwarding] = 2;
+		percpu_ctr_set(&f->ip->stats, Forwarding, 2);
 	else
-		f->ip->stats[Forwarding] = 1;
+		percpu_ctr_set(&f->ip->stats, Forwarding, 1);
 }
 
 int
@@ -266,7 +202,7 @@ ipoput4(struct Fs *f,
 	/* Fill out the ip header */
 	eh = (struct Ip4hdr *)(bp->rp);
 
-	ip->stats[OutRequests]++;
+	percpu_ctr_inc(&ip->stats, OutRequests);
 
 	/* Number of uint8_ts in data and ip header to write */
 	len = blocklen(bp);
@@ -274,7 +210,7 @@ ipoput4(struct Fs *f,
 	if (gating) {
 		chunk = nhgets(eh->length);
 		if (chunk > len) {
-			ip->stats[OutDiscards]++;
+			percpu_ctr_inc(&ip->stats, OutDiscards);
 			netlog(f, Logip, "short gated packet\n");
 			goto free;
 		}
@@ -282,14 +218,14 @@ ipoput4(struct Fs *f,
 			len = chunk;
 	}
 	if (len >= IP_MAX) {
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		netlog(f, Logip, "exceeded ip max size %V\n", eh->dst);
 		goto free;
 	}
 
 	r = v4lookup(f, eh->dst, c);
 	if (r == NULL) {
-		ip->stats[OutNoRoutes]++;
+		percpu_ctr_inc(&ip->stats, OutNoRoutes);
 		netlog(f, Logip, "no interface %V\n", eh->dst);
 		rv = -1;
 		goto free;
@@ -344,8 +280,8 @@ ipoput4(struct Fs *f,
 		printd("%V: DF set\n", eh->dst);
 
 	if (eh->frag[0] & (IP_DF >> 8)) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, FragFails);
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		icmpcantfrag(f, bp, medialen);
 		netlog(f, Logip, "%V: eh->frag[0] & (IP_DF>>8)\n", eh->dst);
 		goto raise;
@@ -353,8 +289,8 @@ ipoput4(struct Fs *f,
 
 	seglen = (medialen - IP4HDR) & ~7;
 	if (seglen < 8) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, FragFails);
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		netlog(f, Logip, "%V seglen < 8\n", eh->dst);
 		goto raise;
 	}
@@ -403,9 +339,9 @@ ipoput4(struct Fs *f,
 		feh->cksum[1] = 0;
 		hnputs(feh->cksum, ipcsum(&feh->vihl));
 		ifc->m->bwrite(ifc, nb, V4, gate);
-		ip->stats[FragCreates]++;
+		percpu_ctr_inc(&ip->stats, FragCreates);
 	}
-	ip->stats[FragOKs]++;
+	percpu_ctr_inc(&ip->stats, FragOKs);
 raise:
 	runlock(&ifc->rwlock);
 	poperror();
@@ -433,7 +369,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	}
 
 	ip = f->ip;
-	ip->stats[InReceives]++;
+	percpu_ctr_inc(&ip->stats, InReceives);
 
 	/*
 	 *  Ensure we have all the header info in the first
@@ -455,7 +391,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 
 	/* dump anything that whose header doesn't checksum */
 	if ((bp->flag & Bipck) == 0 && ipcsum(&h->vihl)) {
-		ip->stats[InHdrErrors]++;
+		percpu_ctr_inc(&ip->stats, InHdrErrors);
 		netlog(f, Logip, "ip: checksum error %V\n", h->src);
 		freeblist(bp);
 		return;
@@ -467,7 +403,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	if ((h->vihl & 0x0F) != IP_HLEN4) {
 		hl = (h->vihl & 0xF) << 2;
 		if (hl < (IP_HLEN4 << 2)) {
-			ip->stats[InHdrErrors]++;
+			percpu_ctr_inc(&ip->stats, InHdrErrors);
 			netlog(f, Logip, "ip: %V bad hivl 0x%x\n", h->src, h->vihl);
 			freeblist(bp);
 			return;
@@ -497,7 +433,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		conv.r = NULL;
 		r = v4lookup(f, h->dst, &conv);
 		if (r == NULL || r->rt.ifc == ifc) {
-			ip->stats[OutDiscards]++;
+			percpu_ctr_inc(&ip->stats, OutDiscards);
 			freeblist(bp);
 			return;
 		}
@@ -505,7 +441,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		/* don't forward if packet has timed out */
 		hop = h->ttl;
 		if (hop < 1) {
-			ip->stats[InHdrErrors]++;
+			percpu_ctr_inc(&ip->stats, InHdrErrors);
 			icmpttlexceeded(f, ifc->lifc->local, bp);
 			freeblist(bp);
 			return;
@@ -527,7 +463,7 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 			}
 		}
 
-		ip->stats[ForwDatagrams]++;
+		percpu_ctr_inc(&ip->stats, ForwDatagrams);
 		tos = h->tos;
 		hop = h->ttl;
 		ipoput4(f, bp, 1, hop - 1, tos, &conv);
@@ -552,12 +488,12 @@ void ipiput4(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	proto = h->proto;
 	p = Fsrcvpcol(f, proto);
 	if (p != NULL && p->rcv != NULL) {
-		ip->stats[InDelivers]++;
+		percpu_ctr_inc(&ip->stats, InDelivers);
 		(*p->rcv) (p, ifc, bp);
 		return;
 	}
-	ip->stats[InDiscards]++;
-	ip->stats[InUnknownProtos]++;
+	percpu_ctr_inc(&ip->stats, InDiscards);
+	percpu_ctr_inc(&ip->stats, InUnknownProtos);
 	freeblist(bp);
 }
 
@@ -566,228 +502,46 @@ int ipstats(struct Fs *f, char *buf, int len)
 	struct IP *ip;
 	char *p, *e;
 	int i;
+	struct fragstats fst = {0};
 
 	ip = f->ip;
-	ip->stats[DefaultTTL] = MAXTTL;
+	percpu_ctr_set(&ip->stats, DefaultTTL, MAXTTL);
+	fraghash_stats(ip->frag4, &fst);
+	fraghash_stats(ip->frag6, &fst);
+	percpu_ctr_set(&ip->stats, ReasmTimeout, fst.timeouts);
+	percpu_ctr_set(&ip->stats, ReasmReqds, fst.reqds);
+	percpu_ctr_set(&ip->stats, ReasmOKs, fst.oks);
+	percpu_ctr_set(&ip->stats, ReasmFails, fst.fails);
 
 	p = buf;
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
-		p = seprintf(p, e, "%s: %u\n", statnames[i], ip->stats[i]);
+		p = seprintf(p, e, "%s: %llu\n", statnames[i],
+		             percpu_ctr_sum(&ip->stats, i));
 	return p - buf;
 }
 
+/* offset is the frag field of the header, and ih->tos is set if there are more
+ * fragments. */
 struct block *ip4reassemble(struct IP *ip, int offset, struct block *bp,
 							struct Ip4hdr *ih)
 {
-	int fend;
-	uint16_t id;
-	struct fragment4 *f, *fnext;
-	uint32_t src, dst;
-	struct block *bl, **l, *last, *prev;
-	int ovlap, len, fragsize, pktposn;
-
-	src = nhgetl(ih->src);
-	dst = nhgetl(ih->dst);
-	id = nhgets(ih->id);
-
-	/*
-	 *  block lists are too hard, pullupblock into a single block
-	 */
-	if (bp->next) {
-		bp = pullupblock(bp, blocklen(bp));
-		ih = (struct Ip4hdr *)(bp->rp);
-	}
-
-	qlock(&ip->fraglock4);
-
-	/*
-	 *  find a reassembly queue for this fragment
-	 */
-	for (f = ip->flisthead4; f; f = fnext) {
-		fnext = f->next;	/* because ipfragfree4 changes the list */
-		if (f->src == src && f->dst == dst && f->id == id)
-			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree4(ip, f);
-		}
-	}
-
-	/*
-	 *  if this isn't a fragmented packet, accept it
-	 *  and get rid of any fragments that might go
-	 *  with it.
-	 */
-	if (!ih->tos && (offset & ~(IP_MF | IP_DF)) == 0) {
-		if (f != NULL) {
-			ipfragfree4(ip, f);
-			ip->stats[ReasmFails]++;
-		}
-		qunlock(&ip->fraglock4);
-		return bp;
-	}
-
-	if (bp->base + sizeof(struct Ipfrag) >= bp->rp) {
-		bp = padblock(bp, sizeof(struct Ipfrag));
-		bp->rp += sizeof(struct Ipfrag);
-	}
-
-	BKFG(bp)->foff = offset << 3;
-	BKFG(bp)->flen = nhgets(ih->length) - IP4HDR;
-
-	/* First fragment allocates a reassembly queue */
-	if (f == NULL) {
-		f = ipfragallo4(ip);
-		f->id = id;
-		f->src = src;
-		f->dst = dst;
-
-		f->blist = bp;
+	uint8_t src[IPaddrlen], dst[IPaddrlen];
+	struct Ipfrag fg;
+	int len;
 
-		qunlock(&ip->fraglock4);
-		ip->stats[ReasmReqds]++;
+	v4tov6(src, ih->src);
+	v4tov6(dst, ih->dst);
+	fg.foff = (offset & ~(IP_MF | IP_DF)) << 3;
+	fg.flen = nhgets(ih->length) - IP4HDR;
+	fg.hlen = IP4HDR;
+	fg.last = !ih->tos;
+	bp = ipfragadd(ip->frag4, bp, &fg, src, dst, nhgets(ih->id), ih->proto,
+	               &len);
+	if (bp == NULL)
 		return NULL;
-	}
-
-	/*
-	 *  find the new fragment's position in the queue
-	 */
-	prev = NULL;
-	l = &f->blist;
-	bl = f->blist;
-	while (bl != NULL && BKFG(bp)->foff > BKFG(bl)->foff) {
-		prev = bl;
-		l = &bl->next;
-		bl = bl->next;
-	}
-
-	/* Check overlap of a previous fragment - trim away as necessary */
-	if (prev) {
-		ovlap = BKFG(prev)->foff + BKFG(prev)->flen - BKFG(bp)->foff;
-		if (ovlap > 0) {
-			if (ovlap >= BKFG(bp)->flen) {
-				freeblist(bp);
-				qunlock(&ip->fraglock4);
-				return NULL;
-			}
-			BKFG(prev)->flen -= ovlap;
-		}
-	}
-
-	/* Link onto assembly queue */
-	bp->next = *l;
-	*l = bp;
-
-	/* Check to see if succeeding segments overlap */
-	if (bp->next) {
-		l = &bp->next;
-		fend = BKFG(bp)->foff + BKFG(bp)->flen;
-		/* Take completely covered segments out */
-		while (*l) {
-			ovlap = fend - BKFG(*l)->foff;
-			if (ovlap <= 0)
-				break;
-			if (ovlap < BKFG(*l)->flen) {
-				BKFG(*l)->flen -= ovlap;
-				BKFG(*l)->foff += ovlap;
-				/* move up ih hdrs */
-				memmove((*l)->rp + ovlap, (*l)->rp, IP4HDR);
-				(*l)->rp += ovlap;
-				break;
-			}
-			last = (*l)->next;
-			(*l)->next = NULL;
-			freeblist(*l);
-			*l = last;
-		}
-	}
-
-	/*
-	 *  look for a complete packet.  if we get to a fragment
-	 *  without IP_MF set, we're done.
-	 */
-	pktposn = 0;
-	for (bl = f->blist; bl; bl = bl->next) {
-		if (BKFG(bl)->foff != pktposn)
-			break;
-		if ((BLKIP(bl)->frag[0] & (IP_MF >> 8)) == 0) {
-			bl = f->blist;
-			len = nhgets(BLKIP(bl)->length);
-			bl->wp = bl->rp + len;
-
-			/* Pullup all the fragment headers and
-			 * return a complete packet
-			 */
-			for (bl = bl->next; bl; bl = bl->next) {
-				fragsize = BKFG(bl)->flen;
-				len += fragsize;
-				bl->rp += IP4HDR;
-				bl->wp = bl->rp + fragsize;
-			}
-
-			bl = f->blist;
-			f->blist = NULL;
-			ipfragfree4(ip, f);
-			ih = BLKIP(bl);
-			hnputs(ih->length, len);
-			qunlock(&ip->fraglock4);
-			ip->stats[ReasmOKs]++;
-			return bl;
-		}
-		pktposn += BKFG(bl)->flen;
-	}
-	qunlock(&ip->fraglock4);
-	return NULL;
-}
-
-/*
- * ipfragfree4 - Free a list of fragments - assume hold fraglock4
- */
-void ipfragfree4(struct IP *ip, struct fragment4 *frag)
-{
-	struct fragment4 *fl, **l;
-
-	if (frag->blist)
-		freeblist(frag->blist);
-
-	frag->src = 0;
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead4;
-	for (fl = *l; fl; fl = fl->next) {
-		if (fl == frag) {
-			*l = frag->next;
-			break;
-		}
-		l = &fl->next;
-	}
-
-	frag->next = ip->fragfree4;
-	ip->fragfree4 = frag;
-
-}
-
-/*
- * ipfragallo4 - allocate a reassembly queue - assume hold fraglock4
- */
-struct fragment4 *ipfragallo4(struct IP *ip)
-{
-	struct fragment4 *f;
-
-	while (ip->fragfree4 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead4; f->next; f = f->next) ;
-		ipfragfree4(ip, f);
-	}
-	f = ip->fragfree4;
-	ip->fragfree4 = f->next;
-	f->next = ip->flisthead4;
-	ip->flisthead4 = f;
-	f->age = NOW + 30000;
-
-	return f;
+	hnputs(BLKIP(bp)->length, IP4HDR + len);
+	return bp;
 }
 
 /* coreboot.c among other things needs this
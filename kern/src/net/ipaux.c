@@ -288,7 +288,7 @@ uint16_t ptclcsum_one(struct block *bp, int offset, int len)
 				continue;
 		}
 		x = MIN(len, ebd->len - boff);
-		addr = (void *)(ebd->base + ebd->off);
+		addr = (void *)(ebd->base + ebd->off + boff);
 		if (odd)
 			hisum += ptclbsum(addr, x);
 		else
@@ -357,6 +357,30 @@ uint16_t ptclcsum(struct block *bp, int offset, int len)
 	return ~losum & 0xffff;
 }
 
+/* Linearizes bp for devices that can't do scatter-gather.  If the packet also
+ * needs its transport checksum done in software, we compute it while we copy
+ * instead of making a second pass over the data in ptclcsum_finalize(). */
+struct block *ptclcsum_linearize(struct block *bp, unsigned int feat)
+{
+	unsigned int flag = bp->flag & BCKSUM_FLAGS;
+	struct block *newb;
+	uint16_t csum;
+
+	if (!bp->extra_len || !flag || (flag & feat) == flag) {
+		bp = linearizeblock(bp);
+		ptclcsum_finalize(bp, feat);
+		return bp;
+	}
+	/* NOTE the pseudo-header partial checksum is already in the packet, past
+	 * checksum_start, so it is part of the sum, just like in finalize. */
+	newb = copyblock_csum(bp, bp->checksum_start, &csum, MEM_WAIT);
+	freeb(bp);
+	hnputs(newb->rp + newb->checksum_start + newb->checksum_offset,
+	       ~csum & 0xffff);
+	newb->flag &= ~BCKSUM_FLAGS;
+	return newb;
+}
+
 enum {
 	Isprefix = 16,
 };
@@ -594,6 +618,71 @@ int parsemac(uint8_t * to, char *from, int len)
 	return i;
 }
 
+/* The well-known default RSS key, so that our software flow hash matches what
+ * most NICs compute in hardware. */
+uint8_t rss_default_key[RSS_KEY_LEN] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+	0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+	0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/* Toeplitz hash of len bytes of data, as used by RSS.  The key must be at least
+ * len + 4 bytes long. */
+uint32_t toeplitz_hash(uint8_t *key, uint8_t *data, int len)
+{
+	uint32_t hash = 0, v;
+
+	v = (key[0] << 24) | (key[1] << 16) | (key[2] << 8) | key[3];
+	for (int i = 0; i < len; i++) {
+		for (int b = 7; b >= 0; b--) {
+			if (data[i] & (1 << b))
+				hash ^= v;
+			v <<= 1;
+			if (key[i + 4] & (1 << b))
+				v |= 1;
+		}
+	}
+	return hash;
+}
+
+/* RSS-style flow hash of the IP packet at pkt: the addresses, plus the ports for
+ * unfragmented TCP and UDP.  Returns 0 for anything that isn't IP. */
+uint32_t ip_flow_hash(uint8_t *key, uint8_t *pkt, int len)
+{
+	uint8_t tuple[2 * IPaddrlen + 4];
+	int n, hl, proto;
+
+	switch (pkt[0] >> 4) {
+	case IP_VER4 >> 4:
+		if (len < IPV4HDR_LEN)
+			return 0;
+		hl = (pkt[0] & 0xf) << 2;
+		proto = pkt[9];
+		memcpy(tuple, pkt + 12, 2 * IPv4addrlen);
+		n = 2 * IPv4addrlen;
+		if (nhgets(pkt + 6) & 0x3fff)
+			proto = 0;
+		break;
+	case IP_VER6 >> 4:
+		if (len < IPV6HDR_LEN)
+			return 0;
+		hl = IPV6HDR_LEN;
+		proto = pkt[6];
+		memcpy(tuple, pkt + 8, 2 * IPaddrlen);
+		n = 2 * IPaddrlen;
+		break;
+	default:
+		return 0;
+	}
+	if ((proto == TCP || proto == UDP) && len >= hl + 4) {
+		memcpy(tuple + n, pkt + hl, 4);
+		n += 4;
+	}
+	return toeplitz_hash(key, tuple, n);
+}
+
 /*
  *  hashing tcp, udp, ... connections
  *  gcc weirdness: it gave a bogus result until ron split the %= out.
@@ -654,12 +743,63 @@ void iphtrem(struct Ipht *ht, struct conv *c)
 	spin_unlock(&ht->lock);
 }
 
+/* Hashes a flow the way a NIC doing RSS does, so a reuseport group splits flows
+ * along the same lines as the receive queues. */
+static uint32_t iphtflowhash(uint8_t *sa, uint16_t sp, uint8_t *da, uint16_t dp)
+{
+	uint8_t tuple[2 * IPaddrlen + 4];
+	int n;
+
+	if (isv4(sa) && isv4(da)) {
+		memcpy(tuple, sa + IPv4off, IPv4addrlen);
+		memcpy(tuple + IPv4addrlen, da + IPv4off, IPv4addrlen);
+		n = 2 * IPv4addrlen;
+	} else {
+		memcpy(tuple, sa, IPaddrlen);
+		memcpy(tuple + IPaddrlen, da, IPaddrlen);
+		n = 2 * IPaddrlen;
+	}
+	hnputs(tuple + n, sp);
+	hnputs(tuple + n + 2, dp);
+	return toeplitz_hash(rss_default_key, tuple, n + 4);
+}
+
+static bool iphtsamegroup(struct Iphash *h, struct Iphash *first)
+{
+	return h->match == first->match && h->c->reuseport
+	       && h->c->lport == first->c->lport
+	       && ipcmp(h->c->laddr, first->c->laddr) == 0;
+}
+
+/* h is the first announced conv to match.  If it is in a reuseport group, the
+ * rest of the group is further down the same chain: pick one by flow hash, so
+ * every segment of a flow goes to the same listener. */
+static struct conv *iphtgroup(struct Iphash *h, uint8_t *sa, uint16_t sp,
+                              uint8_t *da, uint16_t dp)
+{
+	struct Iphash *i;
+	int n = 0, k;
+
+	if (!h->c->reuseport)
+		return h->c;
+	for (i = h; i != NULL; i = i->next)
+		if (iphtsamegroup(i, h))
+			n++;
+	if (n == 1)
+		return h->c;
+	k = iphtflowhash(sa, sp, da, dp) % n;
+	for (i = h; ; i = i->next)
+		if (iphtsamegroup(i, h) && k-- == 0)
+			return i->c;
+}
+
 /* look for a matching conversation with the following precedence
  *	connected && raddr,rport,laddr,lport
  *	announced && laddr,lport
  *	announced && *,lport
  *	announced && laddr,*
  *	announced && *,*
+ * an announced match in a reuseport group is spread across the group.
  */
 struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 					  uint16_t dp)
@@ -689,6 +829,7 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 			continue;
 		c = h->c;
 		if (dp == c->lport && ipcmp(da, c->laddr) == 0) {
+			c = iphtgroup(h, sa, sp, da, dp);
 			spin_unlock(&ht->lock);
 			return c;
 		}
@@ -701,6 +842,7 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 			continue;
 		c = h->c;
 		if (dp == c->lport) {
+			c = iphtgroup(h, sa, sp, da, dp);
 			spin_unlock(&ht->lock);
 			return c;
 		}
@@ -713,6 +855,7 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 			continue;
 		c = h->c;
 		if (ipcmp(da, c->laddr) == 0) {
+			c = iphtgroup(h, sa, sp, da, dp);
 			spin_unlock(&ht->lock);
 			return c;
 		}
@@ -723,7 +866,7 @@ struct conv *iphtlook(struct Ipht *ht, uint8_t * sa, uint16_t sp, uint8_t * da,
 	for (h = ht->tab[hv]; h != NULL; h = h->next) {
 		if (h->match != IPmatchany)
 			continue;
-		c = h->c;
+		c = iphtgroup(h, sa, sp, da, dp);
 		spin_unlock(&ht->lock);
 		return c;
 	}
@@ -0,0 +1,403 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * IP fragment reassembly queues, shared by v4 (ip4reassemble()) and v6
+ * (ip6reassemble()).
+ *
+ * Queues are hashed on (src, dst, id, proto), with v4 addresses in their v6
+ * form, and each bucket has its own lock, so fragments of different datagrams
+ * don't serialize on one lock or one list walk.
+ *
+ * A queue holds its fragments sorted by offset and linked through block->list.
+ * Each fragment is still whatever block list the medium gave us: we only need
+ * its headers in the first block.  Overlaps are trimmed by adjusting the
+ * fragment's struct Ipfrag (kept in the headroom of its first block), not by
+ * moving data.  When the datagram is complete, every fragment is trimmed to its
+ * payload and the lists are chained together, so reassembly never copies the
+ * payload.
+ *
+ * Queues expire FragLife after they are created; expired queues are freed
+ * whenever a lookup walks past them.  We also cap the memory held by all
+ * queues.  Past FragMemHigh, we sweep the table from a clock hand, freeing
+ * expired queues and then any queues, until we're under FragMemLow. */
+
+#include <slab.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <hash.h>
+#include <atomic.h>
+#include <smp.h>
+#include <ip.h>
+
+enum {
+	FragHashBits = 10,
+	Nfraghash = 1 << FragHashBits,
+	FragLife = 30000,			/* msec */
+	FragMaxFrags = 128,			/* per datagram */
+	FragMemHigh = 4 * MB,
+	FragMemLow = 3 * MB,
+	FragMax = 64 * 1024,		/* largest datagram payload */
+};
+
+struct fragq {
+	struct fragq *next;
+	struct block *flist;		/* fragments, by offset, linked by ->list */
+	uint8_t src[IPaddrlen];
+	uint8_t dst[IPaddrlen];
+	uint32_t id;
+	uint8_t proto;
+	int nfrags;
+	size_t mem;					/* blockalloclen of the fragments */
+	uint64_t age;				/* NOW at which it expires */
+};
+
+struct fragbucket {
+	spinlock_t lock;
+	struct fragq *head;
+};
+
+struct fraghash {
+	struct fragbucket tab[Nfraghash];
+	atomic_t mem;
+	unsigned int hand;			/* next bucket to sweep */
+	struct fragstats stats;
+};
+
+struct fraghash *fraghash_alloc(void)
+{
+	struct fraghash *fh;
+
+	fh = kzmalloc(sizeof(struct fraghash), MEM_WAIT);
+	for (int i = 0; i < Nfraghash; i++)
+		spinlock_init(&fh->tab[i].lock);
+	atomic_init(&fh->mem, 0);
+	return fh;
+}
+
+void fraghash_stats(struct fraghash *fh, struct fragstats *st)
+{
+	st->timeouts += fh->stats.timeouts;
+	st->reqds += fh->stats.reqds;
+	st->oks += fh->stats.oks;
+	st->fails += fh->stats.fails;
+}
+
+static struct fragbucket *fragbucket(struct fraghash *fh, uint8_t *src,
+                                     uint8_t *dst, uint32_t id, uint8_t proto)
+{
+	uint64_t w[2 * IPaddrlen / sizeof(uint64_t)];
+	uint64_t h = (uint64_t)id << 8 | proto;
+
+	memcpy(w, src, IPaddrlen);
+	memcpy((uint8_t*)w + IPaddrlen, dst, IPaddrlen);
+	for (int i = 0; i < ARRAY_SIZE(w); i++)
+		h = hash_64(h ^ w[i], 64);
+	return &fh->tab[hash_64(h, FragHashBits)];
+}
+
+/* Unlinks fq from b, which is locked, and frees it with its fragments. */
+static void fragfree(struct fraghash *fh, struct fragbucket *b,
+                     struct fragq *fq)
+{
+	struct fragq **l;
+	struct block *bl, *next;
+
+	for (l = &b->head; *l != fq; l = &(*l)->next)
+		;
+	*l = fq->next;
+	for (bl = fq->flist; bl; bl = next) {
+		next = bl->list;
+		bl->list = NULL;
+		freeblist(bl);
+	}
+	atomic_add(&fh->mem, -(long)fq->mem);
+	kfree(fq);
+}
+
+/* Frees the expired queues in b, which is locked. */
+static void fragexpire(struct fraghash *fh, struct fragbucket *b)
+{
+	struct fragq *fq, *next;
+
+	for (fq = b->head; fq; fq = next) {
+		next = fq->next;
+		if ((int64_t)(fq->age - NOW) < 0) {
+			fh->stats.timeouts++;
+			fragfree(fh, b, fq);
+		}
+	}
+}
+
+/* Sweeps buckets until the queues hold less than FragMemLow: first for expired
+ * queues, then taking whatever we find. */
+static void fragevict(struct fraghash *fh)
+{
+	struct fragbucket *b;
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < Nfraghash; i++) {
+			if (atomic_read(&fh->mem) < FragMemLow)
+				return;
+			b = &fh->tab[fh->hand++ % Nfraghash];
+			spin_lock(&b->lock);
+			if (!pass) {
+				fragexpire(fh, b);
+			} else {
+				while (b->head) {
+					fh->stats.fails++;
+					fragfree(fh, b, b->head);
+				}
+			}
+			spin_unlock(&b->lock);
+		}
+	}
+}
+
+/* Makes sure bp has room for its struct Ipfrag in front of its rp.  If it
+ * doesn't, we move its hlen bytes of headers into a new block in front. */
+static struct block *fragroom(struct block *bp, int hlen)
+{
+	struct block *nb;
+
+	if (bp->rp - bp->base >= sizeof(struct Ipfrag))
+		return bp;
+	nb = block_alloc(hlen, MEM_ATOMIC);
+	if (!nb) {
+		freeblist(bp);
+		return NULL;
+	}
+	memcpy(nb->wp, bp->rp, hlen);
+	nb->wp += hlen;
+	bp->rp += hlen;
+	nb->flag |= bp->flag & BCKSUM_FLAGS;
+	nb->next = bp;
+	return nb;
+}
+
+/* Trims each fragment of fq to its payload, the first one to its headers and
+ * payload, and chains them.  Returns the datagram and its payload length. */
+static struct block *fragjoin(struct fragq *fq, int *len)
+{
+	struct block *bl, *next, *head = NULL, **tail = &head;
+	struct Ipfrag fg;
+	int total = 0;
+
+	for (bl = fq->flist; bl; bl = next) {
+		next = bl->list;
+		bl->list = NULL;
+		fg = *BKFG(bl);
+		if (bl == fq->flist)
+			bl = trimblock(bl, 0, fg.hlen + fg.flen);
+		else
+			bl = trimblock(bl, fg.hlen, fg.flen);
+		if (!bl) {
+			/* a fragment shorter than its header said */
+			for (bl = next; bl; bl = next) {
+				next = bl->list;
+				bl->list = NULL;
+				freeblist(bl);
+			}
+			freeblist(head);
+			fq->flist = NULL;
+			return NULL;
+		}
+		total += fg.flen;
+		*tail = bl;
+		while (bl->next)
+			bl = bl->next;
+		tail = &bl->next;
+	}
+	fq->flist = NULL;
+	*len = total;
+	return head;
+}
+
+/* Returns TRUE if the fragments of fq run from 0 to a last fragment.  Drops
+ * anything queued past the last fragment. */
+static bool fragcomplete(struct fragq *fq)
+{
+	struct block *bl, *next;
+	int pktposn = 0;
+
+	for (bl = fq->flist; bl; bl = bl->list) {
+		if (BKFG(bl)->foff != pktposn)
+			return FALSE;
+		if (BKFG(bl)->last) {
+			next = bl->list;
+			bl->list = NULL;
+			for (bl = next; bl; bl = next) {
+				next = bl->list;
+				bl->list = NULL;
+				freeblist(bl);
+			}
+			return TRUE;
+		}
+		pktposn += BKFG(bl)->flen;
+	}
+	return FALSE;
+}
+
+/* Puts bp, described by fg, into fq in offset order, trimming overlaps.
+ * Returns FALSE (and frees bp) if bp had nothing new. */
+static bool fraginsert(struct fragq *fq, struct block *bp)
+{
+	struct block *bl, *prev, **l, *last;
+	struct Ipfrag *fg = BKFG(bp);
+	int ovlap, fend;
+
+	/* find the new fragment's position in the queue */
+	prev = NULL;
+	l = &fq->flist;
+	for (bl = fq->flist; bl && fg->foff > BKFG(bl)->foff; bl = bl->list) {
+		prev = bl;
+		l = &bl->list;
+	}
+
+	/* Check overlap of a previous fragment - trim away as necessary */
+	if (prev) {
+		ovlap = BKFG(prev)->foff + BKFG(prev)->flen - fg->foff;
+		if (ovlap > 0) {
+			if (ovlap >= fg->flen) {
+				freeblist(bp);
+				return FALSE;
+			}
+			BKFG(prev)->flen -= ovlap;
+		}
+	}
+
+	/* Link onto assembly queue */
+	bp->list = *l;
+	*l = bp;
+	fq->nfrags++;
+
+	/* Check to see if succeeding segments overlap */
+	fend = fg->foff + fg->flen;
+	l = &bp->list;
+	while (*l) {
+		ovlap = fend - BKFG(*l)->foff;
+		if (ovlap <= 0)
+			break;
+		if (ovlap < BKFG(*l)->flen) {
+			/* skip the covered payload; the headers stay put */
+			BKFG(*l)->flen -= ovlap;
+			BKFG(*l)->foff += ovlap;
+			BKFG(*l)->hlen += ovlap;
+			break;
+		}
+		/* Take completely covered segments out */
+		last = (*l)->list;
+		(*l)->list = NULL;
+		freeblist(*l);
+		fq->nfrags--;
+		*l = last;
+	}
+	return TRUE;
+}
+
+/* Adds a fragment to its reassembly queue.  fg describes bp, whose first block
+ * must hold its fg->hlen bytes of headers.  Returns the reassembled datagram,
+ * with the first fragment's headers and *len bytes of payload, or NULL if it's
+ * not complete yet.  A fragment at offset 0 that is also the last is returned
+ * as is, after dropping any queue for its datagram. */
+struct block *ipfragadd(struct fraghash *fh, struct block *bp,
+                        struct Ipfrag *fg, uint8_t *src, uint8_t *dst,
+                        uint32_t id, uint8_t proto, int *len)
+{
+	struct fragbucket *b;
+	struct fragq *fq;
+	size_t mem;
+	bool evict = FALSE;
+
+	if (fg->foff + fg->flen > FragMax || blocklen(bp) < fg->hlen + fg->flen) {
+		fh->stats.fails++;
+		freeblist(bp);
+		return NULL;
+	}
+	b = fragbucket(fh, src, dst, id, proto);
+	spin_lock(&b->lock);
+	fragexpire(fh, b);
+	for (fq = b->head; fq; fq = fq->next)
+		if (fq->id == id && fq->proto == proto && !ipcmp(fq->src, src) &&
+		    !ipcmp(fq->dst, dst))
+			break;
+
+	/* not a fragmented packet: accept it and get rid of any fragments that
+	 * might go with it. */
+	if (fg->foff == 0 && fg->last) {
+		if (fq) {
+			fh->stats.fails++;
+			fragfree(fh, b, fq);
+		}
+		spin_unlock(&b->lock);
+		*len = fg->flen;
+		return bp;
+	}
+
+	bp = fragroom(bp, fg->hlen);
+	if (!bp)
+		goto out_fail;
+	*BKFG(bp) = *fg;
+	bp->list = NULL;
+	mem = blockalloclen(bp);
+
+	/* First fragment allocates a reassembly queue */
+	if (!fq) {
+		fq = kzmalloc(sizeof(struct fragq), MEM_ATOMIC);
+		if (!fq) {
+			freeblist(bp);
+			goto out_fail;
+		}
+		memmove(fq->src, src, IPaddrlen);
+		memmove(fq->dst, dst, IPaddrlen);
+		fq->id = id;
+		fq->proto = proto;
+		fq->age = NOW + FragLife;
+		fq->flist = bp;
+		fq->nfrags = 1;
+		fq->mem = mem;
+		fq->next = b->head;
+		b->head = fq;
+		fh->stats.reqds++;
+		evict = atomic_fetch_and_add(&fh->mem, mem) + mem > FragMemHigh;
+		spin_unlock(&b->lock);
+		if (evict)
+			fragevict(fh);
+		return NULL;
+	}
+
+	if (!fraginsert(fq, bp)) {
+		spin_unlock(&b->lock);
+		return NULL;
+	}
+	fq->mem += mem;
+	evict = atomic_fetch_and_add(&fh->mem, mem) + mem > FragMemHigh;
+	if (fq->nfrags > FragMaxFrags) {
+		fh->stats.fails++;
+		fragfree(fh, b, fq);
+		spin_unlock(&b->lock);
+		return NULL;
+	}
+	if (!fragcomplete(fq)) {
+		spin_unlock(&b->lock);
+		if (evict)
+			fragevict(fh);
+		return NULL;
+	}
+	bp = fragjoin(fq, len);
+	fragfree(fh, b, fq);
+	if (bp)
+		fh->stats.oks++;
+	else
+		fh->stats.fails++;
+	spin_unlock(&b->lock);
+	return bp;
+
+out_fail:
+	fh->stats.fails++;
+	spin_unlock(&b->lock);
+	return NULL;
+}
@@ -237,7 +237,7 @@ static void ipifcunbind(struct Ipifc *ifc)
 }
 
 char sfixedformat[] =
-	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu\n";
+	"device %s maxtu %d sendra %d recvra %d mflag %d oflag %d maxraint %d minraint %d linkmtu %d reachtime %d rxmitra %d ttl %d routerlt %d pktin %lu pktout %lu errin %lu errout %lu tracedrop %lu";
 
 char slineformat[] = "	%-40I %-10M %-40I %-12lu %-12lu\n";
 
@@ -255,6 +255,8 @@ static int ipifcstate(struct conv *c, char *state, int n)
 				 ifc->rp.minraint, ifc->rp.linkmtu, ifc->rp.reachtime,
 				 ifc->rp.rxmitra, ifc->rp.ttl, ifc->rp.routerlt,
 				 ifc->in, ifc->out, ifc->inerr, ifc->outerr, ifc->tracedrop);
+	m += rpsstats(ifc, state + m, n - m);
+	m += snprintf(state + m, n - m, "\n");
 
 	rlock(&ifc->rwlock);
 	for (lifc = ifc->lifc; lifc && n > m; lifc = lifc->next)
@@ -837,6 +839,8 @@ static void ipifcctl(struct conv *c, char **argv, int argc)
 		ipifcsendra6(ifc, argv, argc);
 	else if (strcmp(argv[0], "recvra6") == 0)
 		ipifcrecvra6(ifc, argv, argc);
+	else if (strcmp(argv[0], "rps") == 0)
+		rpsctl(c->p->f, ifc, argv, argc);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -38,11 +38,13 @@
 #include <cpio.h>
 #include <pmap.h>
 #include <smp.h>
+#include <sort.h>
 #include <ip.h>
 
 static void walkadd(struct Fs *, struct route **, struct route *);
 static void addnode(struct Fs *, struct route **, struct route *);
 static void calcd(struct route *);
+struct route **looknode(struct route **cur, struct route *r);
 
 /* these are used for all instances of IP */
 struct route *v4freelist;
@@ -325,6 +327,26 @@ static void addnode(struct Fs *f, struct route **cur, struct route *new)
 
 #define	V4H(a)	((a&0x07ffffff)>>(32-Lroot-5))
 
+/* Prefix length of a contiguous mask, or -1 */
+static int v4masklen(uint32_t m)
+{
+	if (~m & (~m + 1))
+		return -1;
+	return 32 - __builtin_popcount(~m);
+}
+
+static struct route *v4exact(void *arg, uint32_t addr, int plen)
+{
+	struct Fs *f = arg;
+	struct route rt, **r;
+
+	rt.rt.type = Rv4;
+	rt.v4.address = addr;
+	rt.v4.endaddress = addr | (plen ? ~(~0U << (32 - plen)) : ~0U);
+	r = looknode(&f->v4root[V4H(addr)], &rt);
+	return r ? *r : NULL;
+}
+
 void
 v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		   uint8_t * gate, int type)
@@ -333,7 +355,7 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 	uint32_t sa;
 	uint32_t m;
 	uint32_t ea;
-	int h, eh;
+	int h, eh, plen;
 
 	m = nhgetl(mask);
 	sa = nhgetl(a) & m;
@@ -356,6 +378,21 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		}
 		wunlock(&routelock);
 	}
+
+	/* Point the trie at whichever route survived in the forest: an equal
+	 * one absorbs the new one. */
+	plen = v4masklen(m);
+	wlock(&routelock);
+	__seq_start_write(&f->rtseq);
+	if (plen < 0) {
+		f->v4nonprefix = TRUE;
+	} else {
+		p = v4exact(f, sa, plen);
+		if (p)
+			v4trie_insert(f->v4trie, sa, plen, p);
+	}
+	__seq_end_write(&f->rtseq);
+	wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcaddroute(f, Rv4, a, mask, gate, type);
@@ -364,6 +401,36 @@ v4addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 #define	V6H(a)	(((a)[IPllen-1] & 0x07ffffff)>>(32-Lroot-5))
 #define ISDFLT(a, mask, tag) ((ipcmp((a),v6Unspecified)==0) && (ipcmp((mask),v6Unspecified)==0) && (strcmp((tag), "ra")!=0))
 
+static int v6masklen(uint8_t *mask)
+{
+	int i, len, inv;
+
+	for (i = 0; i < IPaddrlen && mask[i] == 0xff; i++)
+		;
+	len = i * 8;
+	if (i == IPaddrlen)
+		return len;
+	inv = (uint8_t)~mask[i];
+	if (inv & (inv + 1))
+		return -1;
+	len += 8 - __builtin_popcount(inv);
+	for (i++; i < IPaddrlen; i++)
+		if (mask[i])
+			return -1;
+	return len;
+}
+
+static struct route *v6exact(struct Fs *f, uint32_t *sa, uint32_t *ea)
+{
+	struct route rt, **r;
+
+	rt.rt.type = 0;
+	memmove(rt.v6.address, sa, IPaddrlen);
+	memmove(rt.v6.endaddress, ea, IPaddrlen);
+	r = looknode(&f->v6root[V6H(sa)], &rt);
+	return r ? *r : NULL;
+}
+
 void
 v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		   uint8_t * gate, int type)
@@ -371,7 +438,7 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 	struct route *p;
 	uint32_t sa[IPllen], ea[IPllen];
 	uint32_t x, y;
-	int h, eh;
+	int h, eh, plen;
 
 	/*
 	   if(ISDFLT(a, mask, tag))
@@ -402,6 +469,19 @@ v6addroute(struct Fs *f, char *tag, uint8_t * a, uint8_t * mask,
 		}
 		wunlock(&routelock);
 	}
+
+	plen = v6masklen(mask);
+	wlock(&routelock);
+	__seq_start_write(&f->rtseq);
+	if (plen < 0) {
+		f->v6nonprefix = TRUE;
+	} else {
+		p = v6exact(f, sa, ea);
+		if (p)
+			v6trie_insert(f->v6trie, sa, plen, p);
+	}
+	__seq_end_write(&f->rtseq);
+	wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcaddroute(f, 0, a, mask, gate, type);
@@ -438,8 +518,9 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 {
 	struct route **r, *p;
 	struct route rt;
-	int h, eh;
+	int h, eh, plen;
 	uint32_t m;
+	bool removed = FALSE;
 
 	m = nhgetl(mask);
 	rt.v4.address = nhgetl(a) & m;
@@ -447,9 +528,11 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 	rt.rt.type = Rv4;
 
 	eh = V4H(rt.v4.endaddress);
+	plen = v4masklen(m);
+	if (dolock)
+		wlock(&routelock);
+	__seq_start_write(&f->rtseq);
 	for (h = V4H(rt.v4.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v4root[h], &rt);
 		if (r) {
 			p = *r;
@@ -457,6 +540,7 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			 * this one, since it looks like the if code is when we want to
 			 * release.  btw, use better code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				removed = TRUE;
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -469,9 +553,14 @@ void v4delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
+	/* Readers retry until we're done, so no one uses a freed route the trie
+	 * still points at */
+	if (removed && plen >= 0)
+		v4trie_remove(f->v4trie, rt.v4.address, plen, v4exact, f);
+	__seq_end_write(&f->rtseq);
+	if (dolock)
+		wunlock(&routelock);
 	v4routegeneration++;
 
 	ipifcremroute(f, Rv4, a, mask);
@@ -481,8 +570,9 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 {
 	struct route **r, *p;
 	struct route rt;
-	int h, eh;
+	int h, eh, plen;
 	uint32_t x, y;
+	bool removed = FALSE;
 
 	for (h = 0; h < IPllen; h++) {
 		x = nhgetl(a + 4 * h);
@@ -493,9 +583,11 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 	rt.rt.type = 0;
 
 	eh = V6H(rt.v6.endaddress);
+	plen = v6masklen(mask);
+	if (dolock)
+		wlock(&routelock);
+	__seq_start_write(&f->rtseq);
 	for (h = V6H(rt.v6.address); h <= eh; h++) {
-		if (dolock)
-			wlock(&routelock);
 		r = looknode(&f->v6root[h], &rt);
 		if (r) {
 			p = *r;
@@ -503,6 +595,7 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 			 * this one, since it looks like the if code is when we want to
 			 * release.  btw, use better code reuse btw v4 and v6... */
 			if (kref_put(&p->rt.kref)) {
+				removed = TRUE;
 				*r = 0;
 				addqueue(&f->queue, p->rt.left);
 				addqueue(&f->queue, p->rt.mid);
@@ -515,26 +608,25 @@ void v6delroute(struct Fs *f, uint8_t * a, uint8_t * mask, int dolock)
 				}
 			}
 		}
-		if (dolock)
-			wunlock(&routelock);
 	}
+	/* Readers retry until we're done, so no one uses a freed route the trie
+	 * still points at */
+	if (removed && plen >= 0)
+		v6trie_remove(f->v6trie, rt.v6.address, plen);
+	__seq_end_write(&f->rtseq);
+	if (dolock)
+		wunlock(&routelock);
 	v6routegeneration++;
 
 	ipifcremroute(f, 0, a, mask);
 }
 
-struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+/* The range forest only matters for lookups with non-contiguous masks; the
+ * trie has everything else. */
+static struct route *v4forestlookup(struct Fs *f, uint32_t la)
 {
 	struct route *p, *q;
-	uint32_t la;
-	uint8_t gate[IPaddrlen];
-	struct Ipifc *ifc;
-
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v4routegeneration)
-		return c->r;
 
-	la = nhgetl(a);
 	q = NULL;
 	for (p = f->v4root[V4H(la)]; p;)
 		if (la >= p->v4.address) {
@@ -545,6 +637,31 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 				p = p->rt.right;
 		} else
 			p = p->rt.left;
+	return q;
+}
+
+struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
+{
+	struct route *q;
+	uint32_t la;
+	uint8_t gate[IPaddrlen];
+	struct Ipifc *ifc;
+	seq_ctr_t seq;
+
+	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
+		&& c->rgen == v4routegeneration)
+		return c->r;
+
+	la = nhgetl(a);
+	if (f->v4nonprefix)
+		q = v4forestlookup(f, la);
+	else {
+		do {
+			seq = ACCESS_ONCE(f->rtseq);
+			rmb();
+			q = v4trie_lookup(f->v4trie, la);
+		} while (seqctr_retry(seq, ACCESS_ONCE(f->rtseq)));
+	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -567,27 +684,11 @@ struct route *v4lookup(struct Fs *f, uint8_t * a, struct conv *c)
 	return q;
 }
 
-struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
+static struct route *v6forestlookup(struct Fs *f, uint32_t *la)
 {
 	struct route *p, *q;
-	uint32_t la[IPllen];
-	int h;
 	uint32_t x, y;
-	uint8_t gate[IPaddrlen];
-	struct Ipifc *ifc;
-
-	if (memcmp(a, v4prefix, IPv4off) == 0) {
-		q = v4lookup(f, a + IPv4off, c);
-		if (q != NULL)
-			return q;
-	}
-
-	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
-		&& c->rgen == v6routegeneration)
-		return c->r;
-
-	for (h = 0; h < IPllen; h++)
-		la[h] = nhgetl(a + 4 * h);
+	int h;
 
 	q = 0;
 	for (p = f->v6root[V6H(la)]; p;) {
@@ -617,6 +718,40 @@ struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
 		p = p->rt.mid;
 next:	;
 	}
+	return q;
+}
+
+struct route *v6lookup(struct Fs *f, uint8_t * a, struct conv *c)
+{
+	struct route *q;
+	uint32_t la[IPllen];
+	int h;
+	uint8_t gate[IPaddrlen];
+	struct Ipifc *ifc;
+	seq_ctr_t seq;
+
+	if (memcmp(a, v4prefix, IPv4off) == 0) {
+		q = v4lookup(f, a + IPv4off, c);
+		if (q != NULL)
+			return q;
+	}
+
+	if (c != NULL && c->r != NULL && c->r->rt.ifc != NULL
+		&& c->rgen == v6routegeneration)
+		return c->r;
+
+	for (h = 0; h < IPllen; h++)
+		la[h] = nhgetl(a + 4 * h);
+
+	if (f->v6nonprefix)
+		q = v6forestlookup(f, la);
+	else {
+		do {
+			seq = ACCESS_ONCE(f->rtseq);
+			rmb();
+			q = v6trie_lookup(f->v6trie, la);
+		} while (seqctr_retry(seq, ACCESS_ONCE(f->rtseq)));
+	}
 
 	if (q && (q->rt.ifc == NULL || q->rt.ifcid != q->rt.ifc->ifcid)) {
 		if (q->rt.type & Rifc) {
@@ -762,6 +897,12 @@ void ipwalkroutes(struct Fs *f, struct routewalk *rw)
 	runlock(&routelock);
 }
 
+void routeinit(struct Fs *f)
+{
+	f->v4trie = v4trie_alloc();
+	f->v6trie = v6trie_alloc();
+}
+
 long routeread(struct Fs *f, char *p, uint32_t offset, int n)
 {
 	struct routewalk rw;
@@ -817,7 +958,7 @@ int routeflush(struct Fs *f, struct route *r, char *tag)
 	return 0;
 }
 
-long routewrite(struct Fs *f, struct chan *c, char *p, int n)
+static void routectl(struct Fs *f, struct chan *c, char *p, int n)
 {
 	ERRSTACK(1);
 	int h, changed;
@@ -887,5 +1028,121 @@ long routewrite(struct Fs *f, struct chan *c, char *p, int n)
 
 	poperror();
 	kfree(cb);
+}
+
+struct bulkroute {
+	uint8_t addr[IPaddrlen];
+	uint8_t mask[IPaddrlen];
+	uint8_t gate[IPaddrlen];
+	int plen;
+	int line;
+};
+
+static int bulkroute_cmp(const void *a, const void *b)
+{
+	const struct bulkroute *x = a, *y = b;
+
+	if (x->plen != y->plen)
+		return x->plen < y->plen ? -1 : 1;
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static void bulkadd(struct Fs *f, struct chan *c, struct bulkroute *br, int nr)
+{
+	char *tag = "none";
+
+	if (c != NULL)
+		tag = ((struct IPaux *)c->aux)->tag;
+	sort(br, nr, sizeof(struct bulkroute), bulkroute_cmp);
+	for (int i = 0; i < nr; i++) {
+		if (memcmp(br[i].addr, v4prefix, IPv4off) == 0)
+			v4addroute(f, tag, br[i].addr + IPv4off, br[i].mask + IPv4off,
+			           br[i].gate + IPv4off, 0);
+		else
+			v6addroute(f, tag, br[i].addr, br[i].mask, br[i].gate, 0);
+	}
+}
+
+/* Parses "add addr mask gate" into br.  Returns FALSE for any other command,
+ * leaving the line alone. */
+static bool parsebulkadd(struct bulkroute *br, char *line, int len)
+{
+	char *f[5];
+	int nf;
+
+	while (len && (*line == ' ' || *line == '\t')) {
+		line++;
+		len--;
+	}
+	if (len < 4 || strncmp(line, "add", 3) != 0 ||
+	    (line[3] != ' ' && line[3] != '\t'))
+		return FALSE;
+	line[len] = '\0';
+	nf = tokenize(line, f, ARRAY_SIZE(f));
+	if (nf < 4)
+		error(EINVAL, "short add in route batch");
+	parseip(br->addr, f[1]);
+	parseipmask(br->mask, f[2]);
+	parseip(br->gate, f[3]);
+	if (memcmp(br->addr, v4prefix, IPv4off) == 0)
+		br->plen = v4masklen(nhgetl(br->mask + IPv4off));
+	else
+		br->plen = v6masklen(br->mask);
+	return TRUE;
+}
+
+/* A write of several lines is a batch, one command per line.  Each run of
+ * "add"s is sorted by prefix length (keeping the order of equal ones), so a
+ * prefix always goes in before the longer ones inside it.  Then the forest
+ * never has to hoist a subtree out from under a new covering range and re-add
+ * it node by node, which is what makes loading a full table slow. */
+static void routebulk(struct Fs *f, struct chan *c, char *p, int n)
+{
+	ERRSTACK(1);
+	char *buf, *line, *eol;
+	struct bulkroute *br;
+	int nlines = 1, nr = 0;
+
+	buf = kmalloc(n + 1, MEM_WAIT);
+	br = NULL;
+	if (waserror()) {
+		kfree(buf);
+		kfree(br);
+		nexterror();
+	}
+	memmove(buf, p, n);
+	buf[n] = '\0';
+	for (int i = 0; i < n; i++)
+		nlines += buf[i] == '\n';
+	br = kmalloc(nlines * sizeof(struct bulkroute), MEM_WAIT);
+	for (line = buf; line < buf + n; line = eol + 1) {
+		eol = memchr(line, '\n', buf + n - line);
+		if (!eol)
+			eol = buf + n;
+		if (eol == line)
+			continue;
+		if (parsebulkadd(&br[nr], line, eol - line)) {
+			br[nr].line = nr;
+			nr++;
+			continue;
+		}
+		bulkadd(f, c, br, nr);
+		nr = 0;
+		routectl(f, c, line, eol - line);
+	}
+	bulkadd(f, c, br, nr);
+	poperror();
+	kfree(br);
+	kfree(buf);
+}
+
+long routewrite(struct Fs *f, struct chan *c, char *p, int n)
+{
+	char *nl = memchr(p, '\n', n);
+
+	if (nl && nl < p + n - 1)
+		routebulk(f, c, p, n);
+	else
+		routectl(f, c, p, n);
 	return n;
 }
@@ -0,0 +1,415 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Longest prefix match tries for the route lookup fast path.
+ *
+ * The range forest in iproute.c is still the route table: it owns the struct
+ * routes, their refcounts and tags, and it's what routeread and flush walk.
+ * These tries just map an address to the forest's route for the longest prefix
+ * that covers it, so forwarding doesn't walk a tree per packet.
+ *
+ * IPv4 is a fixed-stride multibit trie, 16-8-8 (DIR-16-8-8): a 64K-entry root
+ * table for the top 16 bits and 256-entry tables below it, allocated on demand.
+ * An entry is either the longest-prefix route for every address under it, or
+ * a table for the next 8 bits, so a lookup is at most three dependent loads.
+ * A prefix is expanded over the slots it covers in the level its length falls
+ * in (/0-/16 in the root, /17-/24 in the middle, /25-/32 at the bottom), and
+ * pushed down into any tables under those slots.  A new table starts out with
+ * its parent slot's route everywhere.  Tables are only freed with the whole
+ * trie; a box only ever has as many as the /16s and /24s that have had longer
+ * prefixes in them.
+ *
+ * IPv6 is a path-compressed binary (Patricia) trie.  Routes hang off nodes, a
+ * node with no route is just a branch point, and single-child branch points
+ * are spliced out, so the depth is bounded by the number of prefixes, not by
+ * 128.
+ *
+ * Writers are serialized by the caller (routelock), and readers take no lock.
+ * A writer fills in a new table or node completely before it links it in, and
+ * each entry changes with a single store, so a reader always walks a
+ * well-formed structure.  Memory is type-stable: tables stay around and
+ * dead v6 nodes go on a freelist, like the forest's routes.  Readers that care
+ * about seeing a route that is being removed or recycled check a seq counter
+ * around the lookup (f->rtseq, see v4lookup()). */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <ip.h>
+
+enum {
+	V4tRootBits = 16,
+	V4tBits = 8,
+	V4tLevels = 3,
+	V4tChild = 1,				/* low bit of an entry: it's a table */
+};
+
+/* An entry is a struct route *, or a struct v4t_tbl * | V4tChild */
+struct v4t_tbl {
+	uintptr_t e[1 << V4tBits];
+	uint8_t plen[1 << V4tBits];
+};
+
+struct v4trie {
+	uintptr_t root[1 << V4tRootBits];
+	uint8_t plen[1 << V4tRootBits];
+	unsigned long ntbls;
+};
+
+/* Prefix length at which each level ends */
+static const int v4t_end[V4tLevels] = {16, 24, 32};
+
+struct v6t_node {
+	uint32_t key[IPllen];
+	int plen;
+	struct route *r;
+	struct v6t_node *child[2];
+};
+
+struct v6trie {
+	struct v6t_node *root;
+	struct v6t_node *free;		/* linked through child[0] */
+	unsigned long nnodes;
+};
+
+struct v4trie *v4trie_alloc(void)
+{
+	return kzmalloc(sizeof(struct v4trie), MEM_WAIT);
+}
+
+static struct v4t_tbl *v4t_child(uintptr_t e)
+{
+	return e & V4tChild ? (struct v4t_tbl*)(e & ~(uintptr_t)V4tChild) : NULL;
+}
+
+/* Index of addr's slot in a table whose level covers (start, end]. */
+static unsigned int v4t_idx(uint32_t addr, int start, int end)
+{
+	return (addr >> (32 - end)) & ((1U << (end - start)) - 1);
+}
+
+struct route *v4trie_lookup(struct v4trie *t, uint32_t addr)
+{
+	uintptr_t e;
+
+	e = ACCESS_ONCE(t->root[addr >> (32 - V4tRootBits)]);
+	if (!(e & V4tChild))
+		return (struct route*)e;
+	e = ACCESS_ONCE(v4t_child(e)->e[(addr >> 8) & 0xff]);
+	if (!(e & V4tChild))
+		return (struct route*)e;
+	return (struct route*)ACCESS_ONCE(v4t_child(e)->e[addr & 0xff]);
+}
+
+/* Puts r (of length rplen) in slot i, and in every slot of the tables below
+ * it, where the route there is no longer than plen.  With remove, it only
+ * replaces routes of exactly plen, which are the one being removed. */
+static void v4t_set(uintptr_t *e, uint8_t *p, unsigned int i, int plen,
+                    struct route *r, int rplen, bool remove)
+{
+	struct v4t_tbl *tbl = v4t_child(e[i]);
+
+	if (tbl) {
+		for (int j = 0; j < ARRAY_SIZE(tbl->e); j++)
+			v4t_set(tbl->e, tbl->plen, j, plen, r, rplen, remove);
+		return;
+	}
+	if (remove ? e[i] && p[i] == plen : !e[i] || p[i] <= plen) {
+		p[i] = r ? rplen : 0;
+		ACCESS_ONCE(e[i]) = (uintptr_t)r;
+	}
+}
+
+/* Finds the table at level lvl on addr's path, creating tables if create is
+ * set.  A new table starts out with its parent entry's route in every slot.
+ * Returns the level's start, or -1 if a table was missing. */
+static int v4t_walk(struct v4trie *t, uint32_t addr, int lvl, bool create,
+                    uintptr_t **entries, uint8_t **plens)
+{
+	uintptr_t *e = t->root;
+	uint8_t *p = t->plen;
+	struct v4t_tbl *tbl;
+	unsigned int i;
+	int start = 0;
+
+	for (int l = 0; l < lvl; l++) {
+		i = v4t_idx(addr, start, v4t_end[l]);
+		tbl = v4t_child(e[i]);
+		if (!tbl) {
+			if (!create)
+				return -1;
+			tbl = kmalloc(sizeof(struct v4t_tbl), MEM_WAIT);
+			for (int j = 0; j < ARRAY_SIZE(tbl->e); j++) {
+				tbl->e[j] = e[i];
+				tbl->plen[j] = p[i];
+			}
+			wmb();	/* filled in before readers can see it */
+			ACCESS_ONCE(e[i]) = (uintptr_t)tbl | V4tChild;
+			t->ntbls++;
+		}
+		e = tbl->e;
+		p = tbl->plen;
+		start = v4t_end[l];
+	}
+	*entries = e;
+	*plens = p;
+	return start;
+}
+
+static int v4t_level(int plen)
+{
+	int lvl = 0;
+
+	while (plen > v4t_end[lvl])
+		lvl++;
+	return lvl;
+}
+
+/* Points every address in addr/plen that doesn't have a longer prefix at r. */
+void v4trie_insert(struct v4trie *t, uint32_t addr, int plen, struct route *r)
+{
+	int lvl = v4t_level(plen);
+	int start, end = v4t_end[lvl];
+	uintptr_t *e;
+	uint8_t *p;
+	unsigned int idx, n;
+
+	start = v4t_walk(t, addr, lvl, TRUE, &e, &p);
+	n = 1U << (end - plen);
+	idx = v4t_idx(addr, start, end) & ~(n - 1);
+	for (unsigned int i = idx; i < idx + n; i++)
+		v4t_set(e, p, i, plen, r, plen, FALSE);
+}
+
+/* Takes addr/plen out.  Its addresses go to the next shorter prefix that
+ * covers them, which exact() looks up in the route table. */
+void v4trie_remove(struct v4trie *t, uint32_t addr, int plen,
+                   struct route *(*exact)(void *arg, uint32_t addr, int plen),
+                   void *arg)
+{
+	int lvl = v4t_level(plen);
+	int start, end = v4t_end[lvl];
+	uintptr_t *e;
+	uint8_t *p;
+	struct route *repl = NULL;
+	int rplen;
+	unsigned int idx, n;
+
+	start = v4t_walk(t, addr, lvl, FALSE, &e, &p);
+	if (start < 0)
+		return;
+	for (rplen = plen - 1; rplen >= 0; rplen--) {
+		repl = exact(arg, addr & (rplen ? ~0U << (32 - rplen) : 0), rplen);
+		if (repl)
+			break;
+	}
+	n = 1U << (end - plen);
+	idx = v4t_idx(addr, start, end) & ~(n - 1);
+	for (unsigned int i = idx; i < idx + n; i++)
+		v4t_set(e, p, i, plen, repl, rplen, TRUE);
+}
+
+void v4trie_free(struct v4trie *t)
+{
+	struct v4t_tbl *tbl;
+
+	for (int i = 0; i < ARRAY_SIZE(t->root); i++) {
+		tbl = v4t_child(t->root[i]);
+		if (!tbl)
+			continue;
+		for (int j = 0; j < ARRAY_SIZE(tbl->e); j++)
+			kfree(v4t_child(tbl->e[j]));
+		kfree(tbl);
+	}
+	kfree(t);
+}
+
+unsigned long v4trie_memory(struct v4trie *t)
+{
+	return sizeof(struct v4trie) + t->ntbls * sizeof(struct v4t_tbl);
+}
+
+struct v6trie *v6trie_alloc(void)
+{
+	return kzmalloc(sizeof(struct v6trie), MEM_WAIT);
+}
+
+static int v6bit(const uint32_t *a, int n)
+{
+	return (a[n >> 5] >> (31 - (n & 31))) & 1;
+}
+
+/* Whether a and key agree on the first plen bits. */
+static bool v6match(const uint32_t *a, const uint32_t *key, int plen)
+{
+	int i;
+
+	for (i = 0; plen >= 32; i++, plen -= 32) {
+		if (a[i] != key[i])
+			return FALSE;
+	}
+	return !plen || !((a[i] ^ key[i]) >> (32 - plen));
+}
+
+static int v6cpl(const uint32_t *a, const uint32_t *b)
+{
+	for (int i = 0; i < IPllen; i++) {
+		if (a[i] != b[i])
+			return i * 32 + __builtin_clz(a[i] ^ b[i]);
+	}
+	return 128;
+}
+
+struct route *v6trie_lookup(struct v6trie *t, const uint32_t *a)
+{
+	struct v6t_node *n = ACCESS_ONCE(t->root);
+	struct route *best = NULL, *r;
+	int plen, last = -1;
+
+	while (n) {
+		plen = ACCESS_ONCE(n->plen);
+		/* Only a node recycled under us breaks this; the caller retries */
+		if (plen <= last || plen > 128)
+			break;
+		if (!v6match(a, n->key, plen))
+			break;
+		r = ACCESS_ONCE(n->r);
+		if (r)
+			best = r;
+		if (plen == 128)
+			break;
+		last = plen;
+		n = ACCESS_ONCE(n->child[v6bit(a, plen)]);
+	}
+	return best;
+}
+
+static struct v6t_node *v6t_new(struct v6trie *t, const uint32_t *a, int plen,
+                                struct route *r)
+{
+	struct v6t_node *n = t->free;
+	int i;
+
+	if (n)
+		t->free = n->child[0];
+	else
+		n = kmalloc(sizeof(struct v6t_node), MEM_WAIT);
+	memset(n, 0, sizeof(struct v6t_node));
+	for (i = 0; i < plen / 32; i++)
+		n->key[i] = a[i];
+	if (plen % 32)
+		n->key[i] = a[i] & (~0U << (32 - plen % 32));
+	n->plen = plen;
+	n->r = r;
+	t->nnodes++;
+	return n;
+}
+
+static void v6t_free(struct v6trie *t, struct v6t_node *n)
+{
+	n->child[0] = t->free;
+	t->free = n;
+	t->nnodes--;
+}
+
+void v6trie_insert(struct v6trie *t, const uint32_t *a, int plen,
+                   struct route *r)
+{
+	struct v6t_node **pp = &t->root, *n, *nn, *glue;
+	int cpl;
+
+	while ((n = *pp)) {
+		cpl = MIN(v6cpl(a, n->key), MIN(plen, n->plen));
+		if (cpl == n->plen) {
+			if (n->plen == plen) {
+				ACCESS_ONCE(n->r) = r;
+				return;
+			}
+			pp = &n->child[v6bit(a, n->plen)];
+			continue;
+		}
+		/* n isn't on our path: we go above it, or we fork off a branch point
+		 * at the bit where we differ */
+		nn = v6t_new(t, a, plen, r);
+		if (cpl == plen) {
+			nn->child[v6bit(n->key, plen)] = n;
+		} else {
+			glue = v6t_new(t, a, cpl, NULL);
+			glue->child[v6bit(a, cpl)] = nn;
+			glue->child[v6bit(n->key, cpl)] = n;
+			nn = glue;
+		}
+		wmb();
+		ACCESS_ONCE(*pp) = nn;
+		return;
+	}
+	nn = v6t_new(t, a, plen, r);
+	wmb();
+	ACCESS_ONCE(*pp) = nn;
+}
+
+void v6trie_remove(struct v6trie *t, const uint32_t *a, int plen)
+{
+	struct v6t_node **pp = &t->root, **parentpp = NULL;
+	struct v6t_node *n, *parent = NULL, *child;
+
+	while ((n = *pp)) {
+		if (n->plen > plen || !v6match(a, n->key, n->plen))
+			return;
+		if (n->plen == plen)
+			break;
+		parentpp = pp;
+		parent = n;
+		pp = &n->child[v6bit(a, n->plen)];
+	}
+	if (!n || !n->r)
+		return;
+	ACCESS_ONCE(n->r) = NULL;
+	if (n->child[0] && n->child[1])
+		return;
+	child = n->child[0] ? n->child[0] : n->child[1];
+	ACCESS_ONCE(*pp) = child;
+	v6t_free(t, n);
+	/* A branch point left with one child isn't needed either */
+	if (parent && !parent->r && !child) {
+		child = parent->child[0] ? parent->child[0] : parent->child[1];
+		ACCESS_ONCE(*parentpp) = child;
+		v6t_free(t, parent);
+	}
+}
+
+static void v6t_free_tree(struct v6t_node *n)
+{
+	if (!n)
+		return;
+	v6t_free_tree(n->child[0]);
+	v6t_free_tree(n->child[1]);
+	kfree(n);
+}
+
+void v6trie_free(struct v6trie *t)
+{
+	struct v6t_node *n;
+
+	v6t_free_tree(t->root);
+	while ((n = t->free)) {
+		t->free = n->child[0];
+		kfree(n);
+	}
+	kfree(t);
+}
+
+unsigned long v6trie_memory(struct v6trie *t)
+{
+	return sizeof(struct v6trie) + t->nnodes * sizeof(struct v6t_node);
+}
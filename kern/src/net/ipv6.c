@@ -44,16 +44,8 @@ enum {
 #define IPV6CLASS(hdr) ((hdr->vcf[0]&0x0F)<<2 | (hdr->vcf[1]&0xF0)>>2)
 #define BLKIPVER(xp)	(((struct ip6hdr*)((xp)->rp))->vcf[0]&0xF0)
 #define NEXT_ID(x) (__sync_add_and_fetch(&(x), 1))
-/*
- * This sleazy macro is stolen shamelessly from ip.c, see comment there.
- */
-#define BKFG(xp)	((struct Ipfrag*)((xp)->base))
-struct fragment6;
-
 struct block *ip6reassemble(struct IP *, int unused_int, struct block *,
                             struct ip6hdr *);
-void ipfragfree6(struct IP *, struct fragment6 *);
-struct fragment6 *ipfragallo6(struct IP *);
 static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm);
 int unfraglen(struct block *bp, uint8_t * nexthdr, int setfh);
 struct block *procopts(struct block *bp);
@@ -105,41 +97,14 @@ static char *statnames[] = {
 	[FragCreates] "FragCreates",
 };
 
-struct Fragment4 {
-	struct block *blist;
-	struct fragment4 *next;
-	uint32_t src;
-	uint32_t dst;
-	uint16_t id;
-	uint64_t age;
-};
-
-struct fragment6 {
-	struct block *blist;
-	struct fragment6 *next;
-	uint8_t src[IPaddrlen];
-	uint8_t dst[IPaddrlen];
-	unsigned int id;
-	uint64_t age;
-};
-
-struct Ipfrag {
-	uint16_t foff;
-	uint16_t flen;
-};
-
 /* an instance of IP */
 struct IP {
-	uint32_t stats[Nstats];
+	struct percpu_ctrs stats;	/* [Nstats] */
 
-	qlock_t fraglock4;
-	struct fragment4 *flisthead4;
-	struct fragment4 *fragfree4;
+	struct fraghash *frag4;		/* reassembly queues, see ipfrag.c */
 	int id4;
 
-	qlock_t fraglock6;
-	struct fragment6 *flisthead6;
-	struct fragment6 *fragfree6;
+	struct fraghash *frag6;
 	int id6;
 
 	int iprouting;				/* true if we route like a gateway */
@@ -166,7 +131,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	/* Fill out the ip header */
 	eh = (struct ip6hdr *)(bp->rp);
 
-	ip->stats[OutRequests]++;
+	percpu_ctr_inc(&ip->stats, OutRequests);
 
 	/* Number of uint8_ts in data and ip header to write */
 	len = blocklen(bp);
@@ -180,7 +145,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 	if (gating) {
 		chunk = nhgets(eh->ploadlen);
 		if (chunk > len) {
-			ip->stats[OutDiscards]++;
+			percpu_ctr_inc(&ip->stats, OutDiscards);
 			netlog(f, Logip, "short gated packet\n");
 			goto free;
 		}
@@ -189,14 +154,14 @@ int ipoput6(struct Fs *f, struct block *bp,
 	}
 
 	if (len >= IP_MAX) {
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		netlog(f, Logip, "exceeded ip max size %I\n", eh->dst);
 		goto free;
 	}
 
 	r = v6lookup(f, eh->dst, c);
 	if (r == NULL) {
-		ip->stats[OutNoRoutes]++;
+		percpu_ctr_inc(&ip->stats, OutNoRoutes);
 		netlog(f, Logip, "no interface %I\n", eh->dst);
 		rv = -1;
 		goto free;
@@ -251,7 +216,7 @@ int ipoput6(struct Fs *f, struct block *bp,
 			 * we fragment if ifc->reassemble is turned on; an exception
 			 * needed for nat.
 			 */
-			ip->stats[OutDiscards]++;
+			percpu_ctr_inc(&ip->stats, OutDiscards);
 			icmppkttoobig6(f, ifc, bp);
 			netlog(f, Logip, "%I: gated pkts not fragmented\n", eh->dst);
 			goto raise;
@@ -260,8 +225,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 	/* start v6 fragmentation */
 	uflen = unfraglen(bp, &nexthdr, 1);
 	if (uflen > medialen) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, FragFails);
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		netlog(f, Logip, "%I: unfragmentable part too big\n", eh->dst);
 		goto raise;
 	}
@@ -269,8 +234,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 	flen = len - uflen;
 	seglen = (medialen - (uflen + IP6FHDR)) & ~7;
 	if (seglen < 8) {
-		ip->stats[FragFails]++;
-		ip->stats[OutDiscards]++;
+		percpu_ctr_inc(&ip->stats, FragFails);
+		percpu_ctr_inc(&ip->stats, OutDiscards);
 		netlog(f, Logip, "%I: seglen < 8\n", eh->dst);
 		goto raise;
 	}
@@ -312,8 +277,8 @@ int ipoput6(struct Fs *f, struct block *bp,
 		chunk = seglen;
 		while (chunk) {
 			if (!xp) {
-				ip->stats[OutDiscards]++;
-				ip->stats[FragFails]++;
+				percpu_ctr_inc(&ip->stats, OutDiscards);
+				percpu_ctr_inc(&ip->stats, FragFails);
 				freeblist(nb);
 				netlog(f, Logip, "!xp: chunk in v6%d\n", chunk);
 				goto raise;
@@ -331,9 +296,9 @@ int ipoput6(struct Fs *f, struct block *bp,
 		}
 
 		ifc->m->bwrite(ifc, nb, V6, gate);
-		ip->stats[FragCreates]++;
+		percpu_ctr_inc(&ip->stats, FragCreates);
 	}
-	ip->stats[FragOKs]++;
+	percpu_ctr_inc(&ip->stats, FragOKs);
 
 raise:
 	runlock(&ifc->rwlock);
@@ -357,7 +322,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	struct route *r, *sr;
 
 	ip = f->ip;
-	ip->stats[InReceives]++;
+	percpu_ctr_inc(&ip->stats, InReceives);
 
 	/*
 	 *  Ensure we have all the header info in the first
@@ -389,7 +354,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 
 	/* Check header version */
 	if (BLKIPVER(bp) != IP_VER6) {
-		ip->stats[InHdrErrors]++;
+		percpu_ctr_inc(&ip->stats, InHdrErrors);
 		netlog(f, Logip, "ip: bad version 0x%x\n", (h->vcf[0] & 0xF0) >> 2);
 		freeblist(bp);
 		return;
@@ -406,7 +371,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		r = v6lookup(f, h->dst, NULL);
 
 		if (r == NULL || sr == r) {
-			ip->stats[OutDiscards]++;
+			percpu_ctr_inc(&ip->stats, OutDiscards);
 			freeblist(bp);
 			return;
 		}
@@ -414,7 +379,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		/* don't forward if packet has timed out */
 		hop = h->ttl;
 		if (hop < 1) {
-			ip->stats[InHdrErrors]++;
+			percpu_ctr_inc(&ip->stats, InHdrErrors);
 			icmpttlexceeded6(f, ifc, bp);
 			freeblist(bp);
 			return;
@@ -426,7 +391,7 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 		if (bp == NULL)
 			return;
 
-		ip->stats[ForwDatagrams]++;
+		percpu_ctr_inc(&ip->stats, ForwDatagrams);
 		h = (struct ip6hdr *)(bp->rp);
 		tos = IPV6CLASS(h);
 		hop = h->ttl;
@@ -444,65 +409,16 @@ void ipiput6(struct Fs *f, struct Ipifc *ifc, struct block *bp)
 	proto = h->proto;
 	p = Fsrcvpcol(f, proto);
 	if (p != NULL && p->rcv != NULL) {
-		ip->stats[InDelivers]++;
+		percpu_ctr_inc(&ip->stats, InDelivers);
 		(*p->rcv) (p, ifc, bp);
 		return;
 	}
 
-	ip->stats[InDiscards]++;
-	ip->stats[InUnknownProtos]++;
+	percpu_ctr_inc(&ip->stats, InDiscards);
+	percpu_ctr_inc(&ip->stats, InUnknownProtos);
 	freeblist(bp);
 }
 
-/*
- * ipfragfree6 - copied from ipfragfree4 - assume hold fraglock6
- */
-void ipfragfree6(struct IP *ip, struct fragment6 *frag)
-{
-	struct fragment6 *fl, **l;
-
-	if (frag->blist)
-		freeblist(frag->blist);
-
-	memset(frag->src, 0, IPaddrlen);
-	frag->id = 0;
-	frag->blist = NULL;
-
-	l = &ip->flisthead6;
-	for (fl = *l; fl; fl = fl->next) {
-		if (fl == frag) {
-			*l = frag->next;
-			break;
-		}
-		l = &fl->next;
-	}
-
-	frag->next = ip->fragfree6;
-	ip->fragfree6 = frag;
-
-}
-
-/*
- * ipfragallo6 - copied from ipfragalloc4
- */
-struct fragment6 *ipfragallo6(struct IP *ip)
-{
-	struct fragment6 *f;
-
-	while (ip->fragfree6 == NULL) {
-		/* free last entry on fraglist */
-		for (f = ip->flisthead6; f->next; f = f->next) ;
-		ipfragfree6(ip, f);
-	}
-	f = ip->fragfree6;
-	ip->fragfree6 = f->next;
-	f->next = ip->flisthead6;
-	ip->flisthead6 = f;
-	f->age = NOW + 30000;
-
-	return f;
-}
-
 static struct block *procxtns(struct IP *ip, struct block *bp, int doreasm)
 {
 
@@ -570,178 +486,29 @@ struct block *procopts(struct block *bp)
 struct block *ip6reassemble(struct IP *ip, int uflen, struct block *bp,
                             struct ip6hdr *ih)
 {
-
-	int fend, offset;
-	unsigned int id;
-	struct fragment6 *f, *fnext;
 	struct fraghdr6 *fraghdr;
-	uint8_t src[IPaddrlen], dst[IPaddrlen];
-	struct block *bl, **l, *last, *prev;
-	int ovlap, len, fragsize, pktposn;
+	struct Ipfrag fg;
+	int len;
 
+	bp = pullupblock(bp, uflen + IP6FHDR);
+	if (bp == NULL)
+		return NULL;
+	ih = (struct ip6hdr *)(bp->rp);
 	fraghdr = (struct fraghdr6 *)(bp->rp + uflen);
-	memmove(src, ih->src, IPaddrlen);
-	memmove(dst, ih->dst, IPaddrlen);
-	id = nhgetl(fraghdr->id);
-	offset = nhgets(fraghdr->offsetRM) & ~7;
-
-	/*
-	 *  block lists are too hard, pullupblock into a single block
-	 */
-	if (bp->next) {
-		bp = pullupblock(bp, blocklen(bp));
-		ih = (struct ip6hdr *)(bp->rp);
-	}
-
-	qlock(&ip->fraglock6);
-
-	/*
-	 *  find a reassembly queue for this fragment
-	 */
-	for (f = ip->flisthead6; f; f = fnext) {
-		fnext = f->next;
-		if (ipcmp(f->src, src) == 0 && ipcmp(f->dst, dst) == 0 && f->id == id)
-			break;
-		if (f->age < NOW) {
-			ip->stats[ReasmTimeout]++;
-			ipfragfree6(ip, f);
-		}
-	}
-
-	/*
-	 *  if this isn't a fragmented packet, accept it
-	 *  and get rid of any fragments that might go
-	 *  with it.
-	 */
-	if (nhgets(fraghdr->offsetRM) == 0) {	// first frag is also the last
-		if (f != NULL) {
-			ipfragfree6(ip, f);
-			ip->stats[ReasmFails]++;
-		}
-		qunlock(&ip->fraglock6);
-		return bp;
-	}
-
-	if (bp->base + sizeof(struct Ipfrag) >= bp->rp) {
-		bp = padblock(bp, sizeof(struct Ipfrag));
-		bp->rp += sizeof(struct Ipfrag);
-	}
-
-	BKFG(bp)->foff = offset;
-	BKFG(bp)->flen = nhgets(ih->ploadlen) + IP6HDR - uflen - IP6FHDR;
-
-	/* First fragment allocates a reassembly queue */
-	if (f == NULL) {
-		f = ipfragallo6(ip);
-		f->id = id;
-		memmove(f->src, src, IPaddrlen);
-		memmove(f->dst, dst, IPaddrlen);
-
-		f->blist = bp;
-
-		qunlock(&ip->fraglock6);
-		ip->stats[ReasmReqds]++;
+	fg.foff = nhgets(fraghdr->offsetRM) & ~7;
+	fg.flen = nhgets(ih->ploadlen) + IP6HDR - uflen - IP6FHDR;
+	fg.hlen = uflen + IP6FHDR;
+	fg.last = (fraghdr->offsetRM[1] & 1) == 0;
+	/* v6 fragments are matched on (src, dst, id) alone */
+	bp = ipfragadd(ip->frag6, bp, &fg, ih->src, ih->dst, nhgetl(fraghdr->id),
+	               0, &len);
+	if (bp == NULL)
 		return NULL;
-	}
-
-	/*
-	 *  find the new fragment's position in the queue
-	 */
-	prev = NULL;
-	l = &f->blist;
-	bl = f->blist;
-	while (bl != NULL && BKFG(bp)->foff > BKFG(bl)->foff) {
-		prev = bl;
-		l = &bl->next;
-		bl = bl->next;
-	}
-
-	/* Check overlap of a previous fragment - trim away as necessary */
-	if (prev) {
-		ovlap = BKFG(prev)->foff + BKFG(prev)->flen - BKFG(bp)->foff;
-		if (ovlap > 0) {
-			if (ovlap >= BKFG(bp)->flen) {
-				freeblist(bp);
-				qunlock(&ip->fraglock6);
-				return NULL;
-			}
-			BKFG(prev)->flen -= ovlap;
-		}
-	}
-
-	/* Link onto assembly queue */
-	bp->next = *l;
-	*l = bp;
-
-	/* Check to see if succeeding segments overlap */
-	if (bp->next) {
-		l = &bp->next;
-		fend = BKFG(bp)->foff + BKFG(bp)->flen;
-
-		/* Take completely covered segments out */
-
-		while (*l) {
-			ovlap = fend - BKFG(*l)->foff;
-
-			if (ovlap <= 0)
-				break;
-			if (ovlap < BKFG(*l)->flen) {
-				BKFG(*l)->flen -= ovlap;
-				BKFG(*l)->foff += ovlap;
-				/* move up ih hdrs */
-				memmove((*l)->rp + ovlap, (*l)->rp, uflen);
-				(*l)->rp += ovlap;
-				break;
-			}
-			last = (*l)->next;
-			(*l)->next = NULL;
-			freeblist(*l);
-			*l = last;
-		}
-	}
-
-	/*
-	 *  look for a complete packet.  if we get to a fragment
-	 *  with the trailing bit of fraghdr->offsetRM[1] set, we're done.
-	 */
-	pktposn = 0;
-	for (bl = f->blist; bl; bl = bl->next) {
-		if (BKFG(bl)->foff != pktposn)
-			break;
 
-		fraghdr = (struct fraghdr6 *)(bl->rp + uflen);
-		if ((fraghdr->offsetRM[1] & 1) == 0) {
-			bl = f->blist;
-
-			/* get rid of frag header in first fragment */
-
-			memmove(bl->rp + IP6FHDR, bl->rp, uflen);
-			bl->rp += IP6FHDR;
-			len = nhgets(((struct ip6hdr *)(bl->rp))->ploadlen) - IP6FHDR;
-			bl->wp = bl->rp + len + IP6HDR;
-
-			/* Pullup all the fragment headers and
-			 * return a complete packet
-			 */
-			for (bl = bl->next; bl; bl = bl->next) {
-				fragsize = BKFG(bl)->flen;
-				len += fragsize;
-				bl->rp += uflen + IP6FHDR;
-				bl->wp = bl->rp + fragsize;
-			}
-
-			bl = f->blist;
-			f->blist = NULL;
-			ipfragfree6(ip, f);
-			ih = (struct ip6hdr *)(bl->rp);
-			hnputs(ih->ploadlen, len);
-			qunlock(&ip->fraglock6);
-			ip->stats[ReasmOKs]++;
-			return bl;
-		}
-		pktposn += BKFG(bl)->flen;
-	}
-	qunlock(&ip->fraglock6);
-
-	return NULL;
+	/* get rid of frag header in first fragment */
+	memmove(bp->rp + IP6FHDR, bp->rp, uflen);
+	bp->rp += IP6FHDR;
+	ih = (struct ip6hdr *)(bp->rp);
+	hnputs(ih->ploadlen, uflen - IP6HDR + len);
+	return bp;
 }
@@ -40,106 +40,165 @@
 #include <smp.h>
 #include <ip.h>
 
+/* Loopback packets don't go through a kproc.  loopbackbwrite() puts them on
+ * the sending core's backlog and, if the backlog was idle, sends a routine
+ * kernel message to its own core to run ipiput on them.  Routine messages run
+ * before the core goes back to userspace or idles, so a sender's syscall
+ * delivers its own packets on its way out: no queue hop to another kthread, no
+ * context switch and no IPI.
+ *
+ * We can't call ipiput right from bwrite.  The sender holds locks that the
+ * receive path wants (e.g. TCP's conv qlock around tcpoutput()), and the
+ * receiver's reply would want the sender's.  By the time the kmsg runs, the
+ * sender has let go of everything.  Packets sent while draining (ACKs,
+ * replies) go on the same backlog and the drain loop picks them up, so there
+ * is no recursion.  A drain does at most LoopbackBudget packets before it
+ * requeues itself, to let other routine work run, and a backlog holds at most
+ * LoopbackBacklogMax packets, since a kthread that never blocks won't drain
+ * its core's.
+ *
+ * TCP and UDP leave their checksums to the device (Btcpck, Budpck), and we
+ * never compute them: the packet never left memory.  The receive side skips
+ * checking those, and we tell it to skip the IP header's too (Bipck). */
 enum {
 	Maxtu = 16 * 1024,
+	LoopbackBudget = 64,
+	LoopbackBacklogMax = 1024,
 };
 
 typedef struct LB LB;
+
+struct lb_backlog {
+	spinlock_t lock;
+	LB *lb;
+	bool scheduled;				/* a drain kmsg is pending or running */
+	struct block *head;
+	struct block *tail;
+	unsigned int len;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
 struct LB {
-	struct proc *readp;
-	struct queue *q;
 	struct Fs *f;
+	struct Ipifc *ifc;
+	bool unbound;
+	struct lb_backlog *backlog;	/* one per core */
 };
 
-static void loopbackread(void *a);
+static void loopback_deliver(LB *lb, struct block *bp)
+{
+	ERRSTACK(1);
+	struct Ipifc *ifc = lb->ifc;
+
+	ifc->in++;
+	if (!canrlock(&ifc->rwlock)) {
+		freeb(bp);
+		return;
+	}
+	/* "discard the error" style, like the medium kprocs */
+	if (!waserror()) {
+		if (lb->unbound || ifc->lifc == NULL) {
+			freeb(bp);
+		} else {
+			ipifc_trace_block(ifc, bp);
+			bp->flag |= Bipck;
+			if ((bp->rp[0] & 0xF0) == IP_VER6)
+				ipiput6(lb->f, ifc, bp);
+			else
+				ipiput4(lb->f, ifc, bp);
+		}
+	}
+	poperror();
+	runlock(&ifc->rwlock);
+}
+
+/* Kmsg handler, runs on the backlog's core (at least until ipiput blocks). */
+static void __loopback_drain(uint32_t srcid, long a0, long a1, long a2)
+{
+	struct lb_backlog *bl = (struct lb_backlog*)a0;
+	struct block *bp;
+
+	for (int i = 0; i < LoopbackBudget; i++) {
+		spin_lock(&bl->lock);
+		bp = bl->head;
+		if (!bp) {
+			bl->scheduled = FALSE;
+			spin_unlock(&bl->lock);
+			return;
+		}
+		bl->head = bp->list;
+		if (!bl->head)
+			bl->tail = NULL;
+		bl->len--;
+		spin_unlock(&bl->lock);
+		bp->list = NULL;
+		loopback_deliver(bl->lb, bp);
+	}
+	/* Still scheduled, just at the back of the line */
+	send_kernel_message(core_id(), __loopback_drain, (long)bl, 0, 0,
+	                    KMSG_ROUTINE);
+}
 
 static void
 loopbackbind(struct Ipifc *ifc, int unused_int, char **unused_char_pp_t)
 {
 	LB *lb;
 
-	lb = kzmalloc(sizeof(*lb), 0);
+	lb = kzmalloc(sizeof(*lb), MEM_WAIT);
 	lb->f = ifc->conv->p->f;
-	/* TO DO: make queue size a function of kernel memory */
-	lb->q = qopen(128 * 1024, Qmsg, NULL, NULL);
+	lb->ifc = ifc;
+	lb->backlog = kzmalloc(num_cores * sizeof(struct lb_backlog), MEM_WAIT);
+	for (int i = 0; i < num_cores; i++) {
+		spinlock_init(&lb->backlog[i].lock);
+		lb->backlog[i].lb = lb;
+	}
 	ifc->arg = lb;
 	ifc->mbps = 1000;
-
-	ktask("loopbackread", loopbackread, ifc);
-
 }
 
+/* Drain kmsgs can be in flight on any core, so we never free the LB.  Packets
+ * that show up from now on get dropped. */
 static void loopbackunbind(struct Ipifc *ifc)
 {
 	LB *lb = ifc->arg;
 
-	printk("%s is messed up, shouldn't track procs\n", __FUNCTION__);
-
-	/*if(lb->readp)
-	   postnote(lb->readp, 1, "unbind", 0);
-	 */
-
-	/* wait for reader to die */
-	while (lb->readp != 0)
-		kthread_usleep(300 * 1000);
-
-	/* clean up */
-	qfree(lb->q);
-	kfree(lb);
+	lb->unbound = TRUE;
 }
 
 static void
 loopbackbwrite(struct Ipifc *ifc, struct block *bp, int unused_int,
 			   uint8_t * unused_uint8_p_t)
 {
-	LB *lb;
+	LB *lb = ifc->arg;
+	struct lb_backlog *bl = &lb->backlog[core_id()];
+	bool kick = FALSE;
 
-	ptclcsum_finalize(bp, 0);
-	lb = ifc->arg;
-	if (qpass(lb->q, bp) < 0)
-		ifc->outerr++;
 	ifc->out++;
-}
-
-static void loopbackread(void *a)
-{
-	ERRSTACK(2);
-	struct Ipifc *ifc;
-	struct block *bp;
-	LB *lb;
-
-	ifc = a;
-	lb = ifc->arg;
-	lb->readp = current;	/* hide identity under a rock for unbind */
-	if (waserror()) {
-		lb->readp = 0;
-		warn("loopbackread exits unexpectedly");
+	/* As far as the sender is concerned, the packet is gone.  Its blocks would
+	 * otherwise count as in flight until the peer reads them. */
+	for (struct block *b = bp; b; b = b->next)
+		block_txdone(b);
+	spin_lock(&bl->lock);
+	if (bl->len >= LoopbackBacklogMax) {
+		spin_unlock(&bl->lock);
+		freeb(bp);
+		ifc->outerr++;
 		return;
-		poperror();
 	}
-	for (;;) {
-		bp = qbread(lb->q, Maxtu);
-		if (bp == NULL)
-			continue;
-		ifc->in++;
-		if (!canrlock(&ifc->rwlock)) {
-			freeb(bp);
-			continue;
-		}
-		if (waserror()) {
-			runlock(&ifc->rwlock);
-			nexterror();
-		}
-		if (ifc->lifc == NULL) {
-			freeb(bp);
-		} else {
-			ipifc_trace_block(ifc, bp);
-			ipiput4(lb->f, ifc, bp);
-		}
-		runlock(&ifc->rwlock);
-		poperror();
+	bp->list = NULL;
+	if (bl->tail)
+		bl->tail->list = bp;
+	else
+		bl->head = bp;
+	bl->tail = bp;
+	bl->len++;
+	if (!bl->scheduled) {
+		bl->scheduled = TRUE;
+		kick = TRUE;
 	}
-	poperror();
+	spin_unlock(&bl->lock);
+	if (kick)
+		send_kernel_message(core_id(), __loopback_drain, (long)bl, 0, 0,
+		                    KMSG_ROUTINE);
 }
 
 struct medium loopbackmedium = {
@@ -61,6 +61,7 @@ void netifinit(struct ether *nif, char *name, int nfile, uint32_t limit)
 	else
 		nif->nfile = 0;
 	nif->limit = limit;
+	percpu_ctrs_init(&nif->pkts, Nnetifpkts, MEM_WAIT);
 }
 
 /*
@@ -276,6 +277,8 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 	switch (NETTYPE(c->qid.path)) {
 		case Ndataqid:
 			f = nif->f[NETID(c->qid.path)];
+			if (etherring_on(f))
+				return etherring_read(f, a, n);
 			return qread(f->in, a, n);
 		case Nctlqid:
 			return readnum(offset, a, n, NETID(c->qid.path), NUMSIZE);
@@ -283,14 +286,16 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 			p = kzmalloc(READSTR, 0);
 			if (p == NULL)
 				return 0;
-			j = snprintf(p, READSTR, "in: %d\n", nif->inpackets);
+			j = snprintf(p, READSTR, "in: %llu\n",
+			             percpu_ctr_sum(&nif->pkts, NetifInPackets));
 			j += snprintf(p + j, READSTR - j, "link: %d\n", nif->link);
-			j += snprintf(p + j, READSTR - j, "out: %d\n", nif->outpackets);
+			j += snprintf(p + j, READSTR - j, "out: %llu\n",
+			              percpu_ctr_sum(&nif->pkts, NetifOutPackets));
 			j += snprintf(p + j, READSTR - j, "crc errs: %d\n", nif->crcs);
 			j += snprintf(p + j, READSTR - j, "overflows: %d\n",
 						  nif->overflows);
-			j += snprintf(p + j, READSTR - j, "soft overflows: %d\n",
-						  nif->soverflows);
+			j += snprintf(p + j, READSTR - j, "soft overflows: %llu\n",
+			              percpu_ctr_sum(&nif->pkts, NetifSoverflows));
 			j += snprintf(p + j, READSTR - j, "framing errs: %d\n",
 						  nif->frames);
 			j += snprintf(p + j, READSTR - j, "buffer errs: %d\n", nif->buffs);
@@ -316,7 +321,22 @@ netifread(struct ether *nif, struct chan *c, void *a, long n,
 				j += snprintf(p + j, READSTR - j, "tso ");
 			if (nif->feat & NETF_LRO)
 				j += snprintf(p + j, READSTR - j, "lro ");
-			snprintf(p + j, READSTR - j, "\n");
+			j += snprintf(p + j, READSTR - j, "\n");
+			for (i = 0; i < nif->nrxq; i++)
+				j += snprintf(p + j, READSTR - j, "rxq %d: core %d in %llu\n",
+				              i, nif->rxq[i].coreid, nif->rxq[i].packets);
+			for (i = 0; i < nif->nrxq; i++) {
+				if (!nif->rxq[i].poll)
+					continue;
+				j += snprintf(p + j, READSTR - j,
+				              "poll %d: irqs %llu polls %llu busy %llu "
+				              "rdpolls %llu pkts %llu ppp %u itr %u%s\n",
+				              i, nif->rxq[i].irqs, nif->rxq[i].polls,
+				              nif->rxq[i].busypolls, nif->rxq[i].rdpolls,
+				              nif->rxq[i].packets,
+				              nif->rxq[i].ppp / 16, nif->rxq[i].itr,
+				              nif->rxq[i].itrauto ? " auto" : "");
+			}
 			n = readstr(offset, a, n, p);
 			kfree(p);
 			return n;
@@ -439,6 +459,8 @@ long netifwrite(struct ether *nif, struct chan *c, void *a, long n)
 		p = netmulti(nif, f, binaddr, 0);
 		if (p)
 			error(EFAIL, p);
+	} else if ((p = matchtoken(buf, "ring")) != 0) {
+		etherringctl(f, p);
 	} else if (matchtoken(buf, "oneblock")) {
 		/* Qmsg + Qcoal = one block at a time. */
 		q_toggle_qmsg(f->in, TRUE);
@@ -532,6 +554,7 @@ void netifclose(struct ether *nif, struct chan *c)
 		f->type = 0;
 		f->bridge = 0;
 		f->headersonly = 0;
+		etherringclose(f);
 		qclose(f->in);
 	}
 	qunlock(&f->qlock);
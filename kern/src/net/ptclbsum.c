@@ -48,175 +48,179 @@ static uint8_t *aendian = (uint8_t *) & endian;
 
 #ifdef CONFIG_X86
 
-/* $NetBSD: in_cksum.c,v 1.7 1997/09/02 13:18:15 thorpej Exp $ */
+#include <cpu_feat.h>
 
-/*-
- * Copyright (c) 1988, 1992, 1993
- *	The Regents of the University of California.  All rights reserved.
- * Copyright (c) 1996
- *	Matt Thomas <matt@3am-software.com>
+/* x86 checksum kernels.
  *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions
- * are met:
- * 1. Redistributions of source code must retain the above copyright
- *    notice, this list of conditions and the following disclaimer.
- * 2. Redistributions in binary form must reproduce the above copyright
- *    notice, this list of conditions and the following disclaimer in the
- *    documentation and/or other materials provided with the distribution.
- * 3. All advertising materials mentioning features or use of this software
- *    must display the following acknowledgement:
- *	This product includes software developed by the University of
- *	California, Berkeley and its contributors.
- * 4. Neither the name of the University nor the names of its contributors
- *    may be used to endorse or promote products derived from this software
- *    without specific prior written permission.
+ * The ones-complement sum is endian-neutral, so we sum the buffer as a string
+ * of little-endian 64 bit words with end-around carry and only swap when we
+ * fold down to 16 bits.  x86 doesn't care about alignment, so we never need to
+ * mask or rotate for odd addresses; the result is the same as if the data
+ * started at an even address.
  *
- * THIS SOFTWARE IS PROVIDED BY THE REGENTS AND CONTRIBUTORS ``AS IS'' AND
- * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
- * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
- * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
- * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
- * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
- * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
- * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
- * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
- * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
- * SUCH DAMAGE.
+ * We don't use SSE/AVX: the kernel is built with -mno-sse, and the user's FPU
+ * state is still live when we run protocol code on its behalf.  Saving and
+ * restoring it (xsave/xrstor) costs more than we'd gain for MTU-sized packets.
+ * Instead, the main loops keep the adds in the integer carry chain: one chain
+ * with adc, or two independent chains with adcx/adox on CPUs with ADX.  Either
+ * way, we're doing 8 bytes per add and are mostly limited by loads.
  *
- *	@(#)in_cksum.c	8.1 (Berkeley) 6/10/93
- */
+ * The loops are careful to only use instructions that preserve the flags they
+ * are carrying (lea, mov, dec for CF, jrcxz). */
 
-/*
- * Checksum routine for Internet Protocol family headers
- *    (Portable Alpha version).
- *
- * This routine is very heavily used in the network
- * code and should be modified for each CPU to be as fast as possible.
- */
+static inline uint64_t csum_add64(uint64_t sum, uint64_t x)
+{
+	sum += x;
+	return sum + (sum < x);
+}
+
+/* Adds 64 bytes at a time, nr_chunks > 0 */
+static uint64_t csum_adc_loop(const uint8_t *buf, size_t nr_chunks,
+                              uint64_t sum)
+{
+	asm volatile("clc;"
+	             "1:"
+	             "adcq 0(%[buf]), %[sum];"
+	             "adcq 8(%[buf]), %[sum];"
+	             "adcq 16(%[buf]), %[sum];"
+	             "adcq 24(%[buf]), %[sum];"
+	             "adcq 32(%[buf]), %[sum];"
+	             "adcq 40(%[buf]), %[sum];"
+	             "adcq 48(%[buf]), %[sum];"
+	             "adcq 56(%[buf]), %[sum];"
+	             "leaq 64(%[buf]), %[buf];"
+	             "decq %[n];"
+	             "jnz 1b;"
+	             "adcq $0, %[sum];"
+	             : [sum] "+r" (sum), [buf] "+r" (buf), [n] "+r" (nr_chunks)
+	             :
+	             : "cc", "memory");
+	return sum;
+}
+
+/* Adds 64 bytes at a time, nr_chunks > 0, using two carry chains: CF (adcx)
+ * and OF (adox).  dec would clobber OF, so the loop counter lives in rcx and
+ * we test it with jrcxz. */
+static uint64_t csum_adx_loop(const uint8_t *buf, size_t nr_chunks,
+                              uint64_t sum)
+{
+	uint64_t sum2 = 0, zero = 0;
+
+	asm volatile("xorl %k[zero], %k[zero];"	/* clears CF and OF */
+	             "1:"
+	             "adcxq 0(%[buf]), %[sum];"
+	             "adoxq 8(%[buf]), %[sum2];"
+	             "adcxq 16(%[buf]), %[sum];"
+	             "adoxq 24(%[buf]), %[sum2];"
+	             "adcxq 32(%[buf]), %[sum];"
+	             "adoxq 40(%[buf]), %[sum2];"
+	             "adcxq 48(%[buf]), %[sum];"
+	             "adoxq 56(%[buf]), %[sum2];"
+	             "leaq 64(%[buf]), %[buf];"
+	             "leaq -1(%[n]), %[n];"
+	             "jrcxz 2f;"
+	             "jmp 1b;"
+	             "2:"
+	             "adcxq %[zero], %[sum];"
+	             "adoxq %[zero], %[sum2];"
+	             : [sum] "+r" (sum), [sum2] "+r" (sum2), [buf] "+r" (buf),
+	               [n] "+c" (nr_chunks), [zero] "+r" (zero)
+	             :
+	             : "cc", "memory");
+	return csum_add64(sum, sum2);
+}
 
-#define ADDCARRY(x)  (x > 65535 ? x -= 65535 : x)
-#define REDUCE32							  \
-    {									  \
-	q_util.q = sum;							  \
-	sum = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3];	  \
-    }
-#define REDUCE16							  \
-    {									  \
-	q_util.q = sum;							  \
-	l_util.l = q_util.s[0] + q_util.s[1] + q_util.s[2] + q_util.s[3]; \
-	sum = l_util.s[0] + l_util.s[1];				  \
-	ADDCARRY(sum);							  \
-    }
+/* Copies and adds 32 bytes at a time, nr_chunks > 0 */
+static uint64_t csum_copy_adc_loop(uint8_t *dst, const uint8_t *src,
+                                   size_t nr_chunks, uint64_t sum)
+{
+	uint64_t t0, t1, t2, t3;
+
+	asm volatile("clc;"
+	             "1:"
+	             "movq 0(%[src]), %[t0];"
+	             "movq 8(%[src]), %[t1];"
+	             "movq 16(%[src]), %[t2];"
+	             "movq 24(%[src]), %[t3];"
+	             "adcq %[t0], %[sum];"
+	             "movq %[t0], 0(%[dst]);"
+	             "adcq %[t1], %[sum];"
+	             "movq %[t1], 8(%[dst]);"
+	             "adcq %[t2], %[sum];"
+	             "movq %[t2], 16(%[dst]);"
+	             "adcq %[t3], %[sum];"
+	             "movq %[t3], 24(%[dst]);"
+	             "leaq 32(%[src]), %[src];"
+	             "leaq 32(%[dst]), %[dst];"
+	             "decq %[n];"
+	             "jnz 1b;"
+	             "adcq $0, %[sum];"
+	             : [sum] "+r" (sum), [src] "+r" (src), [dst] "+r" (dst),
+	               [n] "+r" (nr_chunks), [t0] "=&r" (t0), [t1] "=&r" (t1),
+	               [t2] "=&r" (t2), [t3] "=&r" (t3)
+	             :
+	             : "cc", "memory");
+	return sum;
+}
 
-static const uint32_t in_masks[] = {
-	/*0 bytes*/ /*1 byte*/	/*2 bytes*/ /*3 bytes*/
-	0x00000000, 0x000000FF, 0x0000FFFF, 0x00FFFFFF,	/* offset 0 */
-	0x00000000, 0x0000FF00, 0x00FFFF00, 0xFFFFFF00,	/* offset 1 */
-	0x00000000, 0x00FF0000, 0xFFFF0000, 0xFFFF0000,	/* offset 2 */
-	0x00000000, 0xFF000000, 0xFF000000, 0xFF000000,	/* offset 3 */
-};
+/* Adds the trailing 0..7 bytes, zero-extended, as one little-endian word. */
+static uint64_t csum_tail(const uint8_t *buf, size_t len, uint64_t sum)
+{
+	uint64_t x = 0;
 
-union l_util {
-	uint16_t s[2];
-	uint32_t l;
-};
-union q_util {
-	uint16_t s[4];
-	uint32_t l[2];
-	uint64_t q;
-};
+	for (int i = 0; i < len; i++)
+		x |= (uint64_t)buf[i] << (i * 8);
+	return csum_add64(sum, x);
+}
 
-static uint64_t
-in_cksumdata(const void *buf, int len)
+/* Folds a 64 bit little-endian sum to 16 bits, in network order. */
+static uint16_t csum_fold(uint64_t sum)
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return cpu_to_be16(sum);
+}
+
+uint16_t ptclbsum(uint8_t *addr, int len)
 {
-	const uint32_t *lw = (const uint32_t *) buf;
 	uint64_t sum = 0;
-	uint64_t prefilled;
-	int offset;
-	union q_util q_util;
+	size_t nr_chunks = len / 64;
 
-	if ((3 & (long) lw) == 0 && len == 20) {
-	     sum = (uint64_t) lw[0] + lw[1] + lw[2] + lw[3] + lw[4];
-	     REDUCE32;
-	     return sum;
+	if (nr_chunks) {
+		if (cpu_has_feat(CPU_FEAT_X86_ADX))
+			sum = csum_adx_loop(addr, nr_chunks, sum);
+		else
+			sum = csum_adc_loop(addr, nr_chunks, sum);
+		addr += nr_chunks * 64;
+		len -= nr_chunks * 64;
 	}
+	for (; len >= 8; len -= 8, addr += 8)
+		sum = csum_add64(sum, *(uint64_t*)addr);
+	return csum_fold(csum_tail(addr, len, sum));
+}
 
-	if ((offset = 3 & (long) lw) != 0) {
-		const uint32_t *masks = in_masks + (offset << 2);
-		lw = (uint32_t *) (((long) lw) - offset);
-		sum = *lw++ & masks[len >= 3 ? 3 : len];
-		len -= 4 - offset;
-		if (len <= 0) {
-			REDUCE32;
-			return sum;
-		}
-	}
-#if 0
-	/*
-	 * Force to cache line boundary.
-	 */
-	offset = 32 - (0x1f & (long) lw);
-	if (offset < 32 && len > offset) {
-		len -= offset;
-		if (4 & offset) {
-			sum += (uint64_t) lw[0];
-			lw += 1;
-		}
-		if (8 & offset) {
-			sum += (uint64_t) lw[0] + lw[1];
-			lw += 2;
-		}
-		if (16 & offset) {
-			sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-			lw += 4;
-		}
-	}
-#endif
-	/*
-	 * access prefilling to start load of next cache line.
-	 * then add current cache line
-	 * save result of prefilling for loop iteration.
-	 */
-	prefilled = lw[0];
-	while ((len -= 32) >= 4) {
-		uint64_t prefilling = lw[8];
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-		prefilled = prefilling;
-	}
-	if (len >= 0) {
-		sum += prefilled + lw[1] + lw[2] + lw[3]
-			+ lw[4] + lw[5] + lw[6] + lw[7];
-		lw += 8;
-	} else {
-		len += 32;
-	}
-	while ((len -= 16) >= 0) {
-		sum += (uint64_t) lw[0] + lw[1] + lw[2] + lw[3];
-		lw += 4;
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	uint64_t sum = 0, x;
+	size_t nr_chunks = len / 32;
+
+	if (nr_chunks) {
+		sum = csum_copy_adc_loop(dst, src, nr_chunks, sum);
+		dst += nr_chunks * 32;
+		src += nr_chunks * 32;
+		len -= nr_chunks * 32;
 	}
-	len += 16;
-	while ((len -= 4) >= 0) {
-		sum += (uint64_t) *lw++;
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		x = *(uint64_t*)src;
+		*(uint64_t*)dst = x;
+		sum = csum_add64(sum, x);
 	}
-	len += 4;
-	if (len > 0)
-		sum += (uint64_t) (in_masks[len] & *lw);
-	REDUCE32;
-	return sum;
-}
-uint16_t ptclbsum(uint8_t * addr, int len)
-{
-	uint64_t sum = in_cksumdata(addr, len);
-	union q_util q_util;
-	union l_util l_util;
-	if ((uintptr_t)addr & 1)
-		sum <<= 8;
-	REDUCE16;
-	return cpu_to_be16(sum);
+	memcpy(dst, src, len);
+	return csum_fold(csum_tail(src, len, sum));
 }
+
 #else
 uint16_t ptclbsum(uint8_t * addr, int len)
 {
@@ -284,4 +288,10 @@ uint16_t ptclbsum(uint8_t * addr, int len)
 
 	return losum & 0xffff;
 }
+
+uint16_t ptclbsum_copy(uint8_t *dst, uint8_t *src, int len)
+{
+	memcpy(dst, src, len);
+	return ptclbsum(dst, len);
+}
 #endif
@@ -0,0 +1,201 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Receive packet steering (RPS).
+ *
+ * Most NICs have a single receive path: one driver kproc that calls etheriq(),
+ * and one medium kproc (e.g. etherread4) that pulls packets off the netfile and
+ * calls ipiput.  Without RPS, all of the protocol processing for an interface
+ * happens on whatever core that medium kproc is on.
+ *
+ * With RPS, the medium kproc just hashes each packet's flow (the same Toeplitz
+ * hash that RSS NICs use) and hands it to a per-core backlog.  The backlog is
+ * drained by a routine kernel message on its core, which runs ipiput.  Packets
+ * of a flow always go to the same core, so there's no reordering within a flow.
+ *
+ * Turn it on with "rps core0 core1 ..." on the ipifc's ctl, and off with
+ * "rps off".  Each backlog holds at most RpsBacklogMax packets; past that we
+ * drop, like a full NIC ring would. */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <ip.h>
+
+enum {
+	RpsMaxCores = 64,
+	RpsBacklogMax = 1024,
+};
+
+struct rps_backlog {
+	spinlock_t lock;
+	struct Fs *f;
+	struct Ipifc *ifc;
+	int coreid;
+	bool scheduled;				/* a drain kmsg is pending or running */
+	struct block *head;
+	struct block *tail;
+	unsigned int len;
+	uint64_t packets;
+	uint64_t drops;
+	uint64_t kicks;
+} __attribute__((aligned(ARCH_CL_SIZE)));
+
+struct rps {
+	int ncores;
+	struct rps_backlog backlog[RpsMaxCores];
+};
+
+static void rps_deliver(struct Fs *f, struct Ipifc *ifc, struct block *bp)
+{
+	if ((bp->rp[0] & 0xF0) == IP_VER6)
+		ipiput6(f, ifc, bp);
+	else
+		ipiput4(f, ifc, bp);
+}
+
+/* Kmsg handler, runs on the backlog's core.  Keeps draining until the backlog
+ * is empty, so producers only need to kick us when we're not scheduled. */
+static void __rps_drain(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct rps_backlog *bl = (struct rps_backlog*)a0;
+	struct Ipifc *ifc = bl->ifc;
+	struct block *bp, *next;
+
+	for (;;) {
+		spin_lock(&bl->lock);
+		bp = bl->head;
+		bl->head = bl->tail = NULL;
+		bl->len = 0;
+		if (!bp)
+			bl->scheduled = FALSE;
+		spin_unlock(&bl->lock);
+		if (!bp)
+			return;
+		for (; bp; bp = next) {
+			next = bp->list;
+			bp->list = NULL;
+			if (!canrlock(&ifc->rwlock)) {
+				freeb(bp);
+				continue;
+			}
+			/* "discard the error" style, like the medium kprocs */
+			if (!waserror())
+				rps_deliver(bl->f, ifc, bp);
+			poperror();
+			runlock(&ifc->rwlock);
+		}
+	}
+}
+
+/* Called by a medium's receive kproc, with ifc rlocked, instead of ipiput. */
+void rps_input(struct Fs *f, struct Ipifc *ifc, struct block *bp)
+{
+	struct rps *rps = ifc->rps;
+	struct rps_backlog *bl;
+	int ncores = rps->ncores;
+	bool kick = FALSE;
+
+	if (!ncores) {
+		rps_deliver(f, ifc, bp);
+		return;
+	}
+	bl = &rps->backlog[ip_flow_hash(rss_default_key, bp->rp, BHLEN(bp))
+	                   % ncores];
+	spin_lock(&bl->lock);
+	if (bl->len >= RpsBacklogMax) {
+		bl->drops++;
+		spin_unlock(&bl->lock);
+		freeb(bp);
+		return;
+	}
+	bp->list = NULL;
+	if (bl->tail)
+		bl->tail->list = bp;
+	else
+		bl->head = bp;
+	bl->tail = bp;
+	bl->len++;
+	bl->packets++;
+	if (!bl->scheduled) {
+		bl->scheduled = TRUE;
+		bl->kicks++;
+		kick = TRUE;
+	}
+	spin_unlock(&bl->lock);
+	if (kick)
+		send_kernel_message(bl->coreid, __rps_drain, (long)bl, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+/* "rps off" or "rps core0 [core1 ...]".  Called with the ifc's conv locked.
+ * The rps struct is never freed once allocated, since packets may be in flight
+ * on any of its backlogs. */
+void rpsctl(struct Fs *f, struct Ipifc *ifc, char **argv, int argc)
+{
+	struct rps *rps = ifc->rps;
+	struct rps_backlog *bl;
+	int coreid, ncores;
+
+	if (argc < 2)
+		error(EINVAL, "usage: rps off | rps core0 [core1 ...]");
+	if (strcmp(argv[1], "off") == 0) {
+		if (rps)
+			rps->ncores = 0;
+		return;
+	}
+	ncores = argc - 1;
+	if (ncores > RpsMaxCores)
+		error(EINVAL, "rps: at most %d cores", RpsMaxCores);
+	for (int i = 1; i < argc; i++) {
+		coreid = atoi(argv[i]);
+		if (coreid < 0 || coreid >= num_cores)
+			error(EINVAL, "rps: bad core %d", coreid);
+	}
+	if (!rps) {
+		rps = kzmalloc(sizeof(struct rps), MEM_WAIT);
+		for (int i = 0; i < RpsMaxCores; i++) {
+			bl = &rps->backlog[i];
+			spinlock_init(&bl->lock);
+			bl->f = f;
+			bl->ifc = ifc;
+		}
+	}
+	/* Shrink first, so producers never see a backlog without a core */
+	rps->ncores = MIN(rps->ncores, ncores);
+	wmb();
+	for (int i = 0; i < ncores; i++)
+		rps->backlog[i].coreid = atoi(argv[i + 1]);
+	wmb();
+	rps->ncores = ncores;
+	ifc->rps = rps;
+}
+
+/* Appends "rpscore N pkts N drops N" for each backlog to buf. */
+int rpsstats(struct Ipifc *ifc, char *buf, int len)
+{
+	struct rps *rps = ifc->rps;
+	struct rps_backlog *bl;
+	int n = 0;
+
+	if (!rps)
+		return 0;
+	for (int i = 0; i < rps->ncores && n < len; i++) {
+		bl = &rps->backlog[i];
+		n += snprintf(buf + n, len - n,
+		              " rpscore %d rpspkts %llu rpsdrops %llu rpskicks %llu",
+		              bl->coreid, bl->packets, bl->drops, bl->kicks);
+	}
+	return n;
+}
@@ -53,6 +53,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <crypto/2sha.h>
 
 enum {
 	QMAX = 64 * 1024 - 1,
@@ -75,6 +76,8 @@ enum {
 	TcptimerDONE = 2,
 	MAX_TIME = (1 << 20),	/* Forever */
 	TCP_ACK = 50,	/* Timed ack sequence in ms */
+	TCP_INITSCALE = 3,	/* initial receive window is QMAX << this, at most */
+	TCP_MAXSCALE = 8,	/* window scale we offer on fast links */
 	MAXBACKMS = 9 * 60 * 1000,	/* longest backoff time (ms) before hangup */
 
 	URG = 0x20,	/* Data marked urgent */
@@ -108,6 +111,8 @@ enum {
 	ACTIVE = 8,
 	SYNACK = 16,
 	TSO = 32,
+	CORK = 64,	/* user asked us to hold partial segments */
+	NOAUTOCORK = 128,
 
 	LOGAGAIN = 3,
 	LOGDGAIN = 2,
@@ -127,6 +132,9 @@ enum {
 	Maxlimbo = 1000,	/* maximum procs waiting for response to SYN ACK */
 	NLHT = 256,	/* hash table size, must be a power of 2 */
 	LHTMASK = NLHT - 1,
+	SynCookieLimbo = 500,	/* past this many in limbo, answer SYNs with cookies */
+	SynCookieShift = 16,	/* cookie clock ticks every 2^16 ms */
+	SynCookieSecret = 16,	/* bytes */
 
 	HaveWS = 1 << 8,
 };
@@ -285,6 +293,16 @@ struct Tcpctl {
 	uint64_t time;				/* time Finwait2 or Syn_received was sent */
 	int nochecksum;				/* non-zero means don't send checksums */
 	int flgcnt;					/* number of flags in the sequence (FIN,SEQ) */
+	int autocorked;				/* holding data until tx_inflight drains */
+	struct {
+		uint32_t seq;			/* rcv.nxt that ends the current rtt sample */
+		uint64_t time;			/* when that sample started */
+		int rtt;				/* smoothed receiver-side rtt, ms */
+		uint64_t mark;			/* start of this drain measurement */
+		uint64_t read;			/* q_bytes_read(rq) at mark */
+		uint32_t space;			/* most the reader has drained in an rtt */
+		uint32_t grown;			/* window past its start, charged to rcvmem */
+	} rcvbuf;
 
 	union {
 		Tcp4hdr tcp4hdr;
@@ -323,8 +341,33 @@ struct Limbo {
 	uint8_t rexmits;			/* number of retransmissions */
 };
 
+/*
+ *  Once too many calls are in limbo, we stop keeping state for new ones and
+ *  answer their SYNs with a SYN cookie instead: the ISS of our SYN ACK encodes
+ *  everything we need to create the conversation, and the final ACK brings it
+ *  back (as ack - 1).  The cookie is
+ *
+ *	bits 31-27	a clock that ticks every 2^SynCookieShift ms
+ *	bits 26-24	the peer's MSS, as an index into syncookie_mss[]
+ *	bits 23-20	the peer's window scale + 1, or 0 if it sent none
+ *	bits 19-0	a keyed hash of all of the above, the 4-tuple and the irs
+ *
+ *  A cookie is good for one or two ticks.  What we lose is retransmission of
+ *  the SYN ACK and whatever the peer's MSS was between the table's entries.
+ *
+ *  The MAC is only 20 bits, so a blind ACK with a guessed cookie gets in one
+ *  time in 2^20 (twice that, counting the previous tick).  That's the price of
+ *  fitting it in the ISS; Linux makes the same trade with 24.  We only take
+ *  cookies back for a little while after sending some, and failed guesses show
+ *  up in SynCookiesFailed.  "syncookies off" turns them off entirely.
+ */
+static const uint16_t syncookie_mss[] = {
+	0, 536, 1220, 1400, 1440, 1460, 4312, 8960
+};
+
 int tcp_irtt = DEF_RTT;			/* Initial guess at round trip time */
 uint16_t tcp_mss = DEF_MSS;		/* Maximum segment size to be sent */
+long tcp_rcvmem_max = 256 << 20;	/* Budget for receive window growth */
 
 enum {
 	/* MIB stats */
@@ -345,6 +388,15 @@ enum {
 	HlenErrs,
 	LenErrs,
 	OutOfOrder,
+	SynCookiesSent,
+	SynCookiesRecv,
+	SynCookiesFailed,
+	OutDataSegs,
+	OutDataBytes,
+	AutoCorked,
+	Corked,
+	RcvWinGrows,
+	RcvBufMem,
 
 	Nstats
 };
@@ -365,6 +417,15 @@ static char *statnames[] = {
 	[HlenErrs] "HlenErrs",
 	[LenErrs] "LenErrs",
 	[OutOfOrder] "OutOfOrder",
+	[SynCookiesSent] "SynCookiesSent",
+	[SynCookiesRecv] "SynCookiesRecv",
+	[SynCookiesFailed] "SynCookiesFailed",
+	[OutDataSegs] "OutDataSegs",
+	[OutDataBytes] "OutDataBytes",
+	[AutoCorked] "AutoCorked",
+	[Corked] "Corked",
+	[RcvWinGrows] "RcvWinGrows",
+	[RcvBufMem] "RcvBufMem",
 };
 
 typedef struct Tcppriv Tcppriv;
@@ -380,11 +441,17 @@ struct tcppriv {
 	int nlimbo;
 	Limbo *lht[NLHT];
 
+	/* SYN cookies, for when limbo fills up */
+	uint8_t cookie_secret[SynCookieSecret];
+	bool cookie_secret_set;
+	uint64_t lastcookie;		/* when we last sent one */
+
 	/* for keeping track of tcpackproc */
 	qlock_t apl;
 	int ackprocstarted;
 
-	uint32_t stats[Nstats];
+	struct percpu_ctrs stats;	/* [Nstats] */
+	atomic_t rcvmem;			/* receive window growth, all convs */
 };
 
 /*
@@ -398,6 +465,10 @@ struct tcppriv {
  */
 int tcpporthogdefense = 0;
 
+/* Set to zero ("syncookies off") to go back to evicting calls from a full
+ * limbo */
+int tcpsyncookies = 1;
+
 int addreseq(Tcpctl *, struct tcppriv *, Tcp *, struct block *, uint16_t);
 void getreseq(Tcpctl *, Tcp *, struct block **, uint16_t *);
 void localclose(struct conv *, char *unused_char_p_t);
@@ -409,6 +480,9 @@ void tcpstart(struct conv *, int);
 void tcptimeout(void *);
 void tcpsndsyn(struct conv *, Tcpctl *);
 void tcprcvwin(struct conv *);
+static void tcprcvtune(struct conv *, Tcpctl *, struct tcppriv *, uint64_t);
+static void tcprcvrelease(struct tcppriv *, Tcpctl *);
+int seq_ge(uint32_t, uint32_t);
 void tcpacktimer(void *);
 void tcpkeepalive(void *);
 void tcpsetkacounter(Tcpctl *);
@@ -436,9 +510,9 @@ void tcpsetstate(struct conv *s, uint8_t newstate)
 		return;
 
 	if (oldstate == Established)
-		tpriv->stats[CurrEstab]--;
+		percpu_ctr_dec(&tpriv->stats, CurrEstab);
 	if (newstate == Established)
-		tpriv->stats[CurrEstab]++;
+		percpu_ctr_inc(&tpriv->stats, CurrEstab);
 
 	/**
 	print( "%d/%d %s->%s CurrEstab=%d\n", s->lport, s->rport,
@@ -450,6 +524,7 @@ void tcpsetstate(struct conv *s, uint8_t newstate)
 			qclose(s->rq);
 			qclose(s->wq);
 			qclose(s->eq);
+			tcprcvrelease(tpriv, tcb);
 			break;
 
 		case Close_wait:	/* Remote closes */
@@ -476,14 +551,15 @@ static int tcpstate(struct conv *c, char *state, int n)
 	s = (Tcpctl *) (c->ptcl);
 
 	return snprintf(state, n,
-					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d\n",
+					"%s qin %d qout %d srtt %d mdev %d cwin %u swin %u>>%d rwin %u>>%d timer.start %llu timer.count %llu rerecv %d katimer.start %d katimer.count %d rbuf %u rrtt %d rspace %u\n",
 					tcpstates[s->state],
 					c->rq ? qlen(c->rq) : 0,
 					c->wq ? qlen(c->wq) : 0,
 					s->srtt, s->mdev,
 					s->cwind, s->snd.wnd, s->rcv.scale, s->rcv.wnd,
 					s->snd.scale, s->timer.start, s->timer.count, s->rerecv,
-					s->katimer.start, s->katimer.count);
+					s->katimer.start, s->katimer.count, s->window,
+					s->rcvbuf.rtt, s->rcvbuf.space);
 }
 
 static int tcpinuse(struct conv *c)
@@ -621,6 +697,81 @@ void tcprcvwin(struct conv *s)
 		tcb->rcv.blocked = 1;
 }
 
+/*
+ *  Receive window autotuning.  A connection starts with the window
+ *  tcpsetscale() gave it, and once per rtt we look at how much the reader
+ *  drained from the rq.  If that's a new high, we grow the window (and the
+ *  rq limit) to two rtts' worth of it, so the sender isn't window-limited
+ *  while we measure again.  The most we can advertise is QMAX << snd.scale,
+ *  and all the growth together is capped at tcp_rcvmem_max.
+ *
+ *  We time the rtt from our side: note the right edge of the window we're
+ *  advertising, and see how long the data takes to get there.  A sender
+ *  that isn't window-limited makes this read long, which just slows growth.
+ */
+static void tcprcvrtt(Tcpctl *tcb, uint64_t now)
+{
+	int sample;
+
+	if (tcb->rcvbuf.time && seq_ge(tcb->rcv.nxt, tcb->rcvbuf.seq)) {
+		sample = MAX(now - tcb->rcvbuf.time, 1);
+		if (tcb->rcvbuf.rtt)
+			tcb->rcvbuf.rtt = (7 * tcb->rcvbuf.rtt + sample) / 8;
+		else
+			tcb->rcvbuf.rtt = sample;
+		tcb->rcvbuf.time = 0;
+	}
+	if (!tcb->rcvbuf.time) {
+		tcb->rcvbuf.seq = tcb->rcv.nxt + MAX(tcb->rcv.wnd, 1);
+		tcb->rcvbuf.time = now;
+	}
+}
+
+static void tcprcvtune(struct conv *s, Tcpctl *tcb, struct tcppriv *tpriv,
+                       uint64_t now)
+{
+	uint64_t read;
+	uint32_t drained, want;
+	long grow, old, over;
+
+	tcprcvrtt(tcb, now);
+	if (!tcb->rcvbuf.rtt || now - tcb->rcvbuf.mark < tcb->rcvbuf.rtt)
+		return;
+	read = q_bytes_read(s->rq);
+	drained = read - tcb->rcvbuf.read;
+	tcb->rcvbuf.read = read;
+	tcb->rcvbuf.mark = now;
+	if (drained <= tcb->rcvbuf.space)
+		return;
+	tcb->rcvbuf.space = drained;
+	want = MIN(2 * drained + 16 * tcb->mss, QMAX << tcb->snd.scale);
+	if (want <= tcb->window)
+		return;
+	grow = want - tcb->window;
+	old = atomic_fetch_and_add(&tpriv->rcvmem, grow);
+	if (old + grow > tcp_rcvmem_max) {
+		over = MIN(grow, old + grow - tcp_rcvmem_max);
+		atomic_add(&tpriv->rcvmem, -over);
+		grow -= over;
+		if (!grow)
+			return;
+	}
+	tcb->window += grow;
+	tcb->rcvbuf.grown += grow;
+	qsetlimit(s->rq, tcb->window);
+	percpu_ctr_inc(&tpriv->stats, RcvWinGrows);
+}
+
+/* Gives back a connection's window growth to the budget. */
+static void tcprcvrelease(struct tcppriv *tpriv, Tcpctl *tcb)
+{
+	if (!tcb->rcvbuf.grown)
+		return;
+	atomic_add(&tpriv->rcvmem, -(long)tcb->rcvbuf.grown);
+	tcb->window -= tcb->rcvbuf.grown;
+	tcb->rcvbuf.grown = 0;
+}
+
 void tcpacktimer(void *v)
 {
 	ERRSTACK(1);
@@ -646,7 +797,8 @@ void tcpacktimer(void *v)
 
 static void tcpcreate(struct conv *c)
 {
-	c->rq = qopen(QMAX, Qcoalesce, 0, 0);
+	/* tcpiput() is the only writer, and it holds the conv's qlock */
+	c->rq = qopen(QMAX, Qcoalesce | Qspsc, 0, 0);
 	c->wq = qopen(8 * QMAX, Qkick, tcpkick, c);
 }
 
@@ -817,7 +969,7 @@ int tcpmtu(struct Proto *tcp, uint8_t * addr, int version, int *scale,
 
 	if (ifc != NULL) {
 		if (ifc->mbps > 100)
-			*scale = HaveWS | 3;
+			*scale = HaveWS | TCP_MAXSCALE;
 		else if (ifc->mbps > 10)
 			*scale = HaveWS | 1;
 		else
@@ -839,6 +991,7 @@ void inittcpctl(struct conv *s, int mode)
 
 	tcb = (Tcpctl *) s->ptcl;
 
+	tcprcvrelease(s->p->priv, tcb);
 	memset(tcb, 0, sizeof(Tcpctl));
 
 	tcb->ssthresh = 65535;
@@ -899,6 +1052,36 @@ void inittcpctl(struct conv *s, int mode)
 	qsetlimit(s->rq, QMAX);
 }
 
+/*
+ *  for the ktests: tcprcvsetup makes s (with s->p from tcpalloc() and s->rq
+ *  open) a fresh connection that offered window scale sndscale, giving back
+ *  any growth it had.  tcprcvdata takes len more bytes of in-order data at
+ *  time now (ms), as tcpiput would, and returns the window.  tcprcvmem is the
+ *  growth charged to tcp_rcvmem_max.
+ */
+void tcprcvsetup(struct conv *s, int sndscale)
+{
+	inittcpctl(s, TCP_LISTEN);
+	tcpsetscale(s, (Tcpctl*)s->ptcl, HaveWS | sndscale, HaveWS | sndscale);
+}
+
+uint32_t tcprcvdata(struct conv *s, uint32_t len, uint64_t now)
+{
+	Tcpctl *tcb = (Tcpctl*)s->ptcl;
+
+	tcb->rcv.nxt += len;
+	tcprcvtune(s, tcb, s->p->priv, now);
+	tcprcvwin(s);
+	return tcb->window;
+}
+
+long tcprcvmem(struct Proto *tcp)
+{
+	struct tcppriv *tpriv = tcp->priv;
+
+	return atomic_read(&tpriv->rcvmem);
+}
+
 /*
  *  called with s qlocked
  */
@@ -928,13 +1111,13 @@ void tcpstart(struct conv *s, int mode)
 	iphtadd(&tpriv->ht, s);
 	switch (mode) {
 		case TCP_LISTEN:
-			tpriv->stats[PassiveOpens]++;
+			percpu_ctr_inc(&tpriv->stats, PassiveOpens);
 			tcb->flags |= CLONE;
 			tcpsetstate(s, Listen);
 			break;
 
 		case TCP_CONNECT:
-			tpriv->stats[ActiveOpens]++;
+			percpu_ctr_inc(&tpriv->stats, ActiveOpens);
 			tcb->flags |= ACTIVE;
 			tcpsndsyn(s, tcb);
 			tcpsetstate(s, Syn_sent);
@@ -1316,7 +1499,7 @@ sndrst(struct Proto *tcp, uint8_t * source, uint8_t * dest,
 			panic("sndrst: version %d", version);
 	}
 
-	tpriv->stats[OutRsts]++;
+	percpu_ctr_inc(&tpriv->stats, OutRsts);
 	rflags = RST;
 
 	/* convince the other end that this reset is in band */
@@ -1473,6 +1656,177 @@ int sndsynack(struct Proto *tcp, Limbo * lp)
 	return 0;
 }
 
+static uint32_t syncookie_hash(struct tcppriv *tpriv, Limbo *lp,
+                               uint32_t meta)
+{
+	uint8_t msg[SynCookieSecret + 2 * IPaddrlen + 12];
+	uint8_t digest[VB2_SHA1_DIGEST_SIZE];
+	uint8_t *m = msg;
+
+	memmove(m, tpriv->cookie_secret, SynCookieSecret);
+	m += SynCookieSecret;
+	memmove(m, lp->laddr, IPaddrlen);
+	m += IPaddrlen;
+	memmove(m, lp->raddr, IPaddrlen);
+	m += IPaddrlen;
+	hnputs(m, lp->lport);
+	hnputs(m + 2, lp->rport);
+	hnputl(m + 4, lp->irs);
+	hnputl(m + 8, meta);
+	vb2_digest_buffer(msg, sizeof(msg), VB2_HASH_SHA1, digest, sizeof(digest));
+	return nhgetl(digest);
+}
+
+static uint32_t syncookie_tick(void)
+{
+	return (NOW >> SynCookieShift) & 0x1f;
+}
+
+/* Makes lp->iss the cookie for lp, as of cookie clock tick */
+static void syncookie_make(struct tcppriv *tpriv, Limbo *lp, uint32_t tick)
+{
+	uint32_t meta;
+	int mss = 0;
+
+	if (!tpriv->cookie_secret_set) {
+		urandom_read(tpriv->cookie_secret, SynCookieSecret);
+		tpriv->cookie_secret_set = TRUE;
+	}
+	if (lp->mss) {
+		mss = 1;
+		while (mss + 1 < ARRAY_SIZE(syncookie_mss) &&
+		       syncookie_mss[mss + 1] <= lp->mss)
+			mss++;
+	}
+	meta = tick << 27 | mss << 24;
+	if (lp->rcvscale)
+		meta |= (MIN(lp->rcvscale & 0xff, 14) + 1) << 20;
+	lp->iss = meta | (syncookie_hash(tpriv, lp, meta) & 0xfffff);
+}
+
+/*
+ *  answer a SYN with a cookie instead of putting it in limbo
+ *
+ *  called with proto locked
+ */
+static void
+sndsyncookie(struct conv *s, uint8_t *source, uint8_t *dest, Tcp *seg,
+			 int version)
+{
+	struct tcppriv *tpriv = s->p->priv;
+	Limbo lp;
+
+	memset(&lp, 0, sizeof(lp));
+	lp.version = version;
+	ipmove(lp.laddr, dest);
+	ipmove(lp.raddr, source);
+	lp.lport = seg->dest;
+	lp.rport = seg->source;
+	lp.mss = seg->mss;
+	lp.rcvscale = seg->ws;
+	lp.irs = seg->seq;
+	syncookie_make(tpriv, &lp, syncookie_tick());
+	if (sndsynack(s->p, &lp) == 0) {
+		percpu_ctr_inc(&tpriv->stats, SynCookiesSent);
+		tpriv->lastcookie = NOW;
+	}
+}
+
+/*
+ *  the ACK to a SYN ACK that isn't in limbo might be bringing back a cookie.
+ *  if it is, returns a new Limbo for tcpincoming to use up.
+ *
+ *  called with proto locked
+ */
+static Limbo *syncookie_check(struct Proto *tcp, Tcp *segp, uint8_t *src,
+                              uint8_t *dst, uint8_t version, uint32_t tick)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	Limbo *lp;
+	uint32_t cookie = segp->ack - 1;
+	uint32_t meta = cookie & 0xfff00000;
+	int ws = (cookie >> 20) & 0xf;
+	int scale;
+	uint8_t flag = 0;
+
+	/* we only take cookies back for a while after handing some out */
+	if (!tcpsyncookies || !tpriv->lastcookie ||
+	    NOW - tpriv->lastcookie > 2ULL << SynCookieShift)
+		return NULL;
+	lp = kzmalloc(sizeof(*lp), 0);
+	if (lp == NULL)
+		return NULL;
+	lp->version = version;
+	ipmove(lp->laddr, dst);
+	ipmove(lp->raddr, src);
+	lp->lport = segp->dest;
+	lp->rport = segp->source;
+	lp->irs = segp->seq - 1;
+	if (((tick - (cookie >> 27)) & 0x1f) > 1 ||
+	    (syncookie_hash(tpriv, lp, meta) & 0xfffff) != (cookie & 0xfffff)) {
+		percpu_ctr_inc(&tpriv->stats, SynCookiesFailed);
+		kfree(lp);
+		return NULL;
+	}
+	percpu_ctr_inc(&tpriv->stats, SynCookiesRecv);
+	lp->iss = cookie;
+	lp->mss = syncookie_mss[(cookie >> 24) & 0x7];
+	if (ws) {
+		lp->rcvscale = HaveWS | (ws - 1);
+		tcpmtu(tcp, dst, version, &scale, &flag);
+		lp->sndscale = scale;
+	}
+	/* we don't know the RTT; make tcpincoming guess the default */
+	lp->lastsend = NOW - tcp_irtt;
+	return lp;
+}
+
+/*
+ *  for the ktests: the cookie we'd answer a v4 SYN (no window scaling) with at
+ *  cookie clock tick, and what an ACK bringing it back at tick gets us: the
+ *  MSS tcpincoming would use, or -1 if the cookie is refused.
+ */
+uint32_t tcpsyncookie(struct Proto *tcp, uint8_t *raddr, uint16_t rport,
+                      uint8_t *laddr, uint16_t lport, uint32_t irs,
+                      uint16_t mss, uint32_t tick)
+{
+	struct tcppriv *tpriv = tcp->priv;
+	Limbo lp;
+
+	memset(&lp, 0, sizeof(lp));
+	lp.version = V4;
+	ipmove(lp.laddr, laddr);
+	ipmove(lp.raddr, raddr);
+	lp.lport = lport;
+	lp.rport = rport;
+	lp.mss = mss;
+	lp.irs = irs;
+	syncookie_make(tpriv, &lp, tick & 0x1f);
+	tpriv->lastcookie = NOW;
+	return lp.iss;
+}
+
+int tcpsyncookiemss(struct Proto *tcp, uint8_t *raddr, uint16_t rport,
+                    uint8_t *laddr, uint16_t lport, uint32_t irs,
+                    uint32_t cookie, uint32_t tick)
+{
+	Tcp seg;
+	Limbo *lp;
+	int mss;
+
+	memset(&seg, 0, sizeof(seg));
+	seg.source = rport;
+	seg.dest = lport;
+	seg.seq = irs + 1;
+	seg.ack = cookie + 1;
+	lp = syncookie_check(tcp, &seg, raddr, laddr, V4, tick & 0x1f);
+	if (lp == NULL)
+		return -1;
+	mss = lp->mss;
+	kfree(lp);
+	return mss;
+}
+
 #define hashipa(a, p) ( ( (a)[IPaddrlen-2] + (a)[IPaddrlen-1] + p )&LHTMASK )
 
 /*
@@ -1506,6 +1860,10 @@ limbo(struct conv *s, uint8_t * source, uint8_t * dest, Tcp * seg, int version)
 	}
 	lp = *l;
 	if (lp == NULL) {
+		if (tcpsyncookies && tpriv->nlimbo >= SynCookieLimbo) {
+			sndsyncookie(s, source, dest, seg, version);
+			return;
+		}
 		if (tpriv->nlimbo >= Maxlimbo && tpriv->lht[h]) {
 			lp = tpriv->lht[h];
 			tpriv->lht[h] = lp->next;
@@ -1671,12 +2029,18 @@ static struct conv *tcpincoming(struct conv *s, Tcp * segp, uint8_t * src,
 		}
 		break;
 	}
-	if (lp == NULL)
-		return NULL;
+	if (lp == NULL) {
+		lp = syncookie_check(s->p, segp, src, dst, version,
+		                     syncookie_tick());
+		if (lp == NULL)
+			return NULL;
+	}
 
 	new = Fsnewcall(s, src, segp->source, dst, segp->dest, version);
-	if (new == NULL)
+	if (new == NULL) {
+		kfree(lp);
 		return NULL;
+	}
 
 	memmove(new->ptcl, s->ptcl, sizeof(Tcpctl));
 	tcb = (Tcpctl *) new->ptcl;
@@ -1970,7 +2334,7 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 	f = tcp->f;
 	tpriv = tcp->priv;
 
-	tpriv->stats[InSegs]++;
+	percpu_ctr_inc(&tpriv->stats, InSegs);
 
 	h4 = (Tcp4hdr *) (bp->rp);
 	h6 = (Tcp6hdr *) (bp->rp);
@@ -1989,8 +2353,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		hnputs(h4->tcplen, length - TCP4_PKT);
 		if (!(bp->flag & Btcpck) && (h4->tcpcksum[0] || h4->tcpcksum[1]) &&
 			ptclcsum(bp, TCP4_IPLEN, length - TCP4_IPLEN)) {
-			tpriv->stats[CsumErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, CsumErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp proto cksum\n");
 			freeblist(bp);
 			return;
@@ -1999,8 +2363,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 
 		hdrlen = ntohtcp4(&seg, &bp);
 		if (hdrlen < 0) {
-			tpriv->stats[HlenErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, HlenErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp hdr len\n");
 			return;
 		}
@@ -2015,8 +2379,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		length -= hdrlen + TCP4_PKT;
 		bp = trimblock(bp, hdrlen + TCP4_PKT, length);
 		if (bp == NULL) {
-			tpriv->stats[LenErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, LenErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "tcp len < 0 after trim\n");
 			return;
 		}
@@ -2034,8 +2398,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		hnputl(h6->vcf, length);
 		if ((h6->tcpcksum[0] || h6->tcpcksum[1]) &&
 			ptclcsum(bp, TCP6_IPLEN, length + TCP6_PHDRSIZE)) {
-			tpriv->stats[CsumErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, CsumErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp proto cksum\n");
 			freeblist(bp);
 			return;
@@ -2046,8 +2410,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 
 		hdrlen = ntohtcp6(&seg, &bp);
 		if (hdrlen < 0) {
-			tpriv->stats[HlenErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, HlenErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "bad tcp hdr len\n");
 			return;
 		}
@@ -2062,8 +2426,8 @@ void tcpiput(struct Proto *tcp, struct Ipifc *unused, struct block *bp)
 		length -= hdrlen;
 		bp = trimblock(bp, hdrlen + TCP6_PKT, length);
 		if (bp == NULL) {
-			tpriv->stats[LenErrs]++;
-			tpriv->stats[InErrs]++;
+			percpu_ctr_inc(&tpriv->stats, LenErrs);
+			percpu_ctr_inc(&tpriv->stats, InErrs);
 			netlog(f, Logtcp, "tcp len < 0 after trim\n");
 			return;
 		}
@@ -2243,7 +2607,7 @@ reset:
 	for (;;) {
 		if (seg.flags & RST) {
 			if (tcb->state == Established) {
-				tpriv->stats[EstabResets]++;
+				percpu_ctr_inc(&tpriv->stats, EstabResets);
 				if (tcb->rcv.nxt != seg.seq)
 					printd
 						("out of order RST rcvd: %I.%d -> %I.%d, rcv.nxt 0x%lx seq 0x%lx\n",
@@ -2359,6 +2723,7 @@ reset:
 					/*
 					 *  update our rcv window
 					 */
+					tcprcvtune(s, tcb, tpriv, NOW);
 					tcprcvwin(s);
 
 					/*
@@ -2450,6 +2815,79 @@ raise:
 	tcpkick(s);
 }
 
+/*
+ *  Autocorking: a write that leaves less than an MSS unsent doesn't go out
+ *  as a tiny segment if one of our earlier segments is still on its way out
+ *  (queued in the driver or below).  We count those with tx_inflight: each
+ *  segment's b->txdone is tcp_txdone(), and when the last one is freed (or
+ *  handed to the receive side by loopback) we kick tcpoutput() again, by which
+ *  time more writes have usually piled up.  This
+ *  is like Nagle, except that what we wait for is the NIC, not an RTT.  The
+ *  ack timer bounds the wait in case a block never comes back to freeb().
+ *
+ *  "cork" holds partial segments until "uncork" or a FIN, though they still
+ *  ride along with any ACK we have to send.  "autocork 0" sends every write
+ *  right away.
+ */
+static void __tcp_uncork(uint32_t srcid, long a0, long a1, long a2)
+{
+	ERRSTACK(1);
+	struct conv *s = (struct conv*)a0;
+	Tcpctl *tcb = (Tcpctl*)s->ptcl;
+
+	qlock(&s->qlock);
+	if (waserror()) {
+		qunlock(&s->qlock);
+		nexterror();
+	}
+	if (tcb->autocorked) {
+		tcb->autocorked = FALSE;
+		switch (tcb->state) {
+			case Established:
+			case Close_wait:
+				tcpoutput(s);
+		}
+	}
+	qunlock(&s->qlock);
+	poperror();
+}
+
+static void tcp_txdone(struct block *b)
+{
+	struct conv *s = b->free_arg;
+	Tcpctl *tcb = (Tcpctl*)s->ptcl;
+
+	/* The atomic is a full barrier; pairs with the mb in tcpcork(). */
+	if (atomic_fetch_and_add(&s->tx_inflight, -1) != 1)
+		return;
+	if (ACCESS_ONCE(tcb->autocorked))
+		send_kernel_message(core_id(), __tcp_uncork, (long)s, 0, 0,
+		                    KMSG_ROUTINE);
+}
+
+/* Returns TRUE if tcpoutput() should hold back a partial segment. */
+static bool tcpcork(struct conv *s, Tcpctl *tcb, struct tcppriv *tpriv)
+{
+	if (tcb->flags & CORK) {
+		percpu_ctr_inc(&tpriv->stats, Corked);
+		return TRUE;
+	}
+	if (tcb->flags & NOAUTOCORK)
+		return FALSE;
+	tcb->autocorked = TRUE;
+	mb();
+	/* Segments from the conv's last life can still be out there, and their
+	 * txdones drive the count below zero.  That's nothing in flight for us. */
+	if (atomic_read(&s->tx_inflight) <= 0) {
+		tcb->autocorked = FALSE;
+		return FALSE;
+	}
+	percpu_ctr_inc(&tpriv->stats, AutoCorked);
+	if (tcb->acktimer.state != TcptimerON)
+		tcpgo(tpriv, &tcb->acktimer);
+	return TRUE;
+}
+
 /*
  *  always enters and exits with the s locked.  We drop
  *  the lock to ipoput the packet so some care has to be
@@ -2543,6 +2981,12 @@ void tcpoutput(struct conv *s)
 			}
 		}
 
+		/* Partial segment with nothing after it: maybe wait for more */
+		if (ssize && ssize < tcb->mss && ssize == sndcnt - sent &&
+		    tcb->flgcnt == 0 && !(tcb->flags & FORCE) &&
+		    tcpcork(s, tcb, tpriv))
+			break;
+
 		dsize = ssize;
 		seg.urg = 0;
 
@@ -2616,7 +3060,7 @@ void tcpoutput(struct conv *s)
 			netlog(f, Logtcp, "rexmit: %I.%d -> %I.%d ptr 0x%lx nxt 0x%lx\n",
 				   s->raddr, s->rport, s->laddr, s->lport, tcb->snd.ptr,
 				   tcb->snd.nxt);
-			tpriv->stats[RetransSegs]++;
+			percpu_ctr_inc(&tpriv->stats, RetransSegs);
 		}
 
 		tcb->snd.ptr += ssize;
@@ -2668,7 +3112,16 @@ void tcpoutput(struct conv *s)
 				}
 		}
 
-		tpriv->stats[OutSegs]++;
+		percpu_ctr_inc(&tpriv->stats, OutSegs);
+		if (dsize) {
+			percpu_ctr_inc(&tpriv->stats, OutDataSegs);
+			percpu_ctr_add(&tpriv->stats, OutDataBytes, dsize);
+		}
+		if (!(tcb->flags & NOAUTOCORK) && !hbp->txdone) {
+			hbp->txdone = tcp_txdone;
+			hbp->free_arg = s;
+			atomic_inc(&s->tx_inflight);
+		}
 
 		/* put off the next keep alive */
 		tcpgo(tpriv, &tcb->katimer);
@@ -2875,7 +3328,7 @@ void tcptimeout(void *arg)
 				   tcb->snd.una, tcb->timer.start, NOW);
 			tcpsettimer(tcb);
 			tcprxmit(s);
-			tpriv->stats[RetransTimeouts]++;
+			percpu_ctr_inc(&tpriv->stats, RetransTimeouts);
 			tcb->snd.dupacks = 0;
 			break;
 		case Time_wait:
@@ -2939,7 +3392,7 @@ addreseq(Tcpctl * tcb, struct tcppriv *tpriv, Tcp * seg,
 		rp->next = rp1;
 		tcb->reseq = rp;
 		if (rp->next != NULL)
-			tpriv->stats[OutOfOrder]++;
+			percpu_ctr_inc(&tpriv->stats, OutOfOrder);
 		return 0;
 	}
 
@@ -2950,7 +3403,7 @@ addreseq(Tcpctl * tcb, struct tcppriv *tpriv, Tcp * seg,
 			rp->next = rp1->next;
 			rp1->next = rp;
 			if (rp->next != NULL)
-				tpriv->stats[OutOfOrder]++;
+				percpu_ctr_inc(&tpriv->stats, OutOfOrder);
 			break;
 		}
 		rp1 = rp1->next;
@@ -3125,6 +3578,55 @@ static void tcpporthogdefensectl(char *val)
 		error(EINVAL, "unknown value for tcpporthogdefense");
 }
 
+static void tcpsyncookiesctl(char **f, int n)
+{
+	if (n != 2)
+		error(EINVAL, "usage: syncookies on|off");
+	if (strcmp(f[1], "on") == 0)
+		tcpsyncookies = 1;
+	else if (strcmp(f[1], "off") == 0)
+		tcpsyncookies = 0;
+	else
+		error(EINVAL, "unknown value for syncookies");
+}
+
+/* "cork", "uncork", or "autocork 0|1", for the current connection. */
+static void tcpcorkctl(struct conv *c, char **f, int n)
+{
+	Tcpctl *tcb = (Tcpctl*)c->ptcl;
+
+	if (strcmp(f[0], "cork") == 0) {
+		tcb->flags |= CORK;
+		return;
+	}
+	if (strcmp(f[0], "uncork") == 0) {
+		tcb->flags &= ~CORK;
+	} else {
+		if (n != 2)
+			error(EINVAL, "usage: autocork 0|1");
+		if (atoi(f[1]))
+			tcb->flags &= ~NOAUTOCORK;
+		else
+			tcb->flags |= NOAUTOCORK;
+		tcb->autocorked = FALSE;
+	}
+	/* Send whatever we were holding */
+	switch (tcb->state) {
+		case Established:
+		case Close_wait:
+			tcpoutput(c);
+	}
+}
+
+/* "tcprcvmem BYTES": the budget for autotuned receive windows, see
+ * tcprcvtune(). */
+static void tcprcvmemctl(char **f, int n)
+{
+	if (n != 2)
+		error(EINVAL, "usage: tcprcvmem bytes");
+	tcp_rcvmem_max = strtol(f[1], 0, 0);
+}
+
 /* called with c qlocked */
 static void tcpctl(struct conv *c, char **f, int n)
 {
@@ -3136,6 +3638,14 @@ static void tcpctl(struct conv *c, char **f, int n)
 		tcpsetchecksum(c, f, n);
 	else if (n >= 1 && strcmp(f[0], "tcpporthogdefense") == 0)
 		tcpporthogdefensectl(f[1]);
+	else if (n >= 1 && strcmp(f[0], "syncookies") == 0)
+		tcpsyncookiesctl(f, n);
+	else if (n >= 1 && strcmp(f[0], "tcprcvmem") == 0)
+		tcprcvmemctl(f, n);
+	else if (n >= 1 && (strcmp(f[0], "cork") == 0 ||
+	                    strcmp(f[0], "uncork") == 0 ||
+	                    strcmp(f[0], "autocork") == 0))
+		tcpcorkctl(c, f, n);
 	else
 		error(EINVAL, "unknown command to %s", __func__);
 }
@@ -3147,10 +3657,12 @@ int tcpstats(struct Proto *tcp, char *buf, int len)
 	int i;
 
 	priv = tcp->priv;
+	percpu_ctr_set(&priv->stats, RcvBufMem, atomic_read(&priv->rcvmem));
 	p = buf;
 	e = p + len;
 	for (i = 0; i < Nstats; i++)
-		p = seprintf(p, e, "%s: %u\n", statnames[i], priv->stats[i]);
+		p = seprintf(p, e, "%s: %llu\n", statnames[i],
+		             percpu_ctr_sum(&priv->stats, i));
 	return p - buf;
 }
 
@@ -3224,16 +3736,18 @@ int dump_tcp_ht(void)
 	return 0;
 }
 
-void tcpinit(struct Fs *fs)
+/* A tcp Proto that isn't attached to an Fs yet.  tcpinit() attaches one; the
+ * ktests use their own and tcpfree() it. */
+struct Proto *tcpalloc(void)
 {
 	struct Proto *tcp;
 	struct tcppriv *tpriv;
 
-	tcp = kzmalloc(sizeof(struct Proto), 0);
-	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), 0);
-	debug_priv = tpriv;
+	tcp = kzmalloc(sizeof(struct Proto), MEM_WAIT);
+	tpriv = tcp->priv = kzmalloc(sizeof(struct tcppriv), MEM_WAIT);
 	qlock_init(&tpriv->tl);
 	qlock_init(&tpriv->apl);
+	percpu_ctrs_init(&tpriv->stats, Nstats, MEM_WAIT);
 	tcp->name = "tcp";
 	tcp->connect = tcpconnect;
 	tcp->announce = tcpannounce;
@@ -3251,8 +3765,24 @@ void tcpinit(struct Fs *fs)
 	tcp->ipproto = IP_TCPPROTO;
 	tcp->nc = 4096;
 	tcp->ptclsize = sizeof(Tcpctl);
-	tpriv->stats[MaxConn] = tcp->nc;
+	percpu_ctr_set(&tpriv->stats, MaxConn, tcp->nc);
+	return tcp;
+}
+
+void tcpfree(struct Proto *tcp)
+{
+	struct tcppriv *tpriv = tcp->priv;
+
+	percpu_ctrs_destroy(&tpriv->stats);
+	kfree(tpriv);
+	kfree(tcp);
+}
+
+void tcpinit(struct Fs *fs)
+{
+	struct Proto *tcp = tcpalloc();
 
+	debug_priv = tcp->priv;
 	Fsproto(fs, tcp);
 }
 
@@ -3262,7 +3792,7 @@ tcpsetscale(struct conv *s, Tcpctl * tcb, uint16_t rcvscale, uint16_t sndscale)
 	if (rcvscale) {
 		tcb->rcv.scale = rcvscale & 0xff;
 		tcb->snd.scale = sndscale & 0xff;
-		tcb->window = QMAX << tcb->snd.scale;
+		tcb->window = QMAX << MIN(tcb->snd.scale, TCP_INITSCALE);
 		qsetlimit(s->rq, tcb->window);
 	} else {
 		tcb->rcv.scale = 0;
@@ -40,6 +40,7 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <ros/net.h>
 
 #include <vfs.h>
 #include <kfs.h>
@@ -114,12 +115,13 @@ struct Udp6hdr {
 };
 
 /* MIB II counters */
-typedef struct Udpstats Udpstats;
-struct Udpstats {
-	uint32_t udpInDatagrams;
-	uint32_t udpNoPorts;
-	uint32_t udpInErrors;
-	uint32_t udpOutDatagrams;
+enum {
+	udpInDatagrams,
+	udpNoPorts,
+	udpInErrors,
+	udpOutDatagrams,
+
+	Nudpstats,
 };
 
 typedef struct Udppriv Udppriv;
@@ -127,7 +129,7 @@ struct Udppriv {
 	struct Ipht ht;
 
 	/* MIB counters */
-	Udpstats ustats;
+	struct percpu_ctrs ustats;	/* [Nudpstats] */
 
 	/* non-MIB stats */
 	uint32_t csumerr;			/* checksum errors */
@@ -380,7 +382,7 @@ void udpkick(void *x, struct block *bp)
 		default:
 			panic("udpkick: version %d", version);
 	}
-	upriv->ustats.udpOutDatagrams++;
+	percpu_ctr_inc(&upriv->ustats, udpOutDatagrams);
 }
 
 void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
@@ -388,7 +390,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 	int len;
 	Udp4hdr *uh4;
 	Udp6hdr *uh6;
-	struct conv *c;
+	struct conv *c, *nc;
 	Udpcb *ucb;
 	uint8_t raddr[IPaddrlen], laddr[IPaddrlen];
 	uint16_t rport, lport;
@@ -400,7 +402,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 
 	upriv = udp->priv;
 	f = udp->f;
-	upriv->ustats.udpInDatagrams++;
+	percpu_ctr_inc(&upriv->ustats, udpInDatagrams);
 
 	uh4 = (Udp4hdr *) (bp->rp);
 	version = ((uh4->vihl & 0xF0) == IP_VER6) ? V6 : V4;
@@ -425,7 +427,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 			if (!(bp->flag & Budpck) &&
 			    (uh4->udpcksum[0] || uh4->udpcksum[1]) &&
 			    ptclcsum(bp, UDP4_PHDR_OFF, len + UDP4_PHDR_SZ)) {
-				upriv->ustats.udpInErrors++;
+				percpu_ctr_inc(&upriv->ustats, udpInErrors);
 				netlog(f, Logudp, "udp: checksum error %I\n",
 				       raddr);
 				printd("udp: checksum error %I\n", raddr);
@@ -449,7 +451,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 			hnputl(uh6->viclfl, len);
 			uh6->hoplimit = IP_UDPPROTO;
 			if (ptclcsum(bp, UDP6_PHDR_OFF, len + UDP6_PHDR_SZ)) {
-				upriv->ustats.udpInErrors++;
+				percpu_ctr_inc(&upriv->ustats, udpInErrors);
 				netlog(f, Logudp, "udp: checksum error %I\n", raddr);
 				printd("udp: checksum error %I\n", raddr);
 				freeblist(bp);
@@ -468,7 +470,7 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 	c = iphtlook(&upriv->ht, raddr, rport, laddr, lport);
 	if (c == NULL) {
 		/* no converstation found */
-		upriv->ustats.udpNoPorts++;
+		percpu_ctr_inc(&upriv->ustats, udpNoPorts);
 		netlog(f, Logudp, "udp: no conv %I!%d -> %I!%d\n", raddr, rport,
 			   laddr, lport);
 
@@ -510,12 +512,14 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 				}
 			}
 			qlock(&udp->qlock);
-			c = Fsnewcall(c, raddr, rport, laddr, lport, version);
+			nc = Fsnewcall(c, raddr, rport, laddr, lport, version);
 			qunlock(&udp->qlock);
-			if (c == NULL) {
+			if (nc == NULL) {
 				freeblist(bp);
 				return;
 			}
+			nc->batch = c->batch;
+			c = nc;
 			iphtadd(&upriv->ht, c);
 			ucb = (Udpcb *) c->ptcl;
 		}
@@ -594,6 +598,87 @@ void udpiput(struct Proto *udp, struct Ipifc *ifc, struct block *bp)
 
 }
 
+/* Batch mode read: as many datagrams as fit in n bytes, each behind a struct
+ * udpmsg_hdr.  One syscall can drain a whole burst.  If the copy out faults,
+ * the rest of the batch is dropped, like the rest of a datagram would be. */
+long udpbatchread(struct conv *c, void *va, long n, bool nonblock)
+{
+	ERRSTACK(1);
+	struct udpmsg_hdr hdr;
+	struct block *volatile b, *volatile next;	/* volatile for the waserror */
+	uint8_t *p = va;
+	long left = n;
+	size_t len;
+
+	if (n < sizeof(hdr))
+		error(EINVAL, "udp batch reads need room for a struct udpmsg_hdr");
+	b = qbread_msgs(c->rq, n, sizeof(hdr), nonblock);
+	next = NULL;
+	if (waserror()) {
+		freeb(b);
+		freeblist(next);
+		nexterror();
+	}
+	for (; b; b = next) {
+		next = b->next;
+		b->next = NULL;
+		/* Only the first datagram can be short: the rest were picked to fit.
+		 * A max-sized datagram plus its address header can overflow len. */
+		len = MIN(MIN(BLEN(b), left - sizeof(hdr)), UINT16_MAX);
+		hdr.len = len;
+		hdr.flags = len < BLEN(b) ? UDPMSG_TRUNC : 0;
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		freeb(bl2mem(p, b, len));
+		p += len;
+		left -= sizeof(hdr) + len;
+	}
+	poperror();
+	return p - (uint8_t*)va;
+}
+
+/* Batch mode write: sends one datagram per struct udpmsg_hdr in va.  Each
+ * header is copied in once and checked before its frame goes out.  If a frame
+ * is bad, faults, or won't fit (nonblock), we stop there: the caller gets the
+ * bytes of the frames we sent, or the error if we sent none. */
+long udpbatchwrite(struct conv *c, void *va, long n, bool nonblock)
+{
+	ERRSTACK(1);
+	struct udpmsg_hdr hdr;
+	struct block *volatile b = NULL;	/* volatile for the waserror */
+	uint8_t *volatile p = va;
+	uint8_t *end = (uint8_t*)va + n;
+	struct block *frame;
+
+	if (waserror()) {
+		freeb(b);
+		if (p == va)
+			nexterror();
+		poperror();
+		return p - (uint8_t*)va;
+	}
+	while (p < end) {
+		if (end - p < sizeof(hdr))
+			error(EINVAL, "udp batch: short header at %ld", p - (uint8_t*)va);
+		memcpy(&hdr, p, sizeof(hdr));
+		if (hdr.flags || hdr.len > end - p - sizeof(hdr))
+			error(EINVAL, "udp batch: bad header at %ld", p - (uint8_t*)va);
+		b = block_alloc(hdr.len, MEM_WAIT);
+		memcpy(b->wp, p + sizeof(hdr), hdr.len);
+		b->wp += hdr.len;
+		/* The queue frees the frame if it throws. */
+		frame = b;
+		b = NULL;
+		if (nonblock)
+			qbwrite_nonblock(c->wq, frame);
+		else
+			qbwrite(c->wq, frame);
+		p += sizeof(hdr) + hdr.len;
+	}
+	poperror();
+	return n;
+}
+
 static void udpctl(struct conv *c, char **f, int n)
 {
 	Udpcb *ucb = (Udpcb*)c->ptcl;
@@ -602,7 +687,11 @@ static void udpctl(struct conv *c, char **f, int n)
 		ucb->headers = 6;
 	else if ((n == 1) && strcmp(f[0], "headers") == 0)
 		ucb->headers = 7;
-	else
+	else if ((n == 1) && strcmp(f[0], "batch") == 0) {
+		if (c->zcrx)
+			error(EBUSY, "batch and zcrecv don't mix");
+		c->batch = 1;
+	} else
 		error(EINVAL, "unknown command to %s", __func__);
 }
 
@@ -665,19 +754,25 @@ int udpstats(struct Proto *udp, char *buf, int len)
 	upriv = udp->priv;
 	p = buf;
 	e = p + len;
-	p = seprintf(p, e, "InDatagrams: %u\n", upriv->ustats.udpInDatagrams);
-	p = seprintf(p, e, "NoPorts: %u\n", upriv->ustats.udpNoPorts);
-	p = seprintf(p, e, "InErrors: %u\n", upriv->ustats.udpInErrors);
-	p = seprintf(p, e, "OutDatagrams: %u\n", upriv->ustats.udpOutDatagrams);
+	p = seprintf(p, e, "InDatagrams: %llu\n",
+	             percpu_ctr_sum(&upriv->ustats, udpInDatagrams));
+	p = seprintf(p, e, "NoPorts: %llu\n",
+	             percpu_ctr_sum(&upriv->ustats, udpNoPorts));
+	p = seprintf(p, e, "InErrors: %llu\n",
+	             percpu_ctr_sum(&upriv->ustats, udpInErrors));
+	p = seprintf(p, e, "OutDatagrams: %llu\n",
+	             percpu_ctr_sum(&upriv->ustats, udpOutDatagrams));
 	return p - buf;
 }
 
 void udpinit(struct Fs *fs)
 {
 	struct Proto *udp;
+	Udppriv *upriv;
 
 	udp = kzmalloc(sizeof(struct Proto), 0);
-	udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	upriv = udp->priv = kzmalloc(sizeof(Udppriv), 0);
+	percpu_ctrs_init(&upriv->ustats, Nudpstats, MEM_WAIT);
 	udp->name = "udp";
 	udp->connect = udpconnect;
 	udp->bind = udpbind;
@@ -0,0 +1,337 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Zero-copy receive (zcrx).
+ *
+ * A process hands a conversation a ring of anonymous memory with "zcrecv VA
+ * NPAGES".  From then on, reads of the data file return struct zcrx_desc
+ * entries (ros/net.h) that point into the ring, and the process gives each one
+ * back with "zcrelease OFF ...".
+ *
+ * Payload that sits in a page-aligned extra_data buffer, and that nobody else
+ * holds a reference on, is not copied: we map the buffer's page straight into
+ * a ring slot (lend_kpage()) and hold a kmalloc ref until the release.
+ * Everything else (headers, small or unaligned payload) is copied into the
+ * current copy slot, packed back to back.
+ *
+ * Each ring page is a slot with a count of outstanding descriptors.  The copy
+ * slot holds one extra ref while we are still filling it. */
+
+#include <vfs.h>
+#include <kfs.h>
+#include <slab.h>
+#include <kmalloc.h>
+#include <kref.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <error.h>
+#include <cpio.h>
+#include <pmap.h>
+#include <smp.h>
+#include <umem.h>
+#include <mm.h>
+#include <process.h>
+#include <ip.h>
+#include <ros/net.h>
+
+enum {
+	ZcrxMaxSlots = 4096,
+};
+
+struct zcrx_slot {
+	int refs;
+	void *lent_buf;				/* kmalloc'd buffer we hold a ref on */
+	void *lent_kva;				/* its page mapped at this slot */
+};
+
+struct zcrx {
+	qlock_t rlock;				/* serializes readers */
+	qlock_t qlock;				/* protects the slots */
+	struct proc *p;
+	uintptr_t va;
+	int nslots;
+	int nfree;
+	int hand;					/* where to start looking for a free slot */
+	int cslot;					/* copy slot, or -1 */
+	uint32_t coff;				/* next free byte in the copy slot */
+	struct zcrx_slot slot[];
+};
+
+static uintptr_t slot_va(struct zcrx *zc, int i)
+{
+	return zc->va + ((uintptr_t)i << PGSHIFT);
+}
+
+static int get_slot(struct zcrx *zc)
+{
+	int i;
+
+	for (int n = 0; n < zc->nslots; n++) {
+		i = (zc->hand + n) % zc->nslots;
+		if (!zc->slot[i].refs) {
+			zc->slot[i].refs = 1;
+			zc->nfree--;
+			zc->hand = (i + 1) % zc->nslots;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void put_slot(struct zcrx *zc, int i)
+{
+	struct zcrx_slot *s = &zc->slot[i];
+
+	assert(s->refs > 0);
+	if (--s->refs)
+		return;
+	if (s->lent_kva) {
+		reclaim_kpage(zc->p, slot_va(zc, i), s->lent_kva);
+		kfree(s->lent_buf);
+		s->lent_buf = NULL;
+		s->lent_kva = NULL;
+	}
+	zc->nfree++;
+}
+
+/* Adds a descriptor for [off, off + len), merging with the previous one if it
+ * is contiguous.  Returns TRUE if a new descriptor was used. */
+static bool add_desc(struct zcrx_desc *d, int *nd, uint32_t off, uint32_t len)
+{
+	if (*nd && d[*nd - 1].off + d[*nd - 1].len == off &&
+	    PGOFF(off)) {
+		d[*nd - 1].len += len;
+		return FALSE;
+	}
+	d[*nd].off = off;
+	d[*nd].len = len;
+	(*nd)++;
+	return TRUE;
+}
+
+static void zcrx_copy(struct zcrx *zc, struct zcrx_desc *d, int *nd,
+                      uint8_t *from, size_t len)
+{
+	size_t amt;
+	uint32_t off;
+
+	while (len) {
+		if (zc->cslot < 0 || zc->coff == PGSIZE) {
+			if (zc->cslot >= 0)
+				put_slot(zc, zc->cslot);
+			zc->cslot = get_slot(zc);
+			/* zcrx_read() only pulls as much as the free slots can hold */
+			assert(zc->cslot >= 0);
+			zc->coff = 0;
+		}
+		amt = MIN(len, PGSIZE - zc->coff);
+		off = (zc->cslot << PGSHIFT) + zc->coff;
+		if (memcpy_to_user(zc->p, (void*)(zc->va + off), from, amt))
+			error(EFAULT, "zcrecv ring is not mapped");
+		if (add_desc(d, nd, off, amt))
+			zc->slot[zc->cslot].refs++;
+		zc->coff += amt;
+		from += amt;
+		len -= amt;
+	}
+}
+
+/* Whether we can lend ebd's pages to the process.  If someone else (a clone, a
+ * snooper) can see this buffer, we can't hand out a writable view of it.  Ask
+ * before lending any of its pages: each lent page holds its own ref. */
+static bool zcrx_lendable(struct extra_bdata *ebd)
+{
+	return !(ebd->flags & EBD_PAGEMAP) &&
+	       kmalloc_refcnt((void*)ebd->base) == 1;
+}
+
+/* Tries to map the page at kva, part of ebd's buffer, into a free slot. */
+static bool zcrx_lend(struct zcrx *zc, struct zcrx_desc *d, int *nd,
+                      struct extra_bdata *ebd, uint8_t *kva)
+{
+	int i;
+
+	i = get_slot(zc);
+	assert(i >= 0);
+	if (lend_kpage(zc->p, slot_va(zc, i), kva)) {
+		zc->slot[i].refs = 0;
+		zc->nfree++;
+		return FALSE;
+	}
+	kmalloc_incref((void*)ebd->base);
+	zc->slot[i].lent_buf = (void*)ebd->base;
+	zc->slot[i].lent_kva = kva;
+	d[*nd].off = i << PGSHIFT;
+	d[*nd].len = PGSIZE;
+	(*nd)++;
+	return TRUE;
+}
+
+static void zcrx_place(struct zcrx *zc, struct block *b, struct zcrx_desc *d,
+                       int *nd)
+{
+	struct extra_bdata *ebd;
+	uint8_t *kva;
+	size_t len, amt;
+	bool lend;
+
+	for (; b; b = b->next) {
+		if (BHLEN(b))
+			zcrx_copy(zc, d, nd, b->rp, BHLEN(b));
+		for (int i = 0; i < b->nr_extra_bufs; i++) {
+			ebd = &b->extra_data[i];
+			if (!ebd->base || !ebd->len)
+				continue;
+			kva = (uint8_t*)ebd->base + ebd->off;
+			len = ebd->len;
+			lend = zcrx_lendable(ebd);
+			while (len) {
+				if (lend && !PGOFF(kva) && len >= PGSIZE &&
+				    zcrx_lend(zc, d, nd, ebd, kva)) {
+					kva += PGSIZE;
+					len -= PGSIZE;
+					continue;
+				}
+				amt = MIN(len, PGSIZE - PGOFF(kva));
+				zcrx_copy(zc, d, nd, kva, amt);
+				kva += amt;
+				len -= amt;
+			}
+		}
+	}
+}
+
+/* How many bytes we can pull off the queue and be sure to place, given ndesc
+ * descriptors left.  n bytes take at most n / PGSIZE + 2 new slots (the copy
+ * slot can start partly full), and at most twice that in descriptors (each lent
+ * page can split a copy run). */
+static size_t zcrx_budget(struct zcrx *zc, int ndesc)
+{
+	long pages = MIN(zc->nfree - 1, ndesc / 2 - 1);
+
+	return pages > 0 ? pages * PGSIZE : 0;
+}
+
+long zcrx_read(struct conv *c, void *va, long n, bool nonblock)
+{
+	ERRSTACK(2);
+	struct zcrx *zc = c->zcrx;
+	struct zcrx_desc *d = va;
+	int ndesc = n / sizeof(struct zcrx_desc);
+	int nd = 0;
+	struct block *b;
+	size_t budget;
+
+	if (current != zc->p)
+		error(EPERM, "zcrecv ring belongs to another process");
+	if (ndesc < 4)
+		error(EINVAL, "zcrecv reads need room for at least 4 descriptors");
+	qlock(&zc->rlock);
+	if (waserror()) {
+		qunlock(&zc->rlock);
+		nexterror();
+	}
+	budget = zcrx_budget(zc, ndesc);
+	if (!budget)
+		error(ENOBUFS, "zcrecv ring is full, release some descriptors");
+	b = nonblock ? qbread_nonblock(c->rq, budget) : qbread(c->rq, budget);
+	while (b) {
+		qlock(&zc->qlock);
+		if (waserror()) {
+			qunlock(&zc->qlock);
+			freeblist(b);
+			nexterror();
+		}
+		zcrx_place(zc, b, d, &nd);
+		budget = zcrx_budget(zc, ndesc - nd);
+		poperror();
+		qunlock(&zc->qlock);
+		freeblist(b);
+		b = NULL;
+		if (!budget || !qcanread(c->rq))
+			break;
+		/* Someone could have drained the queue.  Keep what we have. */
+		if (!waserror())
+			b = qbread_nonblock(c->rq, budget);
+		poperror();
+	}
+	poperror();
+	qunlock(&zc->rlock);
+	return nd * sizeof(struct zcrx_desc);
+}
+
+/* "zcrecv VA NPAGES".  Called with the conv qlocked. */
+void zcrxctl(struct conv *c, char **argv, int argc)
+{
+	struct zcrx *zc;
+	uintptr_t va;
+	long nslots;
+
+	if (argc != 3)
+		error(EINVAL, "usage: zcrecv va npages");
+	if (c->zcrx)
+		error(EBUSY, "zcrecv is already on");
+	if (c->batch)
+		error(EBUSY, "batch and zcrecv don't mix");
+	va = strtoul(argv[1], 0, 0);
+	nslots = strtoul(argv[2], 0, 0);
+	if (PGOFF(va) || nslots <= 1 || nslots > ZcrxMaxSlots)
+		error(EINVAL, "zcrecv: va must be page aligned, 1 < npages <= %d",
+		      ZcrxMaxSlots);
+	if (!is_user_rwaddr((void*)va, nslots << PGSHIFT))
+		error(EFAULT, "zcrecv: bad ring address");
+	zc = kzmalloc(sizeof(struct zcrx) + nslots * sizeof(struct zcrx_slot),
+	              MEM_WAIT);
+	qlock_init(&zc->rlock);
+	qlock_init(&zc->qlock);
+	proc_incref(current, 1);
+	zc->p = current;
+	zc->va = va;
+	zc->nslots = nslots;
+	zc->nfree = nslots;
+	zc->cslot = -1;
+	c->zcrx = zc;
+}
+
+/* "zcrelease OFF [OFF ...]".  Called with the conv qlocked. */
+void zcrxrelease(struct conv *c, char **argv, int argc)
+{
+	struct zcrx *zc = c->zcrx;
+	unsigned long off;
+	int i;
+
+	if (!zc)
+		error(EINVAL, "zcrecv is not on");
+	qlock(&zc->qlock);
+	for (int j = 1; j < argc; j++) {
+		off = strtoul(argv[j], 0, 0);
+		i = off >> PGSHIFT;
+		if (i >= zc->nslots || !zc->slot[i].refs ||
+		    (i == zc->cslot && zc->slot[i].refs == 1)) {
+			qunlock(&zc->qlock);
+			error(EINVAL, "zcrelease: no descriptor at %lu", off);
+		}
+		put_slot(zc, i);
+	}
+	qunlock(&zc->qlock);
+}
+
+/* Called when the conv closes.  No one can be reading. */
+void zcrxclose(struct conv *c)
+{
+	struct zcrx *zc = c->zcrx;
+
+	if (!zc)
+		return;
+	for (int i = 0; i < zc->nslots; i++) {
+		if (zc->slot[i].lent_kva) {
+			reclaim_kpage(zc->p, slot_va(zc, i), zc->slot[i].lent_kva);
+			kfree(zc->slot[i].lent_buf);
+		}
+	}
+	proc_decref(zc->p);
+	kfree(zc);
+	c->zcrx = NULL;
+}
@@ -70,6 +70,8 @@ struct block *block_alloc(size_t size, int mem_flags)
 	b->next = NULL;
 	b->list = NULL;
 	b->free = NULL;
+	b->free_arg = NULL;
+	b->txdone = NULL;
 	b->flag = 0;
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -136,6 +138,40 @@ int block_add_extd(struct block *b, unsigned int nr_bufs, int mem_flags)
 	return 0;
 }
 
+/* Extra data buffers are usually kmalloc'd, refcounted with kmalloc_incref()
+ * and kfree().  They can also be page cache pages (sendfile), flagged with
+ * EBD_PAGEMAP by whoever appended them, which hold a page map slot ref
+ * instead. */
+void extra_buf_incref(struct extra_bdata *ebd)
+{
+	if (ebd->flags & EBD_PAGEMAP)
+		pm_get_page(kva2page((void*)ebd->base));
+	else
+		kmalloc_incref((void*)ebd->base);
+}
+
+void extra_buf_decref(struct extra_bdata *ebd)
+{
+	if (ebd->flags & EBD_PAGEMAP)
+		pm_put_page(kva2page((void*)ebd->base));
+	else
+		kfree((void*)ebd->base);
+}
+
+/* A block's txdone hook tells whoever sent it that the block is done going
+ * out.  freeb() runs it, and so do devices that pass the block along instead of
+ * freeing it, like loopback, before the receive side sees it.  It runs at most
+ * once. */
+void block_txdone(struct block *b)
+{
+	void (*txdone)(struct block *) = b->txdone;
+
+	if (!txdone)
+		return;
+	b->txdone = NULL;
+	txdone(b);
+}
+
 /* Go backwards from the end of the list, remember the last unused slot, and
  * stop when a used slot is encountered. */
 static struct extra_bdata *next_unused_slot(struct block *b)
@@ -155,6 +191,14 @@ static struct extra_bdata *next_unused_slot(struct block *b)
  * Return 0 on success or -1 on error. */
 int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
                        uint32_t len, int mem_flags)
+{
+	return block_append_extra_flags(b, base, off, len, 0, mem_flags);
+}
+
+/* Like block_append_extra(), with EBD_ flags saying what kind of buffer base
+ * is. */
+int block_append_extra_flags(struct block *b, uintptr_t base, uint32_t off,
+                             uint32_t len, uint32_t ebd_flags, int mem_flags)
 {
 	unsigned int nr_bufs = b->nr_extra_bufs + 1;
 	struct extra_bdata *ebd;
@@ -169,6 +213,7 @@ int block_append_extra(struct block *b, uintptr_t base, uint32_t off,
 	ebd->base = base;
 	ebd->off = off;
 	ebd->len = len;
+	ebd->flags = ebd_flags;
 	b->extra_len += ebd->len;
 	return 0;
 }
@@ -177,12 +222,10 @@ void free_block_extra(struct block *b)
 {
 	struct extra_bdata *ebd;
 
-	/* assuming our release method is kfree, which will change when we support
-	 * user buffers */
 	for (int i = 0; i < b->nr_extra_bufs; i++) {
 		ebd = &b->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			extra_buf_decref(ebd);
 	}
 	b->extra_len = 0;
 	b->nr_extra_bufs = 0;
@@ -199,6 +242,7 @@ size_t freeb(struct block *b)
 	if (b == NULL)
 		return 0;
 	ret = BLEN(b);
+	block_txdone(b);
 	free_block_extra(b);
 	/*
 	 * drivers which perform non cache coherent DMA manage their own buffer
@@ -232,6 +276,138 @@ size_t freeblist(struct block *b)
 	return ret;
 }
 
+/* Block pools.
+ *
+ * A NIC driver allocates a receive block for every packet, and freeb() gives
+ * it right back.  A bpool keeps those blocks around instead: pool blocks have
+ * b->free set, so freeb() (from etheriq, qio, wherever the packet ends up)
+ * puts them back on their pool's free list, and the next replenish takes one
+ * off without going through kmalloc.
+ *
+ * Every pool block has the same size, and its data area (rp) starts on a
+ * cache line, with Hdrspc in front of it like block_alloc().  Pool blocks are
+ * still kmalloc'd one at a time: qclone() points other blocks at a block's
+ * body with kmalloc_incref().  A pool block that someone still points at when
+ * it is freed just drops its ref and leaves the pool, as does one freed while
+ * the pool's free list is full. */
+struct bpool {
+	spinlock_t lock;
+	char *name;
+	size_t size;
+	unsigned int max;			/* most blocks we keep on the free list */
+	unsigned int nfree;
+	struct block *free;
+	uint64_t allocs;
+	uint64_t hits;
+	uint64_t recycles;
+	uint64_t drops;
+};
+
+/* The pool pointer lives right after the block header. */
+static struct bpool **block_bpool(struct block *b)
+{
+	return (struct bpool**)(b + 1);
+}
+
+static void bpool_reset(struct bpool *pool, struct block *b)
+{
+	b->next = NULL;
+	b->list = NULL;
+	b->txdone = NULL;
+	b->flag = 0;
+	b->checksum = 0;
+	b->base = (uint8_t*)ROUNDUP((uintptr_t)(block_bpool(b) + 1),
+	                            ARCH_CL_SIZE);
+	b->rp = b->base + Hdrspc;
+	b->wp = b->rp;
+	/* drivers like to lie about lim; put it back */
+	b->lim = b->rp + pool->size;
+}
+
+static void bpool_free(struct block *b)
+{
+	struct bpool *pool = *block_bpool(b);
+
+	spin_lock_irqsave(&pool->lock);
+	if (kmalloc_refcnt(b) != 1 || pool->nfree >= pool->max) {
+		pool->drops++;
+		spin_unlock_irqsave(&pool->lock);
+		kfree(b);
+		return;
+	}
+	b->next = pool->free;
+	pool->free = b;
+	pool->nfree++;
+	pool->recycles++;
+	spin_unlock_irqsave(&pool->lock);
+}
+
+/* Makes a pool of blocks with size bytes of room after rp.  The pool keeps at
+ * most max free blocks around, and starts with prealloc of them. */
+struct bpool *bpool_create(char *name, size_t size, unsigned int max,
+                           unsigned int prealloc)
+{
+	struct bpool *pool;
+	struct block *b;
+
+	static_assert(Hdrspc % ARCH_CL_SIZE == 0);
+	pool = kzmalloc(sizeof(struct bpool), MEM_WAIT);
+	spinlock_init_irqsave(&pool->lock);
+	pool->name = name;
+	pool->size = size;
+	pool->max = max;
+	for (int i = 0; i < MIN(prealloc, max); i++) {
+		b = bpool_alloc(pool, MEM_WAIT);
+		b->next = pool->free;
+		pool->free = b;
+		pool->nfree++;
+	}
+	pool->allocs = 0;
+	return pool;
+}
+
+/* Gets a block from the pool, or a new one if the pool is empty.  Either way,
+ * freeb() brings it back here. */
+struct block *bpool_alloc(struct bpool *pool, int mem_flags)
+{
+	struct block *b;
+
+	spin_lock_irqsave(&pool->lock);
+	pool->allocs++;
+	b = pool->free;
+	if (b) {
+		pool->free = b->next;
+		pool->nfree--;
+		pool->hits++;
+	}
+	spin_unlock_irqsave(&pool->lock);
+	if (!b) {
+		b = kmalloc(sizeof(struct block) + sizeof(struct bpool*) +
+		            (ARCH_CL_SIZE - 1) + Hdrspc + pool->size, mem_flags);
+		if (!b)
+			return NULL;
+		*block_bpool(b) = pool;
+		b->free = bpool_free;
+		b->extra_len = 0;
+		b->nr_extra_bufs = 0;
+		b->extra_data = 0;
+	}
+	bpool_reset(pool, b);
+	return b;
+}
+
+/* Prints a line of pool stats into [p, e), for a driver's ifstat. */
+char *seprintbpool(char *p, char *e, struct bpool *pool)
+{
+	uint64_t allocs = pool->allocs;
+
+	return seprintf(p, e,
+	                "%s pool: allocs %llu hits %llu (%llu%%) recycles %llu drops %llu free %u/%u\n",
+	                pool->name, allocs, pool->hits,
+	                allocs ? pool->hits * 100 / allocs : 0, pool->recycles,
+	                pool->drops, pool->nfree, pool->max);
+}
+
 void checkb(struct block *b, char *msg)
 {
 	void *dead = (void *)Bdead;
@@ -267,7 +443,8 @@ void checkb(struct block *b, char *msg)
 			panic("checkb %s: ebd %d has no base, but has off %d and len %d",
 			      msg, i, ebd->off, ebd->len);
 		if (ebd->base) {
-			if (!kmalloc_refcnt((void*)ebd->base))
+			if (!(ebd->flags & EBD_PAGEMAP) &&
+			    !kmalloc_refcnt((void*)ebd->base))
 				panic("checkb %s: buf %d, base %p has no refcnt!\n", msg, i,
 				      ebd->base);
 			extra_len += ebd->len;
@@ -39,28 +39,451 @@
 #include <pmap.h>
 #include <smp.h>
 #include <ip.h>
+#include <pagemap.h>
+#include <page_alloc.h>
+#include <kthread.h>
 
 /*
- * no cache in hosted mode
- */
+ * Client-side cache for CCACHE mounts.  Each cached file gets a mntcache,
+ * keyed by the chan's (type, dev, qid.path), and its data lives in a page_map.
+ * A page's pg_private holds how many of its bytes, from the start, we have.  9P
+ * reads can come back short anywhere, so a page with less than PGSIZE isn't
+ * necessarily at EOF; we fill in the rest when someone reads there.  We only
+ * know where EOF is once a read at some offset gets nothing (mc->eof).
+ *
+ * The cache is only good for the qid.vers it was filled under.  copen() checks
+ * the version the server gave us at open time and drops everything on a
+ * mismatch.  Writes are write-through: the rpc goes to the server, then
+ * cwrite() patches any pages we have.  Since the server bumps the version on
+ * writes, our next open of the file starts from scratch anyway.
+ *
+ * Misses fetch a readahead cluster with one (pipelined) mntrdwr(), and the
+ * cluster grows while the reader stays sequential.  We don't hold mc->lock for
+ * that rpc, so other readers of the file get what's already cached meanwhile.
+ * There's a fixed pool of mntcaches, recycled in LRU order, and a global limit
+ * on cached pages.
+ *
+ * mc->lock covers the page_map and everything else in the mntcache except the
+ * LRU/hash links, which belong to cache.lock.  The key (path, dev, type) only
+ * changes with both locks held, so either one is enough to look at it.  A
+ * chan's mcp is only a hint; we recheck the key and version under mc->lock
+ * every time.
+ *
+ * If we can't get rid of some old pages (someone still has a ref), the mntcache
+ * stays invalid and its chans go uncached until a later copen() or trim gets
+ * them all. */
+
+enum {
+	NHASH = 128,
+	NFILE = 512,
+	RA_MIN = 4,					/* pages */
+	RA_MAX = 64,
+};
+
+struct mntcache {
+	qlock_t lock;
+	struct mntcache *hash;
+	TAILQ_ENTRY(mntcache) lru;
+	uint64_t path;
+	uint32_t dev;
+	int type;
+	uint32_t vers;
+	bool hashed;				/* on cache.hash under path */
+	bool valid;					/* vers means something */
+	unsigned long maxpg;		/* one past the highest page we've loaded */
+	int64_t eof;				/* file length, or -1 if we don't know it */
+	unsigned long ra_next;		/* where a sequential reader goes next */
+	unsigned long ra_pgs;		/* current readahead window */
+	struct page_map pm;
+	/* the cluster being loaded, for mc_readpage() */
+	uint8_t *fill;
+	int64_t fill_off;
+	long fill_len;
+};
+TAILQ_HEAD(mntcache_tailq, mntcache);
+
+static struct {
+	spinlock_t lock;
+	struct mntcache *hash[NHASH];
+	struct mntcache_tailq lru;	/* head is the most recently used */
+	struct mntcache *pool;
+} cache;
+
+static long mntcache_max_pages = 16384;
+static atomic_t mntcache_pages;
+static atomic_t mntcache_hits;
+static atomic_t mntcache_misses;
+static atomic_t mntcache_ra_pages;
+static atomic_t mntcache_invals;
+DEVVARS_ENTRY(mntcache_max_pages, "dg");
+DEVVARS_ENTRY(mntcache_pages, "dg");
+DEVVARS_ENTRY(mntcache_hits, "dg");
+DEVVARS_ENTRY(mntcache_misses, "dg");
+DEVVARS_ENTRY(mntcache_ra_pages, "dg");
+DEVVARS_ENTRY(mntcache_invals, "dg");
+
+/* Fills a page from the cluster in mc->fill.  pm_load_page() calls this with
+ * mc->lock held, so it can't fail. */
+static int mc_readpage(struct page_map *pm, struct page *page)
+{
+	struct mntcache *mc = container_of(pm, struct mntcache, pm);
+	int64_t pg_off = ((int64_t)page->pg_index << PGSHIFT) - mc->fill_off;
+	long valid = 0;
+
+	if (pg_off >= 0 && pg_off < mc->fill_len)
+		valid = MIN(mc->fill_len - pg_off, PGSIZE);
+	memcpy(page2kva(page), mc->fill + pg_off, valid);
+	memset(page2kva(page) + valid, 0, PGSIZE - valid);
+	page->pg_private = (void*)valid;
+	atomic_or(&page->pg_flags, PG_UPTODATE);
+	return 0;
+}
+
+static int mc_writepage(struct page_map *pm, struct page *page)
+{
+	/* We're write-through; pages are never dirty. */
+	return 0;
+}
+
+static struct page_map_operations mc_pm_op = {
+	.readpage = mc_readpage,
+	.writepage = mc_writepage,
+};
+
+static unsigned int mc_hash(uint64_t path)
+{
+	return path % NHASH;
+}
+
+static bool mc_matches(struct mntcache *mc, struct chan *c)
+{
+	return mc->valid && mc->path == c->qid.path && mc->dev == c->dev &&
+	       mc->type == c->type && mc->vers == c->qid.vers;
+}
+
+/* Drops all of mc's pages.  If some are still in use, mc goes invalid and we
+ * keep maxpg so the next attempt covers them.  Returns TRUE if they're all
+ * gone.  Called with mc->lock held. */
+static bool mc_invalidate(struct mntcache *mc)
+{
+	int nr;
+
+	mc->ra_next = 0;
+	mc->ra_pgs = RA_MIN;
+	mc->eof = -1;
+	if (!mc->maxpg)
+		return TRUE;
+	nr = pm_remove_contig(&mc->pm, 0, mc->maxpg);
+	atomic_add(&mntcache_pages, -nr);
+	atomic_inc(&mntcache_invals);
+	if (mc->pm.pm_num_pages) {
+		mc->valid = FALSE;
+		return FALSE;
+	}
+	mc->maxpg = 0;
+	return TRUE;
+}
+
 void cinit(void)
 {
+	struct mntcache *mc;
+
+	spinlock_init(&cache.lock);
+	TAILQ_INIT(&cache.lru);
+	cache.pool = kzmalloc(NFILE * sizeof(struct mntcache), MEM_WAIT);
+	for (int i = 0; i < NFILE; i++) {
+		mc = &cache.pool[i];
+		qlock_init(&mc->lock);
+		pm_init(&mc->pm, &mc_pm_op, mc);
+		mc->ra_pgs = RA_MIN;
+		mc->eof = -1;
+		TAILQ_INSERT_TAIL(&cache.lru, mc, lru);
+	}
 }
 
+static void mc_unhash(struct mntcache *mc)
+{
+	struct mntcache **l;
+
+	for (l = &cache.hash[mc_hash(mc->path)]; *l; l = &(*l)->hash) {
+		if (*l == mc) {
+			*l = mc->hash;
+			break;
+		}
+	}
+	mc->hash = NULL;
+}
+
+/* Finds or makes c's mntcache, and makes sure it's good for c's version. */
 void copen(struct chan *c)
 {
-	c->flag &= ~CCACHE;
+	struct mntcache *mc;
+	unsigned int h = mc_hash(c->qid.path);
+	bool locked = FALSE;
+
+	spin_lock(&cache.lock);
+	for (mc = cache.hash[h]; mc; mc = mc->hash) {
+		if (mc->path == c->qid.path && mc->dev == c->dev &&
+		    mc->type == c->type)
+			break;
+	}
+	if (!mc) {
+		/* Recycle the least recently used one that no one is using. */
+		TAILQ_FOREACH_REVERSE(mc, &cache.lru, mntcache_tailq, lru) {
+			if (canqlock(&mc->lock))
+				break;
+		}
+		if (!mc) {
+			spin_unlock(&cache.lock);
+			c->mcp = NULL;
+			return;
+		}
+		locked = TRUE;
+		if (mc->hashed)
+			mc_unhash(mc);
+		mc->valid = FALSE;
+		mc->hashed = TRUE;
+		mc->path = c->qid.path;
+		mc->dev = c->dev;
+		mc->type = c->type;
+		mc->hash = cache.hash[h];
+		cache.hash[h] = mc;
+	}
+	TAILQ_REMOVE(&cache.lru, mc, lru);
+	TAILQ_INSERT_HEAD(&cache.lru, mc, lru);
+	spin_unlock(&cache.lock);
+
+	if (!locked)
+		qlock(&mc->lock);
+	if (mc->path != c->qid.path || mc->dev != c->dev ||
+	    mc->type != c->type) {
+		/* Recycled again while we waited; just go uncached. */
+		qunlock(&mc->lock);
+		c->mcp = NULL;
+		return;
+	}
+	if (!mc->valid || mc->vers != c->qid.vers) {
+		mc->vers = c->qid.vers;
+		mc->valid = mc_invalidate(mc);
+	}
+	qunlock(&mc->lock);
+	c->mcp = mc;
 }
 
-int cread(struct chan *c, uint8_t * b, int n, int64_t off)
+/* Returns c's mntcache, locked, or NULL if c isn't cached anymore. */
+static struct mntcache *mc_lock(struct chan *c)
 {
-	return 0;
+	struct mntcache *mc = c->mcp;
+
+	if (!mc)
+		return NULL;
+	qlock(&mc->lock);
+	if (!mc_matches(mc, c)) {
+		qunlock(&mc->lock);
+		return NULL;
+	}
+	return mc;
+}
+
+/* Keeps us under mntcache_max_pages by dropping whole files, least recently
+ * used first.  We give up if a pass frees nothing, since the coldest file's
+ * pages might all be in use.  Don't hold any mc->lock. */
+static void cache_trim(void)
+{
+	struct mntcache *mc;
+	long before;
+
+	while ((before = atomic_read(&mntcache_pages)) > mntcache_max_pages) {
+		spin_lock(&cache.lock);
+		TAILQ_FOREACH_REVERSE(mc, &cache.lru, mntcache_tailq, lru) {
+			if (mc->maxpg && canqlock(&mc->lock))
+				break;
+		}
+		spin_unlock(&cache.lock);
+		if (!mc)
+			return;
+		mc_invalidate(mc);
+		qunlock(&mc->lock);
+		if (atomic_read(&mntcache_pages) >= before)
+			return;
+	}
+}
+
+/* Copies data at off into the pages we have.  A page only takes it if it
+ * lines up with or overlaps what the page already has; we can't keep track of
+ * a gap.  We never add pages here.  Called with mc->lock held. */
+static void mc_patch(struct mntcache *mc, uint8_t *buf, long len, int64_t off)
+{
+	struct page *page;
+	long pg_off, valid, n;
+
+	while (len > 0) {
+		pg_off = PGOFF(off);
+		n = MIN(len, PGSIZE - pg_off);
+		if (!pm_load_page_nowait(&mc->pm, off >> PGSHIFT, &page)) {
+			valid = (long)page->pg_private;
+			if (pg_off <= valid) {
+				memcpy(page2kva(page) + pg_off, buf, n);
+				page->pg_private = (void*)MAX(valid, pg_off + n);
+			}
+			pm_put_page(page);
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	if (mc->eof >= 0 && off > mc->eof)
+		mc->eof = off;
+}
+
+/* Reads from off to the end of a readahead cluster from the server.  Pages we
+ * don't have come in whole; a page we have the start of (off is where it ends)
+ * gets the rest.  A read that gets nothing tells us where EOF is.
+ *
+ * We drop mc->lock for the rpc.  Returns FALSE if mc isn't c's anymore once we
+ * have it back.  Called and returns with mc->lock held, even when it throws. */
+static bool mc_fill(struct mntcache *mc, struct chan *c, int64_t off)
+{
+	ERRSTACK(1);
+	struct page *page;
+	unsigned long idx = off >> PGSHIFT, first, nr_pgs, before;
+	uint8_t *fill;
+	size_t sz;
+	long len;
+
+	if (idx == mc->ra_next)
+		mc->ra_pgs = MIN(mc->ra_pgs * 2, RA_MAX);
+	else
+		mc->ra_pgs = RA_MIN;
+	sz = mc->ra_pgs << PGSHIFT;
+	fill = kpages_alloc(sz, MEM_WAIT);
+	qunlock(&mc->lock);
+	if (waserror()) {
+		kpages_free(fill, sz);
+		qlock(&mc->lock);
+		nexterror();
+	}
+	len = mntrdwr(Tread, c, fill + PGOFF(off), sz - PGOFF(off), off);
+	poperror();
+	qlock(&mc->lock);
+	if (!mc_matches(mc, c)) {
+		kpages_free(fill, sz);
+		return FALSE;
+	}
+	if (!len) {
+		mc->eof = off;
+		kpages_free(fill, sz);
+		return TRUE;
+	}
+	/* The partial page, and any pages someone else loaded meanwhile. */
+	mc_patch(mc, fill + PGOFF(off), len, off);
+	/* Then the pages we don't have, skipping a partial first one: we can't
+	 * make that one up if it went away. */
+	mc->fill = fill;
+	mc->fill_off = (int64_t)idx << PGSHIFT;
+	mc->fill_len = PGOFF(off) + len;
+	first = PGOFF(off) ? 1 : 0;
+	nr_pgs = ROUNDUP(mc->fill_len, PGSIZE) >> PGSHIFT;
+	before = mc->pm.pm_num_pages;
+	for (unsigned long i = first; i < nr_pgs; i++) {
+		if (pm_load_page(&mc->pm, idx + i, &page))
+			break;
+		pm_put_page(page);
+	}
+	atomic_add(&mntcache_pages, mc->pm.pm_num_pages - before);
+	atomic_add(&mntcache_ra_pages, nr_pgs - 1);
+	mc->maxpg = MAX(mc->maxpg, idx + nr_pgs);
+	mc->ra_next = idx + nr_pgs;
+	mc->fill = NULL;
+	kpages_free(fill, sz);
+	return TRUE;
+}
+
+/* Reads what we can of [off, off + len) from the cache, fetching missing data
+ * from the server.  Returns how much we got, and sets *eof if we stopped at the
+ * end of the file.  Otherwise the caller goes to the server for the rest. */
+int cread(struct chan *c, uint8_t *buf, int len, int64_t off, bool *eof)
+{
+	ERRSTACK(1);
+	struct mntcache *mc;
+	struct page *page;
+	unsigned long idx;
+	long pg_off, valid, n;
+	int64_t fill_at, tried = -1;
+	int total = 0;
+
+	*eof = FALSE;
+	if (off < 0)
+		return 0;
+	mc = mc_lock(c);
+	if (!mc)
+		return 0;
+	if (waserror()) {
+		qunlock(&mc->lock);
+		nexterror();
+	}
+	while (len > 0) {
+		if (mc->eof >= 0 && off >= mc->eof) {
+			*eof = TRUE;
+			break;
+		}
+		idx = off >> PGSHIFT;
+		pg_off = PGOFF(off);
+		if (pm_load_page_nowait(&mc->pm, idx, &page)) {
+			fill_at = (int64_t)idx << PGSHIFT;
+		} else {
+			valid = (long)page->pg_private;
+			n = MIN(len, MAX(valid - pg_off, 0));
+			if (n) {
+				atomic_inc(&mntcache_hits);
+				if (idx == mc->ra_next - 1 || idx == mc->ra_next)
+					mc->ra_next = idx + 1;
+				memcpy(buf, page2kva(page) + pg_off, n);
+				pm_put_page(page);
+				buf += n;
+				off += n;
+				len -= n;
+				total += n;
+				continue;
+			}
+			pm_put_page(page);
+			fill_at = ((int64_t)idx << PGSHIFT) + valid;
+		}
+		/* If we already tried here and got nowhere, let the caller try. */
+		if (fill_at == tried)
+			break;
+		tried = fill_at;
+		atomic_inc(&mntcache_misses);
+		if (!mc_fill(mc, c, fill_at))
+			break;
+	}
+	poperror();
+	qunlock(&mc->lock);
+	cache_trim();
+	return total;
+}
+
+/* Patches the pages we have with data that just went to or came from the
+ * server. */
+static void mc_update(struct chan *c, uint8_t *buf, int len, int64_t off)
+{
+	struct mntcache *mc;
+
+	if (off < 0 || len <= 0)
+		return;
+	mc = mc_lock(c);
+	if (!mc)
+		return;
+	mc_patch(mc, buf, len, off);
+	qunlock(&mc->lock);
 }
 
-void cwrite(struct chan *c, uint8_t * buf, int n, int64_t off)
+void cwrite(struct chan *c, uint8_t *buf, int len, int64_t off)
 {
+	mc_update(c, buf, len, off);
 }
 
-void cupdate(struct chan *c, uint8_t * buf, int n, int64_t off)
+void cupdate(struct chan *c, uint8_t *buf, int len, int64_t off)
 {
+	mc_update(c, buf, len, off);
 }
@@ -88,6 +88,11 @@ struct queue {
 	void *wake_data;
 
 	char err[ERRMAX];
+
+	/* Qspsc only, see qspsc_push() */
+	struct block **ring;
+	unsigned long ring_head __attribute__((aligned(ARCH_CL_SIZE)));
+	unsigned long ring_tail __attribute__((aligned(ARCH_CL_SIZE)));
 };
 
 enum {
@@ -98,6 +103,8 @@ enum {
 	QIO_JUST_ONE_BLOCK = (1 << 3),	/* when qbreading, just get one block */
 	QIO_NON_BLOCK = (1 << 4),		/* throw EAGAIN instead of blocking */
 	QIO_DONT_KICK = (1 << 5),		/* don't kick when waking */
+	QspscRing = 256,				/* blocks in a Qspsc ring, power of 2 */
+	RING_LISTED = 1,				/* ring_head: the list may have blocks */
 };
 
 unsigned int qiomaxatomic = Maxatomic;
@@ -279,6 +286,67 @@ struct block *copyblock(struct block *bp, int mem_flags)
 	return newb;
 }
 
+/* Helper for copyblock_csum: appends len bytes of from to the block body,
+ * summing everything after the first *skip bytes into sums[odd]. */
+static void copy_csum_to_block_body(struct block *to, uint8_t *from, size_t len,
+                                    size_t *skip, uint32_t sums[2], int *odd)
+{
+	size_t plain = MIN(len, *skip);
+
+	memcpy(to->wp, from, plain);
+	to->wp += plain;
+	from += plain;
+	len -= plain;
+	*skip -= plain;
+	if (!len)
+		return;
+	sums[*odd] += ptclbsum_copy(to->wp, from, len);
+	to->wp += len;
+	*odd ^= len & 1;
+}
+
+/* Like copyblock(), but also computes the ones-complement sum (ptclbsum()) of
+ * the bytes from csum_off to the end of the block in the same pass as the copy,
+ * so we only touch the data once.  The sum is folded but not complemented. */
+struct block *copyblock_csum(struct block *bp, int csum_off, uint16_t *csum,
+                             int mem_flags)
+{
+	struct block *newb;
+	struct extra_bdata *ebd;
+	uint32_t sums[2] = {0, 0};
+	size_t skip = csum_off;
+	int odd = 0;
+
+	QDEBUG checkb(bp, "copyblock_csum 0");
+	newb = block_alloc(BLEN(bp), mem_flags);
+	if (!newb)
+		return 0;
+	copy_csum_to_block_body(newb, bp->rp, BHLEN(bp), &skip, sums, &odd);
+	for (int i = 0; i < bp->nr_extra_bufs; i++) {
+		ebd = &bp->extra_data[i];
+		if (!ebd->base || !ebd->len)
+			continue;
+		copy_csum_to_block_body(newb, (void*)ebd->base + ebd->off, ebd->len,
+		                        &skip, sums, &odd);
+	}
+	/* odd-offset sums are byte-swapped relative to the even ones */
+	sums[0] += sums[1] >> 8;
+	sums[0] += (sums[1] & 0xff) << 8;
+	while (sums[0] >> 16)
+		sums[0] = (sums[0] >> 16) + (sums[0] & 0xffff);
+	*csum = sums[0];
+	if (bp->flag & BCKSUM_FLAGS) {
+		newb->flag |= (bp->flag & BCKSUM_FLAGS);
+		newb->checksum_start = bp->checksum_start;
+		newb->checksum_offset = bp->checksum_offset;
+		newb->mss = bp->mss;
+		newb->transport_header_end = bp->transport_header_end;
+	}
+	copyblockcnt++;
+	QDEBUG checkb(newb, "copyblock_csum 1");
+	return newb;
+}
+
 /* Returns a block with the remaining contents of b all in the main body of the
  * returned block.  Replace old references to b with the returned value (which
  * may still be 'b', if no change was needed. */
@@ -339,7 +407,7 @@ struct block *pullupblock(struct block *bp, int n)
 			ebd->off += seglen;
 			bp->extra_len -= seglen;
 			if (ebd->len == 0) {
-				kfree((void *)ebd->base);
+				extra_buf_decref(ebd);
 				ebd->off = 0;
 				ebd->base = 0;
 			}
@@ -400,6 +468,7 @@ struct block *pullupqueue(struct queue *q, int n)
 	struct block *b;
 
 	/* TODO: lock to protect the queue links? */
+	assert(!(q->state & Qspsc));
 	if ((BHLEN(q->bfirst) >= n))
 		return q->bfirst;
 	q->bfirst = pullupblock(q->bfirst, n);
@@ -427,7 +496,7 @@ static int pullext(struct block *bp, int count)
 		ed->off += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			extra_buf_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -453,7 +522,7 @@ static int dropext(struct block *bp, int count)
 		bytes += rem;
 		ed->len -= rem;
 		if (ed->len == 0) {
-			kfree((void *)ed->base);
+			extra_buf_decref(ed);
 			ed->base = 0;
 			ed->off = 0;
 		}
@@ -602,25 +671,169 @@ struct block *adjustblock(struct block *bp, int len)
 	for (; i < bp->nr_extra_bufs; i++) {
 		ebd = &bp->extra_data[i];
 		if (ebd->base)
-			kfree((void*)ebd->base);
+			extra_buf_decref(ebd);
 		ebd->base = ebd->off = ebd->len = 0;
 	}
 	QDEBUG checkb(bp, "adjustblock 4");
 	return bp;
 }
 
+/* Accounting helper: amt bytes of data left q.  Qspsc producers don't hold
+ * q->lock, so we can't either. */
+static void qconsumed(struct queue *q, size_t amt)
+{
+	if (q->state & Qspsc) {
+		__sync_fetch_and_add(&q->dlen, -(int)amt);
+		__sync_fetch_and_add(&q->bytes_read, amt);
+	} else {
+		q->dlen -= amt;
+		q->bytes_read += amt;
+	}
+}
+
 /* Helper: removes and returns the first block from q */
 static struct block *pop_first_block(struct queue *q)
 {
 	struct block *b = q->bfirst;
 
-	q->dlen -= BLEN(b);
-	q->bytes_read += BLEN(b);
+	qconsumed(q, BLEN(b));
 	q->bfirst = b->next;
 	b->next = 0;
 	return b;
 }
 
+/* Qspsc queues.
+ *
+ * A Qspsc queue has a single producer: writes to it must be serialized by the
+ * caller, like TCP does for a conversation's rq with the tcb's qlock.  That
+ * goes for qclose() and qflush() too.  Reads need no extra care.  In
+ * exchange, writes of a single block and reads of whole blocks don't take
+ * q->lock; they go through a ring of block pointers.
+ *
+ * The ring sits behind the block list: every block on the list is older than
+ * every block in the ring.  The producer pushes onto the ring.  Anyone who
+ * needs the list under q->lock (the slow read path, a write that doesn't fit
+ * the ring, qclone(), qflush()) first moves the ring onto the end of the list
+ * with qspsc_gather().
+ *
+ * Lock-free readers pop from the ring with a CAS on ring_head, and only while
+ * the list is empty.  The low bit of ring_head (RING_LISTED) says the list may
+ * not be; gathering sets it before taking anything off the ring, so a reader
+ * never pops a block while an older one sits on the list.  It gets cleared
+ * under q->lock once the list drains.  Blocks are only ever split on the list,
+ * so a block in the ring is never modified.
+ *
+ * dlen and bytes_read are updated atomically, since the producer and the
+ * readers no longer share a lock. */
+
+static bool qspsc_ring_empty(struct queue *q)
+{
+	return ACCESS_ONCE(q->ring_head) >> 1 == ACCESS_ONCE(q->ring_tail);
+}
+
+/* Moves the ring's blocks onto the end of the list.  Called with q->lock
+ * held. */
+static void qspsc_gather(struct queue *q)
+{
+	unsigned long head, tail;
+	struct block *b;
+
+	if (!(q->state & Qspsc))
+		return;
+	/* Lock-free readers leave the ring alone once this bit is set, and the
+	 * rest of the consumers hold q->lock. */
+	head = __sync_fetch_and_or(&q->ring_head, RING_LISTED) >> 1;
+	tail = ACCESS_ONCE(q->ring_tail);
+	rmb();	/* see the slots the producer filled before moving tail */
+	for (; head != tail; head++) {
+		b = q->ring[head & (QspscRing - 1)];
+		b->next = NULL;
+		if (q->bfirst)
+			q->blast->next = b;
+		else
+			q->bfirst = b;
+		q->blast = b;
+	}
+	mb();	/* done with the slots before the producer can reuse them */
+	ACCESS_ONCE(q->ring_head) = (tail << 1) | RING_LISTED;
+}
+
+/* Lets lock-free readers back in if the list is empty.  Called with q->lock
+ * held.  Not calling this is never wrong, just slower. */
+static void qspsc_settle(struct queue *q)
+{
+	if ((q->state & Qspsc) && !q->bfirst)
+		ACCESS_ONCE(q->ring_head) &= ~(unsigned long)RING_LISTED;
+}
+
+/* Lock-free write of a single block to a Qspsc queue.  Returns FALSE if the
+ * write needs the slow path: a block list, a full ring, a closed queue or one
+ * over its limit.  On success, *was_unreadable says if the q was empty. */
+static bool qspsc_push(struct queue *q, struct block *b, int qio_flags,
+                       bool *was_unreadable)
+{
+	unsigned long tail = q->ring_tail;
+
+	if (b->next || (q->state & Qclosed))
+		return FALSE;
+	if ((qio_flags & QIO_LIMIT) && ACCESS_ONCE(q->dlen) >= q->limit)
+		return FALSE;
+	if (tail - (ACCESS_ONCE(q->ring_head) >> 1) >= QspscRing)
+		return FALSE;
+	q->ring[tail & (QspscRing - 1)] = b;
+	/* Count it before readers can see it, so dlen never goes negative.  This
+	 * is also the barrier between the slot and tail. */
+	*was_unreadable = __sync_fetch_and_add(&q->dlen, BLEN(b)) == 0;
+	ACCESS_ONCE(q->ring_tail) = tail + 1;
+	return TRUE;
+}
+
+/* Lock-free read of whole blocks, up to len bytes, from a Qspsc queue.
+ * Returns 0 if there's nothing we can take without q->lock. */
+static struct block *qspsc_pop(struct queue *q, size_t len, int qio_flags)
+{
+	struct block *ret = NULL, **last = &ret, *b;
+	unsigned long head;
+	size_t blen, got = 0;
+	int old_dlen;
+
+	while (1) {
+		head = ACCESS_ONCE(q->ring_head);
+		if ((head & RING_LISTED) || head >> 1 == ACCESS_ONCE(q->ring_tail))
+			break;
+		rmb();
+		/* If someone gathers this block before our CAS, it could already be
+		 * freed, and its BLEN garbage.  That's fine: our CAS will fail. */
+		b = q->ring[(head >> 1) & (QspscRing - 1)];
+		blen = BLEN(b);
+		if (!(q->state & Qmsg) && blen > len - got)
+			break;
+		/* Let the slow path drop the empty blocks */
+		if (!blen && (q->state & Qcoalesce))
+			break;
+		if (!__sync_bool_compare_and_swap(&q->ring_head, head, head + 2))
+			continue;
+		*last = b;
+		last = &b->next;
+		got += blen;
+		if ((q->state & Qmsg) || (qio_flags & QIO_JUST_ONE_BLOCK))
+			break;
+	}
+	if (!ret)
+		return NULL;
+	*last = NULL;
+	__sync_fetch_and_add(&q->bytes_read, got);
+	old_dlen = __sync_fetch_and_add(&q->dlen, -(int)got);
+	if (q->limit && old_dlen >= q->limit &&
+	    old_dlen - (int)got < q->limit) {
+		if (q->kick && !(qio_flags & QIO_DONT_KICK))
+			q->kick(q->arg);
+		rendez_wakeup(&q->wr);
+		qwake_cb(q, FDTAP_FILT_WRITABLE);
+	}
+	return ret;
+}
+
 /* Helper: copies up to copy_amt from a buf to a block's main body (b->wp) */
 static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt)
 {
@@ -634,8 +847,7 @@ static size_t copy_to_block_body(struct block *to, void *from, size_t copy_amt)
 static void block_and_q_lost_extra(struct block *b, struct queue *q, size_t amt)
 {
 	b->extra_len -= amt;
-	q->dlen -= amt;
-	q->bytes_read += amt;
+	qconsumed(q, amt);
 }
 
 /* Helper: moves ebd from a block (in from_q) to another block.  The *ebd is
@@ -647,7 +859,8 @@ static size_t move_ebd(struct extra_bdata *ebd, struct block *to,
 {
 	size_t ret = ebd->len;
 
-	if (block_append_extra(to, ebd->base, ebd->off, ebd->len, MEM_ATOMIC))
+	if (block_append_extra_flags(to, ebd->base, ebd->off, ebd->len, ebd->flags,
+	                             MEM_ATOMIC))
 		return 0;
 	block_and_q_lost_extra(from, from_q, ebd->len);
 	ebd->base = ebd->len = ebd->off = 0;
@@ -677,8 +890,7 @@ static size_t copy_from_first_block(struct queue *q, struct block *to,
 		from->rp += copy_amt;
 		/* We only change dlen, (data len), not q->len, since the q still has
 		 * the same block memory allocation (no kfrees happened) */
-		q->dlen -= copy_amt;
-		q->bytes_read += copy_amt;
+		qconsumed(q, copy_amt);
 	}
 	/* Try to extract the remainder from the extra data */
 	len -= copy_amt;
@@ -749,8 +961,10 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 		first = q->bfirst;
 	} else {
 		spin_lock_irqsave(&q->lock);
+		qspsc_gather(q);
 		first = q->bfirst;
 		if (!first) {
+			qspsc_settle(q);
 			spin_unlock_irqsave(&q->lock);
 			return QBR_FAIL;
 		}
@@ -764,6 +978,7 @@ static int __try_qbread(struct queue *q, size_t len, int qio_flags,
 	blen = BLEN(first);
 	if ((q->state & Qcoalesce) && (blen == 0)) {
 		freeb(pop_first_block(q));
+		qspsc_settle(q);
 		spin_unlock_irqsave(&q->lock);
 		/* Need to retry to make sure we have a first block */
 		return QBR_AGAIN;
@@ -819,6 +1034,7 @@ out_ok:
 	/* Don't wake them up or fire tap if we didn't drain enough. */
 	if (!qwritable(q))
 		was_unwritable = FALSE;
+	qspsc_settle(q);
 	spin_unlock_irqsave(&q->lock);
 	if (was_unwritable) {
 		if (q->kick && !(qio_flags & QIO_DONT_KICK))
@@ -846,6 +1062,11 @@ static struct block *__qbread(struct queue *q, size_t len, int qio_flags,
 	struct block *ret = 0;
 	struct block *volatile spare = 0;	/* volatile for the waserror */
 
+	if (q->state & Qspsc) {
+		ret = qspsc_pop(q, len, qio_flags);
+		if (ret)
+			return ret;
+	}
 	/* __try_qbread can throw, based on qio flags. */
 	if ((qio_flags & QIO_CAN_ERR_SLEEP) && waserror()) {
 		if (spare)
@@ -898,6 +1119,44 @@ struct block *qget(struct queue *q)
 	return __qbread(q, SIZE_MAX, QIO_JUST_ONE_BLOCK, MEM_ATOMIC);
 }
 
+/* Qmsg queues: reads the next message, like qbread(), then takes as many of the
+ * following messages as fit, whole, in what is left of len.  Each message
+ * costs its length plus 'overhead' (the caller's framing).  The first message
+ * comes back whole even if it is bigger than len; it's up to the caller to
+ * truncate it. */
+struct block *qbread_msgs(struct queue *q, size_t len, size_t overhead,
+                          bool nonblock)
+{
+	struct block *ret, *last;
+	bool was_unwritable;
+
+	assert(q->state & Qmsg);
+	ret = nonblock ? qbread_nonblock(q, len) : qbread(q, len);
+	if (!ret)
+		return NULL;
+	len -= MIN(len, BLEN(ret) + overhead);
+	last = ret;
+	spin_lock_irqsave(&q->lock);
+	qspsc_gather(q);
+	was_unwritable = !qwritable(q);
+	while (q->bfirst && BLEN(q->bfirst) + overhead <= len) {
+		last->next = pop_first_block(q);
+		last = last->next;
+		len -= BLEN(last) + overhead;
+	}
+	if (!qwritable(q))
+		was_unwritable = FALSE;
+	qspsc_settle(q);
+	spin_unlock_irqsave(&q->lock);
+	if (was_unwritable) {
+		if (q->kick)
+			q->kick(q->arg);
+		rendez_wakeup(&q->wr);
+		qwake_cb(q, FDTAP_FILT_WRITABLE);
+	}
+	return ret;
+}
+
 /* Throw away the next 'len' bytes in the queue returning the number actually
  * discarded.
  *
@@ -977,6 +1236,7 @@ static size_t point_to_body(struct block *b, uint8_t *body_rp,
 
 	kmalloc_incref(b);
 	ebd->base = (uintptr_t)b;
+	ebd->flags = 0;
 	ebd->off = (uint32_t)(body_rp - (uint8_t*)b);
 	ebd->len = MIN(b->wp - body_rp, len);	/* think of body_rp as b->rp */
 	assert((int)ebd->len >= 0);
@@ -999,8 +1259,9 @@ static size_t point_to_buf(struct block *b, unsigned int b_idx, uint32_t b_off,
 	assert(b_idx < b->nr_extra_bufs);
 	assert(newb_idx < newb->nr_extra_bufs);
 
-	kmalloc_incref((void*)b_ebd->base);
+	extra_buf_incref(b_ebd);
 	n_ebd->base = b_ebd->base;
+	n_ebd->flags = b_ebd->flags;
 	n_ebd->off = b_ebd->off + b_off;
 	n_ebd->len = MIN(b_ebd->len - b_off, len);
 	newb->extra_len += n_ebd->len;
@@ -1108,6 +1369,7 @@ struct block *qclone(struct queue *q, int header_len, int len, uint32_t offset)
 	do {
 		/* TODO: RCU: protecting the q list (b->next) (need read lock) */
 		spin_lock_irqsave(&q->lock);
+		qspsc_gather(q);
 		ret = __blist_clone_to(q->bfirst, newb, len, offset);
 		spin_unlock_irqsave(&q->lock);
 		if (ret)
@@ -1129,6 +1391,7 @@ struct block *qcopy_old(struct queue *q, int len, uint32_t offset)
 	nb = block_alloc(len, MEM_WAIT);
 
 	spin_lock_irqsave(&q->lock);
+	qspsc_gather(q);
 
 	/* go to offset */
 	b = q->bfirst;
@@ -1200,6 +1463,13 @@ struct queue *qopen(int limit, int msg, void (*kick) (void *), void *arg)
 	q->arg = arg;
 	q->state = msg;
 	q->eof = 0;
+	if (msg & Qspsc) {
+		q->ring = kzmalloc(QspscRing * sizeof(struct block*), 0);
+		if (!q->ring) {
+			kfree(q);
+			return 0;
+		}
+	}
 
 	return q;
 }
@@ -1226,7 +1496,7 @@ static int notempty(void *a)
 {
 	struct queue *q = a;
 
-	return (q->state & Qclosed) || q->bfirst != 0;
+	return (q->state & Qclosed) || qcanread(q);
 }
 
 /* Block, waiting for the queue to be non-empty or closed.  Returns with
@@ -1236,8 +1506,10 @@ static bool qwait_and_ilock(struct queue *q, int qio_flags)
 {
 	while (1) {
 		spin_lock_irqsave(&q->lock);
+		qspsc_gather(q);
 		if (q->bfirst != NULL)
 			return TRUE;
+		qspsc_settle(q);
 		if (q->state & Qclosed) {
 			if (++q->eof > 3) {
 				spin_unlock_irqsave(&q->lock);
@@ -1277,6 +1549,7 @@ static bool qwait_and_ilock(struct queue *q, int qio_flags)
 void qaddlist(struct queue *q, struct block *b)
 {
 	/* TODO: q lock? */
+	assert(!(q->state & Qspsc));
 	/* queue the block */
 	if (q->bfirst)
 		q->blast->next = b;
@@ -1317,7 +1590,7 @@ static size_t read_from_block(struct block *b, uint8_t *to, size_t amt)
 		if (!ebd->len) {
 			/* we don't actually have to decref here.  it's also done in
 			 * freeb().  this is the earliest we can free. */
-			kfree((void*)ebd->base);
+			extra_buf_decref(ebd);
 			ebd->base = ebd->off = 0;
 		}
 		to += copy_amt;
@@ -1416,6 +1689,7 @@ struct block *mem2bl(uint8_t * p, int len)
  */
 void qputback(struct queue *q, struct block *b)
 {
+	assert(!(q->state & Qspsc));
 	b->next = q->bfirst;
 	if (q->bfirst == NULL)
 		q->blast = b;
@@ -1483,7 +1757,10 @@ static size_t enqueue_blist(struct queue *q, struct block *b)
 		dlen += BLEN(b);
 	}
 	q->blast = b;
-	q->dlen += dlen;
+	if (q->state & Qspsc)
+		__sync_fetch_and_add(&q->dlen, dlen);
+	else
+		q->dlen += dlen;
 	return dlen;
 }
 
@@ -1500,7 +1777,15 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 		(*q->bypass) (q->arg, b);
 		return ret;
 	}
+	if (q->state & Qspsc) {
+		/* b is gone once it's in the ring */
+		ret = BLEN(b);
+		if (qspsc_push(q, b, qio_flags, &was_unreadable))
+			goto wake;
+	}
 	spin_lock_irqsave(&q->lock);
+	/* everything in the ring goes before b */
+	qspsc_gather(q);
 	was_unreadable = q->dlen == 0;
 	if (q->state & Qclosed) {
 		spin_unlock_irqsave(&q->lock);
@@ -1530,6 +1815,7 @@ static ssize_t __qbwrite(struct queue *q, struct block *b, int qio_flags)
 	ret = enqueue_blist(q, b);
 	QDEBUG checkb(b, "__qbwrite");
 	spin_unlock_irqsave(&q->lock);
+wake:
 	/* TODO: not sure if the usage of a kick is mutually exclusive with a
 	 * wakeup, meaning that actual users either want a kick or have qreaders. */
 	if (q->kick && (was_unreadable || (q->state & Qkick)))
@@ -1697,6 +1983,19 @@ ssize_t qiwrite(struct queue *q, void *vp, int len)
 	return __qwrite(q, vp, len, MEM_ATOMIC, 0);
 }
 
+/* Accounting helper for qclose() and qflush(): q's list, blist, was just
+ * emptied.  Called with q->lock held. */
+static void qdrained(struct queue *q, struct block *blist)
+{
+	if (q->state & Qspsc) {
+		/* A lock-free write can be in flight; don't throw away its dlen */
+		__sync_fetch_and_add(&q->dlen, -blocklen(blist));
+		qspsc_settle(q);
+	} else {
+		q->dlen = 0;
+	}
+}
+
 /*
  *  be extremely careful when calling this,
  *  as there is no reference accounting
@@ -1704,6 +2003,7 @@ ssize_t qiwrite(struct queue *q, void *vp, int len)
 void qfree(struct queue *q)
 {
 	qclose(q);
+	kfree(q->ring);
 	kfree(q);
 }
 
@@ -1723,9 +2023,10 @@ void qclose(struct queue *q)
 	q->state |= Qclosed;
 	q->state &= ~Qdropoverflow;
 	q->err[0] = 0;
+	qspsc_gather(q);
 	bfirst = q->bfirst;
 	q->bfirst = 0;
-	q->dlen = 0;
+	qdrained(q, bfirst);
 	spin_unlock_irqsave(&q->lock);
 
 	/* free queued blocks */
@@ -1823,6 +2124,8 @@ int qwindow(struct queue *q)
  */
 int qcanread(struct queue *q)
 {
+	if (q->state & Qspsc)
+		return q->bfirst != 0 || !qspsc_ring_empty(q);
 	return q->bfirst != 0;
 }
 
@@ -1880,9 +2183,10 @@ void qflush(struct queue *q)
 
 	/* mark it */
 	spin_lock_irqsave(&q->lock);
+	qspsc_gather(q);
 	bfirst = q->bfirst;
 	q->bfirst = 0;
-	q->dlen = 0;
+	qdrained(q, bfirst);
 	spin_unlock_irqsave(&q->lock);
 
 	/* free queued blocks */
@@ -177,6 +177,15 @@ static int pm_insert_page(struct page_map *pm, unsigned long index,
 	return 0;
 }
 
+/* Increfs the PM slot ref.  The caller must already hold one, so the page
+ * can't be undergoing removal. */
+void pm_get_page(struct page *page)
+{
+	void **tree_slot = page->pg_tree_slot;
+	assert(tree_slot && pm_slot_check_refcnt(*tree_slot));
+	atomic_add((atomic_t*)tree_slot, 1UL << PM_REFCNT_SHIFT);
+}
+
 /* Decrefs the PM slot ref (usage of a PM page).  The PM's page ref remains. */
 void pm_put_page(struct page *page)
 {
@@ -40,3 +40,39 @@ void percpu_init(void)
 	}
 	run_init_functions();
 }
+
+void percpu_ctrs_init(struct percpu_ctrs *pc, size_t nr, int flags)
+{
+	pc->nr = nr;
+	pc->stride = ROUNDUP(nr * sizeof(uint64_t), ARCH_CL_SIZE) /
+	             sizeof(uint64_t);
+	pc->ctrs = kzmalloc_align(num_cores * pc->stride * sizeof(uint64_t),
+	                          flags, ARCH_CL_SIZE);
+}
+
+void percpu_ctrs_destroy(struct percpu_ctrs *pc)
+{
+	kfree(pc->ctrs);
+	pc->ctrs = NULL;
+	pc->nr = 0;
+}
+
+uint64_t percpu_ctr_sum(struct percpu_ctrs *pc, size_t i)
+{
+	uint64_t sum = 0;
+
+	assert(i < pc->nr);
+	for (int c = 0; c < num_cores; c++)
+		sum += ACCESS_ONCE(pc->ctrs[c * pc->stride + i]);
+	return sum;
+}
+
+/* For the occasional gauge kept in a set of counters.  Racing increments from
+ * other cores land on top of val. */
+void percpu_ctr_set(struct percpu_ctrs *pc, size_t i, uint64_t val)
+{
+	assert(i < pc->nr);
+	for (int c = 0; c < num_cores; c++)
+		pc->ctrs[c * pc->stride + i] = 0;
+	pc->ctrs[i] = val;
+}
@@ -300,7 +300,8 @@ void page_remove(pgdir_t pgdir, void *va)
 		page = pa2page(pte_get_paddr(pte));
 		pte_clear(pte);
 		tlb_invalidate(pgdir, va);
-		page_decref(page);
+		if (!page_is_lent(page))
+			page_decref(page);
 	} else if (pte_is_paged_out(pte)) {
 		/* TODO: (SWAP) need to free this from the swap */
 		panic("Swapping not supported!");
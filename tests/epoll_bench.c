@@ -0,0 +1,166 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * #epoll readiness set benchmark: a server-style loop over many idle FDs with a
+ * few active ones per round.
+ *
+ * usage: epoll_bench [-n PIPES] [-r ROUNDS] [-k ACTIVE] [-m lt|et|oneshot]
+ *
+ * We make PIPES pipes (two FDs each, so the default is 100k FDs), add every
+ * read end to one set, and then each round write a byte to ACTIVE of them and
+ * harvest the set until we've drained them all.  Prints the cost of the adds
+ * and the events per second and per read of the data file.  Fails if one read
+ * reports the same FD twice. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <parlib/timing.h>
+#include <ros/fdtap.h>
+
+enum {
+	EV_BATCH = 128,
+};
+
+static int nr_pipes = 50000;
+static int nr_rounds = 100;
+static int nr_active = 1000;
+static char *mode = "lt";
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static void ctl(int cfd, char *msg)
+{
+	if (write(cfd, msg, strlen(msg)) < 0)
+		sysfatal(msg);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, dir_fd, ctl_fd, data_fd;
+	int (*pipes)[2];
+	long *seen;		/* the read that last reported each pipe */
+	struct fd_tap_event evs[EV_BATCH];
+	char cmd[128], *flags;
+	char c = 'x';
+	long n, reads = 0, events = 0;
+	int drained, idx;
+	uint64_t start, add_nsec, run_nsec = 0;
+
+	while ((opt = getopt(argc, argv, "n:r:k:m:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_pipes = atoi(optarg);
+			break;
+		case 'r':
+			nr_rounds = atoi(optarg);
+			break;
+		case 'k':
+			nr_active = atoi(optarg);
+			break;
+		case 'm':
+			mode = optarg;
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-n pipes] [-r rounds] [-k active] [-m lt|et|oneshot]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (!strcmp(mode, "lt"))
+		flags = "";
+	else if (!strcmp(mode, "et"))
+		flags = " et";
+	else if (!strcmp(mode, "oneshot"))
+		flags = " oneshot";
+	else
+		sysfatal("mode must be lt, et, or oneshot");
+	if (nr_pipes <= 0 || nr_active <= 0 || nr_active > nr_pipes)
+		sysfatal("need 0 < active <= pipes");
+
+	dir_fd = open("#epoll", O_PATH);
+	if (dir_fd < 0)
+		sysfatal("#epoll");
+	ctl_fd = openat(dir_fd, "ctl", O_RDWR);
+	data_fd = openat(dir_fd, "data", O_RDONLY);
+	if (ctl_fd < 0 || data_fd < 0)
+		sysfatal("#epoll files");
+
+	pipes = malloc(nr_pipes * sizeof(*pipes));
+	seen = calloc(nr_pipes, sizeof(long));
+	for (int i = 0; i < nr_pipes; i++) {
+		if (pipe(pipes[i]))
+			sysfatal("pipe");
+		if (fcntl(pipes[i][0], F_SETFL, O_NONBLOCK))
+			sysfatal("setfl");
+	}
+	start = nsec();
+	for (int i = 0; i < nr_pipes; i++) {
+		snprintf(cmd, sizeof(cmd), "add %d %d %d%s", pipes[i][0],
+		         FDTAP_FILT_READABLE, i, flags);
+		ctl(ctl_fd, cmd);
+	}
+	add_nsec = nsec() - start;
+
+	for (int r = 0; r < nr_rounds; r++) {
+		/* Spread the active pipes out, a different set each round. */
+		for (int i = 0; i < nr_active; i++) {
+			idx = (r * nr_active + i * (nr_pipes / nr_active)) % nr_pipes;
+			if (write(pipes[idx][1], &c, 1) != 1)
+				sysfatal("write");
+		}
+		start = nsec();
+		drained = 0;
+		while (drained < nr_active) {
+			n = read(data_fd, evs, sizeof(evs));
+			if (n <= 0)
+				sysfatal("read #epoll");
+			reads++;
+			n /= sizeof(struct fd_tap_event);
+			events += n;
+			for (int i = 0; i < n; i++) {
+				idx = evs[i].data;
+				if (seen[idx] == reads) {
+					fprintf(stderr, "%s: fd %d reported twice in one read\n",
+					        mode, pipes[idx][0]);
+					exit(-1);
+				}
+				seen[idx] = reads;
+				if (read(pipes[idx][0], &c, 1) == 1)
+					drained++;
+				if (!strcmp(mode, "oneshot")) {
+					snprintf(cmd, sizeof(cmd), "mod %d %d %d oneshot",
+					         pipes[idx][0], FDTAP_FILT_READABLE, idx);
+					ctl(ctl_fd, cmd);
+				}
+			}
+		}
+		run_nsec += nsec() - start;
+	}
+
+	printf("%s: %d FDs in the set, added in %.1f msec (%.2f usec each)\n",
+	       mode, nr_pipes, add_nsec / 1e6, add_nsec / 1000.0 / nr_pipes);
+	printf("%s: %d rounds of %d active, %.0f events/sec, %.1f events/read, %.2f usec/round\n",
+	       mode, nr_rounds, nr_active, events / (run_nsec / 1e9),
+	       (double)events / reads, run_nsec / 1000.0 / nr_rounds);
+	for (int i = 0; i < nr_pipes; i++) {
+		snprintf(cmd, sizeof(cmd), "del %d", pipes[i][0]);
+		ctl(ctl_fd, cmd);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	close(data_fd);
+	close(ctl_fd);
+	close(dir_fd);
+	free(seen);
+	free(pipes);
+	return 0;
+}
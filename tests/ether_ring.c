@@ -0,0 +1,162 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * #ether packet ring capture (struct ether_ring_hdr, ros/net.h).
+ *
+ * usage: ether_ring [-d DEV] [-t TYPE] [-p NPAGES] [-s SECS] [-x COUNT]
+ *
+ * Connects a new netfile of DEV (default /net/ether0) to TYPE (default -1, all
+ * types), puts it in ring mode with NPAGES of memory, and polls the rx ring for
+ * SECS seconds, printing packets and bytes per second and the kernel's drop
+ * count.  With -x, first sends COUNT broadcast frames of TYPE through the tx
+ * ring, one doorbell write per ring full. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <ros/net.h>
+
+static char *dev = "/net/ether0";
+static long type = -1;
+static long npages = 256;
+static int secs = 10;
+static long tx_count;
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static void ctl(int cfd, char *msg)
+{
+	if (write(cfd, msg, strlen(msg)) < 0)
+		sysfatal(msg);
+}
+
+static struct ether_frame *frame(struct ether_ring_hdr *hdr, uint32_t off,
+                                 uint32_t idx)
+{
+	return (void*)hdr + off + (idx & (hdr->nr_frames - 1)) * hdr->frame_sz;
+}
+
+static void send_frames(struct ether_ring_hdr *hdr, int data_fd)
+{
+	struct ether_frame *fr;
+	long sent = 0, n;
+	uint32_t prod;
+
+	while (sent < tx_count) {
+		prod = hdr->tx_prod;
+		while (sent < tx_count &&
+		       prod - *(volatile uint32_t*)&hdr->tx_cons < hdr->nr_frames) {
+			fr = frame(hdr, hdr->tx_off, prod);
+			memset(fr->data, 0xff, 6);
+			fr->data[12] = type >> 8;
+			fr->data[13] = type;
+			memset(fr->data + 14, 0, 46);
+			fr->len = 60;
+			prod++;
+			sent++;
+		}
+		__sync_synchronize();
+		hdr->tx_prod = prod;
+		n = write(data_fd, "", 1);
+		if (n < 0)
+			sysfatal("tx doorbell");
+	}
+	printf("sent %ld frames\n", sent);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, ctl_fd, data_fd, n;
+	char buf[128], num[32];
+	struct ether_ring_hdr *hdr;
+	struct ether_frame *fr;
+	uint32_t cons;
+	long pkts = 0, bytes = 0;
+	uint64_t start, now;
+
+	while ((opt = getopt(argc, argv, "d:t:p:s:x:")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev = optarg;
+			break;
+		case 't':
+			type = strtol(optarg, 0, 0);
+			break;
+		case 'p':
+			npages = atol(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'x':
+			tx_count = atol(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-d dev] [-t type] [-p npages] [-s secs] [-x count]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (tx_count && type < 0)
+		sysfatal("sending needs a -t type");
+
+	snprintf(buf, sizeof(buf), "%s/clone", dev);
+	ctl_fd = open(buf, O_RDWR);
+	if (ctl_fd < 0)
+		sysfatal(buf);
+	n = read(ctl_fd, num, sizeof(num) - 1);
+	if (n <= 0)
+		sysfatal("read clone");
+	num[n] = 0;
+	snprintf(buf, sizeof(buf), "connect %ld", type);
+	ctl(ctl_fd, buf);
+
+	hdr = mmap(0, npages * PGSIZE, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (hdr == MAP_FAILED)
+		sysfatal("mmap");
+	snprintf(buf, sizeof(buf), "ring %p %ld", hdr, npages);
+	ctl(ctl_fd, buf);
+	snprintf(buf, sizeof(buf), "%s/%d/data", dev, atoi(num));
+	data_fd = open(buf, O_RDWR);
+	if (data_fd < 0)
+		sysfatal(buf);
+	printf("%s: %u frames of %u bytes a side\n", buf, hdr->nr_frames,
+	       hdr->frame_sz);
+
+	if (tx_count)
+		send_frames(hdr, data_fd);
+
+	start = nsec();
+	cons = hdr->rx_cons;
+	do {
+		while (cons != *(volatile uint32_t*)&hdr->rx_prod) {
+			__sync_synchronize();
+			fr = frame(hdr, hdr->rx_off, cons);
+			bytes += fr->len;
+			pkts++;
+			cons++;
+			hdr->rx_cons = cons;
+		}
+		now = nsec();
+	} while (now - start < secs * 1000000000ULL);
+
+	printf("rx: %ld packets, %.0f pkts/sec, %.1f MB/sec, %llu dropped\n", pkts,
+	       pkts / ((now - start) / 1e9), bytes / ((now - start) / 1e3),
+	       (unsigned long long)hdr->rx_drops);
+	close(data_fd);
+	close(ctl_fd);
+	munmap(hdr, npages * PGSIZE);
+	return 0;
+}
@@ -0,0 +1,198 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Localhost TCP benchmark: request/response latency and bulk throughput over
+ * 127.0.0.1.
+ *
+ * usage: lo_bench [-n ITERS] [-s SIZE] [-m MB] [-p PORT]
+ *
+ * The rr test sends SIZE bytes and waits for SIZE back, ITERS times, and prints
+ * transactions per second and the mean round trip.  The stream test sends MB
+ * megabytes to a sink thread and prints MB/s, timed from the first write to
+ * the sink seeing EOF. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iplib/iplib.h>
+#include <parlib/timing.h>
+
+enum {
+	BULK_CHUNK = 64 * 1024,
+};
+
+static char *port = "5557";
+static char adir[40];
+static int iters = 100000;
+static int size = 64;
+static long mb = 256;
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static int accept_one(void)
+{
+	char ldir[40];
+	int lcfd, dfd;
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		sysfatal("listen");
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0)
+		sysfatal("accept");
+	close(lcfd);
+	return dfd;
+}
+
+static int dial_lo(void)
+{
+	char addr[64];
+	int dfd;
+
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%s", port);
+	dfd = dial9(addr, 0, 0, 0, 0);
+	if (dfd < 0)
+		sysfatal("dial");
+	return dfd;
+}
+
+/* Reads exactly n bytes, returns FALSE on EOF. */
+static int readn(int fd, char *buf, int n)
+{
+	int ret, sofar = 0;
+
+	while (sofar < n) {
+		ret = read(fd, buf + sofar, n - sofar);
+		if (ret <= 0)
+			return 0;
+		sofar += ret;
+	}
+	return 1;
+}
+
+static void *echo(void *arg)
+{
+	char *buf = malloc(size);
+	int dfd = accept_one();
+
+	while (readn(dfd, buf, size)) {
+		if (write(dfd, buf, size) != size)
+			sysfatal("echo");
+	}
+	close(dfd);
+	free(buf);
+	return 0;
+}
+
+static void *sink(void *arg)
+{
+	static char buf[BULK_CHUNK];
+	int dfd = accept_one();
+	long cnt, total = 0;
+
+	while ((cnt = read(dfd, buf, sizeof(buf))) > 0)
+		total += cnt;
+	close(dfd);
+	return (void*)total;
+}
+
+static void run_rr(void)
+{
+	pthread_t srv;
+	char *buf = malloc(size);
+	uint64_t start;
+	double secs;
+	int dfd;
+
+	pthread_create(&srv, NULL, echo, NULL);
+	dfd = dial_lo();
+	memset(buf, 0xaa, size);
+	start = nsec();
+	for (int i = 0; i < iters; i++) {
+		if (write(dfd, buf, size) != size)
+			sysfatal("write");
+		if (!readn(dfd, buf, size))
+			sysfatal("short echo");
+	}
+	secs = (nsec() - start) / 1e9;
+	close(dfd);
+	pthread_join(srv, NULL);
+	free(buf);
+	printf("rr      %d x %d bytes: %.0f trans/sec, %.2f usec per round trip\n",
+	       iters, size, iters / secs, secs * 1e6 / iters);
+}
+
+static void run_stream(void)
+{
+	pthread_t snk;
+	char *buf = malloc(BULK_CHUNK);
+	long total = mb * 1024 * 1024;
+	uint64_t start;
+	double secs;
+	void *got;
+	int dfd;
+
+	pthread_create(&snk, NULL, sink, NULL);
+	dfd = dial_lo();
+	memset(buf, 0x55, BULK_CHUNK);
+	start = nsec();
+	for (long sent = 0; sent < total; sent += BULK_CHUNK) {
+		if (write(dfd, buf, BULK_CHUNK) != BULK_CHUNK)
+			sysfatal("write");
+	}
+	close(dfd);
+	pthread_join(snk, &got);
+	secs = (nsec() - start) / 1e9;
+	free(buf);
+	if ((long)got != total)
+		fprintf(stderr, "stream: sink got %ld bytes, expected %ld\n",
+		        (long)got, total);
+	printf("stream  %ld MB in %.3f sec, %.2f MB/s\n", mb, secs, mb / secs);
+}
+
+int main(int argc, char **argv)
+{
+	char addr[64];
+	int opt, afd;
+
+	while ((opt = getopt(argc, argv, "n:s:m:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'm':
+			mb = atol(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-n iters] [-s size] [-m MB] [-p port]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (iters <= 0 || size <= 0 || mb <= 0) {
+		fprintf(stderr, "iters, size and MB must be positive\n");
+		exit(-1);
+	}
+	snprintf(addr, sizeof(addr), "tcp!*!%s", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0)
+		sysfatal("announce");
+	run_rr();
+	run_stream();
+	close(afd);
+	return 0;
+}
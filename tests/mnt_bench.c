@@ -0,0 +1,308 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * 9P mount read/write benchmark, against a local stand-in for a remote server.
+ *
+ * usage: mnt_bench [-c] [-d DIR] [-s MB] [-b BYTES] [-l USEC] [-m MSIZE]
+ *
+ * We serve a single synthetic file of MB megabytes over a pipe, mount it on
+ * DIR, and time reading and writing it through the mount, first one iounit per
+ * syscall (one rpc at a time) and then BYTES per syscall.  Every reply is held
+ * back by USEC to look like a network round trip; the server keeps answering
+ * requests meanwhile, like a real one would.  MSIZE caps the msize the server
+ * accepts in Tversion.  The most rpcs we ever saw outstanding shows how wide
+ * the kernel's window got.
+ *
+ * With -c, we mount with MCACHE.  devmnt only pipelines reads on those mounts,
+ * so that's where a window shows up, in the page cache's readahead fills once
+ * MSIZE is smaller than a fill.  The first read fills the cache, and the later
+ * ones should come out of it.  The cached pass fails if it sends any reads,
+ * including the one that finds EOF.  Writes always go one rpc at a time. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <fcall.h>
+#include <ndblib/fcallfmt.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+#include <ros/syscall.h>
+
+#define QTDIR 0x80
+#define QTFILE 0x00
+#define MCACHE 0x0010
+
+enum {
+	MAXMSG = IOHDRSZ + 1024 * 1024,
+	QROOT = 0,
+	QFILE = 1,
+};
+
+struct reply {
+	struct reply *next;
+	uint64_t due;
+	unsigned int len;
+	uint8_t msg[];
+};
+
+static char *mntpt = "/tmp/mnt_bench";
+static long file_sz = 16 << 20;
+static long io_sz = 1 << 20;
+static long latency_usec = 100;
+static unsigned int max_msize = MAXMSG;
+static int mnt_flags;
+
+static int srv_fd;
+static unsigned int msize;
+static pthread_mutex_t reply_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reply_cv = PTHREAD_COND_INITIALIZER;
+static struct reply *reply_head, **reply_tail = &reply_head;
+static long inflight, max_inflight, nr_rpcs;
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+/* Queues f as the reply to the request it answers, due latency_usec from now.
+ * Replies go out in order, so an Rflush never beats the reply it flushes. */
+static void respond(struct fcall *f, int io)
+{
+	struct reply *r = malloc(sizeof(struct reply) + msize);
+
+	r->len = convS2M(f, r->msg, msize);
+	if (r->len <= BIT16SZ)
+		sysfatal("convS2M");
+	r->due = nsec() + latency_usec * 1000;
+	r->next = NULL;
+	pthread_mutex_lock(&reply_lock);
+	*reply_tail = r;
+	reply_tail = &r->next;
+	if (io) {
+		nr_rpcs++;
+		if (++inflight > max_inflight)
+			max_inflight = inflight;
+	}
+	pthread_cond_signal(&reply_cv);
+	pthread_mutex_unlock(&reply_lock);
+}
+
+static void *replier(void *arg)
+{
+	struct reply *r;
+	uint64_t now;
+
+	for (;;) {
+		pthread_mutex_lock(&reply_lock);
+		while (!reply_head)
+			pthread_cond_wait(&reply_cv, &reply_lock);
+		r = reply_head;
+		reply_head = r->next;
+		if (!reply_head)
+			reply_tail = &reply_head;
+		pthread_mutex_unlock(&reply_lock);
+		now = nsec();
+		if (r->due > now)
+			usleep((r->due - now) / 1000);
+		if (write(srv_fd, r->msg, r->len) != r->len)
+			sysfatal("srv write");
+		pthread_mutex_lock(&reply_lock);
+		if (GBIT8(r->msg + BIT32SZ) == Rread ||
+		    GBIT8(r->msg + BIT32SZ) == Rwrite)
+			inflight--;
+		pthread_mutex_unlock(&reply_lock);
+		free(r);
+	}
+	return 0;
+}
+
+static void rerror(struct fcall *f, char *ename)
+{
+	f->type = Rerror;
+	f->ename = ename;
+	respond(f, 0);
+}
+
+static void *server(void *arg)
+{
+	static uint8_t msg[MAXMSG];
+	static char data[MAXMSG];
+	struct fcall f;
+	struct qid root = {QROOT, 0, QTDIR};
+	struct qid file = {QFILE, 0, QTFILE};
+	int n, io;
+
+	memset(data, 'x', sizeof(data));
+	for (;;) {
+		n = read9pmsg(srv_fd, msg, sizeof(msg));
+		if (n <= 0)
+			break;
+		if (convM2S(msg, n, &f) != n)
+			sysfatal("convM2S");
+		io = 0;
+		switch (f.type) {
+		case Tversion:
+			msize = f.msize < max_msize ? f.msize : max_msize;
+			f.msize = msize;
+			break;
+		case Tattach:
+			f.qid = root;
+			break;
+		case Twalk:
+			if (f.nwname > 1 ||
+			    (f.nwname == 1 && strcmp(f.wname[0], "file"))) {
+				rerror(&f, "file does not exist");
+				continue;
+			}
+			f.nwqid = f.nwname;
+			f.wqid[0] = file;
+			break;
+		case Topen:
+			f.qid = file;
+			f.iounit = 0;
+			break;
+		case Tread:
+			if (f.offset >= file_sz)
+				f.count = 0;
+			else if (f.offset + f.count > file_sz)
+				f.count = file_sz - f.offset;
+			f.data = data;
+			io = 1;
+			break;
+		case Twrite:
+			io = 1;
+			break;
+		case Tclunk:
+		case Tflush:
+			break;
+		default:
+			rerror(&f, "unsupported");
+			continue;
+		}
+		f.type++;
+		respond(&f, io);
+	}
+	return 0;
+}
+
+/* Reads or writes the whole file in chunks of sz bytes.  Reads keep going until
+ * they get EOF.  Returns MB/sec. */
+static double run(char *path, int write_it, long sz)
+{
+	char *buf = malloc(sz);
+	long n, done = 0;
+	uint64_t start;
+	int fd;
+
+	memset(buf, 'y', sz);
+	fd = open(path, write_it ? O_WRONLY : O_RDONLY);
+	if (fd < 0)
+		sysfatal(path);
+	start = nsec();
+	while (!write_it || done < file_sz) {
+		n = write_it ? write(fd, buf, sz) : read(fd, buf, sz);
+		if (!n && !write_it)
+			break;
+		if (n <= 0)
+			sysfatal(write_it ? "write" : "read");
+		done += n;
+	}
+	start = nsec() - start;
+	if (done != file_sz) {
+		fprintf(stderr, "%s: got %ld bytes, wanted %ld\n", path, done, file_sz);
+		exit(-1);
+	}
+	close(fd);
+	free(buf);
+	return done / (start / 1e3);
+}
+
+static void report(char *path, int write_it, char *how, long sz)
+{
+	double mbs;
+	long rpcs, most;
+
+	pthread_mutex_lock(&reply_lock);
+	nr_rpcs = max_inflight = 0;
+	pthread_mutex_unlock(&reply_lock);
+	mbs = run(path, write_it, sz);
+	pthread_mutex_lock(&reply_lock);
+	rpcs = nr_rpcs;
+	most = max_inflight;
+	pthread_mutex_unlock(&reply_lock);
+	printf("%s %-6s %8ld bytes/call: %8.1f MB/sec, %6ld rpcs, %3ld outstanding max\n",
+	       write_it ? "write" : "read ", how, sz, mbs, rpcs, most);
+	if (!strcmp(how, "cached") && rpcs) {
+		fprintf(stderr, "FAIL: cached read sent %ld rpcs\n", rpcs);
+		exit(-1);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int opt, p[2];
+	pthread_t srv_thread, reply_thread;
+	char path[128];
+	long iounit;
+
+	while ((opt = getopt(argc, argv, "cd:s:b:l:m:")) != -1) {
+		switch (opt) {
+		case 'c':
+			mnt_flags |= MCACHE;
+			break;
+		case 'd':
+			mntpt = optarg;
+			break;
+		case 's':
+			file_sz = atol(optarg) << 20;
+			break;
+		case 'b':
+			io_sz = atol(optarg);
+			break;
+		case 'l':
+			latency_usec = atol(optarg);
+			break;
+		case 'm':
+			max_msize = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-c] [-d dir] [-s MB] [-b bytes] [-l usec] [-m msize]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (max_msize < 256 || max_msize > MAXMSG)
+		sysfatal("msize must be between 256 and 1MB + IOHDRSZ");
+
+	if (pipe(p))
+		sysfatal("pipe");
+	srv_fd = p[0];
+	if (pthread_create(&srv_thread, NULL, server, NULL) ||
+	    pthread_create(&reply_thread, NULL, replier, NULL))
+		sysfatal("pthread_create");
+	if (mkdir(mntpt, 0777) && errno != EEXIST)
+		sysfatal(mntpt);
+	if (syscall(SYS_nmount, p[1], mntpt, strlen(mntpt), mnt_flags))
+		sysfatal("mount");
+	snprintf(path, sizeof(path), "%s/file", mntpt);
+
+	iounit = msize - IOHDRSZ;
+	printf("%s: msize %u, %ld MB file, %ld usec per rpc\n", path, msize,
+	       file_sz >> 20, latency_usec);
+	report(path, 0, "serial", iounit);
+	report(path, 0, "big", io_sz);
+	if (mnt_flags & MCACHE)
+		report(path, 0, "cached", io_sz);
+	report(path, 1, "serial", iounit);
+	report(path, 1, "big", io_sz);
+	syscall(SYS_nunmount, NULL, 0, mntpt, strlen(mntpt));
+	return 0;
+}
@@ -0,0 +1,255 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * TCP ping-pong latency, with and without busy polling.
+ *
+ * usage: pingpong [-b USEC] [-C] [-n ITERS] [-s SIZE] [-p PORT] [-S | -c HOST]
+ *
+ * Each iteration sends SIZE bytes and waits for the echo.  We print a
+ * histogram of the round trip times and some percentiles.  -b sets "busypoll
+ * USEC" on both ends' conversations.  Only MCPs busy poll, so the client and
+ * the server both run in pthreads, which makes us one.
+ *
+ * -C runs the client twice, first without busy polling and then with -b's
+ * USEC, and fails unless busy polling lowered the median round trip.
+ *
+ * By default the echo server is a thread on this box, over loopback.  -S just
+ * runs the server, and -c HOST runs the client against a server on HOST, which
+ * is the interesting case for busy polling a NIC. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <iplib/iplib.h>
+#include <parlib/timing.h>
+
+static char *port = "5556";
+static int busypoll;
+static int compare;
+static uint64_t p50;		/* of the last client run, nsec */
+static int size = 64;
+static int iters = 100000;
+
+enum {
+	NR_BUCKETS = 24,	/* log2 usec */
+};
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static void set_busypoll(int cfd)
+{
+	char msg[32];
+
+	if (!busypoll)
+		return;
+	snprintf(msg, sizeof(msg), "busypoll %d", busypoll);
+	if (write(cfd, msg, strlen(msg)) < 0)
+		sysfatal("busypoll ctl");
+}
+
+/* Reads exactly n bytes, returns FALSE on EOF. */
+static int readn(int fd, char *buf, int n)
+{
+	int ret, sofar = 0;
+
+	while (sofar < n) {
+		ret = read(fd, buf + sofar, n - sofar);
+		if (ret <= 0)
+			return 0;
+		sofar += ret;
+	}
+	return 1;
+}
+
+/* Echoes one connection until EOF. */
+static void *server(void *arg)
+{
+	char *adir = arg;
+	char ldir[40];
+	char *buf = malloc(size);
+	int lcfd, dfd;
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		sysfatal("listen");
+	set_busypoll(lcfd);
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0)
+		sysfatal("accept");
+	while (readn(dfd, buf, size)) {
+		if (write(dfd, buf, size) != size)
+			sysfatal("echo");
+	}
+	close(dfd);
+	close(lcfd);
+	free(buf);
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_results(uint64_t *rtt, int n)
+{
+	int hist[NR_BUCKETS] = {0};
+	int b, max = 1;
+
+	for (int i = 0; i < n; i++) {
+		b = 0;
+		while ((rtt[i] / 1000) >> b && b < NR_BUCKETS - 1)
+			b++;
+		hist[b]++;
+	}
+	for (b = 0; b < NR_BUCKETS; b++)
+		max = hist[b] > max ? hist[b] : max;
+	printf("rtt usec      count\n");
+	for (b = 0; b < NR_BUCKETS; b++) {
+		if (!hist[b])
+			continue;
+		printf("< %-8lu %8d ", 1UL << b, hist[b]);
+		for (int i = 0; i < hist[b] * 50 / max; i++)
+			putchar('*');
+		putchar('\n');
+	}
+	qsort(rtt, n, sizeof(uint64_t), cmp_u64);
+	p50 = rtt[n / 2];
+	printf("busypoll %d usec, %d bytes: min %.2f p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f usec\n",
+	       busypoll, size, rtt[0] / 1e3, rtt[n / 2] / 1e3, rtt[n * 9 / 10] / 1e3,
+	       rtt[n * 99 / 100] / 1e3, rtt[n * 999 / 1000] / 1e3,
+	       rtt[n - 1] / 1e3);
+}
+
+static void *client(void *arg)
+{
+	char *host = arg;
+	char addr[128];
+	char *buf = malloc(size);
+	uint64_t *rtt = malloc(iters * sizeof(uint64_t));
+	uint64_t start;
+	int dfd, cfd;
+
+	snprintf(addr, sizeof(addr), "tcp!%s!%s", host, port);
+	dfd = dial9(addr, 0, 0, &cfd, 0);
+	if (dfd < 0)
+		sysfatal("dial");
+	set_busypoll(cfd);
+	memset(buf, 0xaa, size);
+	for (int i = 0; i < iters; i++) {
+		start = nsec();
+		if (write(dfd, buf, size) != size)
+			sysfatal("write");
+		if (!readn(dfd, buf, size))
+			sysfatal("short echo");
+		rtt[i] = nsec() - start;
+	}
+	close(dfd);
+	close(cfd);
+	print_results(rtt, iters);
+	free(rtt);
+	free(buf);
+	return 0;
+}
+
+/* One client run, against host, or an echo server thread on this box if host
+ * is NULL. */
+static void run(char *host, char *adir)
+{
+	pthread_t srv, cli;
+
+	if (host) {
+		pthread_create(&cli, NULL, client, host);
+		pthread_join(cli, NULL);
+		return;
+	}
+	pthread_create(&srv, NULL, server, adir);
+	pthread_create(&cli, NULL, client, "127.0.0.1");
+	pthread_join(cli, NULL);
+	pthread_join(srv, NULL);
+}
+
+int main(int argc, char **argv)
+{
+	char addr[64], adir[40];
+	char *host = NULL;
+	int opt, afd = -1, server_only = 0, on;
+	uint64_t off_p50 = 0;
+	pthread_t srv;
+
+	while ((opt = getopt(argc, argv, "b:Cn:s:p:Sc:")) != -1) {
+		switch (opt) {
+		case 'b':
+			busypoll = atoi(optarg);
+			break;
+		case 'C':
+			compare = 1;
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'S':
+			server_only = 1;
+			break;
+		case 'c':
+			host = optarg;
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-b usec] [-C] [-n iters] [-s size] [-p port] [-S | -c host]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (iters <= 0 || size <= 0) {
+		fprintf(stderr, "iters and size must be positive\n");
+		exit(-1);
+	}
+	if (compare && (!busypoll || server_only)) {
+		fprintf(stderr, "-C needs -b and a client\n");
+		exit(-1);
+	}
+	if (!host) {
+		snprintf(addr, sizeof(addr), "tcp!*!%s", port);
+		afd = announce9(addr, adir, 0);
+		if (afd < 0)
+			sysfatal("announce");
+	}
+	if (server_only) {
+		for (;;) {
+			pthread_create(&srv, NULL, server, adir);
+			pthread_join(srv, NULL);
+		}
+	}
+	if (compare) {
+		on = busypoll;
+		busypoll = 0;
+		run(host, adir);
+		off_p50 = p50;
+		busypoll = on;
+	}
+	run(host, adir);
+	if (afd >= 0)
+		close(afd);
+	if (compare) {
+		printf("p50 %.2f usec without busypoll, %.2f usec with: %s\n",
+		       off_p50 / 1e3, p50 / 1e3, p50 < off_p50 ? "PASS" : "FAIL");
+		return p50 < off_p50 ? 0 : -1;
+	}
+	return 0;
+}
@@ -0,0 +1,150 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Block device IOPS at queue depths 1 to 32.
+ *
+ * usage: sd_qd_bench [-f FILE] [-b BYTES] [-r MB] [-s SECS] [-q MAXDEPTH] [-w]
+ *
+ * For each depth d in 1, 2, 4, ... MAXDEPTH, we run d threads that each pread
+ * (or with -w, pwrite, which clobbers the disk) BYTES at random aligned offsets
+ * in the first MB megabytes of FILE for SECS seconds, so the device has d
+ * requests outstanding at a time.  Prints IOPS, MB/sec, and the mean latency.
+ * With ncq, IOPS should keep going up with depth until the drive saturates;
+ * "ncq off" on the unit's ctl gives the queue depth 1 baseline. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <parlib/parlib.h>
+#include <parlib/timing.h>
+
+enum {
+	MAXDEPTH = 32,
+};
+
+static char *path = "#S/sdE0/data";
+static long io_sz = 4096;
+static long range_mb = 1024;
+static int secs = 5;
+static int max_depth = MAXDEPTH;
+static int write_it;
+
+static int fd;
+static volatile int running;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	long ios;
+	uint64_t nsec;
+};
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	long nblocks = (range_mb << 20) / io_sz;
+	char *buf = malloc(io_sz);
+	off_t off;
+	uint64_t start;
+	ssize_t n;
+
+	memset(buf, 'z', io_sz);
+	while (running) {
+		off = (off_t)(rand_r(&w->seed) % nblocks) * io_sz;
+		start = nsec();
+		n = write_it ? pwrite(fd, buf, io_sz, off) : pread(fd, buf, io_sz, off);
+		if (n != io_sz)
+			sysfatal(write_it ? "pwrite" : "pread");
+		w->nsec += nsec() - start;
+		w->ios++;
+	}
+	free(buf);
+	return 0;
+}
+
+static void run(int depth)
+{
+	struct worker w[MAXDEPTH];
+	long ios = 0;
+	uint64_t lat = 0, start;
+	double elapsed;
+
+	memset(w, 0, sizeof(w));
+	running = 1;
+	start = nsec();
+	for (int i = 0; i < depth; i++) {
+		w[i].seed = depth * MAXDEPTH + i;
+		if (pthread_create(&w[i].thread, NULL, worker, &w[i]))
+			sysfatal("pthread_create");
+	}
+	sleep(secs);
+	running = 0;
+	for (int i = 0; i < depth; i++) {
+		pthread_join(w[i].thread, NULL);
+		ios += w[i].ios;
+		lat += w[i].nsec;
+	}
+	elapsed = (nsec() - start) / 1e9;
+	printf("qd %2d: %8.0f IOPS, %7.1f MB/sec, %8.1f usec/io\n", depth,
+	       ios / elapsed, ios * io_sz / elapsed / 1e6,
+	       ios ? lat / 1000.0 / ios : 0);
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "f:b:r:s:q:w")) != -1) {
+		switch (opt) {
+		case 'f':
+			path = optarg;
+			break;
+		case 'b':
+			io_sz = atol(optarg);
+			break;
+		case 'r':
+			range_mb = atol(optarg);
+			break;
+		case 's':
+			secs = atoi(optarg);
+			break;
+		case 'q':
+			max_depth = atoi(optarg);
+			break;
+		case 'w':
+			write_it = 1;
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-f file] [-b bytes] [-r MB] [-s secs] [-q maxdepth] [-w]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (io_sz < 512 || io_sz % 512)
+		sysfatal("bytes must be a multiple of 512");
+	if ((range_mb << 20) < io_sz)
+		sysfatal("range is smaller than one io");
+	if (max_depth < 1 || max_depth > MAXDEPTH)
+		sysfatal("maxdepth must be between 1 and 32");
+
+	fd = open(path, write_it ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		sysfatal(path);
+	printf("%s: random %s of %ld bytes over %ld MB, %d sec per depth\n", path,
+	       write_it ? "writes" : "reads", io_sz, range_mb, secs);
+	for (int depth = 1; depth <= max_depth; depth *= 2)
+		run(depth);
+	close(fd);
+	return 0;
+}
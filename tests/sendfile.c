@@ -0,0 +1,147 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * Compares serving a file over TCP with read()/write() against the #ip
+ * "sendfile" ctl, over loopback.
+ *
+ * usage: sendfile [-s MB] [-p port] [file]
+ *
+ * Without a file, we make a MB-sized one in /tmp.  Each run sends the whole
+ * file to a sink thread on the same box, and the time is from the first byte
+ * sent to the sink seeing EOF. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <iplib/iplib.h>
+#include <parlib/timing.h>
+
+static char *port = "5555";
+static char adir[40];
+static int afd;
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+/* Accepts one connection, reads it to EOF, returns the byte count. */
+static void *sink(void *arg)
+{
+	char ldir[40];
+	int lcfd, dfd;
+	long cnt, total = 0;
+	static char buf[64 * 1024];
+
+	lcfd = listen9(adir, ldir, 0);
+	if (lcfd < 0)
+		sysfatal("listen");
+	dfd = accept9(lcfd, ldir);
+	if (dfd < 0)
+		sysfatal("accept");
+	while ((cnt = read(dfd, buf, sizeof(buf))) > 0)
+		total += cnt;
+	close(dfd);
+	close(lcfd);
+	return (void*)total;
+}
+
+static void run(char *name, int fd, size_t size, int use_sendfile)
+{
+	pthread_t sinker;
+	char addr[128], ctlmsg[64], *buf;
+	int dfd, cfd;
+	ssize_t cnt;
+	uint64_t start;
+	double secs;
+	void *got;
+
+	pthread_create(&sinker, NULL, sink, NULL);
+	snprintf(addr, sizeof(addr), "tcp!127.0.0.1!%s", port);
+	dfd = dial9(addr, 0, 0, &cfd, 0);
+	if (dfd < 0)
+		sysfatal("dial");
+	start = nsec();
+	if (use_sendfile) {
+		snprintf(ctlmsg, sizeof(ctlmsg), "sendfile %d 0 %lu", fd, size);
+		if (write(cfd, ctlmsg, strlen(ctlmsg)) < 0)
+			sysfatal("sendfile ctl");
+	} else {
+		buf = malloc(64 * 1024);
+		lseek(fd, 0, SEEK_SET);
+		while ((cnt = read(fd, buf, 64 * 1024)) > 0) {
+			if (write(dfd, buf, cnt) != cnt)
+				sysfatal("write");
+		}
+		free(buf);
+	}
+	close(dfd);
+	close(cfd);
+	pthread_join(sinker, &got);
+	secs = (nsec() - start) / 1e9;
+	if ((size_t)got != size)
+		fprintf(stderr, "%s: sink got %lu bytes, expected %lu\n", name,
+		        (size_t)got, size);
+	printf("%-10s %lu bytes in %.3f sec, %.2f MB/s\n", name, size, secs,
+	       size / secs / (1024 * 1024));
+}
+
+int main(int argc, char **argv)
+{
+	char *path = NULL;
+	size_t mb = 64;
+	struct stat st;
+	char *buf, addr[64];
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			mb = atol(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s MB] [-p port] [file]\n", argv[0]);
+			exit(-1);
+		}
+	}
+	if (optind < argc) {
+		path = argv[optind];
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			sysfatal("open");
+	} else {
+		path = "/tmp/sendfile-bench";
+		fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			sysfatal("create");
+		buf = malloc(1024 * 1024);
+		for (int i = 0; i < 1024 * 1024; i++)
+			buf[i] = i;
+		for (size_t i = 0; i < mb; i++)
+			if (write(fd, buf, 1024 * 1024) != 1024 * 1024)
+				sysfatal("fill");
+		free(buf);
+	}
+	if (fstat(fd, &st))
+		sysfatal("stat");
+
+	snprintf(addr, sizeof(addr), "tcp!*!%s", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0)
+		sysfatal("announce");
+
+	/* once to warm the page cache, then the real runs */
+	run("warmup", fd, st.st_size, 0);
+	run("readwrite", fd, st.st_size, 0);
+	run("sendfile", fd, st.st_size, 1);
+	return 0;
+}
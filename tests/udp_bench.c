@@ -0,0 +1,225 @@
+/* Copyright (c) 2026 Google Inc.
+ * agent <agent@local>
+ * See LICENSE for details.
+ *
+ * UDP datagram throughput over loopback, one datagram per syscall versus the
+ * "batch" framing (struct udpmsg_hdr, ros/net.h).
+ *
+ * usage: udp_bench [-n COUNT] [-s SIZE] [-b BATCH] [-p PORT]
+ *
+ * A sender thread writes COUNT datagrams of SIZE bytes, BATCH per write in
+ * batch mode, and a receiver reads them from an announced conversation in
+ * headers mode, BATCH per read at most.  UDP can drop, so we print what made it
+ * along with datagrams per second and datagrams per read.  The sender keeps
+ * sending an end marker until the receiver sees one. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <iplib/iplib.h>
+#include <parlib/timing.h>
+#include <parlib/uthread.h>
+#include <ros/net.h>
+
+enum {
+	ADDR_HDR = 52,	/* headers mode: raddr, laddr, ifcaddr, rport, lport */
+	DATA = 'D',
+	END = 'E',
+};
+
+static int port = 5558;
+static long count = 1000000;
+static int size = 64;
+static int batch = 32;
+static volatile int rcv_done;
+
+struct result {
+	long dgrams;
+	long reads;
+	uint64_t nsec;
+};
+
+static void sysfatal(char *msg)
+{
+	perror(msg);
+	exit(-1);
+}
+
+static void ctl(int cfd, char *msg)
+{
+	if (write(cfd, msg, strlen(msg)) < 0)
+		sysfatal(msg);
+}
+
+/* Returns the number of data datagrams in buf, and sets *end if it holds the
+ * end marker. */
+static long count_frames(char *buf, long n, int nbatch, int *end)
+{
+	struct udpmsg_hdr hdr;
+	long dgrams = 0;
+
+	if (nbatch == 1) {
+		*end = buf[ADDR_HDR] == END;
+		return !*end;
+	}
+	for (char *p = buf; p < buf + n; p += sizeof(hdr) + hdr.len) {
+		memcpy(&hdr, p, sizeof(hdr));
+		if (p[sizeof(hdr) + ADDR_HDR] == END)
+			*end = 1;
+		else
+			dgrams++;
+	}
+	return dgrams;
+}
+
+static void *receiver(void *arg)
+{
+	int dfd = (long)arg;
+	int nbatch = batch;
+	long bufsz = nbatch * (sizeof(struct udpmsg_hdr) + ADDR_HDR + size);
+	char *buf = malloc(bufsz);
+	struct result *res = calloc(1, sizeof(struct result));
+	uint64_t start = 0;
+	long n;
+	int end = 0;
+
+	for (;;) {
+		n = read(dfd, buf, nbatch == 1 ? ADDR_HDR + size : bufsz);
+		if (n <= 0)
+			sysfatal("read");
+		if (!start)
+			start = nsec();
+		res->reads++;
+		res->dgrams += count_frames(buf, n, nbatch, &end);
+		if (end)
+			break;
+	}
+	res->nsec = nsec() - start;
+	rcv_done = 1;
+	close(dfd);
+	free(buf);
+	return res;
+}
+
+/* Fills buf with nr frames of one datagram each, returns the length. */
+static long fill_frames(char *buf, int nr, char what)
+{
+	struct udpmsg_hdr hdr = {.len = size, .flags = 0};
+	char *p = buf;
+
+	for (int i = 0; i < nr; i++) {
+		memcpy(p, &hdr, sizeof(hdr));
+		p += sizeof(hdr);
+		memset(p, what, size);
+		p += size;
+	}
+	return p - buf;
+}
+
+static void run(int nbatch)
+{
+	char addr[64], adir[40], path[64];
+	char *buf;
+	int afd, dfd, cfd, rfd;
+	long len, sent = 0;
+	pthread_t rcv;
+	void *ret;
+	struct result *res;
+
+	batch = nbatch;
+	rcv_done = 0;
+	snprintf(addr, sizeof(addr), "udp!*!%d", port);
+	afd = announce9(addr, adir, 0);
+	if (afd < 0)
+		sysfatal("announce");
+	ctl(afd, "headers");
+	if (nbatch > 1)
+		ctl(afd, "batch");
+	snprintf(path, sizeof(path), "%s/data", adir);
+	rfd = open(path, O_RDWR);
+	if (rfd < 0)
+		sysfatal("open data");
+	pthread_create(&rcv, NULL, receiver, (void*)(long)rfd);
+
+	snprintf(addr, sizeof(addr), "udp!127.0.0.1!%d", port);
+	dfd = dial9(addr, 0, 0, &cfd, 0);
+	if (dfd < 0)
+		sysfatal("dial");
+	if (nbatch > 1)
+		ctl(cfd, "batch");
+	buf = malloc(nbatch * (sizeof(struct udpmsg_hdr) + size));
+	if (nbatch == 1) {
+		memset(buf, DATA, size);
+		for (; sent < count; sent++)
+			if (write(dfd, buf, size) != size)
+				sysfatal("write");
+	} else {
+		len = fill_frames(buf, nbatch, DATA);
+		for (; sent + nbatch <= count; sent += nbatch)
+			if (write(dfd, buf, len) != len)
+				sysfatal("write");
+		if (sent < count) {
+			len = fill_frames(buf, count - sent, DATA);
+			if (write(dfd, buf, len) != len)
+				sysfatal("write");
+			sent = count;
+		}
+	}
+	len = nbatch == 1 ? size : fill_frames(buf, 1, END);
+	if (nbatch == 1)
+		memset(buf, END, size);
+	while (!rcv_done) {
+		if (write(dfd, buf, len) != len)
+			sysfatal("write end");
+		uthread_usleep(1000);
+	}
+	pthread_join(rcv, &ret);
+	res = ret;
+	printf("batch %-3d %ld x %d bytes: got %ld (%.2f%% lost), %.0f dgrams/sec, %.1f dgrams/read\n",
+	       nbatch, sent, size, res->dgrams,
+	       100.0 * (sent - res->dgrams) / sent,
+	       res->dgrams / (res->nsec / 1e9), (double)res->dgrams / res->reads);
+	free(res);
+	free(buf);
+	close(dfd);
+	close(cfd);
+	close(afd);
+}
+
+int main(int argc, char **argv)
+{
+	int opt, nbatch = 32;
+
+	while ((opt = getopt(argc, argv, "n:s:b:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'b':
+			nbatch = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-n count] [-s size] [-b batch] [-p port]\n",
+			        argv[0]);
+			exit(-1);
+		}
+	}
+	if (count <= 0 || size <= 0 || size > 65000 || nbatch <= 1) {
+		fprintf(stderr, "count and size must be positive, size <= 65000, batch > 1\n");
+		exit(-1);
+	}
+	run(1);
+	port++;
+	run(nbatch);
+	return 0;
+}
@@ -4,6 +4,9 @@
  *
  * Epoll, built on FD taps, CEQs, and blocking uthreads on event queues.
  *
+ * The kernel's #epoll device has native readiness sets with level-triggered,
+ * oneshot, and nested sets, and no one-tap-per-FD limit.  See ros/fdtap.h.
+ *
  * TODO: There are a few incompatibilities with Linux's epoll, some of which are
  * artifacts of the implementation, and other issues:
  * 	- you can't epoll on an epoll fd (or any user fd).  you can only epoll on a